@@ -0,0 +1,324 @@
+/*
+    Micro-benchmarks for the intersection and build kernels of the ray tracer:
+
+    1) aabb::hit and the sphere, quad and triangle intersection routines
+    2) every acceleration structure builder on the meshes in models/
+    3) single-ray closest hit traversal of those structures with a fixed ray set
+    4) the same traversal over the array form of every structure, in each node layout of flat_tree.h, and the
+       memory per million triangles of every structure and layout
+
+    Every benchmark is repeated and summarised (mean, median, standard deviation, min, max).
+    Results can be saved as a baseline and later runs compared against it:
+
+        ./benchmark --save bench/baseline.csv
+        ./benchmark --baseline bench/baseline.csv --tolerance 10
+*/
+
+#include "../src/common.h"
+#include "../src/accelerate.h"
+#include "../src/build_options.h"
+#include "../src/flat_tree.h"
+#include "../src/metrics.h"
+#include "../src/model.h"
+#include "../src/primitive.h"
+
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct bench_summary {
+    std::string name;
+    std::string unit;
+    int repetitions = 0;
+    double mean = 0, median = 0, stddev = 0, min = 0, max = 0;
+};
+
+struct bench_options {
+    int repetitions = 10;
+    int rays = 4096;
+    double tolerance = 10.0; // percent
+    std::string filter;
+    std::string models_dir = "models";
+    std::string save_path;
+    std::string baseline_path;
+};
+
+static volatile unsigned long long sink = 0;
+
+bench_summary summarize(const std::string& name, const std::string& unit, std::vector<double> samples) {
+    bench_summary s;
+    s.name = name;
+    s.unit = unit;
+    s.repetitions = samples.size();
+    std::sort(samples.begin(), samples.end());
+    s.min = samples.front();
+    s.max = samples.back();
+    size_t n = samples.size();
+    s.median = (n % 2) ? samples[n / 2] : 0.5 * (samples[n / 2 - 1] + samples[n / 2]);
+    for (double v : samples)
+        s.mean += v;
+    s.mean /= n;
+    for (double v : samples)
+        s.stddev += (v - s.mean) * (v - s.mean);
+    s.stddev = n > 1 ? std::sqrt(s.stddev / (n - 1)) : 0;
+    return s;
+}
+
+// Runs `work` once to warm up and then `repetitions` times. `work` returns the number of operations it did, every
+// sample is the time per operation multiplied by `scale` (1e9 for ns/op, 1e3 for ms/op).
+template <typename F>
+bench_summary run(const bench_options& opt, const std::string& name, const std::string& unit, double scale, F work) {
+    sink += work();
+    std::vector<double> samples;
+    for (int i = 0; i < opt.repetitions; i++) {
+        stopwatch timer;
+        unsigned long long ops = work();
+        double seconds = timer.elapsed();
+        samples.push_back(seconds / (ops ? ops : 1) * scale);
+    }
+    bench_summary s = summarize(name, unit, samples);
+    printf("%-36s %12.3f %12.3f %10.3f %12.3f %12.3f  %s\n", s.name.c_str(), s.median, s.mean, s.stddev, s.min, s.max,
+           s.unit.c_str());
+    fflush(stdout);
+    return s;
+}
+
+// Rays start on a sphere around `box` and aim at a random point inside it, so most of them hit something
+std::vector<ray> fixed_rays(const aabb& box, int count, unsigned int seed) {
+    rng gen(seed);
+    point center = box.centroid();
+    vec3 extent(box.x.size(), box.y.size(), box.z.size());
+    double radius = extent.length() * 2;
+
+    std::vector<ray> rays;
+    rays.reserve(count);
+    for (int i = 0; i < count; i++) {
+        double z = 1 - 2 * gen.next();
+        double phi = 2 * pi * gen.next();
+        double r = std::sqrt(std::fmax(0.0, 1 - z * z));
+        point origin = center + radius * vec3(r * std::cos(phi), r * std::sin(phi), z);
+        point target(box.x.min + gen.next() * extent.x(), box.y.min + gen.next() * extent.y(),
+                     box.z.min + gen.next() * extent.z());
+        rays.push_back(ray(origin, target - origin));
+    }
+    return rays;
+}
+
+unsigned long long trace_all(const hittable& object, const std::vector<ray>& rays) {
+    unsigned long long hits = 0;
+    for (const ray& r : rays) {
+        hit_record rec;
+        if (object.hit(r, interval(0.0001, infinity), rec))
+            hits++;
+    }
+    sink += hits;
+    return rays.size();
+}
+
+// Structure bytes per million primitives, a single sample so it is compared against a baseline like the timings
+bench_summary memory(const std::string& name, const hittable& structure, size_t primitives) {
+    double mib = structure.structure_bytes() / (1024.0 * 1024.0) * 1e6 / std::max<size_t>(primitives, 1);
+    bench_summary s = summarize(name, "MiB/Mtri", std::vector<double>(1, mib));
+    printf("%-36s %12.3f %12s %10s %12s %12s  %s\n", s.name.c_str(), s.median, "", "", "", "", s.unit.c_str());
+    fflush(stdout);
+    return s;
+}
+
+std::vector<std::string> list_models(const std::string& dir) {
+    std::vector<std::string> paths;
+    DIR* d = opendir(dir.c_str());
+    if (d == NULL)
+        return paths;
+    while (dirent* entry = readdir(d)) {
+        std::string name = entry->d_name;
+        if (name.size() > 4 && name.substr(name.size() - 4) == ".obj")
+            paths.push_back(dir + "/" + name);
+    }
+    closedir(d);
+    std::sort(paths.begin(), paths.end());
+    return paths;
+}
+
+shared_ptr<hittable> build_structure(const std::string& mode, hittable_list list) {
+    if (mode == "bvh")
+        return make_shared<bvh_node>(list);
+    if (mode == "kd")
+        return make_shared<kd_node>(list);
+    if (mode == "bih")
+        return make_shared<bih_node>(list);
+    if (mode == "sbvh")
+        return make_shared<sbvh_node>(list, build_options().sbvh_budget);
+    return make_shared<hittable_list>(list);
+}
+
+bool selected(const bench_options& opt, const std::string& name) {
+    return opt.filter.empty() || name.find(opt.filter) != std::string::npos;
+}
+
+void save_csv(const std::string& path, const std::vector<bench_summary>& results) {
+    std::ofstream out(path);
+    out << "name,unit,repetitions,median,mean,stddev,min,max\n";
+    for (const auto& s : results)
+        out << s.name << ',' << s.unit << ',' << s.repetitions << ',' << s.median << ',' << s.mean << ',' << s.stddev
+            << ',' << s.min << ',' << s.max << '\n';
+    std::clog << "Saved " << results.size() << " results to " << path << std::endl;
+}
+
+std::map<std::string, bench_summary> load_csv(const std::string& path) {
+    std::map<std::string, bench_summary> results;
+    std::ifstream in(path);
+    std::string line;
+    std::getline(in, line); // header
+    while (std::getline(in, line)) {
+        std::stringstream ss(line);
+        std::string field;
+        std::vector<std::string> fields;
+        while (std::getline(ss, field, ','))
+            fields.push_back(field);
+        if (fields.size() < 8)
+            continue;
+        bench_summary s;
+        s.name = fields[0];
+        s.unit = fields[1];
+        s.repetitions = atoi(fields[2].c_str());
+        s.median = atof(fields[3].c_str());
+        s.mean = atof(fields[4].c_str());
+        s.stddev = atof(fields[5].c_str());
+        s.min = atof(fields[6].c_str());
+        s.max = atof(fields[7].c_str());
+        results[s.name] = s;
+    }
+    return results;
+}
+
+// Compares medians, a benchmark regresses when it is more than `tolerance` percent slower than the baseline
+int compare(const std::string& path, const std::vector<bench_summary>& results, double tolerance) {
+    auto baseline = load_csv(path);
+    if (baseline.empty()) {
+        std::clog << "Could not read baseline " << path << std::endl;
+        return 1;
+    }
+
+    int regressions = 0;
+    printf("\n%-36s %12s %12s %9s\n", "comparison", "baseline", "current", "change");
+    for (const auto& s : results) {
+        auto it = baseline.find(s.name);
+        if (it == baseline.end()) {
+            printf("%-36s %12s %12.3f %9s  new\n", s.name.c_str(), "-", s.median, "-");
+            continue;
+        }
+        double change = (s.median - it->second.median) / it->second.median * 100.0;
+        bool regressed = change > tolerance;
+        regressions += regressed;
+        printf("%-36s %12.3f %12.3f %8.1f%%%s\n", s.name.c_str(), it->second.median, s.median, change,
+               regressed ? "  REGRESSION" : "");
+    }
+    printf("\n%d regression(s) above %.1f%%\n", regressions, tolerance);
+    return regressions > 0 ? 1 : 0;
+}
+
+bench_options parse_bench_args(int argc, char* argv[]) {
+    bench_options opt;
+    for (int i = 1; i + 1 < argc; i++) {
+        const char* flag = argv[i];
+        const char* param = argv[i + 1];
+        if (strcmp(flag, "-r") == 0 || strcmp(flag, "--repetitions") == 0)
+            opt.repetitions = std::max(1, atoi(param));
+        else if (strcmp(flag, "-n") == 0 || strcmp(flag, "--rays") == 0)
+            opt.rays = std::max(1, atoi(param));
+        else if (strcmp(flag, "-f") == 0 || strcmp(flag, "--filter") == 0)
+            opt.filter = param;
+        else if (strcmp(flag, "--models") == 0)
+            opt.models_dir = param;
+        else if (strcmp(flag, "--save") == 0)
+            opt.save_path = param;
+        else if (strcmp(flag, "--baseline") == 0)
+            opt.baseline_path = param;
+        else if (strcmp(flag, "--tolerance") == 0)
+            opt.tolerance = atof(param);
+    }
+    return opt;
+}
+
+int main(int argc, char* argv[]) {
+    bench_options opt = parse_bench_args(argc, argv);
+    std::vector<bench_summary> results;
+    auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+
+    printf("%-36s %12s %12s %10s %12s %12s\n", "benchmark", "median", "mean", "stddev", "min", "max");
+
+    // Primitive intersection kernels, all against the same rays around the unit cube
+    aabb unit_box(point(-1, -1, -1), point(1, 1, 1));
+    auto prim_rays = fixed_rays(aabb(point(-1.5, -1.5, -1.5), point(1.5, 1.5, 1.5)), opt.rays, 1);
+    sphere sph(point(0, 0, 0), 1.0, mat);
+    quad qd(point(-1, -1, 0), vec3(2, 0, 0), vec3(0, 2, 0), mat);
+    triangle tri(point(-1, -1, 0), vec3(2, 0, 0), vec3(0, 2, 0), mat);
+
+    if (selected(opt, "aabb::hit"))
+        results.push_back(run(opt, "aabb::hit", "ns/ray", 1e9, [&]() {
+            unsigned long long hits = 0;
+            for (const ray& r : prim_rays)
+                hits += unit_box.hit(r, interval(0.0001, infinity));
+            sink += hits;
+            return (unsigned long long)prim_rays.size();
+        }));
+    if (selected(opt, "sphere::hit"))
+        results.push_back(run(opt, "sphere::hit", "ns/ray", 1e9, [&]() { return trace_all(sph, prim_rays); }));
+    if (selected(opt, "quad::hit"))
+        results.push_back(run(opt, "quad::hit", "ns/ray", 1e9, [&]() { return trace_all(qd, prim_rays); }));
+    if (selected(opt, "triangle::hit"))
+        results.push_back(run(opt, "triangle::hit", "ns/ray", 1e9, [&]() { return trace_all(tri, prim_rays); }));
+
+    // Builders and traversal on every model
+    const char* modes[] = {"bvh", "kd", "bih", "sbvh"};
+    const char* layouts[] = {"dfs", "treelet", "veb", "quantized"};
+    for (const std::string& path : list_models(opt.models_dir)) {
+        std::vector<vec3> vertices, face_indices;
+        if (!model::loadOBJ(path.c_str(), vertices, face_indices))
+            continue;
+        mesh triangles(vertices, face_indices, mat);
+        auto name = path.substr(path.find_last_of("/\\") + 1);
+        auto rays = fixed_rays(triangles.bounding_box(), opt.rays, 2);
+
+        for (const char* mode : modes) {
+            std::string build_name = std::string("build/") + mode + "/" + name;
+            if (selected(opt, build_name))
+                results.push_back(run(opt, build_name, "ms/build", 1e3, [&]() {
+                    auto structure = build_structure(mode, triangles);
+                    sink += structure->structure_bytes();
+                    return 1ULL;
+                }));
+
+            std::string trace_name = std::string("traverse/") + mode + "/" + name;
+            if (selected(opt, trace_name)) {
+                auto structure = build_structure(mode, triangles);
+                results.push_back(run(opt, trace_name, "ns/ray", 1e9, [&]() { return trace_all(*structure, rays); }));
+            }
+
+            std::string memory_name = std::string("memory/") + mode + "/" + name;
+            if (selected(opt, memory_name))
+                results.push_back(memory(memory_name, *build_structure(mode, triangles), triangles.objects.size()));
+
+            for (const char* layout : layouts) {
+                std::string layout_name = std::string("traverse/") + mode + "-" + layout + "/" + name;
+                if (!selected(opt, layout_name))
+                    continue;
+                auto structure = with_layout(build_structure(mode, triangles), layout);
+                results.push_back(run(opt, layout_name, "ns/ray", 1e9, [&]() { return trace_all(*structure, rays); }));
+                std::string memory_name = std::string("memory/") + mode + "-" + layout + "/" + name;
+                if (selected(opt, memory_name))
+                    results.push_back(memory(memory_name, *structure, triangles.objects.size()));
+            }
+        }
+    }
+
+    if (!opt.save_path.empty())
+        save_csv(opt.save_path, results);
+    if (!opt.baseline_path.empty())
+        return compare(opt.baseline_path, results, opt.tolerance);
+    return 0;
+}
@@ -1,15 +1,18 @@
 #!/bin/zsh
 
+# Needs the research build (make main_stats) for the traversal statistics in output/stats/
+mkdir -p output/stats
+
+# The three angles of a scene only differ in their CAM line, so every scene is loaded and built once and its
+# angles are rendered as views: output/${mode}_scene_${scene}_000{0,1,2}.ppm for angles 1, 2 and 3
 for mode in bvh kd bih
 do
 	echo "Mode: $mode"
 	for scene in {1..3}
 	do
 		echo "Scene: $scene"
-		for angle in {1..3}
-		do
-			echo "Camera angle: $angle"
-			./main -m $mode -i "scenes/scene_${scene}_angle_${angle}.trace" -o "ouput/${mode}_scene_${scene}_angle_${angle}.ppm"
-		done
+		views="output/scene_${scene}_views.txt"
+		printf "%s\n" scenes/scene_${scene}_angle_{1..3}.trace > "$views"
+		./main_stats -m $mode -i "scenes/scene_${scene}_angle_1.trace" --views "$views" -o "output/${mode}_scene_${scene}.ppm"
 	done
 done
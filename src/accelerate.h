@@ -4,6 +4,8 @@
     1) A superclass for tree structures called node
     2) A bvh implementation
     3) A kD-tree implementation
+    4) A BIH implementation
+    5) An SBVH: a binned SAH BVH that also splits primitives between its children
 */
 
 #ifndef ACCELERATE_H
@@ -12,6 +14,7 @@
 #include "common.h"
 #include "hittable.h"
 #include <cstddef>
+#include <functional>
 
 //* BASE NODE
 class node : public hittable {
@@ -19,38 +22,39 @@ class node : public hittable {
     node() {}
     virtual ~node() = default;
 
-    virtual int axis_heuristic() const {
-        return random_int(0, 2);
+    // Random split axis, `gen` is keyed by the node so builds are reproducible
+    virtual int axis_heuristic(rng& gen) const {
+        return gen.next_int(0, 2);
     }
 
-    static bool box_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis_index) {
+    static bool box_compare(const shared_ptr<hittable>& a, const shared_ptr<hittable>& b, int axis_index) {
         auto a_axis_interval = a->bounding_box().axis_interval(axis_index);
         auto b_axis_interval = b->bounding_box().axis_interval(axis_index);
         return a_axis_interval.min < b_axis_interval.min;
     }
 
-    static bool box_x_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
+    static bool box_x_compare(const shared_ptr<hittable>& a, const shared_ptr<hittable>& b) {
         return box_compare(a, b, 0);
     }
-    static bool box_y_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
+    static bool box_y_compare(const shared_ptr<hittable>& a, const shared_ptr<hittable>& b) {
         return box_compare(a, b, 1);
     }
-    static bool box_z_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
+    static bool box_z_compare(const shared_ptr<hittable>& a, const shared_ptr<hittable>& b) {
         return box_compare(a, b, 2);
     }
 
-    static bool centre_x_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
+    static bool centre_x_compare(const shared_ptr<hittable>& a, const shared_ptr<hittable>& b) {
         return a->bounding_box().centroid().x() < b->bounding_box().centroid().x();
     }
-    static bool centre_y_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
+    static bool centre_y_compare(const shared_ptr<hittable>& a, const shared_ptr<hittable>& b) {
         return a->bounding_box().centroid().y() < b->bounding_box().centroid().y();
     }
-    static bool centre_z_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
+    static bool centre_z_compare(const shared_ptr<hittable>& a, const shared_ptr<hittable>& b) {
         return a->bounding_box().centroid().z() < b->bounding_box().centroid().z();
     }
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        rec.stats->record_traversal_step();
+        record_traversal_step(rec);
         if (!bbox.hit(r, ray_t))
             return false;
 
@@ -62,19 +66,74 @@ class node : public hittable {
 
     aabb bounding_box() const override { return bbox; }
 
-  private:
+    const shared_ptr<hittable>& left_child() const { return left; }
+    const shared_ptr<hittable>& right_child() const { return right; }
+
+    size_t structure_bytes() const override {
+        size_t bytes = node_bytes() + left->structure_bytes();
+        if (right != left)
+            bytes += right->structure_bytes();
+        return bytes;
+    }
+
+    size_t top_level_bytes() const override {
+        size_t bytes = node_bytes() + left->top_level_bytes();
+        if (right != left)
+            bytes += right->top_level_bytes();
+        return bytes;
+    }
+
+    void flatten(std::vector<flat_primitive>& out) const override {
+        left->flatten(out);
+        if (right != left)
+            right->flatten(out);
+    }
+
+    // Every node box becomes the union of its children again. For the kD-tree and the BIH that turns the spatial
+    // bounds into object bounds, which node::hit culls with just the same.
+    aabb refit() override {
+        aabb box = left->refit();
+        if (right != left)
+            box = aabb(box, right->refit());
+        bbox = box;
+        return bbox;
+    }
+
+    double sah_cost(double parent_area) const override {
+        double area = bbox.surface_area();
+        double cost = traversal_cost * area + left->sah_cost(area);
+        if (right != left)
+            cost += right->sah_cost(area);
+        return cost;
+    }
+
+    // Cost of a box test relative to one primitive intersection test
+    static constexpr double traversal_cost = 1.0;
+
+  protected:
     shared_ptr<hittable> left;
     shared_ptr<hittable> right;
     aabb bbox;
+
+    virtual size_t node_bytes() const { return sizeof(node); }
 };
 
 //* BVH NODE
 class bvh_node : public node {
   public:
+    // Makes the subtree over objects [start, end) in place of building it, see lazy_tree.h
+    typedef std::function<shared_ptr<hittable>(size_t start, size_t end)> deferral;
+
     bvh_node(hittable_list list) : bvh_node(list.objects, 0, list.objects.size()) {}
 
-    bvh_node(std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end) {
-        int axis = axis_heuristic();
+    bvh_node(std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end)
+        : bvh_node(objects, start, end, -1, deferral()) {}
+
+    // Builds the top `levels` levels only and leaves every larger subtree below them to `defer`. The objects are
+    // sorted exactly as for a full build, so the subtrees built later from their ranges complete the same tree
+    bvh_node(std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end, int levels, const deferral& defer) {
+        rng gen(start, end);
+        int axis = axis_heuristic(gen);
 
         auto comparator = (axis == 0) ? box_x_compare : (axis == 1) ? box_y_compare : box_z_compare;
 
@@ -90,30 +149,23 @@ class bvh_node : public node {
             std::sort(std::begin(objects) + start, std::begin(objects) + end, comparator);
 
             auto mid = start + object_span / 2;
-            left = make_shared<bvh_node>(objects, start, mid);
-            right = make_shared<bvh_node>(objects, mid, end);
+            left = subtree(objects, start, mid, levels - 1, defer);
+            right = subtree(objects, mid, end, levels - 1, defer);
         }
 
         bbox = aabb(left->bounding_box(), right->bounding_box());
     }
 
-    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        rec.stats->record_traversal_step();
-        if (!bbox.hit(r, ray_t))
-            return false;
-
-        bool hit_left = left->hit(r, ray_t, rec);
-        bool hit_right = right->hit(r, interval(ray_t.min, hit_left ? rec.t : ray_t.max), rec);
-
-        return hit_left || hit_right;
-    }
-
-    aabb bounding_box() const override { return bbox; }
+  protected:
+    size_t node_bytes() const override { return sizeof(bvh_node); }
 
   private:
-    shared_ptr<hittable> left;
-    shared_ptr<hittable> right;
-    aabb bbox;
+    static shared_ptr<hittable> subtree(std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end,
+                                        int levels, const deferral& defer) {
+        if (levels == 0 && end - start > 2)
+            return defer(start, end);
+        return make_shared<bvh_node>(objects, start, end, levels, defer);
+    }
 };
 
 //* KD-TREE
@@ -124,7 +176,8 @@ class kd_node : public node {
     kd_node(std::vector<shared_ptr<hittable>>& objects, int depth, const aabb& bounds) {
         bbox = bounds;
 
-        int axis = axis_heuristic(); // Get split axis acording to heuristic
+        rng gen(depth);
+        int axis = axis_heuristic(gen); // Get split axis acording to heuristic
 
         // std::cout << "depth: " << depth << ", axis: " << axis << ", n_objects: " << objects.size() << std::endl;
         if (objects.size() <= min_primitive_count || depth > max_depth) {
@@ -156,29 +209,16 @@ class kd_node : public node {
         }
     }
 
-    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        rec.stats->record_traversal_step();
-        if (!bbox.hit(r, ray_t))
-            return false;
-
-        bool hit_left = left->hit(r, ray_t, rec);
-        bool hit_right = right->hit(r, interval(ray_t.min, hit_left ? rec.t : ray_t.max), rec);
-
-        return hit_left || hit_right;
-    }
-
-    aabb bounding_box() const override { return bbox; }
+  protected:
+    size_t node_bytes() const override { return sizeof(kd_node); }
 
   private:
     static const int min_primitive_count = 2;
     static const int max_depth = 20;
     int depth;
-    shared_ptr<hittable> left;
-    shared_ptr<hittable> right;
-    aabb bbox;
 
     // returns longest axis (always split on longest axis)
-    int axis_heuristic() const override {
+    int axis_heuristic(rng& gen) const override {
         if (bbox.x.size() > bbox.y.size() && bbox.x.size() > bbox.z.size())
             return 0;
         if (bbox.y.size() > bbox.z.size())
@@ -216,7 +256,8 @@ class bih_node : public node {
 
         bih_node(std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end, aabb bounds, int depth) {
             bbox = bounds;
-            int axis = axis_heuristic();
+            rng gen(start, end, depth);
+            int axis = axis_heuristic(gen);
             auto comparator = (axis == 0) ? centre_x_compare : (axis == 1) ? centre_y_compare : centre_z_compare;
 
             size_t object_span = end - start;
@@ -278,23 +319,10 @@ class bih_node : public node {
             }
         }
 
-        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-            rec.stats->record_traversal_step();
-            if (!bbox.hit(r, ray_t))
-                return false;
-
-            bool hit_left = left->hit(r, ray_t, rec);
-            bool hit_right = right->hit(r, interval(ray_t.min, hit_left ? rec.t : ray_t.max), rec);
-
-            return hit_left || hit_right;
-        }
-
-        aabb bounding_box() const override { return bbox; }
+    protected:
+        size_t node_bytes() const override { return sizeof(bih_node); }
 
     private:
-        aabb bbox;
-        shared_ptr<hittable> left;
-        shared_ptr<hittable> right;
         const int min_objects = 4;
         const int max_depth = 20;
 
@@ -361,4 +389,250 @@ class bih_node : public node {
         }
 };
 
-#endif
\ No newline at end of file
+//* SBVH
+// Binned SAH BVH that also considers spatial splits (Stich et al. 2009). A primitive that straddles a spatial split
+// plane is referenced from both children, each with its box clipped to its side. This removes the overlap between
+// child boxes that long triangles cause. The extra references are limited to `duplication_limit` times the
+// primitives, a node without budget left only splits objects.
+class sbvh_node : public node {
+  public:
+    sbvh_node(hittable_list list, double duplication_limit) {
+        builder b(list.objects);
+        b.budget = size_t(duplication_limit * list.objects.size());
+        std::vector<reference> refs;
+        aabb bounds;
+        for (size_t i = 0; i < list.objects.size(); i++) {
+            reference ref;
+            ref.object = i;
+            ref.box = list.objects[i]->clip_box(0, -infinity, infinity);
+            refs.push_back(ref);
+            bounds = aabb(bounds, ref.box);
+        }
+        b.root_area = bounds.surface_area();
+        if (refs.size() < 2 || !split(b, refs, 0)) {
+            left = leaf(b, refs);
+            right = make_shared<hittable_list>();
+            bbox = left->bounding_box();
+        }
+        primitives = list.objects.size();
+        references = primitives + b.duplicates;
+    }
+
+    size_t primitive_count() const { return primitives; }
+    size_t reference_count() const { return references; }
+
+  protected:
+    size_t node_bytes() const override { return sizeof(sbvh_node); }
+
+  private:
+    static const int bins = 16;
+    static const size_t max_leaf_size = 8;
+    static const int max_depth = 64;
+    // Spatial splits are only tried where the best object split leaves children overlapping by this share of the
+    // root area
+    static constexpr double overlap_threshold = 1e-5;
+
+    struct reference {
+        size_t object;
+        aabb box;
+    };
+
+    struct builder {
+        std::vector<shared_ptr<hittable>>& objects;
+        size_t budget = 0;
+        size_t duplicates = 0;
+        double root_area = 0;
+
+        builder(std::vector<shared_ptr<hittable>>& objects) : objects(objects) {}
+    };
+
+    struct split_choice {
+        double cost = infinity;
+        int axis = -1;
+        int plane = 0;          // bin boundary, the left child takes the bins below it
+        bool spatial = false;
+        aabb left, right;
+    };
+
+    size_t primitives = 0;
+    size_t references = 0;
+
+    sbvh_node() {}
+
+    static shared_ptr<hittable> leaf(const builder& b, const std::vector<reference>& refs) {
+        if (refs.size() == 1)
+            return b.objects[refs[0].object];
+        auto list = make_shared<hittable_list>();
+        for (const auto& ref : refs)
+            list->add(b.objects[ref.object]);
+        return list;
+    }
+
+    static shared_ptr<hittable> subtree(builder& b, std::vector<reference>& refs, int depth) {
+        if (refs.size() > 1 && depth < max_depth) {
+            shared_ptr<sbvh_node> inner(new sbvh_node());
+            if (inner->split(b, refs, depth))
+                return inner;
+        }
+        return leaf(b, refs);
+    }
+
+    static double bin_bound(const aabb& bounds, int axis, int i) {
+        const interval& extent = bounds.axis_interval(axis);
+        return i == bins ? extent.max : extent.min + extent.size() * i / bins;
+    }
+
+    // Best SAH split of the reference centroids into bins along each axis
+    static split_choice object_split(const std::vector<reference>& refs, double area) {
+        split_choice best;
+        aabb centroids;
+        for (const auto& ref : refs)
+            centroids = aabb(centroids, aabb(ref.box.centroid(), ref.box.centroid()));
+        for (int axis = 0; axis < 3; axis++) {
+            const interval& extent = centroids.axis_interval(axis);
+            if (extent.size() <= 0)
+                continue;
+            aabb boxes[bins];
+            size_t counts[bins] = {};
+            for (const auto& ref : refs) {
+                int i = std::min(bins - 1, int(bins * (ref.box.centroid()[axis] - extent.min) / extent.size()));
+                boxes[i] = aabb(boxes[i], ref.box);
+                counts[i]++;
+            }
+            evaluate(boxes, counts, counts, axis, area, false, best);
+        }
+        return best;
+    }
+
+    // Best SAH split plane of the node bounds along each axis, references straddling it go to both sides
+    static split_choice spatial_split(const builder& b, const std::vector<reference>& refs, const aabb& bounds,
+                                      double area) {
+        split_choice best;
+        for (int axis = 0; axis < 3; axis++) {
+            const interval& extent = bounds.axis_interval(axis);
+            if (extent.size() <= 0)
+                continue;
+            aabb boxes[bins];
+            size_t entries[bins] = {}, exits[bins] = {};
+            for (const auto& ref : refs) {
+                const interval& span = ref.box.axis_interval(axis);
+                int first = std::max(0, std::min(bins - 1, int(bins * (span.min - extent.min) / extent.size())));
+                int last = std::max(first, std::min(bins - 1, int(bins * (span.max - extent.min) / extent.size())));
+                for (int i = first; i <= last; i++) {
+                    aabb part = first == last ? ref.box :
+                        intersect(ref.box, b.objects[ref.object]->clip_box(axis, bin_bound(bounds, axis, i),
+                                                                          bin_bound(bounds, axis, i + 1)));
+                    boxes[i] = aabb(boxes[i], part);
+                }
+                entries[first]++;
+                exits[last]++;
+            }
+            evaluate(boxes, entries, exits, axis, area, true, best);
+        }
+        return best;
+    }
+
+    // Sweeps the bin boundaries of one axis, the left side counts references that start in its bins and the right
+    // side those that end in its bins
+    static void evaluate(const aabb* boxes, const size_t* entries, const size_t* exits, int axis, double area,
+                         bool spatial, split_choice& best) {
+        aabb right_boxes[bins];
+        size_t right_counts[bins];
+        aabb box;
+        size_t count = 0;
+        for (int i = bins - 1; i > 0; i--) {
+            box = aabb(box, boxes[i]);
+            count += exits[i];
+            right_boxes[i] = box;
+            right_counts[i] = count;
+        }
+        box = aabb();
+        count = 0;
+        for (int i = 1; i < bins; i++) {
+            box = aabb(box, boxes[i - 1]);
+            count += entries[i - 1];
+            if (count == 0 || right_counts[i] == 0)
+                continue;
+            double cost = traversal_cost +
+                          (box.surface_area() * count + right_boxes[i].surface_area() * right_counts[i]) / area;
+            if (cost < best.cost) {
+                best.cost = cost;
+                best.axis = axis;
+                best.plane = i;
+                best.spatial = spatial;
+                best.left = box;
+                best.right = right_boxes[i];
+            }
+        }
+    }
+
+    // Fills this node with two children, false when a leaf is cheaper
+    bool split(builder& b, std::vector<reference>& refs, int depth) {
+        aabb bounds;
+        for (const auto& ref : refs)
+            bounds = aabb(bounds, ref.box);
+        double area = bounds.surface_area();
+        if (area <= 0)
+            return false;
+
+        split_choice best = object_split(refs, area);
+        aabb overlap = best.axis >= 0 ? intersect(best.left, best.right) : aabb();
+        if (b.budget > 0 && (best.axis < 0 || overlap.surface_area() > overlap_threshold * b.root_area)) {
+            split_choice spatial = spatial_split(b, refs, bounds, area);
+            if (spatial.cost < best.cost)
+                best = spatial;
+        }
+        if (best.axis < 0 || (refs.size() <= max_leaf_size && best.cost >= double(refs.size())))
+            return false;
+
+        std::vector<reference> left_refs, right_refs;
+        if (best.spatial) {
+            double plane = bin_bound(bounds, best.axis, best.plane);
+            for (const auto& ref : refs) {
+                const interval& span = ref.box.axis_interval(best.axis);
+                if (span.max <= plane) {
+                    left_refs.push_back(ref);
+                } else if (span.min >= plane) {
+                    right_refs.push_back(ref);
+                } else {
+                    const auto& object = b.objects[ref.object];
+                    reference l = ref, r = ref;
+                    l.box = intersect(ref.box, object->clip_box(best.axis, span.min, plane));
+                    r.box = intersect(ref.box, object->clip_box(best.axis, plane, span.max));
+                    bool l_empty = l.box.x.min > l.box.x.max, r_empty = r.box.x.min > r.box.x.max;
+                    if (!l_empty && !r_empty && b.budget > 0) {
+                        left_refs.push_back(l);
+                        right_refs.push_back(r);
+                        b.budget--;
+                        b.duplicates++;
+                    } else if (l_empty || (!r_empty && ref.box.centroid()[best.axis] >= plane)) {
+                        right_refs.push_back(r_empty ? ref : r);
+                    } else {
+                        left_refs.push_back(l_empty ? ref : l);
+                    }
+                }
+            }
+        } else {
+            aabb centroids;
+            for (const auto& ref : refs)
+                centroids = aabb(centroids, aabb(ref.box.centroid(), ref.box.centroid()));
+            const interval& extent = centroids.axis_interval(best.axis);
+            for (const auto& ref : refs) {
+                int i = std::min(bins - 1, int(bins * (ref.box.centroid()[best.axis] - extent.min) / extent.size()));
+                (i < best.plane ? left_refs : right_refs).push_back(ref);
+            }
+        }
+        if (left_refs.empty() || right_refs.empty())
+            return false;
+
+        std::vector<reference>().swap(refs);
+        left = subtree(b, left_refs, depth + 1);
+        right = subtree(b, right_refs, depth + 1);
+        bbox = aabb(left->bounding_box(), right->bounding_box());
+        // Clipped references make the children tighter than their primitives, the node keeps the clipped bounds
+        bbox = intersect(bbox, bounds);
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,156 @@
+/*
+    IN THIS FILE you will find what is needed to render scenes whose objects move between frames:
+
+    1) dynamic_structure: the top-level acceleration structure of a moving scene. After every frame it is refitted,
+       keeping its topology, and rebuilt once its SAH cost has degraded past a threshold
+    2) scene_animation: moves a share of the spheres and models of a loaded scene along a fixed path, so every run
+       of a sequence renders the same frames
+
+    Models move as instances, their own structure is never rebuilt.
+*/
+
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include "common.h"
+#include "accelerate.h"
+#include "auto_structure.h"
+#include "build_options.h"
+#include "hittable.h"
+#include "model.h"
+#include "primitive.h"
+
+#include <string>
+
+//* DYNAMIC STRUCTURE
+class dynamic_structure : public hittable {
+    public:
+        std::string policy = "refit";       // "rebuild" rebuilds every frame
+        double rebuild_threshold = 1.5;     // rebuild once the SAH cost is this many times the cost after the last build
+
+        dynamic_structure(const hittable_list& objects, const std::string& mode, const build_options& options)
+            : objects(objects), mode(mode), options(options) {
+            rebuild();
+        }
+
+        // Call after objects moved, returns true when the structure was rebuilt
+        bool update() {
+            if (policy == "rebuild" || objects.objects.empty()) {
+                rebuild();
+                return true;
+            }
+            root->refit();
+            if (cost() > rebuild_threshold * built_cost) {
+                rebuild();
+                return true;
+            }
+            return false;
+        }
+
+        // SAH cost normalised by the area of the root box: the expected number of box and primitive tests of a ray
+        // that enters the scene
+        double cost() const {
+            double area = root->bounding_box().surface_area();
+            return area > 0 ? root->sah_cost(area) / area : 0;
+        }
+
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const override { return root->hit(r, ray_t, rec); }
+
+        aabb bounding_box() const override { return root->bounding_box(); }
+
+        size_t structure_bytes() const override { return root->structure_bytes(); }
+
+        size_t top_level_bytes() const override { return root->top_level_bytes(); }
+
+        void flatten(std::vector<flat_primitive>& out) const override { root->flatten(out); }
+
+        aabb refit() override { return root->refit(); }
+
+        double sah_cost(double parent_area) const override { return root->sah_cost(parent_area); }
+    private:
+        hittable_list objects;
+        std::string mode;
+        build_options options;
+        shared_ptr<hittable> root;
+        double built_cost = 0;
+
+        void rebuild() {
+            // A fresh list, so its box is that of the current positions
+            hittable_list current;
+            for (const auto& obj : objects.objects)
+                current.add(obj);
+            built_structure built = make_structure(mode, current, "world", options);
+            // -m auto chooses once, every rebuild after that uses the same structure
+            mode = built.mode;
+            root = built.root ? built.root : make_shared<hittable_list>(current);
+            built_cost = cost();
+        }
+};
+
+//* ANIMATION
+class scene_animation {
+    public:
+        double angular_speed = 0.1;         // radians per frame around the vertical axis through the scene centre
+
+        // Picks every n-th sphere or model so that `share` of them moves, models are wrapped in instances in `objects`
+        scene_animation(hittable_list& objects, double share) {
+            std::vector<size_t> candidates;
+            for (size_t i = 0; i < objects.objects.size(); i++) {
+                auto obj = objects.objects[i].get();
+                if (dynamic_cast<sphere*>(obj) || dynamic_cast<model*>(obj))
+                    candidates.push_back(i);
+            }
+            size_t count = size_t(std::ceil(candidates.size() * std::fmin(std::fmax(share, 0.0), 1.0)));
+            if (count == 0)
+                return;
+            centre = objects.bounding_box().centroid();
+
+            double stride = double(candidates.size()) / count;
+            for (size_t k = 0; k < count; k++) {
+                auto& obj = objects.objects[candidates[size_t(k * stride)]];
+                mover m;
+                if (auto sph = std::dynamic_pointer_cast<sphere>(obj)) {
+                    m.sph = sph;
+                    m.start = sph->position();
+                } else {
+                    m.inst = make_shared<instance>(obj);
+                    obj = m.inst;
+                    m.start = point(0, 0, 0);
+                }
+                m.speed = 1 + int(k % 3);
+                movers.push_back(m);
+            }
+        }
+
+        size_t moving_objects() const { return movers.size(); }
+
+        // Moves the objects to where they are in `frame`, the structures above them still have to be updated
+        void apply(int frame) {
+            for (const auto& m : movers) {
+                double angle = angular_speed * m.speed * frame;
+                if (m.sph) {
+                    m.sph->move_to(centre + rotate_y(m.start - centre, angle));
+                } else {
+                    // Models swing around the scene centre, their own offset starts at zero
+                    point pivot = m.inst->bounding_box().centroid() - m.inst->position();
+                    m.inst->move_to(rotate_y(pivot - centre, angle) - (pivot - centre));
+                }
+            }
+        }
+    private:
+        struct mover {
+            shared_ptr<sphere> sph;
+            shared_ptr<instance> inst;
+            point start;
+            int speed = 1;
+        };
+        std::vector<mover> movers;
+        point centre;
+
+        static vec3 rotate_y(const vec3& v, double angle) {
+            double c = std::cos(angle), s = std::sin(angle);
+            return vec3(c * v.x() + s * v.z(), v.y(), -s * v.x() + c * v.z());
+        }
+};
+
+#endif
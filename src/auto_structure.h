@@ -0,0 +1,260 @@
+/*
+    IN THIS FILE you will find -m auto, which picks the acceleration structure for every list of objects that gets
+    one (the world and every model) by itself:
+
+    1) scene_statistics: how many objects of which type, how much their sizes vary and how evenly they fill the
+       scene box
+    2) auto_structure::choose: a few objects are tested without a structure. Otherwise the choice is between the bvh
+       and the SBVH, whose better trees pay for their slower build once enough rays are traced per object. With
+       --auto-probe n every candidate that could still win is built instead, n rays are traced through it, and the
+       one with the least build time plus expected trace time is kept
+    3) make_structure: the structure a mode names over a list of objects, for the scene, the models and animations
+
+    The thresholds come from single-threaded renders of the scenes in scenes/: the kD-tree and the BIH built slower
+    and traced slower than the bvh on all of them, and the SBVH traced 1.2 to 3 times faster than the bvh while it
+    built 3 (spheres) to 20 (triangles) times slower.
+*/
+
+#ifndef AUTO_STRUCTURE_H
+#define AUTO_STRUCTURE_H
+
+#include "common.h"
+#include "accelerate.h"
+#include "build_options.h"
+#include "camera.h"
+#include "hittable.h"
+#include "lazy_tree.h"
+#include "metrics.h"
+#include "primitive.h"
+
+#include <sstream>
+#include <string>
+
+struct scene_statistics {
+    size_t objects = 0;
+    size_t triangles = 0;
+    size_t quads = 0;
+    size_t spheres = 0;
+    size_t structured = 0;      // objects with a structure of their own, such as models
+    double size_variation = 0;  // standard deviation of the box surface areas over their mean
+    double clustering = 1;      // grid cells holding an object centre over the share a uniform spread would fill
+
+    static scene_statistics of(const hittable_list& list) {
+        scene_statistics s;
+        s.objects = list.objects.size();
+        if (s.objects == 0)
+            return s;
+
+        double sum = 0, sum_squares = 0;
+        for (const auto& obj : list.objects) {
+            if (dynamic_cast<const triangle*>(obj.get()))
+                s.triangles++;
+            else if (dynamic_cast<const quad*>(obj.get()))
+                s.quads++;
+            else if (dynamic_cast<const sphere*>(obj.get()))
+                s.spheres++;
+            else if (obj->structure_bytes() > 0)
+                s.structured++;
+            double area = obj->bounding_box().surface_area();
+            sum += area;
+            sum_squares += area * area;
+        }
+        double mean = sum / s.objects;
+        double variance = std::max(0.0, sum_squares / s.objects - mean * mean);
+        s.size_variation = mean > 0 ? std::sqrt(variance) / mean : 0;
+
+        // About one object per cell if they were spread evenly, at most 32 cells per axis
+        const aabb& bounds = list.bounding_box();
+        int cells = std::max(1, std::min(32, int(std::cbrt(double(s.objects)))));
+        std::vector<bool> filled(size_t(cells) * cells * cells, false);
+        for (const auto& obj : list.objects) {
+            point centre = obj->bounding_box().centroid();
+            size_t index = 0;
+            for (int axis = 0; axis < 3; axis++) {
+                const interval& extent = bounds.axis_interval(axis);
+                double t = extent.size() > 0 ? (centre[axis] - extent.min) / extent.size() : 0;
+                index = index * cells + size_t(std::max(0, std::min(cells - 1, int(t * cells))));
+            }
+            filled[index] = true;
+        }
+        double total = double(filled.size());
+        double uniform = total * (1 - std::exp(-double(s.objects) / total));
+        s.clustering = double(std::count(filled.begin(), filled.end(), true)) / uniform;
+        return s;
+    }
+
+    std::string describe() const {
+        std::ostringstream out;
+        out << objects << " objects (";
+        const char* names[] = {"triangles", "quads", "spheres", "with structures", "other"};
+        size_t counts[] = {triangles, quads, spheres, structured, objects - triangles - quads - spheres - structured};
+        bool first = true;
+        for (int i = 0; i < 5; i++) {
+            if (counts[i] == 0)
+                continue;
+            out << (first ? "" : ", ") << counts[i] << " " << names[i];
+            first = false;
+        }
+        out << "), size variation " << size_variation << ", clustering " << clustering;
+        return out.str();
+    }
+};
+
+struct built_structure {
+    std::string mode;               // the mode that was built, what -m auto chose
+    shared_ptr<hittable> root;      // in its layout, null for "brute"
+    size_t references = 0;          // SBVH leaf references, 0 for the other modes
+};
+
+// The structure `mode` names over `objects` before it is given its layout, null for "brute" and unknown modes
+inline shared_ptr<hittable> build_root(const std::string& mode, hittable_list& objects, const build_options& options) {
+    if (objects.objects.empty())
+        return nullptr;
+    if (mode == "bvh")
+        return make_bvh(objects, options.lazy_levels, options.layout);
+    if (mode == "kd")
+        return make_shared<kd_node>(objects);
+    if (mode == "bih")
+        return make_shared<bih_node>(objects);
+    if (mode == "sbvh")
+        return make_shared<sbvh_node>(objects, options.sbvh_budget);
+    return nullptr;
+}
+
+//* AUTOMATIC SELECTION
+class auto_structure {
+    public:
+        // Lists of up to this many objects are tested one by one
+        static const size_t max_brute_objects = 16;
+
+        // Rays per object from which the SBVH pays for its build. A median split bvh wastes most where objects
+        // cluster, and spatial splits help most where long primitives lie next to small ones
+        static constexpr double sbvh_rays_per_mesh_object = 50;
+        static constexpr double sbvh_rays_per_object = 10;
+
+        // Build time against the bvh's, only to skip probing candidates that cannot win
+        static double build_ratio(const std::string& mode, bool mesh) {
+            if (mode == "sbvh")
+                return mesh ? 10 : 3;
+            if (mode == "kd")
+                return mesh ? 20 : 2;
+            return 1;
+        }
+
+        // Rays a render with `cam` traces, two segments per path, about what the scenes in scenes/ trace. --spp
+        // replaces the samples of the camera
+        static double expected_rays(const camera& cam, const build_options& options) {
+            int spp = options.spp > 0 ? options.spp : cam.samples_per_pixel;
+            double height = std::max(1, int(cam.width / cam.aspect_ratio));
+            return 2.0 * cam.width * height * spp;
+        }
+
+        // Picks the structure for `objects` and logs why, `name` says which list it is. The root is only built yet
+        // if a probe built it
+        static built_structure choose(hittable_list& objects, const std::string& name, const build_options& options) {
+            built_structure choice;
+            scene_statistics stats = scene_statistics::of(objects);
+            std::ostringstream reason;
+            reason << stats.describe() << ", " << options.rays << " rays expected";
+
+            if (stats.objects <= max_brute_objects) {
+                choice.mode = "brute";
+                reason << "; testing so few objects one by one is cheaper than any tree";
+            } else if (options.auto_probe > 0) {
+                probe(objects, stats, options, reason, choice);
+            } else {
+                bool mesh = stats.triangles + stats.quads >= stats.objects / 2;
+                double threshold = mesh ? sbvh_rays_per_mesh_object : sbvh_rays_per_object;
+                if (stats.clustering < 0.5 || stats.size_variation > 1)
+                    threshold /= 2;
+                double per_object = options.rays / stats.objects;
+                choice.mode = per_object >= threshold ? "sbvh" : "bvh";
+                reason << "; " << per_object << " rays per object, the SBVH pays for its build from " << threshold;
+            }
+            std::clog << "\rStructure for " << name << ": " << choice.mode << ". " << reason.str() << std::endl;
+            return choice;
+        }
+
+    private:
+        // Builds the bvh and then every other candidate whose expected build alone takes less than the best build
+        // and trace time so far, and traces the same rays through each
+        static void probe(hittable_list& objects, const scene_statistics& stats, const build_options& options,
+                          std::ostringstream& reason, built_structure& result) {
+            bool mesh = stats.triangles + stats.quads >= stats.objects / 2;
+            std::vector<ray> sample = sample_rays(objects.bounding_box(), options.auto_probe);
+            reason << "; probed with " << sample.size() << " rays:";
+
+            double best = infinity, bvh_build = 0;
+            const char* candidates[] = {"bvh", "sbvh", "bih", "kd"};
+            for (const char* candidate : candidates) {
+                double expected_build = build_ratio(candidate, mesh) * bvh_build;
+                if (bvh_build > 0 && expected_build > best) {
+                    reason << " " << candidate << " skipped,";
+                    continue;
+                }
+                stopwatch timer;
+                auto built = build_root(candidate, objects, options);
+                auto split = std::dynamic_pointer_cast<sbvh_node>(built);
+                size_t references = split ? split->reference_count() : 0;
+                built = with_layout(built, options.layout);
+                double build = timer.elapsed();
+                timer.reset();
+                hit_record rec;
+                for (const auto& r : sample)
+                    built->hit(r, interval(0.001, infinity), rec);
+                double per_ray = timer.elapsed() / sample.size();
+                double total = build + options.rays * per_ray;
+                reason << " " << candidate << " " << build << "s + " << per_ray * 1e6 << "us per ray,";
+                if (std::string(candidate) == "bvh")
+                    bvh_build = build;
+                if (total < best) {
+                    best = total;
+                    result.mode = candidate;
+                    result.root = built;
+                    result.references = references;
+                }
+            }
+            reason << " " << result.mode << " expected to take " << best << "s";
+        }
+
+        // Rays from a sphere around `bounds` to points inside it, the same for every run
+        static std::vector<ray> sample_rays(const aabb& bounds, int n) {
+            std::vector<ray> sample;
+            point centre = bounds.centroid();
+            vec3 half(bounds.x.size() / 2, bounds.y.size() / 2, bounds.z.size() / 2);
+            double radius = 2 * half.length();
+            for (int i = 0; i < n; i++) {
+                rng gen(uint32_t(i), 0, 7);
+                double z = gen.next(-1, 1), phi = gen.next(0, 2 * pi);
+                double s = std::sqrt(std::max(0.0, 1 - z * z));
+                point origin = centre + radius * vec3(s * std::cos(phi), s * std::sin(phi), z);
+                point target(gen.next(bounds.x.min, bounds.x.max), gen.next(bounds.y.min, bounds.y.max),
+                             gen.next(bounds.z.min, bounds.z.max));
+                sample.push_back(ray(origin, target - origin));
+            }
+            return sample;
+        }
+};
+
+// The structure `mode` names over `objects`, in the layout of `options`. "auto" chooses the mode first, `name` says
+// for which list of objects
+inline built_structure make_structure(const std::string& mode, hittable_list& objects, const std::string& name,
+                                      const build_options& options) {
+    if (mode == "auto" && !objects.objects.empty()) {
+        built_structure built = auto_structure::choose(objects, name, options);
+        if (built.root || built.mode == "brute")
+            return built;
+        return make_structure(built.mode, objects, name, options);
+    }
+    built_structure built;
+    built.mode = mode;
+    built.root = build_root(mode, objects, options);
+    auto split = std::dynamic_pointer_cast<sbvh_node>(built.root);
+    if (split)
+        built.references = split->reference_count();
+    if (built.root)
+        built.root = with_layout(built.root, options.layout);
+    return built;
+}
+
+#endif
@@ -0,0 +1,115 @@
+/*
+    IN THIS FILE you will find build_options, the settings that decide how a scene is built: the parameters of the
+    structures, where out-of-core meshes and simplified levels are kept, and how many models load at once.
+
+    They travel with the scene into every builder instead of being set globally, so models that build on loader
+    threads read their own copy, and a render server keeps a scene built under other options apart. Every option is
+    named after its command line flag, and a server request gives it as name=value.
+*/
+
+#ifndef BUILD_OPTIONS_H
+#define BUILD_OPTIONS_H
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct build_options {
+    double sbvh_budget = 0.3;           // extra SBVH references as a share of the primitives
+    std::string layout = "dfs";         // CPU trees: "pointer", "dfs", "treelet", "veb" or "quantized"
+    int lazy_levels = 0;                // bvh levels built up front, the rest when rays reach them; 0 builds all
+    int auto_probe = 0;                 // -m auto: rays traced through every candidate, 0 decides from statistics
+    int spp = 0;                        // -m auto: samples per pixel in place of the scene's own, 0 keeps them
+    double rays = 0;                    // -m auto: rays the render is expected to trace, load_scene sets it
+    std::string out_of_core;            // directory of the cluster files of paged-in models, empty loads them
+    int ooc_memory = 256;               // MiB of clusters resident at once
+    std::string lod = "off";            // levels of detail of models: "off", "instance" or "ray"
+    double lod_detail = 1;              // pixels a triangle of the chosen level may span
+    int lod_levels = 4;                 // levels including the full mesh
+    std::string lod_cache = "output/lod";
+    int load_threads = 0;               // models loaded and built at once, 0 uses every hardware thread
+
+    // Sets the option of the flag --`name`, false if it is not one of these. --spp is left to the caller, it is
+    // also a render setting
+    bool set(const std::string& name, const std::string& value) {
+        if (name == "sbvh-budget")
+            sbvh_budget = atof(value.c_str());
+        else if (name == "layout")
+            layout = value;
+        else if (name == "lazy-levels")
+            lazy_levels = atoi(value.c_str());
+        else if (name == "auto-probe")
+            auto_probe = atoi(value.c_str());
+        else if (name == "out-of-core")
+            out_of_core = value;
+        else if (name == "ooc-memory")
+            ooc_memory = atoi(value.c_str());
+        else if (name == "lod")
+            lod = value;
+        else if (name == "lod-detail")
+            lod_detail = atof(value.c_str());
+        else if (name == "lod-levels")
+            lod_levels = atoi(value.c_str());
+        else if (name == "lod-cache")
+            lod_cache = value;
+        else if (name == "load-threads")
+            load_threads = atoi(value.c_str());
+        else
+            return false;
+        return true;
+    }
+
+    // Every option that set() takes with its value, in a fixed order
+    std::vector<std::pair<std::string, std::string>> values() const {
+        std::vector<std::pair<std::string, std::string>> v;
+        v.push_back(std::make_pair("sbvh-budget", format(sbvh_budget)));
+        v.push_back(std::make_pair("layout", layout));
+        v.push_back(std::make_pair("lazy-levels", format(lazy_levels)));
+        v.push_back(std::make_pair("auto-probe", format(auto_probe)));
+        v.push_back(std::make_pair("out-of-core", out_of_core));
+        v.push_back(std::make_pair("ooc-memory", format(ooc_memory)));
+        v.push_back(std::make_pair("lod", lod));
+        v.push_back(std::make_pair("lod-detail", format(lod_detail)));
+        v.push_back(std::make_pair("lod-levels", format(lod_levels)));
+        v.push_back(std::make_pair("lod-cache", lod_cache));
+        v.push_back(std::make_pair("load-threads", format(load_threads)));
+        return v;
+    }
+
+    // The values as " name=value" words, for server requests and to tell scenes built differently apart
+    std::string request() const {
+        std::string words;
+        for (const auto& v : values())
+            words += " " + v.first + "=" + v.second;
+        return words;
+    }
+
+    // Logs the first option that has no meaning
+    bool valid() const {
+        if (layout != "pointer" && layout != "dfs" && layout != "treelet" && layout != "veb" && layout != "quantized") {
+            std::clog << "Unknown layout " << layout << ", use pointer, dfs, treelet, veb or quantized" << std::endl;
+            return false;
+        }
+        if (lod != "off" && lod != "instance" && lod != "ray") {
+            std::clog << "Unknown level of detail selection " << lod << ", use off, instance or ray" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    size_t ooc_budget_bytes() const { return size_t(std::max(1, ooc_memory)) << 20; }
+    int max_lod_levels() const { return std::max(1, lod_levels); }
+
+    template <class T>
+    static std::string format(T value) {
+        std::ostringstream out;
+        out << value;
+        return out.str();
+    }
+};
+
+#endif
@@ -5,50 +5,113 @@
 #include "hittable.h"
 #include "material.h"
 
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// Per-sample state carried along a path
+struct path_state {
+    sampler* samples;
+    unsigned long long secondary_rays = 0;
+#ifdef COLLECT_STATS
+    unsigned int stat_slot = 0;
+#endif
+};
+
 class camera {
     private:
         double pixel_sample_scale;
         point center;
         vec3 u, v, w;
-        vec3 defocus_disk_u;
-        vec3 defocus_disk_v;
 
-
-        ray get_ray(int x, int y) const {
-            auto offset = sample_square();
+        ray get_ray(int x, int y, sampler& samples) const {
+            auto offset = sample_square(samples);
             auto pixel_sample = pixel00_loc + ((x + offset.x()) * pixel_delta_u) + ((y + offset.y()) * pixel_delta_v);
 
-            auto ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample();
+            auto ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample(samples);
             auto ray_direction = pixel_sample - ray_origin;
 
             return ray(ray_origin, ray_direction);
         }
 
-        vec3 sample_square() const {
-            return vec3(random_double() - 0.5, random_double() - 0.5, 0);
+        vec3 sample_square(sampler& samples) const {
+            sample_2d s = samples.get_2d();
+            return vec3(s.u - 0.5, s.v - 0.5, 0);
         }
 
-        point defocus_disk_sample() const {
-            auto p = random_in_unit_disk();
+        point defocus_disk_sample(sampler& samples) const {
+            auto p = random_in_unit_disk(samples);
             return center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
         }
 
-        color ray_color(const ray& r, int depth, const hittable& world) const {
+        color ray_color(const ray& r, int depth, const hittable& world, path_state& path) const {
             if (depth <= 0)
                 return color(0,0,0);
 
             hit_record rec;
-            rec.stats = stats;
+#ifdef COLLECT_STATS
+            if (depth == max_depth) {
+                rec.stats = stats.get();
+                rec.stat_slot = path.stat_slot;
+            }
+#endif
 
             if (world.hit(r, interval(0.0001, infinity), rec)) {
-                rec.stats->freeze = true;
                 ray scattered;
                 color attenuation;
-                if (rec.mat->scatter(r, rec, attenuation, scattered))
-                    return attenuation * ray_color(scattered, depth-1, world);
+                path.samples->start_bounce(max_depth - depth + 1);
+                if (rec.mat->scatter(r, rec, attenuation, scattered, *path.samples)) {
+                    // The scatter of the last bounce is never traced, as in path_color
+                    if (depth - 1 > 0)
+                        path.secondary_rays++;
+                    return attenuation * ray_color(scattered, depth-1, world, path);
+                }
                 return color(0,0,0);
             }
 
+            return background(r);
+        }
+
+        // Same estimate as ray_color without the recursion: the path throughput is carried along and, from bounce
+        // rr_depth on, paths survive with probability max(throughput) and are reweighted by its inverse
+        color path_color(const ray& r, const hittable& world, path_state& path) const {
+            color throughput(1.0, 1.0, 1.0);
+            ray current = r;
+
+            for (int bounce = 0; bounce < max_depth; bounce++) {
+                hit_record rec;
+#ifdef COLLECT_STATS
+                if (bounce == 0) {
+                    rec.stats = stats.get();
+                    rec.stat_slot = path.stat_slot;
+                }
+#endif
+                if (!world.hit(current, interval(0.0001, infinity), rec))
+                    return throughput * background(current);
+
+                ray scattered;
+                color attenuation;
+                path.samples->start_bounce(bounce + 1);
+                if (!rec.mat->scatter(current, rec, attenuation, scattered, *path.samples))
+                    return color(0,0,0);
+
+                throughput = throughput * attenuation;
+                if (bounce + 1 >= rr_depth) {
+                    double survive = std::fmin(std::fmax(throughput.x(), std::fmax(throughput.y(), throughput.z())), 0.95);
+                    if (survive <= 0 || path.samples->get_1d() >= survive)
+                        return color(0,0,0);
+                    throughput /= survive;
+                }
+
+                if (bounce + 1 < max_depth)
+                    path.secondary_rays++;
+                current = scattered;
+            }
+            return color(0,0,0);
+        }
+
+        static color background(const ray& r) {
             vec3 unit_direction = unit_vector(r.direction());
             auto a = 0.5*(unit_direction.y() + 1.0);
             return (1.0-a)*color(1.0, 1.0, 1.0) + a*color(0.5, 0.7, 1.0);
@@ -66,16 +129,34 @@ class camera {
         point pixel00_loc;
         vec3 pixel_delta_u;
         vec3 pixel_delta_v;
+        vec3 defocus_disk_u;
+        vec3 defocus_disk_v;
         double defocus_angle = 0;
         double focus_dist = 10;
+        int threads = 0; // 0 uses every hardware thread
+        std::string sampler_type = "sobol";
+        bool iterative = true;  // false uses the recursive ray_color, kept for comparison
+        int rr_depth = 5;       // first bounce where Russian roulette may end a path
+        int tile_size = 0;      // 0 hands out whole rows, otherwise square tiles of this many pixels
+        int batch_rays = 0;     // 0 traces every path on its own, otherwise bands of about this many paths together
+        std::function<void(int x, int y, int w, int h)> on_tile;    // called for every finished tile, one at a time
+        std::vector<color> framebuffer;
+        unsigned long long primary_rays = 0;
+        unsigned long long secondary_rays = 0;
+#ifdef COLLECT_STATS
         std::shared_ptr<stat_collector> stats;
+#endif
         void initialize() {           
             height = int(width / aspect_ratio);
             height = (height < 1) ? 1 : height;
 
             pixel_sample_scale = 1.0 / samples_per_pixel;
-            stats = std::make_shared<stat_collector>(stat_collector(samples_per_pixel));
-            stats->samples_per_pixel = samples_per_pixel;
+#ifdef COLLECT_STATS
+            // Kept over the passes of render_samples, render() starts afresh
+            if (!stats || stats->samples_per_pixel != unsigned(samples_per_pixel) ||
+                stats->n_traversal_steps.size() != size_t(width) * height * samples_per_pixel)
+                reset_stats();
+#endif
 
             center = lookfrom;
 
@@ -102,31 +183,224 @@ class camera {
             defocus_disk_v = v * defocus_radius;
         }
 
-        void render(const hittable& world, const char* path = "image.ppm") {
+#ifdef COLLECT_STATS
+        void reset_stats() {
+            stats = std::make_shared<stat_collector>(stat_collector(samples_per_pixel, width * height));
+            stats->samples_per_pixel = samples_per_pixel;
+        }
+#endif
+
+        // Rows (or tiles) are handed out to the threads one at a time, every pixel keys its own random numbers so
+        // the result does not depend on which thread rendered it
+        void render(const hittable& world) {
             initialize();
+#ifdef COLLECT_STATS
+            reset_stats();
+            stats->rendered(0, samples_per_pixel);
+#endif
+            framebuffer.assign(width * height, color(0,0,0));
 
-            std::ofstream image(path);
+            int tile_w = tile_size > 0 ? tile_size : width;
+            int tile_h = tile_size > 0 ? tile_size : 1;
+            if (batch_rays > 0) {
+                tile_w = width;
+                tile_h = std::max(1, batch_rays / std::max(1, width * samples_per_pixel));
+            }
+            int tiles_x = (width + tile_w - 1) / tile_w;
+            int n_tiles = tiles_x * ((height + tile_h - 1) / tile_h);
 
-            image << "P3\n" << width << ' ' << height << "\n255\n";
+            int n_threads = threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency());
+            std::atomic<int> next_tile(0);
+            std::atomic<unsigned long long> bounces(0);
+            std::mutex tile_mutex;
 
-            for (int y = 0; y < height; y++)
-            {
-                print_loading(y);
-                for (int x = 0; x < width; x++)
-                {
-                    color pixel_color(0,0,0);
-                    for (int sample = 0; sample < samples_per_pixel; sample++)
-                    {
-                        stats->new_row();
-                        ray r = get_ray(x, y);
-                        pixel_color += ray_color(r, max_depth, world);
-                        stats->next_sample();
+            auto worker = [&](bool report) {
+                auto samples = make_sampler(sampler_type);
+                unsigned long long local_bounces = 0;
+                for (int tile = next_tile++; tile < n_tiles; tile = next_tile++) {
+                    int x0 = (tile % tiles_x) * tile_w, y0 = (tile / tiles_x) * tile_h;
+                    int x1 = std::min(x0 + tile_w, width), y1 = std::min(y0 + tile_h, height);
+                    if (report)
+                        print_loading(y0);
+                    if (batch_rays > 0)
+                        render_batch(x0, y0, x1, y1, world, *samples, local_bounces);
+                    else
+                        for (int y = y0; y < y1; y++)
+                            for (int x = x0; x < x1; x++)
+                                framebuffer[y * width + x] = render_pixel(x, y, world, *samples, local_bounces);
+                    if (on_tile) {
+                        std::lock_guard<std::mutex> lock(tile_mutex);
+                        on_tile(x0, y0, x1 - x0, y1 - y0);
+                    }
+                }
+                bounces += local_bounces;
+            };
+
+            std::vector<std::thread> pool;
+            for (int t = 1; t < n_threads; t++)
+                pool.push_back(std::thread(worker, false));
+            worker(true);
+            for (auto& t : pool)
+                t.join();
+
+            primary_rays += (unsigned long long)(width) * height * samples_per_pixel;
+            secondary_rays += bounces;
+        }
+
+        // Adds the samples [first, first + count) of every pixel in a region to `sums`, for renders that are split
+        // over passes or processes. They are the samples render() takes and are added one by one after the ones
+        // already in `sums`, so ranges taken in order add up to exactly the image of render()
+        void render_samples(const hittable& world, int x0, int y0, int w, int h, int first, int count,
+                            std::vector<color>& sums) {
+            initialize();
+#ifdef COLLECT_STATS
+            stats->rendered(first, count);
+#endif
+            sums.resize(size_t(w) * h, color(0,0,0));
+
+            int n_threads = threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency());
+            std::atomic<int> next_row(0);
+            std::atomic<unsigned long long> bounces(0);
+
+            auto worker = [&]() {
+                auto samples = make_sampler(sampler_type);
+                unsigned long long local_bounces = 0;
+                for (int row = next_row++; row < h; row = next_row++) {
+                    for (int i = 0; i < w; i++) {
+                        color& sum = sums[row * w + i];
+                        sum = sample_pixel(x0 + i, y0 + row, world, *samples, local_bounces, first, count, sum);
+                    }
+                }
+                bounces += local_bounces;
+            };
+
+            std::vector<std::thread> pool;
+            for (int t = 1; t < n_threads; t++)
+                pool.push_back(std::thread(worker));
+            worker();
+            for (auto& t : pool)
+                t.join();
+
+            primary_rays += (unsigned long long)(w) * h * count;
+            secondary_rays += bounces;
+        }
+
+        color render_pixel(int x, int y, const hittable& world, sampler& samples, unsigned long long& bounces) const {
+            return pixel_sample_scale * sample_pixel(x, y, world, samples, bounces, 0, samples_per_pixel);
+        }
+
+        // path_color for every sample of the pixels in [x0, x1) x [y0, y1), but a bounce at a time: the rays of all
+        // paths still going are traced together with hit_batch. A path takes the same samples as in path_color and
+        // the pixels add their samples up in the same order, so the image is the same
+        void render_batch(int x0, int y0, int x1, int y1, const hittable& world, sampler& samples,
+                          unsigned long long& bounces) {
+            struct batch_path {
+                int x, y, sample;
+                color throughput = color(1.0, 1.0, 1.0);
+                color result = color(0, 0, 0);
+            };
+            std::vector<batch_path> paths;
+            std::vector<size_t> active;
+            ray_batch batch;
+            for (int y = y0; y < y1; y++) {
+                for (int x = x0; x < x1; x++) {
+                    for (int sample = 0; sample < samples_per_pixel; sample++) {
+                        batch_path path;
+                        path.x = x;
+                        path.y = y;
+                        path.sample = sample;
+                        samples.start(x, y, sample);
+                        active.push_back(paths.size());
+                        batch.rays.push_back(get_ray(x, y, samples));
+                        paths.push_back(path);
+                    }
+                }
+            }
+
+            std::vector<size_t> next;
+            std::vector<ray> next_rays;
+            for (int bounce = 0; bounce < max_depth && !active.empty(); bounce++) {
+                batch.reset();
+#ifdef COLLECT_STATS
+                if (bounce == 0) {
+                    for (size_t i = 0; i < active.size(); i++) {
+                        const batch_path& path = paths[active[i]];
+                        batch.recs[i].stats = stats.get();
+                        batch.recs[i].stat_slot = stats->slot(path.y * width + path.x, path.sample);
+                    }
+                }
+#endif
+                world.hit_batch(batch);
+
+                next.clear();
+                next_rays.clear();
+                for (size_t i = 0; i < active.size(); i++) {
+                    batch_path& path = paths[active[i]];
+                    const ray& current = batch.rays[i];
+                    if (!batch.found[i]) {
+                        path.result = path.throughput * background(current);
+                        continue;
+                    }
+
+                    ray scattered;
+                    color attenuation;
+                    samples.start(path.x, path.y, path.sample);
+                    samples.start_bounce(bounce + 1);
+                    if (!batch.recs[i].mat->scatter(current, batch.recs[i], attenuation, scattered, samples))
+                        continue;
+
+                    path.throughput = path.throughput * attenuation;
+                    if (bounce + 1 >= rr_depth) {
+                        const color& t = path.throughput;
+                        double survive = std::fmin(std::fmax(t.x(), std::fmax(t.y(), t.z())), 0.95);
+                        if (survive <= 0 || samples.get_1d() >= survive)
+                            continue;
+                        path.throughput /= survive;
                     }
-                    
-                    stats->next_pixel();
-                    write_color(image, pixel_sample_scale * pixel_color);
+
+                    if (bounce + 1 < max_depth)
+                        bounces++;
+                    next.push_back(active[i]);
+                    next_rays.push_back(scattered);
                 }
+                active.swap(next);
+                batch.rays.swap(next_rays);
             }
+
+            for (int y = y0; y < y1; y++) {
+                for (int x = x0; x < x1; x++) {
+                    color pixel_color(0, 0, 0);
+                    size_t first = (size_t(y - y0) * (x1 - x0) + (x - x0)) * samples_per_pixel;
+                    for (int sample = 0; sample < samples_per_pixel; sample++)
+                        pixel_color += paths[first + sample].result;
+                    framebuffer[y * width + x] = pixel_sample_scale * pixel_color;
+                }
+            }
+        }
+
+        color sample_pixel(int x, int y, const hittable& world, sampler& samples, unsigned long long& bounces,
+                           int first, int count, color pixel_color = color(0,0,0)) const {
+            for (int sample = first; sample < first + count; sample++)
+            {
+                samples.start(x, y, sample);
+                path_state path;
+                path.samples = &samples;
+#ifdef COLLECT_STATS
+                path.stat_slot = stats->slot(y * width + x, sample);
+#endif
+                ray r = get_ray(x, y, samples);
+                pixel_color += iterative ? path_color(r, world, path) : ray_color(r, max_depth, world, path);
+                bounces += path.secondary_rays;
+            }
+            return pixel_color;
+        }
+
+        void write_image(const char* path) const {
+            std::ofstream image(path);
+
+            image << "P3\n" << width << ' ' << height << "\n255\n";
+            for (const color& pixel_color : framebuffer)
+                write_color(image, pixel_color);
             image.close();
         }
 
@@ -136,6 +410,7 @@ class camera {
             std::clog << '[' << std::string(ratio, '#') << std::string(20-ratio, '-') << "] " << std::flush;
         }
 
+#ifdef COLLECT_STATS
         void save_stats(std::string path) {
             std::clog << "\rCollecting Stats...                             " << std::flush;
             auto file_name = stats->get_file_name(path);
@@ -143,6 +418,7 @@ class camera {
             stats->save_intersection_tests_image(file_name, width, height);
             stats->save_traversal_step_image(file_name, width, height);
         }
+#endif
 };
 
 #endif
@@ -0,0 +1,134 @@
+/*
+    IN THIS FILE you will find the checkpoint of a progressive render: the linear sample sums of every pixel and the
+    number of samples they hold.
+
+    The samplers key their random numbers by pixel, sample index, bounce and dimension, so the sample count is all
+    the rng state there is: a resumed render takes the samples from that index on and ends up with the same image
+    as a render that was never stopped. A fingerprint of the scene file, the camera, the sampler, the integrator and
+    the level of detail options makes sure the samples of one render are never added to another.
+
+    Layout: "RTCK", version, width, height, samples (uint32 each), the fingerprint (uint32 length + characters) and
+    width * height * 3 doubles, all in the byte order of the machine that saved it, so a checkpoint only resumes on a
+    machine of the same order.
+*/
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "common.h"
+#include "build_options.h"
+#include "camera.h"
+
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct render_checkpoint {
+    static const uint32_t version = 1;
+
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t samples = 0;
+    std::string fingerprint;
+    std::vector<color> sums;
+
+    // Everything that changes which samples a pixel gets, the samples per pixel excluded so a resume can add more.
+    // The scene is named by its path and a hash of its contents, so an edited scene file does not resume
+    static std::string fingerprint_of(const std::string& scene, const camera& cam, const std::string& integrator,
+                                      const build_options& options) {
+        std::ostringstream out;
+        out.precision(17);
+        out << scene << ' ' << std::hex << hash_file(scene) << std::dec << ' ' << cam.width << 'x' << cam.height
+            << " from " << cam.lookfrom << " at " << cam.lookat << " up " << cam.vup << " fov " << cam.vfov
+            << " blur " << cam.defocus_angle << ' ' << cam.focus_dist << " depth " << cam.max_depth << ' '
+            << cam.sampler_type << ' ' << integrator << " rr " << cam.rr_depth << " lod " << options.lod;
+        if (options.lod != "off")
+            out << ' ' << options.lod_detail << ' ' << options.max_lod_levels();
+        return out.str();
+    }
+
+    // FNV-1a of the bytes of a file, 0 if it cannot be read
+    static unsigned long long hash_file(const std::string& path) {
+        FILE* file = fopen(path.c_str(), "rb");
+        if (file == NULL)
+            return 0;
+        unsigned long long hash = 14695981039346656037ULL;
+        char buffer[1 << 16];
+        size_t count;
+        while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0)
+            for (size_t i = 0; i < count; i++) {
+                hash ^= (unsigned char)buffer[i];
+                hash *= 1099511628211ULL;
+            }
+        fclose(file);
+        return hash;
+    }
+
+    // "output/image.ppm" -> "output/image.ckpt"
+    static std::string path_for(const std::string& image_path) {
+        auto slash = image_path.find_last_of("/\\");
+        auto dot = image_path.find_last_of('.');
+        if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+            return image_path + ".ckpt";
+        return image_path.substr(0, dot) + ".ckpt";
+    }
+
+    // Written next to `path` first and then renamed over it, so a node that is stopped while saving keeps the last
+    // complete checkpoint
+    bool save(const std::string& path) const {
+        std::string temporary = path + ".tmp";
+        FILE* file = fopen(temporary.c_str(), "wb");
+        if (file == NULL) {
+            std::clog << "Could not write checkpoint " << temporary << std::endl;
+            return false;
+        }
+        uint32_t length = uint32_t(fingerprint.size());
+        uint32_t header[] = {version, width, height, samples, length};
+        std::vector<double> values(sums.size() * 3);
+        for (size_t i = 0; i < sums.size(); i++)
+            for (int c = 0; c < 3; c++)
+                values[i * 3 + c] = sums[i][c];
+        bool ok = fwrite("RTCK", 1, 4, file) == 4 && fwrite(header, sizeof(header), 1, file) == 1 &&
+                  fwrite(fingerprint.data(), 1, length, file) == length &&
+                  fwrite(values.data(), sizeof(double), values.size(), file) == values.size();
+        ok = fclose(file) == 0 && ok;
+        if (!ok || std::rename(temporary.c_str(), path.c_str()) != 0) {
+            std::clog << "Could not write checkpoint " << path << std::endl;
+            std::remove(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    bool load(const std::string& path) {
+        FILE* file = fopen(path.c_str(), "rb");
+        if (file == NULL) {
+            std::clog << "Could not open checkpoint " << path << std::endl;
+            return false;
+        }
+        char magic[4];
+        uint32_t header[5];
+        bool ok = fread(magic, 1, 4, file) == 4 && memcmp(magic, "RTCK", 4) == 0 &&
+                  fread(header, sizeof(header), 1, file) == 1 && header[0] == version && header[4] < (1u << 16);
+        if (ok) {
+            width = header[1];
+            height = header[2];
+            samples = header[3];
+            fingerprint.assign(header[4], ' ');
+            std::vector<double> values(size_t(width) * height * 3);
+            ok = fread(&fingerprint[0], 1, header[4], file) == header[4] &&
+                 fread(values.data(), sizeof(double), values.size(), file) == values.size();
+            sums.resize(size_t(width) * height);
+            for (size_t i = 0; ok && i < sums.size(); i++)
+                sums[i] = color(values[i * 3], values[i * 3 + 1], values[i * 3 + 2]);
+        }
+        fclose(file);
+        if (!ok)
+            std::clog << "Checkpoint " << path << " is damaged or from another version" << std::endl;
+        return ok;
+    }
+};
+
+#endif
@@ -0,0 +1,787 @@
+/*
+    IN THIS FILE you will find the OpenCL backend (-b opencl):
+
+    1) host copies of the structs in kernels.cl
+    2) gpu_scene: the flattened scene with a binned SAH BVH in the BVHNode layout the extend kernel walks
+    3) cl_backend: picks a device, uploads a gpu_scene once and path traces it with the wavefront kernels generate,
+       extend, shade and compact, only the finished framebuffer is read back. With builder "lbvh" the BVH is built
+       on the device instead, by the lbvh_* and radix_* kernels
+
+    Compiled programs are cached on disk, so only the first run on a device pays for the online compiler.
+
+    Any scene load_scene returns can be rendered, whatever structure it was built with on the CPU. The lambertian,
+    metal and dielectric materials scatter as in material.h, with the Russian roulette of camera::path_color.
+*/
+
+#ifndef CL_BACKEND_H
+#define CL_BACKEND_H
+
+#include "common.h"
+#include "camera.h"
+#include "hittable.h"
+#include "material.h"
+#include "metrics.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <tuple>
+
+#define CL_TARGET_OPENCL_VERSION 120
+#ifdef __APPLE__
+    #include <OpenCL/cl.h>
+#else
+    #include <CL/cl.h>
+#endif
+
+//* DEVICE STRUCTS, must match kernels.cl
+struct gpu_prim {
+    float a[3];
+    cl_int type;            // 0 triangle, 1 sphere
+    float b[3];
+    cl_int material;
+    float c[3];
+    float radius;
+};
+
+struct gpu_material {
+    float albedo[3];
+    float param;
+    cl_int type;            // flat_material::material_type
+    cl_int pad[3];
+};
+
+struct gpu_bvh_node {
+    float min[3];
+    cl_int left_first;      // inner node: left child, the right child follows it. leaf: first primitive
+    float max[3];
+    cl_int prim_count;      // 0 for inner nodes
+};
+
+static_assert(sizeof(gpu_prim) == 48, "gpu_prim must match struct Prim in kernels.cl");
+static_assert(sizeof(gpu_material) == 32, "gpu_material must match struct Material in kernels.cl");
+static_assert(sizeof(gpu_bvh_node) == 32, "gpu_bvh_node must match struct BVHNode in kernels.cl");
+
+#ifdef EMBEDDED_KERNELS
+// src/kernels.cl as a raw string literal, generated by the Makefile
+static const char* embedded_kernel_source =
+    #include "kernels.cl.inc"
+    ;
+#endif
+
+// Size of struct Ray in kernels.cl, three padded float3 and the intersection
+static const size_t gpu_ray_bytes = 64;
+// Size of struct Path in kernels.cl, the throughput, the pixel and whether it is still alive
+static const size_t gpu_path_bytes = 32;
+
+//* FLATTENED SCENE
+class gpu_scene {
+    public:
+        std::vector<gpu_prim> prims;
+        std::vector<gpu_material> materials;
+        std::vector<gpu_bvh_node> nodes;
+        double build_seconds = 0;
+
+        // Without `build_tree` only the primitives and materials are filled in, in the order of the scene
+        gpu_scene(const hittable& world, bool build_tree = true) {
+            std::vector<flat_primitive> flat;
+            world.flatten(flat);
+
+            // kD-tree and SBVH leaves share primitives, keep each one once. Every instance of a model places its own
+            // copy of the model's primitives
+            std::map<std::tuple<const hittable*, const hittable*, int>, point> seen;
+            std::map<const material*, int> material_index;
+            size_t duplicates = 0;
+            for (const auto& p : flat) {
+                auto kept = seen.insert(std::make_pair(std::make_tuple(p.owner, p.source, p.part), p.a));
+                if (!kept.second) {
+                    if ((kept.first->second - p.a).length_squared() == 0)
+                        duplicates++;
+                    continue;
+                }
+                if (material_index.find(p.mat) == material_index.end()) {
+                    material_index[p.mat] = materials.size();
+                    materials.push_back(to_gpu(p.mat ? p.mat->flatten() : flat_material()));
+                }
+                prims.push_back(to_gpu(p, material_index[p.mat]));
+                bounds.push_back(bounding_box(p));
+            }
+            if (prims.size() != flat.size() - duplicates)
+                std::clog << "OpenCL: " << flat.size() - duplicates - prims.size() << " of " << flat.size() - duplicates
+                          << " primitives were taken for copies of others and are missing" << std::endl;
+
+            if (build_tree) {
+                stopwatch timer;
+                build();
+                build_seconds = timer.elapsed();
+            }
+        }
+
+        size_t bytes() const {
+            return prims.size() * sizeof(gpu_prim) + materials.size() * sizeof(gpu_material) +
+                   nodes.size() * sizeof(gpu_bvh_node);
+        }
+
+    private:
+        static const int bins = 12;
+        static const int max_depth = 60;    // Trace in kernels.cl has a stack of 64
+        std::vector<aabb> bounds;           // per primitive, in the order of prims
+        std::vector<unsigned int> order;
+
+        static gpu_material to_gpu(const flat_material& m) {
+            gpu_material res = {};
+            for (int i = 0; i < 3; i++)
+                res.albedo[i] = float(m.albedo[i]);
+            res.param = float(m.param);
+            res.type = m.type;
+            return res;
+        }
+
+        static gpu_prim to_gpu(const flat_primitive& p, int material) {
+            gpu_prim res = {};
+            for (int i = 0; i < 3; i++) {
+                res.a[i] = float(p.a[i]);
+                res.b[i] = float(p.b[i]);
+                res.c[i] = float(p.c[i]);
+            }
+            res.type = (p.shape == flat_primitive::SPHERE) ? 1 : 0;
+            res.material = material;
+            res.radius = float(p.radius);
+            return res;
+        }
+
+        static aabb bounding_box(const flat_primitive& p) {
+            if (p.shape == flat_primitive::SPHERE) {
+                vec3 r(p.radius, p.radius, p.radius);
+                return aabb(p.a - r, p.a + r);
+            }
+            return aabb(aabb(p.a, p.a + p.b), aabb(p.a, p.a + p.c));
+        }
+
+        static double surface_area(const aabb& box) {
+            double dx = box.x.size(), dy = box.y.size(), dz = box.z.size();
+            return (dx < 0 || dy < 0 || dz < 0) ? 0 : 2 * (dx * dy + dy * dz + dz * dx);
+        }
+
+        void build() {
+            order.resize(prims.size());
+            for (size_t i = 0; i < order.size(); i++)
+                order[i] = i;
+
+            nodes.reserve(2 * prims.size() + 1);
+            nodes.push_back(gpu_bvh_node());
+            if (prims.empty()) {
+                // An inverted root box that every ray misses
+                for (int axis = 0; axis < 3; axis++) {
+                    nodes[0].min[axis] = 1;
+                    nodes[0].max[axis] = -1;
+                }
+                return;
+            }
+            subdivide(0, 0, prims.size(), 0);
+
+            // Leaves point into prims, so store the primitives in leaf order
+            std::vector<gpu_prim> sorted(prims.size());
+            for (size_t i = 0; i < order.size(); i++)
+                sorted[i] = prims[order[i]];
+            prims.swap(sorted);
+        }
+
+        static void set_bounds(gpu_bvh_node& node, const aabb& box) {
+            // Rounded outwards, so the float box still contains the primitives
+            for (int axis = 0; axis < 3; axis++) {
+                node.min[axis] = std::nextafter(float(box.axis_interval(axis).min), -HUGE_VALF);
+                node.max[axis] = std::nextafter(float(box.axis_interval(axis).max), HUGE_VALF);
+            }
+        }
+
+        void make_leaf(size_t index, size_t first, size_t count) {
+            nodes[index].left_first = first;
+            nodes[index].prim_count = count;
+        }
+
+        void subdivide(size_t index, size_t first, size_t count, int depth) {
+            aabb box, centroids;
+            for (size_t i = first; i < first + count; i++) {
+                const aabb& b = bounds[order[i]];
+                box = aabb(box, b);
+                point c = b.centroid();
+                centroids = aabb(centroids, aabb(c, c));
+            }
+            set_bounds(nodes[index], box);
+
+            if (count <= 2 || depth >= max_depth) {
+                make_leaf(index, first, count);
+                return;
+            }
+
+            // Binned SAH over the centroid bounds of every axis
+            int best_axis = -1, best_split = 0;
+            double best_cost = infinity;
+            for (int axis = 0; axis < 3; axis++) {
+                const interval& extent = centroids.axis_interval(axis);
+                if (extent.size() <= 0)
+                    continue;
+                aabb bin_box[bins];
+                int bin_count[bins] = {0};
+                double scale = bins / extent.size();
+                for (size_t i = first; i < first + count; i++) {
+                    const aabb& b = bounds[order[i]];
+                    int bin = std::min(bins - 1, int((b.centroid()[axis] - extent.min) * scale));
+                    bin_count[bin]++;
+                    bin_box[bin] = aabb(bin_box[bin], b);
+                }
+
+                double left_area[bins - 1];
+                int left_count[bins - 1];
+                aabb left_box;
+                int left_sum = 0;
+                for (int i = 0; i < bins - 1; i++) {
+                    left_sum += bin_count[i];
+                    left_box = aabb(left_box, bin_box[i]);
+                    left_count[i] = left_sum;
+                    left_area[i] = surface_area(left_box);
+                }
+                aabb right_box;
+                int right_sum = 0;
+                for (int i = bins - 1; i > 0; i--) {
+                    right_sum += bin_count[i];
+                    right_box = aabb(right_box, bin_box[i]);
+                    if (left_count[i - 1] == 0 || right_sum == 0)
+                        continue;
+                    double cost = left_count[i - 1] * left_area[i - 1] + right_sum * surface_area(right_box);
+                    if (cost < best_cost) {
+                        best_cost = cost;
+                        best_axis = axis;
+                        best_split = i;
+                    }
+                }
+            }
+
+            double leaf_cost = count * surface_area(box);
+            if (best_axis < 0 || (best_cost >= leaf_cost && count <= 8)) {
+                make_leaf(index, first, count);
+                return;
+            }
+
+            const interval& extent = centroids.axis_interval(best_axis);
+            double scale = bins / extent.size();
+            auto middle = std::partition(order.begin() + first, order.begin() + first + count, [&](unsigned int p) {
+                int bin = std::min(bins - 1, int((bounds[p].centroid()[best_axis] - extent.min) * scale));
+                return bin < best_split;
+            });
+            size_t left_count = middle - (order.begin() + first);
+
+            size_t left = nodes.size();
+            nodes.push_back(gpu_bvh_node());
+            nodes.push_back(gpu_bvh_node());
+            nodes[index].left_first = left;
+            nodes[index].prim_count = 0;
+            subdivide(left, first, left_count, depth + 1);
+            subdivide(left + 1, first + left_count, count - left_count, depth + 1);
+        }
+};
+
+//* BACKEND
+class cl_backend {
+    public:
+        std::string platform_name;
+        std::string device_name;
+        std::string kernel_path;            // empty: the embedded source, or src/kernels.cl without one
+        std::string cache_dir;              // empty: $XDG_CACHE_HOME or ~/.cache, "off" disables the cache
+        std::string build_options = "-cl-std=CL1.2";
+        std::string builder = "sah";        // "lbvh" builds the BVH on the device
+        bool program_from_cache = false;
+        structure_metrics scene_metrics;
+
+        ~cl_backend() {
+            cl_mem buffers[] = {node_buffer, prim_buffer, material_buffer};
+            for (cl_mem buffer : buffers)
+                if (buffer) clReleaseMemObject(buffer);
+            cl_kernel kernels[] = {generate_kernel, extend_kernel, shade_kernel, compact_kernel};
+            for (cl_kernel kernel : kernels)
+                if (kernel) clReleaseKernel(kernel);
+            if (program) clReleaseProgram(program);
+            if (queue) clReleaseCommandQueue(queue);
+            if (context) clReleaseContext(context);
+        }
+
+        // Picks the first GPU of any platform, otherwise the first device at all (e.g. PoCL on the CPU),
+        // and builds the kernels for it
+        bool initialize() {
+            cl_uint n_platforms = 0;
+            if (!check(clGetPlatformIDs(0, NULL, &n_platforms), "clGetPlatformIDs") || n_platforms == 0) {
+                std::clog << "OpenCL: no platforms found" << std::endl;
+                return false;
+            }
+            std::vector<cl_platform_id> platforms(n_platforms);
+            clGetPlatformIDs(n_platforms, platforms.data(), NULL);
+
+            cl_platform_id platform = NULL;
+            cl_device_type wanted[] = {CL_DEVICE_TYPE_GPU, CL_DEVICE_TYPE_ALL};
+            for (cl_device_type type : wanted) {
+                for (cl_platform_id p : platforms) {
+                    if (clGetDeviceIDs(p, type, 1, &device, NULL) == CL_SUCCESS) {
+                        platform = p;
+                        break;
+                    }
+                }
+                if (platform)
+                    break;
+            }
+            if (!platform) {
+                std::clog << "OpenCL: no devices found" << std::endl;
+                return false;
+            }
+            platform_name = platform_info(platform, CL_PLATFORM_NAME);
+            device_name = device_info(device, CL_DEVICE_NAME);
+            std::clog << "OpenCL device: " << device_name << " (" << platform_name << ")" << std::endl;
+
+            cl_int status;
+            context = clCreateContext(NULL, 1, &device, NULL, NULL, &status);
+            if (!check(status, "clCreateContext"))
+                return false;
+            queue = clCreateCommandQueue(context, device, 0, &status);
+            if (!check(status, "clCreateCommandQueue"))
+                return false;
+
+            if (!load_program())
+                return false;
+
+            generate_kernel = clCreateKernel(program, "generate", &status);
+            if (!check(status, "clCreateKernel(generate)"))
+                return false;
+            extend_kernel = clCreateKernel(program, "extend", &status);
+            if (!check(status, "clCreateKernel(extend)"))
+                return false;
+            shade_kernel = clCreateKernel(program, "shade", &status);
+            if (!check(status, "clCreateKernel(shade)"))
+                return false;
+            compact_kernel = clCreateKernel(program, "compact", &status);
+            return check(status, "clCreateKernel(compact)");
+        }
+
+        // Flattens the scene, builds the device BVH and copies both to the device, once per scene
+        bool upload(const hittable& world) {
+            // The device builder needs two primitives for an inner node and work-groups of lbvh_group items
+            bool on_device = builder == "lbvh";
+            if (on_device && max_work_group_size() < lbvh_group) {
+                std::clog << "OpenCL: work-groups of " << lbvh_group << " are not supported, building the BVH on the host"
+                          << std::endl;
+                on_device = false;
+            }
+            gpu_scene scene(world, !on_device);
+            if (scene.prims.size() < 2 && on_device) {
+                scene = gpu_scene(world);
+                on_device = false;
+            }
+            if (scene.materials.empty())
+                scene.materials.push_back(gpu_material());
+            if (on_device)
+                return create_buffer(material_buffer, scene.materials) && build_lbvh(scene);
+
+            scene_metrics.name = "opencl";
+            scene_metrics.primitives = scene.prims.size();
+            scene_metrics.build_seconds = scene.build_seconds;
+            scene_metrics.bytes = scene.bytes();
+            std::clog << "\rOpenCL BVH: " << scene.prims.size() << " primitives, " << scene.nodes.size() << " nodes"
+                      << std::endl;
+
+            // An empty scene still gets a primitive, zero sized buffers are not allowed
+            if (scene.prims.empty())
+                scene.prims.push_back(gpu_prim());
+
+            return create_buffer(node_buffer, scene.nodes) && create_buffer(prim_buffer, scene.prims) &&
+                   create_buffer(material_buffer, scene.materials);
+        }
+
+        // Path traces every sample on the device. Rays, paths and the two ray queues live in device buffers for the
+        // whole render, the bounces of a sample ping-pong between the queues. Only the accumulated framebuffer and the
+        // ray count are read back, at the end.
+        bool render(camera& cam) {
+            cam.initialize();
+            cl_uint width = cam.width, height = cam.height;
+            cl_uint count = width * height;
+            cl_uint max_depth = cam.max_depth, rr_depth = cam.rr_depth;
+
+            std::vector<cl_float4> accum(count);
+            for (auto& a : accum)
+                a.s[0] = a.s[1] = a.s[2] = a.s[3] = 0;
+            cl_uint zero = 0;
+            cl_ulong traced = 0;
+
+            bool ok = true;
+            std::vector<cl_mem> buffers;
+            auto device_buffer = [&](size_t bytes, void* data) {
+                cl_int status;
+                cl_mem buffer = clCreateBuffer(context, CL_MEM_READ_WRITE | (data ? CL_MEM_COPY_HOST_PTR : 0), bytes,
+                                               data, &status);
+                ok = ok && check(status, "clCreateBuffer");
+                buffers.push_back(buffer);
+                return buffer;
+            };
+            cl_mem rays = device_buffer(count * gpu_ray_bytes, NULL);
+            cl_mem paths = device_buffer(count * gpu_path_bytes, NULL);
+            cl_mem queues[2] = {device_buffer(count * sizeof(cl_uint), NULL), device_buffer(count * sizeof(cl_uint), NULL)};
+            cl_mem lengths[2] = {device_buffer(sizeof(cl_uint), &zero), device_buffer(sizeof(cl_uint), &zero)};
+            cl_mem traced_buffer = device_buffer(sizeof(cl_ulong), &traced);
+            cl_mem accum_buffer = device_buffer(count * sizeof(cl_float4), accum.data());
+
+            cl_float3 origin = to_float3(cam.lookfrom), p00 = to_float3(cam.pixel00_loc);
+            cl_float3 du = to_float3(cam.pixel_delta_u), dv = to_float3(cam.pixel_delta_v);
+            cl_float3 disk_u = to_float3(cam.defocus_angle > 0 ? cam.defocus_disk_u : vec3(0, 0, 0));
+            cl_float3 disk_v = to_float3(cam.defocus_angle > 0 ? cam.defocus_disk_v : vec3(0, 0, 0));
+
+            for (cl_uint sample = 0; ok && sample < cl_uint(cam.samples_per_pixel); sample++) {
+                std::clog << "\rCurrent Sample: " << sample << '/' << cam.samples_per_pixel << ' ' << std::flush;
+                set_args(generate_kernel, rays, paths, queues[0], lengths[0], accum_buffer, width, height, sample,
+                         origin, p00, du, dv, disk_u, disk_v);
+                ok = run(generate_kernel, count);
+                for (cl_uint bounce = 0; ok && bounce < max_depth; bounce++) {
+                    int in = bounce % 2, out = 1 - in;
+                    set_args(extend_kernel, node_buffer, prim_buffer, rays, queues[in], lengths[in], lengths[out],
+                             traced_buffer);
+                    set_args(shade_kernel, rays, paths, prim_buffer, material_buffer, queues[in], lengths[in],
+                             accum_buffer, width, sample, bounce, max_depth, rr_depth);
+                    set_args(compact_kernel, paths, queues[in], lengths[in], queues[out], lengths[out]);
+                    ok = run(extend_kernel, count) && run(shade_kernel, count) &&
+                         (bounce + 1 == max_depth || run(compact_kernel, count));
+                }
+                ok = ok && check(clFinish(queue), "clFinish");
+            }
+            ok = ok && check(clEnqueueReadBuffer(queue, accum_buffer, CL_TRUE, 0, count * sizeof(cl_float4),
+                                                 accum.data(), 0, NULL, NULL), "clEnqueueReadBuffer") &&
+                 check(clEnqueueReadBuffer(queue, traced_buffer, CL_TRUE, 0, sizeof(cl_ulong), &traced, 0, NULL, NULL),
+                       "clEnqueueReadBuffer");
+            for (cl_mem buffer : buffers)
+                if (buffer) clReleaseMemObject(buffer);
+            if (!ok)
+                return false;
+
+            cam.framebuffer.assign(count, color(0, 0, 0));
+            for (cl_uint i = 0; i < count; i++) {
+                double n = accum[i].s[3] > 0 ? accum[i].s[3] : 1;
+                cam.framebuffer[i] = color(accum[i].s[0] / n, accum[i].s[1] / n, accum[i].s[2] / n);
+            }
+            unsigned long long primary = (unsigned long long)(count) * cam.samples_per_pixel;
+            cam.primary_rays += primary;
+            cam.secondary_rays += traced - primary;
+            return true;
+        }
+
+    private:
+        cl_device_id device = NULL;
+        cl_context context = NULL;
+        cl_command_queue queue = NULL;
+        cl_program program = NULL;
+        cl_kernel generate_kernel = NULL;
+        cl_kernel extend_kernel = NULL;
+        cl_kernel shade_kernel = NULL;
+        cl_kernel compact_kernel = NULL;
+        cl_mem node_buffer = NULL;
+        cl_mem prim_buffer = NULL;
+        cl_mem material_buffer = NULL;
+
+        static const cl_uint lbvh_group = 256;      // LBVH_GROUP in kernels.cl
+        static const cl_uint radix_buckets = 16;    // RADIX_BUCKETS
+        static const cl_uint radix_passes = 8;      // 32-bit keys, 4 bits per pass
+
+        // Builds the BVH from the unsorted primitives on the device and leaves it in node_buffer and prim_buffer,
+        // in the same layout as the host builder. Every phase is waited for, so the times are device times.
+        bool build_lbvh(const gpu_scene& scene) {
+            std::vector<cl_kernel> kernels;
+            std::vector<cl_mem> temporaries;
+            bool ok = run_lbvh(scene, kernels, temporaries);
+            for (cl_kernel kernel : kernels)
+                if (kernel) clReleaseKernel(kernel);
+            for (cl_mem buffer : temporaries)
+                if (buffer) clReleaseMemObject(buffer);
+            return ok;
+        }
+
+        bool run_lbvh(const gpu_scene& scene, std::vector<cl_kernel>& kernels, std::vector<cl_mem>& temp) {
+            const char* names[] = {"lbvh_bounds", "lbvh_morton", "radix_count", "radix_scan", "radix_scatter",
+                                   "lbvh_hierarchy", "lbvh_link", "lbvh_fit", "lbvh_gather"};
+            cl_int status;
+            for (const char* name : names) {
+                kernels.push_back(clCreateKernel(program, name, &status));
+                if (!check(status, name))
+                    return false;
+            }
+            cl_kernel bounds_kernel = kernels[0], morton_kernel = kernels[1], count_kernel = kernels[2];
+            cl_kernel scan_kernel = kernels[3], scatter_kernel = kernels[4], hierarchy_kernel = kernels[5];
+            cl_kernel link_kernel = kernels[6], fit_kernel = kernels[7], gather_kernel = kernels[8];
+
+            cl_uint n = scene.prims.size(), n_nodes = 2 * n - 1;
+            cl_uint groups = (n + lbvh_group - 1) / lbvh_group, histogram_length = radix_buckets * groups;
+            cl_int scene_bounds[6];
+            for (int axis = 0; axis < 3; axis++) {
+                scene_bounds[axis] = float_to_ordered(HUGE_VALF);
+                scene_bounds[axis + 3] = float_to_ordered(-HUGE_VALF);
+            }
+
+            auto device_buffer = [&](size_t bytes, const void* data) {
+                cl_int status;
+                cl_mem buffer = clCreateBuffer(context, CL_MEM_READ_WRITE | (data ? CL_MEM_COPY_HOST_PTR : 0), bytes,
+                                               (void*)data, &status);
+                temp.push_back(buffer);
+                return check(status, "clCreateBuffer") ? buffer : NULL;
+            };
+            cl_mem prims_in = device_buffer(n * sizeof(gpu_prim), scene.prims.data());
+            cl_mem bounds = device_buffer(n * 2 * sizeof(cl_float4), NULL);
+            cl_mem scene_buffer = device_buffer(sizeof(scene_bounds), scene_bounds);
+            cl_mem keys[2] = {device_buffer(n * sizeof(cl_uint), NULL), device_buffer(n * sizeof(cl_uint), NULL)};
+            cl_mem values[2] = {device_buffer(n * sizeof(cl_uint), NULL), device_buffer(n * sizeof(cl_uint), NULL)};
+            cl_mem histogram = device_buffer(histogram_length * sizeof(cl_uint), NULL);
+            cl_mem split = device_buffer((n - 1) * sizeof(cl_int), NULL);
+            cl_mem slot_of = device_buffer((n - 1) * sizeof(cl_int), NULL);
+            cl_mem leaf_slot = device_buffer(n * sizeof(cl_int), NULL);
+            cl_mem parent = device_buffer(n_nodes * sizeof(cl_int), NULL);
+            cl_mem visits = device_buffer(n_nodes * sizeof(cl_uint), NULL);
+            for (cl_mem buffer : temp)
+                if (!buffer)
+                    return false;
+            node_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, n_nodes * sizeof(gpu_bvh_node), NULL, &status);
+            if (!check(status, "clCreateBuffer(nodes)"))
+                return false;
+            prim_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, n * sizeof(gpu_prim), NULL, &status);
+            if (!check(status, "clCreateBuffer(prims)"))
+                return false;
+
+            stopwatch timer;
+            set_args(bounds_kernel, prims_in, n, bounds, scene_buffer);
+            set_args(morton_kernel, bounds, n, scene_buffer, keys[0], values[0]);
+            bool ok = run(bounds_kernel, n, lbvh_group) && run(morton_kernel, n) && check(clFinish(queue), "morton");
+            double morton_seconds = timer.elapsed();
+
+            // Ping-pong between the two key/value buffers, an even number of passes ends in the first
+            timer.reset();
+            for (cl_uint pass = 0; ok && pass < radix_passes; pass++) {
+                cl_uint shift = pass * 4;
+                int from = pass % 2, to = 1 - from;
+                set_args(count_kernel, keys[from], n, shift, histogram);
+                set_args(scan_kernel, histogram, histogram_length);
+                set_args(scatter_kernel, keys[from], values[from], keys[to], values[to], n, shift, histogram);
+                ok = run(count_kernel, n, lbvh_group) && run(scan_kernel, lbvh_group, lbvh_group) &&
+                     run(scatter_kernel, n, lbvh_group);
+            }
+            ok = ok && check(clFinish(queue), "radix sort");
+            double sort_seconds = timer.elapsed();
+
+            timer.reset();
+            set_args(hierarchy_kernel, keys[0], values[0], n, bounds, node_buffer, split, slot_of, leaf_slot);
+            set_args(link_kernel, split, slot_of, n, node_buffer, parent, visits);
+            set_args(fit_kernel, leaf_slot, n, parent, visits, node_buffer);
+            set_args(gather_kernel, prims_in, values[0], n, prim_buffer);
+            ok = ok && run(hierarchy_kernel, n - 1) && run(link_kernel, n - 1) && run(fit_kernel, n) &&
+                 run(gather_kernel, n) && check(clFinish(queue), "hierarchy");
+            double hierarchy_seconds = timer.elapsed();
+            if (!ok)
+                return false;
+
+            scene_metrics.name = "opencl-lbvh";
+            scene_metrics.primitives = n;
+            scene_metrics.build_seconds = morton_seconds + sort_seconds + hierarchy_seconds;
+            scene_metrics.bytes = n * sizeof(gpu_prim) + scene.materials.size() * sizeof(gpu_material) +
+                                  n_nodes * sizeof(gpu_bvh_node);
+            std::clog << "\rOpenCL LBVH: " << n << " primitives, " << n_nodes << " nodes, built on the device in "
+                      << scene_metrics.build_seconds << "s (morton " << morton_seconds << "s, sort " << sort_seconds
+                      << "s, hierarchy " << hierarchy_seconds << "s)" << std::endl;
+            return true;
+        }
+
+        // Enqueues `kernel` over at least `global` items, rounded up to whole work-groups of `local` (0: any size)
+        bool run(cl_kernel kernel, size_t global, size_t local = 0) {
+            if (local)
+                global = (global + local - 1) / local * local;
+            return check(clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &global, local ? &local : NULL, 0, NULL, NULL),
+                         "clEnqueueNDRangeKernel");
+        }
+
+        template <typename... Args>
+        static void set_args(cl_kernel kernel, const Args&... args) {
+            set_arg(kernel, 0, args...);
+        }
+
+        static void set_arg(cl_kernel, cl_uint) {}
+
+        template <typename T, typename... Args>
+        static void set_arg(cl_kernel kernel, cl_uint index, const T& value, const Args&... args) {
+            clSetKernelArg(kernel, index, sizeof(T), &value);
+            set_arg(kernel, index + 1, args...);
+        }
+
+        // The order preserving int of a float that atomic_min / atomic_max in lbvh_bounds work on
+        static cl_int float_to_ordered(float f) {
+            cl_int i;
+            memcpy(&i, &f, sizeof(i));
+            return (i >= 0) ? i : i ^ 0x7fffffff;
+        }
+
+        size_t max_work_group_size() const {
+            size_t size = 0;
+            clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size), &size, NULL);
+            return size;
+        }
+
+        std::string kernel_source() const {
+#ifdef EMBEDDED_KERNELS
+            if (kernel_path.empty())
+                return embedded_kernel_source;
+#endif
+            return read_text_file(kernel_path.empty() ? "src/kernels.cl" : kernel_path);
+        }
+
+        // Cached binaries are only valid for the same device, driver, source and options
+        std::string cache_file(const std::string& source) const {
+            std::string dir = cache_dir;
+            if (dir == "off")
+                return "";
+            if (dir.empty()) {
+                const char* xdg = getenv("XDG_CACHE_HOME");
+                const char* home = getenv("HOME");
+                if (xdg && *xdg)
+                    dir = std::string(xdg) + "/ray-tracer";
+                else if (home && *home)
+                    dir = std::string(home) + "/.cache/ray-tracer";
+                else
+                    return "";
+            }
+            std::string key = device_name + '\n' + device_info(device, CL_DRIVER_VERSION) + '\n' +
+                              device_info(device, CL_DEVICE_VERSION) + '\n' + build_options + '\n' + source;
+            char name[32];
+            snprintf(name, sizeof(name), "%016llx.clbin", hash_string(key));
+            return dir + "/" + name;
+        }
+
+        // Loads the program from the binary cache, or builds it from source and stores the binary for next time
+        bool load_program() {
+            std::string source = kernel_source();
+            if (source.empty()) {
+                std::clog << "OpenCL: could not read " << (kernel_path.empty() ? "src/kernels.cl" : kernel_path)
+                          << std::endl;
+                return false;
+            }
+
+            std::string cache = cache_file(source);
+            std::string binary = cache.empty() ? "" : read_text_file(cache);
+            if (!binary.empty()) {
+                const unsigned char* binary_ptr = (const unsigned char*)binary.data();
+                size_t binary_size = binary.size();
+                cl_int binary_status, status;
+                program = clCreateProgramWithBinary(context, 1, &device, &binary_size, &binary_ptr, &binary_status,
+                                                    &status);
+                if (status == CL_SUCCESS && binary_status == CL_SUCCESS &&
+                    clBuildProgram(program, 1, &device, build_options.c_str(), NULL, NULL) == CL_SUCCESS) {
+                    program_from_cache = true;
+                    std::clog << "OpenCL: program loaded from " << cache << std::endl;
+                    return true;
+                }
+                // A stale or corrupt binary, rebuild it from source
+                if (program) {
+                    clReleaseProgram(program);
+                    program = NULL;
+                }
+            }
+
+            cl_int status;
+            const char* source_ptr = source.c_str();
+            program = clCreateProgramWithSource(context, 1, &source_ptr, NULL, &status);
+            if (!check(status, "clCreateProgramWithSource"))
+                return false;
+            status = clBuildProgram(program, 1, &device, build_options.c_str(), NULL, NULL);
+            if (status != CL_SUCCESS) {
+                size_t log_size = 0;
+                clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
+                std::string log(log_size, '\0');
+                clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, log_size, &log[0], NULL);
+                std::clog << "OpenCL: building the kernels failed:\n" << log << std::endl;
+                return false;
+            }
+            if (!cache.empty())
+                save_binary(cache);
+            return true;
+        }
+
+        void save_binary(const std::string& path) const {
+            size_t size = 0;
+            if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size), &size, NULL) != CL_SUCCESS || size == 0)
+                return;
+            std::string binary(size, '\0');
+            unsigned char* binary_ptr = (unsigned char*)&binary[0];
+            if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binary_ptr), &binary_ptr, NULL) != CL_SUCCESS)
+                return;
+
+            // Written under a temporary name first, so a concurrent run never reads half a binary
+            std::system(("mkdir -p \"" + path.substr(0, path.find_last_of('/')) + "\"").c_str());
+            std::string tmp = path + ".tmp" + std::to_string(stopwatch_ticks());
+            std::ofstream out(tmp, std::ios::binary);
+            out.write(binary.data(), binary.size());
+            out.close();
+            if (out.good())
+                std::rename(tmp.c_str(), path.c_str());
+            else
+                std::remove(tmp.c_str());
+        }
+
+        static long long stopwatch_ticks() {
+            return std::chrono::steady_clock::now().time_since_epoch().count();
+        }
+
+        // FNV-1a
+        static unsigned long long hash_string(const std::string& s) {
+            unsigned long long hash = 14695981039346656037ULL;
+            for (char c : s) {
+                hash ^= (unsigned char)c;
+                hash *= 1099511628211ULL;
+            }
+            return hash;
+        }
+
+        static bool check(cl_int status, const char* what) {
+            if (status != CL_SUCCESS)
+                std::clog << "OpenCL: " << what << " failed with error " << status << std::endl;
+            return status == CL_SUCCESS;
+        }
+
+        template <typename T>
+        bool create_buffer(cl_mem& buffer, std::vector<T>& data) {
+            cl_int status;
+            buffer = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, data.size() * sizeof(T),
+                                    data.data(), &status);
+            return check(status, "clCreateBuffer");
+        }
+
+        static cl_float3 to_float3(const vec3& v) {
+            cl_float3 res;
+            res.s[0] = float(v.x());
+            res.s[1] = float(v.y());
+            res.s[2] = float(v.z());
+            res.s[3] = 0;
+            return res;
+        }
+
+        static std::string platform_info(cl_platform_id platform, cl_platform_info param) {
+            size_t size = 0;
+            clGetPlatformInfo(platform, param, 0, NULL, &size);
+            std::string res(size, '\0');
+            clGetPlatformInfo(platform, param, size, &res[0], NULL);
+            return res.c_str();
+        }
+
+        static std::string device_info(cl_device_id device, cl_device_info param) {
+            size_t size = 0;
+            clGetDeviceInfo(device, param, 0, NULL, &size);
+            std::string res(size, '\0');
+            clGetDeviceInfo(device, param, size, &res[0], NULL);
+            return res.c_str();
+        }
+
+        static std::string read_text_file(const std::string& path) {
+            std::ifstream in(path, std::ios::binary);
+            return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        }
+};
+
+#endif
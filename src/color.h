@@ -13,23 +13,58 @@ inline double linear_to_gamma(double linear_component) {
     return 0;
 }
 
+// Gamma corrected 0-255 values, as they are written to the image
+inline void color_to_bytes(const color& pixel_color, int bytes[3])
+{
+    static const interval intensity(0.000, 0.999);
+    for (int i = 0; i < 3; i++)
+        bytes[i] = int (256 * intensity.clamp(linear_to_gamma(pixel_color[i])));
+}
+
 void write_color(std::ofstream& out, const color& pixel_color)
 {
-    auto r = pixel_color.x();
-    auto g = pixel_color.y();
-    auto b = pixel_color.z();
+    int bytes[3];
+    color_to_bytes(pixel_color, bytes);
 
-    r = linear_to_gamma(r);
-    g = linear_to_gamma(g);
-    b = linear_to_gamma(b);
+    out << bytes[0] << ' ' << bytes[1] << ' ' << bytes[2] << '\n';
+    out.flush();
+}
 
-    static const interval intensity(0.000, 0.999);
-    int rbyte = int (256 * intensity.clamp(r));
-    int gbyte = int (256 * intensity.clamp(g));
-    int bbyte = int (256 * intensity.clamp(b));
+// Reads a P3 image as written by write_color, the values stay in 0-255
+inline bool read_ppm(const std::string& path, int& width, int& height, std::vector<color>& pixels)
+{
+    std::ifstream in(path);
+    std::string magic;
+    int max_value;
+    if (!(in >> magic >> width >> height >> max_value) || magic != "P3")
+        return false;
 
-    out << rbyte << ' ' << gbyte << ' ' << bbyte << '\n';
-    out.flush();
+    pixels.resize(size_t(width) * height);
+    for (auto& p : pixels) {
+        double r, g, b;
+        if (!(in >> r >> g >> b))
+            return false;
+        p = color(r, g, b);
+    }
+    return true;
+}
+
+// Root mean square error against a reference image, both measured on the written 0-255 values scaled to [0, 1]
+inline double image_rmse(const std::vector<color>& image, const std::vector<color>& reference_bytes)
+{
+    if (image.size() != reference_bytes.size() || image.empty())
+        return -1;
+
+    double sum = 0;
+    for (size_t i = 0; i < image.size(); i++) {
+        int bytes[3];
+        color_to_bytes(image[i], bytes);
+        for (int c = 0; c < 3; c++) {
+            double diff = (bytes[c] - reference_bytes[i][c]) / 255.0;
+            sum += diff * diff;
+        }
+    }
+    return std::sqrt(sum / (3.0 * image.size()));
 }
 
 #endif
\ No newline at end of file
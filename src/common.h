@@ -5,7 +5,6 @@
 #include <iostream>
 #include <limits>
 #include <memory>
-#include <random>
 #include <algorithm>
 #include <fstream>
 #include <vector>
@@ -20,20 +19,6 @@ inline double degrees_to_radian(double degrees) {
     return degrees * pi / 180.0;
 }
 
-inline double random_double() {
-    static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-    static std::mt19937 generator;
-    return distribution(generator);
-}
-
-inline double random_double(double min, double max) {
-    return min + (max-min) * random_double();
-}
-
-inline int random_int(int min, int max) {
-    return int(random_double(min, max+1));
-}
-
 inline int min_value(const std::vector<int> v) {
         int min = 999999999;
         for (int i: v){
@@ -54,6 +39,8 @@ inline int max_value(const std::vector<int> v) {
         return max;
 }
 
+#include "rng.h"
+#include "sampler.h"
 #include "geometry.h"
 #include "color.h"
 #include "parser.h"
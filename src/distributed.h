@@ -0,0 +1,447 @@
+/*
+    IN THIS FILE you will find the coordinator of a distributed render. The frame is split into work units, a tile
+    and a range of its samples, that render servers (see server.h) trace with the scene they keep resident:
+
+    1) Every worker loads the scene once, all of them in parallel
+    2) Each worker takes the next unit as soon as it is done with the last one, so fast workers take more of them
+    3) A worker that fails or stays silent past the timeout is dropped and its unit goes back into the queue
+    4) Once the queue is empty, idle workers also trace units another worker is still busy with, the first answer
+       counts. A slow worker then no longer holds up the end of the frame
+    5) The linear sample sums of every tile are added up in sample order. With one range per tile (the default)
+       the image is the same as a render in one process however the units were spread, with several ranges it
+       only differs by rounding
+
+    --local-workers n starts n servers on this host, enough to try all of it on one machine.
+*/
+
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include "common.h"
+#include "camera.h"
+#include "metrics.h"
+#include "parser.h"
+#include "server.h"
+
+#include <deque>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#ifndef _WIN32
+    #include <spawn.h>
+    #include <sys/time.h>
+    #include <sys/wait.h>
+
+    extern char** environ;
+#endif
+
+struct work_unit {
+    int x = 0, y = 0, w = 0, h = 0;
+    int first = 0, count = 0;
+    int copies = 0;                 // workers tracing it right now
+    bool done = false;
+    std::vector<color> sums;
+};
+
+#ifndef _WIN32
+class render_coordinator {
+    public:
+        explicit render_coordinator(const settings& stng) : stng(stng) {}
+
+        ~render_coordinator() {
+            for (auto& w : workers)
+                disconnect(w);
+            // Local workers are ours to stop
+            for (pid_t pid : children) {
+                kill(pid, SIGTERM);
+                waitpid(pid, NULL, 0);
+            }
+            for (const auto& path : child_sockets)
+                unlink(path.c_str());
+        }
+
+        bool run(const char* executable, render_metrics& metrics) {
+            stopwatch timer;
+            std::vector<std::string> addresses;
+            std::stringstream list(stng.workers);
+            std::string address;
+            while (std::getline(list, address, ','))
+                if (!address.empty())
+                    addresses.push_back(address);
+            for (int i = 0; i < stng.local_workers; i++) {
+                std::string path = "/tmp/ray-tracer-worker-" + std::to_string(getpid()) + "-" + std::to_string(i);
+                if (spawn_worker(executable, path))
+                    addresses.push_back(path);
+            }
+            if (addresses.empty()) {
+                std::clog << "No workers, give --workers or --local-workers" << std::endl;
+                return false;
+            }
+
+            // Local workers need a moment before their socket exists
+            for (const auto& a : addresses) {
+                worker w;
+                w.address = a;
+                for (int attempt = 0; attempt < 100 && w.fd < 0; attempt++) {
+                    w.fd = connect_socket(a);
+                    if (w.fd < 0)
+                        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                }
+                if (w.fd < 0) {
+                    std::clog << "Could not connect to worker " << a << std::endl;
+                    continue;
+                }
+                timeval timeout;
+                timeout.tv_sec = long(stng.worker_timeout);
+                timeout.tv_usec = long((stng.worker_timeout - timeout.tv_sec) * 1e6);
+                setsockopt(w.fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+                w.in = fdopen(w.fd, "r");
+                w.out = fdopen(dup(w.fd), "w");
+                workers.push_back(w);
+            }
+            metrics.add_time("connect", timer.elapsed());
+
+            timer.reset();
+            if (!load_everywhere())
+                return false;
+            metrics.add_time("load", timer.elapsed());
+            std::clog << "Rendering " << width << 'x' << height << " at " << spp << " spp on " << alive()
+                      << " workers" << std::endl;
+
+            timer.reset();
+            split();
+            std::vector<std::thread> threads;
+            for (size_t i = 0; i < workers.size(); i++)
+                if (workers[i].fd >= 0)
+                    threads.push_back(std::thread(&render_coordinator::work, this, i));
+            for (auto& t : threads)
+                t.join();
+            metrics.add_time("render", timer.elapsed());
+            std::clog << std::endl;
+
+            size_t missing = 0;
+            for (const auto& u : units)
+                missing += !u.done;
+            if (missing > 0) {
+                std::clog << "Every worker failed, " << missing << " of " << units.size() << " units were not traced"
+                          << std::endl;
+                return false;
+            }
+
+            timer.reset();
+            merge();
+            metrics.add_time("merge", timer.elapsed());
+            metrics.width = width;
+            metrics.height = height;
+            metrics.samples_per_pixel = spp;
+            metrics.primary_rays = primary_rays;
+            metrics.secondary_rays = secondary_rays;
+            for (const auto& w : workers) {
+                worker_metrics m;
+                m.address = w.address;
+                m.units = w.units;
+                m.busy_seconds = w.busy_seconds;
+                m.failed = w.failed;
+                metrics.workers.push_back(m);
+            }
+            std::clog << "Work units: " << units.size() << ", " << reassigned << " requeued from failed workers, "
+                      << backups << " traced twice" << std::endl;
+            return true;
+        }
+
+        void write_image(const std::string& path) const {
+            std::ofstream image(path);
+            image << "P3\n" << width << ' ' << height << "\n255\n";
+            for (const color& pixel_color : framebuffer)
+                write_color(image, pixel_color);
+        }
+    private:
+        struct worker {
+            std::string address;
+            int fd = -1;
+            FILE* in = NULL;
+            FILE* out = NULL;
+            size_t units = 0;
+            double busy_seconds = 0;
+            bool failed = false;
+            bool busy = false;
+        };
+
+        const settings& stng;
+        std::vector<worker> workers;
+        std::vector<pid_t> children;
+        std::vector<std::string> child_sockets;
+
+        int width = 0, height = 0, spp = 0;
+        std::vector<work_unit> units;
+        std::deque<size_t> queue;
+        std::mutex lock;
+        size_t finished = 0, reassigned = 0, backups = 0;
+        unsigned long long primary_rays = 0, secondary_rays = 0;
+        std::vector<color> framebuffer;
+
+        size_t alive() const {
+            size_t n = 0;
+            for (const auto& w : workers)
+                n += w.fd >= 0;
+            return n;
+        }
+
+        bool spawn_worker(const char* executable, const std::string& path) {
+            std::string threads = std::to_string(stng.threads > 0 ? stng.threads :
+                std::max(1u, std::thread::hardware_concurrency() / unsigned(stng.local_workers)));
+            // The build options go with every request, see render_options
+            const char* args[] = {executable, "--server", path.c_str(), "-t", threads.c_str(), NULL};
+            pid_t pid;
+            if (posix_spawn(&pid, executable, NULL, NULL, (char* const*)args, environ) != 0) {
+                std::clog << "Could not start a local worker with " << executable << std::endl;
+                return false;
+            }
+            children.push_back(pid);
+            child_sockets.push_back(path);
+            return true;
+        }
+
+        static void disconnect(worker& w) {
+            if (w.out)
+                fclose(w.out);
+            if (w.in)
+                fclose(w.in);
+            w.in = w.out = NULL;
+            w.fd = -1;
+        }
+
+        static bool send(worker& w, const std::string& line) {
+            return fputs((line + "\n").c_str(), w.out) >= 0 && fflush(w.out) == 0;
+        }
+
+        // One line of the answer without its newline, false once the worker hung up or timed out
+        static bool receive(worker& w, std::string& line) {
+            line.clear();
+            char buffer[65536];
+            while (fgets(buffer, sizeof(buffer), w.in)) {
+                line += buffer;
+                if (!line.empty() && line.back() == '\n') {
+                    line.pop_back();
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Options every worker has to agree on, whatever it was started with
+        std::string render_options() const {
+            return " mode=" + stng.model + " sampler=" + stng.sampler + " integrator=" + stng.integrator +
+                   " rr=" + std::to_string(stng.rr_depth) + stng.build.request() + samples();
+        }
+
+        // --spp in place of the samples of the scene file, nothing when the workers keep those
+        std::string samples() const { return stng.spp > 0 ? " spp=" + std::to_string(stng.spp) : ""; }
+
+        // All workers load at once, the image size comes from the first answer
+        bool load_everywhere() {
+            for (auto& w : workers)
+                if (!send(w, "load " + stng.infile + " " + stng.model + stng.build.request() + samples()))
+                    disconnect(w);
+            for (auto& w : workers) {
+                std::string line;
+                if (w.fd < 0)
+                    continue;
+                if (!receive(w, line) || line.compare(0, 2, "ok") != 0) {
+                    std::clog << "Worker " << w.address << " could not load " << stng.infile << ": " << line
+                              << std::endl;
+                    w.failed = true;
+                    disconnect(w);
+                    continue;
+                }
+                int lw = 0, lh = 0, ls = 0;
+                std::istringstream words(line);
+                std::string word;
+                while (words >> word) {
+                    if (word.compare(0, 6, "width=") == 0) lw = atoi(word.c_str() + 6);
+                    if (word.compare(0, 7, "height=") == 0) lh = atoi(word.c_str() + 7);
+                    if (word.compare(0, 4, "spp=") == 0) ls = atoi(word.c_str() + 4);
+                }
+                if (width == 0) {
+                    width = lw;
+                    height = lh;
+                    spp = ls;
+                } else if (lw != width || lh != height || ls != spp) {
+                    std::clog << "Worker " << w.address << " loaded a different " << stng.infile << std::endl;
+                    disconnect(w);
+                }
+            }
+            if (alive() == 0 || width <= 0 || height <= 0 || spp <= 0) {
+                std::clog << "No worker could load " << stng.infile << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        void split() {
+            int tile = stng.tile_size > 0 ? stng.tile_size : 32;
+            int chunk = stng.chunk_samples > 0 ? std::min(stng.chunk_samples, spp) : spp;
+            for (int y = 0; y < height; y += tile) {
+                for (int x = 0; x < width; x += tile) {
+                    for (int first = 0; first < spp; first += chunk) {
+                        work_unit u;
+                        u.x = x;
+                        u.y = y;
+                        u.w = std::min(tile, width - x);
+                        u.h = std::min(tile, height - y);
+                        u.first = first;
+                        u.count = std::min(chunk, spp - first);
+                        queue.push_back(units.size());
+                        units.push_back(u);
+                    }
+                }
+            }
+        }
+
+        // Next unit for a worker: the queue first, then a backup copy of the unit with the fewest workers on it
+        bool next_unit(worker& w, size_t& index) {
+            std::lock_guard<std::mutex> guard(lock);
+            w.busy = true;
+            while (!queue.empty()) {
+                index = queue.front();
+                queue.pop_front();
+                if (!units[index].done) {
+                    units[index].copies++;
+                    return true;
+                }
+            }
+            bool found = false;
+            for (size_t i = 0; i < units.size(); i++) {
+                if (!units[i].done && units[i].copies > 0 && (!found || units[i].copies < units[index].copies)) {
+                    index = i;
+                    found = true;
+                }
+            }
+            if (found) {
+                units[index].copies++;
+                backups++;
+            }
+            w.busy = found;
+            return found;
+        }
+
+        void work(size_t id) {
+            worker& w = workers[id];
+            size_t index = 0;
+            while (next_unit(w, index)) {
+                const work_unit& u = units[index];
+                std::ostringstream request;
+                request << "trace " << stng.infile << render_options() << " region=" << u.x << ',' << u.y << ','
+                        << u.w << ',' << u.h << " samples=" << u.first << ',' << u.count;
+
+                stopwatch timer;
+                std::string sums, status;
+                bool ok = send(w, request.str()) && receive(w, sums) && receive(w, status) &&
+                          status.compare(0, 9, "ok traced") == 0;
+                std::vector<color> values;
+                ok = ok && decode(sums, u, values);
+                w.busy_seconds += timer.elapsed();
+
+                std::lock_guard<std::mutex> guard(lock);
+                work_unit& unit = units[index];
+                unit.copies--;
+                w.busy = false;
+                if (!ok && finished == units.size()) {
+                    // Cut off below, after another worker finished the frame
+                    disconnect(w);
+                    return;
+                }
+                if (!ok) {
+                    std::clog << "\rWorker " << w.address << " failed, its unit goes back into the queue" << std::endl;
+                    w.failed = true;
+                    disconnect(w);
+                    if (!unit.done) {
+                        queue.push_front(index);
+                        reassigned++;
+                    }
+                    return;
+                }
+                w.units++;
+                if (unit.done)
+                    continue;
+                unit.done = true;
+                unit.sums.swap(values);
+                unsigned long long primary = 0, secondary = 0;
+                sscanf(status.c_str(), "ok traced primary=%llu secondary=%llu", &primary, &secondary);
+                primary_rays += primary;
+                secondary_rays += secondary;
+                finished++;
+                std::clog << "\rUnits: " << finished << '/' << units.size() << ' ' << std::flush;
+
+                // The frame is done, workers still tracing a backup copy are not waited for
+                if (finished == units.size())
+                    for (auto& other : workers)
+                        if (other.busy && other.fd >= 0)
+                            shutdown(other.fd, SHUT_RDWR);
+            }
+        }
+
+        static bool decode(const std::string& line, const work_unit& u, std::vector<color>& values) {
+            int x, y, w, h, offset = 0;
+            if (sscanf(line.c_str(), "sums %d %d %d %d %n", &x, &y, &w, &h, &offset) != 4 || x != u.x || y != u.y ||
+                w != u.w || h != u.h)
+                return false;
+            size_t n = size_t(w) * h;
+            if (line.size() < size_t(offset) + n * 48)
+                return false;
+            values.resize(n);
+            const char* hex = line.c_str() + offset;
+            for (size_t i = 0; i < n; i++, hex += 48)
+                values[i] = color(decode_double(hex), decode_double(hex + 16), decode_double(hex + 32));
+            return true;
+        }
+
+        // Sample ranges of a tile are added in order, then averaged like camera::render_pixel does
+        void merge() {
+            framebuffer.assign(size_t(width) * height, color(0, 0, 0));
+            double scale = 1.0 / spp;
+            for (const auto& u : units) {
+                for (int j = 0; j < u.h; j++)
+                    for (int i = 0; i < u.w; i++)
+                        framebuffer[(u.y + j) * width + u.x + i] += u.sums[j * u.w + i];
+                if (u.first + u.count < spp)
+                    continue;
+                for (int j = 0; j < u.h; j++)
+                    for (int i = 0; i < u.w; i++)
+                        framebuffer[(u.y + j) * width + u.x + i] = scale * framebuffer[(u.y + j) * width + u.x + i];
+            }
+        }
+};
+#endif
+
+// Renders stng.infile on the workers and writes the merged image and metrics like a normal render
+inline bool run_coordinator(const char* executable, const settings& stng) {
+#ifdef _WIN32
+    std::clog << "Distributed rendering needs POSIX sockets" << std::endl;
+    return false;
+#else
+    // A worker that dies must not take the coordinator down with the next request written to it
+    signal(SIGPIPE, SIG_IGN);
+    stopwatch total;
+    render_metrics metrics;
+    metrics.scene = stng.infile;
+    metrics.mode = stng.model;
+    metrics.backend = "distributed";
+    metrics.sampler = stng.sampler;
+    metrics.integrator = stng.integrator;
+    {
+        render_coordinator coordinator(stng);
+        if (!coordinator.run(executable, metrics))
+            return false;
+        stopwatch timer;
+        coordinator.write_image(stng.outfile);
+        metrics.add_time("output", timer.elapsed());
+    }
+    metrics.add_time("total", total.elapsed());
+    metrics.print();
+    metrics.save_json(render_metrics::json_path_for(stng.outfile));
+    return true;
+#endif
+}
+
+#endif
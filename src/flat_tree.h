@@ -0,0 +1,855 @@
+/*
+    IN THIS FILE you will find the array form of the CPU trees. After a bvh, kD-tree, BIH or SBVH is built it is
+    copied into one vector of 32-byte nodes (float boxes rounded outwards and two child references), and a layout
+    pass decides the order of the nodes in that vector:
+
+    1) dfs: depth-first, every left child right after its parent. This is the order the trees are built in
+    2) treelet: cache-line treelets, each grown from its root by adding the node most likely to be visited next,
+       judged by its surface area. The nodes that do not fit start the next treelets
+    3) veb: van Emde Boas order, the top half of the tree's height first and then every bottom subtree, recursively,
+       so a subtree of any height sits in a few consecutive cache lines
+
+    The quantized layout is a different node format. quantized_tree collapses the binary tree into nodes of up to
+    eight children, whose boxes are stored as 8-bit offsets from the node's origin in steps of a power of two per
+    axis. That is 76 bytes per node, or 9.5 bytes per child against the 16 of a flat node.
+
+    The tree is walked exactly like node::hit, left child before right child, so every layout gives the same image.
+    Only where the nodes sit in memory changes.
+
+    profile_layouts renders a small image once, counts how often every node is visited, and then lays out every
+    tree again. The counts replace the surface areas, and the hotter child of every node is placed first.
+*/
+
+#ifndef FLAT_TREE_H
+#define FLAT_TREE_H
+
+#include "common.h"
+#include "accelerate.h"
+#include "camera.h"
+#include "hittable.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <utility>
+
+struct flat_node {
+    float lo[3];
+    float hi[3];
+    uint32_t child[2];      // node index, or leaf_bit and the index into the leaves
+};
+
+static_assert(sizeof(flat_node) == 32, "two flat nodes share a cache line");
+
+// Starts every block on a cache line, otherwise half of the flat nodes would straddle two lines
+template <class T>
+struct cache_line_allocator {
+    typedef T value_type;
+
+    cache_line_allocator() {}
+    template <class U> cache_line_allocator(const cache_line_allocator<U>&) {}
+
+    T* allocate(size_t n) {
+        char* raw = static_cast<char*>(::operator new(n * sizeof(T) + 64));
+        char* aligned = raw + 64 - (reinterpret_cast<uintptr_t>(raw) & 63);
+        reinterpret_cast<char**>(aligned)[-1] = raw;
+        return reinterpret_cast<T*>(aligned);
+    }
+
+    void deallocate(T* p, size_t) { ::operator delete(reinterpret_cast<char**>(p)[-1]); }
+};
+
+template <class T, class U>
+bool operator==(const cache_line_allocator<T>&, const cache_line_allocator<U>&) { return true; }
+template <class T, class U>
+bool operator!=(const cache_line_allocator<T>&, const cache_line_allocator<U>&) { return false; }
+
+class flat_tree : public hittable {
+    public:
+        // Nodes per treelet, one cache line. Larger treelets pull in nodes a depth-first walk reaches much later
+        static const size_t treelet_nodes = 64 / sizeof(flat_node);
+
+        // `layout` is "dfs", "treelet" or "veb"
+        flat_tree(const shared_ptr<hittable>& root, const std::string& layout) : layout(layout) {
+            root_ref = convert(root);
+            owners.shrink_to_fit();
+            apply_layout(layout);
+            std::lock_guard<std::mutex> lock(registry_mutex());
+            registry().push_back(this);
+        }
+
+        ~flat_tree() {
+            std::lock_guard<std::mutex> lock(registry_mutex());
+            auto& trees = registry();
+            trees.erase(std::remove(trees.begin(), trees.end(), this), trees.end());
+        }
+
+        // Depth the traversal stack has room for, deeper trees stay pointer trees
+        static const int max_depth = 120;
+
+        static bool fits(const shared_ptr<hittable>& root, int depth = 0) {
+            auto inner = std::dynamic_pointer_cast<node>(root);
+            if (!inner)
+                return true;
+            if (depth >= max_depth)
+                return false;
+            return fits(inner->left_child(), depth + 1) && fits(inner->right_child(), depth + 1);
+        }
+
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            const point& origin = r.origin();
+            double inverse[3];
+            for (int axis = 0; axis < 3; axis++)
+                inverse[axis] = 1.0 / r.direction()[axis];
+
+            uint32_t stack[max_depth + 2];
+            int top = 0;
+            stack[top++] = root_ref;
+            bool hit_anything = false;
+            while (top > 0) {
+                uint32_t ref = stack[--top];
+                if (ref & leaf_bit) {
+                    const flat_leaf& leaf = leaves[ref & ~leaf_bit];
+                    for (uint32_t i = leaf.first; i < leaf.first + leaf.count; i++) {
+                        if (items[i]->hit(r, ray_t, rec)) {
+                            hit_anything = true;
+                            ray_t.max = rec.t;
+                        }
+                    }
+                    continue;
+                }
+
+                record_traversal_step(rec);
+                if (visits)
+                    visits[ref].fetch_add(1, std::memory_order_relaxed);
+                const flat_node& n = nodes[ref];
+                if (!box_hit(n, origin, inverse, ray_t))
+                    continue;
+                stack[top++] = n.child[1];
+                stack[top++] = n.child[0];
+            }
+            return hit_anything;
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        size_t structure_bytes() const override {
+            size_t bytes = sizeof(flat_tree) + nodes.capacity() * sizeof(flat_node) +
+                           leaves.capacity() * sizeof(flat_leaf) + items.capacity() * sizeof(hittable*) +
+                           owners.capacity() * sizeof(shared_ptr<hittable>);
+            for (const auto* item : items)
+                bytes += item->structure_bytes();
+            return bytes;
+        }
+
+        size_t top_level_bytes() const override {
+            size_t bytes = sizeof(flat_tree) + nodes.capacity() * sizeof(flat_node) +
+                           leaves.capacity() * sizeof(flat_leaf) + items.capacity() * sizeof(hittable*) +
+                           owners.capacity() * sizeof(shared_ptr<hittable>);
+            for (const auto* item : items)
+                bytes += item->top_level_bytes();
+            return bytes;
+        }
+
+        void flatten(std::vector<flat_primitive>& out) const override {
+            for (const auto* item : items)
+                item->flatten(out);
+        }
+
+        aabb refit() override {
+            bbox = refit(root_ref);
+            return bbox;
+        }
+
+        double sah_cost(double parent_area) const override { return sah_cost(root_ref, parent_area); }
+
+        size_t node_count() const { return nodes.size(); }
+
+        // Counts the node visits of every flat tree from now on, until finish_profile
+        static void start_profile() {
+            std::lock_guard<std::mutex> lock(registry_mutex());
+            for (auto* tree : registry()) {
+                tree->visits.reset(new std::atomic<uint32_t>[tree->nodes.size()]);
+                for (size_t i = 0; i < tree->nodes.size(); i++)
+                    tree->visits[i].store(0);
+            }
+        }
+
+        // Lays out every flat tree again with the counted visits, no tree may be traversed meanwhile
+        static void finish_profile() {
+            std::lock_guard<std::mutex> lock(registry_mutex());
+            for (auto* tree : registry()) {
+                if (!tree->visits)
+                    continue;
+                tree->weights.resize(tree->nodes.size());
+                for (size_t i = 0; i < tree->nodes.size(); i++)
+                    tree->weights[i] = tree->visits[i].load();
+                tree->visits.reset();
+                tree->apply_layout(tree->layout);
+                tree->weights.clear();
+            }
+        }
+
+        // The float nearest to `value` on the side that keeps a box conservative
+        static float round_down(double value) {
+            float f = float(value);
+            return double(f) > value ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+        }
+
+        static float round_up(double value) {
+            float f = float(value);
+            return double(f) < value ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+        }
+
+    private:
+        friend class quantized_tree;
+        friend class tree_report;
+
+        static const uint32_t leaf_bit = 0x80000000u;
+
+        struct flat_leaf {
+            uint32_t first;
+            uint32_t count;
+        };
+
+        std::vector<flat_node, cache_line_allocator<flat_node>> nodes;
+        std::vector<flat_leaf> leaves;
+        std::vector<hittable*> items;
+        std::vector<shared_ptr<hittable>> owners;       // keeps the items alive, the tree they came from is dropped
+        std::string layout;
+        uint32_t root_ref = 0;
+        aabb bbox;
+        std::vector<double> weights;                    // visit counts while laying out after a profile
+        mutable std::unique_ptr<std::atomic<uint32_t>[]> visits;
+
+        static std::vector<flat_tree*>& registry() {
+            static std::vector<flat_tree*> trees;
+            return trees;
+        }
+
+        static std::mutex& registry_mutex() {
+            static std::mutex m;
+            return m;
+        }
+
+        static void set_box(flat_node& n, const aabb& box) {
+            for (int axis = 0; axis < 3; axis++) {
+                n.lo[axis] = round_down(box.axis_interval(axis).min);
+                n.hi[axis] = round_up(box.axis_interval(axis).max);
+            }
+        }
+
+        static aabb box_of(const flat_node& n) {
+            return aabb(point(n.lo[0], n.lo[1], n.lo[2]), point(n.hi[0], n.hi[1], n.hi[2]));
+        }
+
+        // aabb::hit against the rounded box
+        static bool box_hit(const flat_node& n, const point& origin, const double* inverse, interval ray_t) {
+            for (int axis = 0; axis < 3; axis++) {
+                double t0 = (n.lo[axis] - origin[axis]) * inverse[axis];
+                double t1 = (n.hi[axis] - origin[axis]) * inverse[axis];
+                if (t0 < t1) {
+                    if (t0 > ray_t.min) ray_t.min = t0;
+                    if (t1 < ray_t.max) ray_t.max = t1;
+                } else {
+                    if (t1 > ray_t.min) ray_t.min = t1;
+                    if (t0 < ray_t.max) ray_t.max = t0;
+                }
+                if (ray_t.max <= ray_t.min)
+                    return false;
+            }
+            return true;
+        }
+
+        // Copies the tree below `object` in depth-first order and returns its reference. Anything that is not a node
+        // becomes a leaf, a list is a leaf of its objects
+        uint32_t convert(const shared_ptr<hittable>& object) {
+            auto inner = std::dynamic_pointer_cast<node>(object);
+            if (!inner)
+                return add_leaf(object);
+            // A bvh node over a single object holds it as both children
+            if (inner->left_child() == inner->right_child())
+                return add_leaf(inner->left_child());
+
+            uint32_t index = uint32_t(nodes.size());
+            nodes.push_back(flat_node());
+            set_box(nodes[index], inner->bounding_box());
+            if (index == 0)
+                bbox = inner->bounding_box();
+            uint32_t left = convert(inner->left_child());
+            uint32_t right = convert(inner->right_child());
+            nodes[index].child[0] = left;
+            nodes[index].child[1] = right;
+            return index;
+        }
+
+        uint32_t add_leaf(const shared_ptr<hittable>& object) {
+            flat_leaf leaf;
+            leaf.first = uint32_t(items.size());
+            auto list = std::dynamic_pointer_cast<hittable_list>(object);
+            if (list) {
+                for (const auto& obj : list->objects)
+                    add_item(obj);
+            } else {
+                add_item(object);
+            }
+            leaf.count = uint32_t(items.size()) - leaf.first;
+            if (nodes.empty())
+                bbox = object->bounding_box();
+            leaves.push_back(leaf);
+            return leaf_bit | uint32_t(leaves.size() - 1);
+        }
+
+        void add_item(const shared_ptr<hittable>& object) {
+            items.push_back(object.get());
+            owners.push_back(object);
+        }
+
+        aabb refit(uint32_t ref) {
+            if (ref & leaf_bit) {
+                const flat_leaf& leaf = leaves[ref & ~leaf_bit];
+                aabb box;
+                for (uint32_t i = leaf.first; i < leaf.first + leaf.count; i++)
+                    box = aabb(box, items[i]->refit());
+                return box;
+            }
+            aabb box(refit(nodes[ref].child[0]), refit(nodes[ref].child[1]));
+            set_box(nodes[ref], box);
+            return box;
+        }
+
+        double sah_cost(uint32_t ref, double parent_area) const {
+            if (ref & leaf_bit) {
+                const flat_leaf& leaf = leaves[ref & ~leaf_bit];
+                double cost = 0;
+                for (uint32_t i = leaf.first; i < leaf.first + leaf.count; i++)
+                    cost += items[i]->sah_cost(parent_area);
+                return cost;
+            }
+            double area = box_of(nodes[ref]).surface_area();
+            return node::traversal_cost * area + sah_cost(nodes[ref].child[0], area) +
+                   sah_cost(nodes[ref].child[1], area);
+        }
+
+        // How likely a visit to this node is, up to a factor shared by the whole tree
+        double weight(uint32_t index) const {
+            return weights.empty() ? box_of(nodes[index]).surface_area() : weights[index];
+        }
+
+        // The inner children of a node in the order they are placed in, the hotter one first after a profile
+        int children(uint32_t index, uint32_t* out) const {
+            const flat_node& n = nodes[index];
+            int count = 0;
+            for (int c = 0; c < 2; c++)
+                if (!(n.child[c] & leaf_bit))
+                    out[count++] = n.child[c];
+            if (count == 2 && !weights.empty() && weights[out[1]] > weights[out[0]])
+                std::swap(out[0], out[1]);
+            return count;
+        }
+
+        void apply_layout(const std::string& name) {
+            if (nodes.empty())
+                return;
+            std::vector<uint32_t> order;
+            order.reserve(nodes.size());
+            if (name == "treelet")
+                treelet_order(order);
+            else if (name == "veb")
+                veb_order(0, height(0), order);
+            else
+                dfs_order(order);
+            reorder(order);
+        }
+
+        void dfs_order(std::vector<uint32_t>& order) const {
+            std::vector<uint32_t> stack(1, 0);
+            while (!stack.empty()) {
+                uint32_t index = stack.back();
+                stack.pop_back();
+                order.push_back(index);
+                uint32_t kids[2];
+                int count = children(index, kids);
+                for (int c = count - 1; c >= 0; c--)
+                    stack.push_back(kids[c]);
+            }
+        }
+
+        // Every treelet grows from its root by taking the most likely node on its border. The border that is left
+        // over becomes the roots of the next treelets, the most likely first
+        void treelet_order(std::vector<uint32_t>& order) const {
+            typedef std::pair<double, uint32_t> candidate;
+            std::vector<uint32_t> roots(1, 0);
+            while (!roots.empty()) {
+                uint32_t root = roots.back();
+                roots.pop_back();
+                std::priority_queue<candidate> border;
+                border.push(candidate(weight(root), root));
+                for (size_t taken = 0; taken < treelet_nodes && !border.empty(); taken++) {
+                    uint32_t index = border.top().second;
+                    border.pop();
+                    order.push_back(index);
+                    uint32_t kids[2];
+                    int count = children(index, kids);
+                    for (int c = 0; c < count; c++)
+                        border.push(candidate(weight(kids[c]), kids[c]));
+                }
+                std::vector<candidate> rest;
+                for (; !border.empty(); border.pop())
+                    rest.push_back(border.top());
+                for (auto it = rest.rbegin(); it != rest.rend(); ++it)
+                    roots.push_back(it->second);
+            }
+        }
+
+        int height(uint32_t index) const {
+            uint32_t kids[2];
+            int count = children(index, kids), h = 0;
+            for (int c = 0; c < count; c++)
+                h = std::max(h, height(kids[c]));
+            return h + 1;
+        }
+
+        // The nodes `depth` levels below `index`, in placement order
+        void level(uint32_t index, int depth, std::vector<uint32_t>& out) const {
+            if (depth == 0) {
+                out.push_back(index);
+                return;
+            }
+            uint32_t kids[2];
+            int count = children(index, kids);
+            for (int c = 0; c < count; c++)
+                level(kids[c], depth - 1, out);
+        }
+
+        // Places the nodes less than `h` levels below `index`
+        void veb_order(uint32_t index, int h, std::vector<uint32_t>& order) const {
+            if (h == 1) {
+                order.push_back(index);
+                return;
+            }
+            int top = (h + 1) / 2;
+            veb_order(index, top, order);
+            std::vector<uint32_t> bottoms;
+            level(index, top, bottoms);
+            for (uint32_t bottom : bottoms)
+                veb_order(bottom, std::min(h - top, height(bottom)), order);
+        }
+
+        // Moves node order[k] to index k, and the leaves and items into the order their nodes are placed in
+        void reorder(const std::vector<uint32_t>& order) {
+            std::vector<uint32_t> where(nodes.size());
+            for (size_t k = 0; k < order.size(); k++)
+                where[order[k]] = uint32_t(k);
+
+            std::vector<flat_node, cache_line_allocator<flat_node>> placed(nodes.size());
+            std::vector<flat_leaf> placed_leaves;
+            std::vector<hittable*> placed_items;
+            placed_leaves.reserve(leaves.size());
+            placed_items.reserve(items.size());
+            auto move_ref = [&](uint32_t ref) {
+                if (!(ref & leaf_bit))
+                    return where[ref];
+                flat_leaf leaf = leaves[ref & ~leaf_bit];
+                uint32_t first = uint32_t(placed_items.size());
+                placed_items.insert(placed_items.end(), items.begin() + leaf.first,
+                                    items.begin() + leaf.first + leaf.count);
+                leaf.first = first;
+                placed_leaves.push_back(leaf);
+                return leaf_bit | uint32_t(placed_leaves.size() - 1);
+            };
+            for (size_t k = 0; k < order.size(); k++) {
+                placed[k] = nodes[order[k]];
+                for (int c = 0; c < 2; c++)
+                    placed[k].child[c] = move_ref(nodes[order[k]].child[c]);
+            }
+            root_ref = move_ref(root_ref);
+            nodes.swap(placed);
+            leaves.swap(placed_leaves);
+            items.swap(placed_items);
+        }
+};
+
+// Up to eight children whose boxes are quantized in the frame of the node: a child covers origin + q * 2^exponent
+// from its lo to its hi q on every axis. The children are kept in the left-first order of the binary tree, the
+// inner ones are consecutive nodes from child_base and the leaves consecutive leaves from leaf_base
+struct quantized_node {
+    float origin[3];
+    int8_t exponent[3];
+    uint8_t inner_mask;
+    uint8_t leaf_mask;
+    uint8_t unused[3];
+    uint32_t child_base;
+    uint32_t leaf_base;
+    uint8_t lo[3][8];
+    uint8_t hi[3][8];
+};
+
+static_assert(sizeof(quantized_node) == 76, "quantized_node is 28 bytes of header and 6 bytes per child");
+
+class quantized_tree : public hittable {
+    public:
+        static const int width = 8;
+
+        explicit quantized_tree(const shared_ptr<hittable>& root) {
+            flat_tree binary(root, "dfs");
+            owners.swap(binary.owners);
+            bbox = binary.bbox;
+            subtree_items.assign(binary.nodes.size(), 0);
+            count_items(binary, binary.root_ref);
+            items.reserve(binary.items.size());
+            nodes.push_back(quantized_node());
+            build(binary, binary.root_ref, 0);
+            std::vector<quantized_node, cache_line_allocator<quantized_node>>(nodes).swap(nodes);
+            std::vector<leaf>(leaves).swap(leaves);
+            std::vector<hittable*>(items).swap(items);
+            std::vector<uint32_t>().swap(subtree_items);
+        }
+
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            const point& origin = r.origin();
+            double inverse[3];
+            for (int axis = 0; axis < 3; axis++)
+                inverse[axis] = 1.0 / r.direction()[axis];
+
+            // A child is skipped if, by the time it is popped, a hit closer than its entry point was found
+            uint32_t stack[(width - 1) * flat_tree::max_depth + 2];
+            double entry[(width - 1) * flat_tree::max_depth + 2];
+            int top = 0;
+            stack[top] = 0;
+            entry[top++] = ray_t.min;
+            bool hit_anything = false;
+            while (top > 0) {
+                --top;
+                if (entry[top] >= ray_t.max)
+                    continue;
+                uint32_t ref = stack[top];
+                if (ref & leaf_bit) {
+                    const leaf& l = leaves[ref & ~leaf_bit];
+                    for (uint32_t i = l.first; i < l.first + l.count; i++) {
+                        if (items[i]->hit(r, ray_t, rec)) {
+                            hit_anything = true;
+                            ray_t.max = rec.t;
+                        }
+                    }
+                    continue;
+                }
+
+                record_traversal_step(rec);
+                const quantized_node& n = nodes[ref];
+                double scale[3];
+                for (int axis = 0; axis < 3; axis++)
+                    scale[axis] = power_of_two(n.exponent[axis]);
+
+                uint32_t hit_refs[width];
+                double hit_entry[width];
+                int hits = 0;
+                uint32_t next_inner = n.child_base, next_leaf = n.leaf_base;
+                for (int c = 0; c < width; c++) {
+                    uint8_t bit = uint8_t(1u << c);
+                    uint32_t child;
+                    if (n.inner_mask & bit)
+                        child = next_inner++;
+                    else if (n.leaf_mask & bit)
+                        child = leaf_bit | next_leaf++;
+                    else
+                        break;
+
+                    interval t = ray_t;
+                    bool missed = false;
+                    for (int axis = 0; axis < 3 && !missed; axis++) {
+                        double lo = n.origin[axis] + n.lo[axis][c] * scale[axis];
+                        double hi = n.origin[axis] + n.hi[axis][c] * scale[axis];
+                        double t0 = (lo - origin[axis]) * inverse[axis];
+                        double t1 = (hi - origin[axis]) * inverse[axis];
+                        if (t0 < t1) {
+                            if (t0 > t.min) t.min = t0;
+                            if (t1 < t.max) t.max = t1;
+                        } else {
+                            if (t1 > t.min) t.min = t1;
+                            if (t0 < t.max) t.max = t0;
+                        }
+                        missed = t.max <= t.min;
+                    }
+                    if (!missed) {
+                        hit_refs[hits] = child;
+                        hit_entry[hits++] = t.min;
+                    }
+                }
+                for (int c = hits - 1; c >= 0; c--) {
+                    stack[top] = hit_refs[c];
+                    entry[top++] = hit_entry[c];
+                }
+            }
+            return hit_anything;
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        size_t structure_bytes() const override {
+            size_t bytes = sizeof(quantized_tree) + nodes.capacity() * sizeof(quantized_node) +
+                           leaves.capacity() * sizeof(leaf) + items.capacity() * sizeof(hittable*) +
+                           owners.capacity() * sizeof(shared_ptr<hittable>);
+            for (const auto* item : items)
+                bytes += item->structure_bytes();
+            return bytes;
+        }
+
+        size_t top_level_bytes() const override {
+            size_t bytes = sizeof(quantized_tree) + nodes.capacity() * sizeof(quantized_node) +
+                           leaves.capacity() * sizeof(leaf) + items.capacity() * sizeof(hittable*) +
+                           owners.capacity() * sizeof(shared_ptr<hittable>);
+            for (const auto* item : items)
+                bytes += item->top_level_bytes();
+            return bytes;
+        }
+
+        void flatten(std::vector<flat_primitive>& out) const override {
+            for (const auto* item : items)
+                item->flatten(out);
+        }
+
+        aabb refit() override {
+            bbox = refit_node(0);
+            return bbox;
+        }
+
+        double sah_cost(double parent_area) const override {
+            return node::traversal_cost * parent_area + node_cost(0);
+        }
+
+        size_t node_count() const { return nodes.size(); }
+
+    private:
+        friend class tree_report;
+
+        static const uint32_t leaf_bit = flat_tree::leaf_bit;
+        // Subtrees of up to this many primitives become one leaf, so the nodes near the bottom are not half empty
+        static const uint32_t max_leaf_items = 3;
+
+        struct leaf {
+            uint32_t first;
+            uint32_t count;
+        };
+
+        std::vector<quantized_node, cache_line_allocator<quantized_node>> nodes;
+        std::vector<leaf> leaves;
+        std::vector<hittable*> items;
+        std::vector<shared_ptr<hittable>> owners;
+        aabb bbox;
+        std::vector<uint32_t> subtree_items;    // per binary node, only while building
+
+        // 2^e for the exponents a quantized_node can hold, without calling ldexp on every node
+        static double power_of_two(int e) {
+            uint64_t bits = uint64_t(1023 + e) << 52;
+            double value;
+            memcpy(&value, &bits, sizeof(value));
+            return value;
+        }
+
+        // Fills nodes[index] with the binary node `ref`, opened up to eight children by repeatedly replacing the
+        // inner child with the largest box by its two children
+        void build(const flat_tree& binary, uint32_t ref, uint32_t index) {
+            std::vector<uint32_t> slots(1, ref);
+            while (slots.size() < width) {
+                int widest = -1;
+                double widest_area = -1;
+                for (size_t i = 0; i < slots.size(); i++) {
+                    if (!opens(slots[i]))
+                        continue;
+                    double area = flat_tree::box_of(binary.nodes[slots[i]]).surface_area();
+                    if (area > widest_area) {
+                        widest = int(i);
+                        widest_area = area;
+                    }
+                }
+                if (widest < 0)
+                    break;
+                const flat_node& opened = binary.nodes[slots[widest]];
+                slots[widest] = opened.child[1];
+                slots.insert(slots.begin() + widest, opened.child[0]);
+            }
+
+            aabb boxes[width];
+            int count = 0;
+            quantized_node n = quantized_node();
+            n.child_base = uint32_t(nodes.size());
+            n.leaf_base = uint32_t(leaves.size());
+            std::vector<uint32_t> inner;
+            for (uint32_t slot : slots) {
+                if (!opens(slot)) {
+                    leaf l;
+                    l.first = uint32_t(items.size());
+                    append_items(binary, slot);
+                    l.count = uint32_t(items.size()) - l.first;
+                    if (l.count == 0)
+                        continue;
+                    leaves.push_back(l);
+                    for (uint32_t i = l.first; i < l.first + l.count; i++)
+                        boxes[count] = aabb(boxes[count], items[i]->bounding_box());
+                    n.leaf_mask |= uint8_t(1u << count);
+                } else {
+                    boxes[count] = flat_tree::box_of(binary.nodes[slot]);
+                    inner.push_back(slot);
+                    n.inner_mask |= uint8_t(1u << count);
+                }
+                count++;
+            }
+            quantize(n, boxes, count);
+            nodes[index] = n;
+            nodes.resize(nodes.size() + inner.size());
+            for (size_t i = 0; i < inner.size(); i++)
+                build(binary, inner[i], n.child_base + uint32_t(i));
+        }
+
+        uint32_t count_items(const flat_tree& binary, uint32_t ref) {
+            if (ref & leaf_bit)
+                return binary.leaves[ref & ~leaf_bit].count;
+            const flat_node& n = binary.nodes[ref];
+            subtree_items[ref] = count_items(binary, n.child[0]) + count_items(binary, n.child[1]);
+            return subtree_items[ref];
+        }
+
+        // Inner binary nodes become quantized nodes, small ones and leaves become leaves
+        bool opens(uint32_t ref) const { return !(ref & leaf_bit) && subtree_items[ref] > max_leaf_items; }
+
+        // The primitives below `ref` in the order the binary tree visits them
+        void append_items(const flat_tree& binary, uint32_t ref) {
+            if (ref & leaf_bit) {
+                const flat_tree::flat_leaf& l = binary.leaves[ref & ~leaf_bit];
+                items.insert(items.end(), binary.items.begin() + l.first, binary.items.begin() + l.first + l.count);
+                return;
+            }
+            append_items(binary, binary.nodes[ref].child[0]);
+            append_items(binary, binary.nodes[ref].child[1]);
+        }
+
+        // Chooses the frame of the node so it spans the union of the child boxes in 255 steps, then rounds every
+        // child box outwards to the steps
+        static void quantize(quantized_node& n, const aabb* boxes, int count) {
+            aabb bounds;
+            for (int c = 0; c < count; c++)
+                bounds = aabb(bounds, boxes[c]);
+            for (int axis = 0; axis < 3; axis++) {
+                const interval& extent = bounds.axis_interval(axis);
+                float origin = count > 0 ? flat_tree::round_down(extent.min) : 0.0f;
+                double span = count > 0 ? extent.max - origin : 0.0;
+                int e = -128;
+                if (span > 0)
+                    e = std::max(-128, std::min(127, int(std::ceil(std::log2(span / 255)))));
+                while (e < 127 && origin + 255 * power_of_two(e) < extent.max)
+                    e++;
+                n.origin[axis] = origin;
+                n.exponent[axis] = int8_t(e);
+
+                double scale = power_of_two(e);
+                for (int c = 0; c < count; c++) {
+                    const interval& box = boxes[c].axis_interval(axis);
+                    double lo = std::floor((box.min - origin) / scale);
+                    double hi = std::ceil((box.max - origin) / scale);
+                    int q_lo = int(std::max(0.0, std::min(255.0, lo)));
+                    int q_hi = int(std::max(0.0, std::min(255.0, hi)));
+                    while (q_lo > 0 && origin + q_lo * scale > box.min)
+                        q_lo--;
+                    while (q_hi < 255 && origin + q_hi * scale < box.max)
+                        q_hi++;
+                    n.lo[axis][c] = uint8_t(q_lo);
+                    n.hi[axis][c] = uint8_t(q_hi);
+                }
+            }
+        }
+
+        // The child boxes of a node, decoded
+        int child_boxes(const quantized_node& n, aabb* boxes) const {
+            int count = 0;
+            for (int c = 0; c < width && ((n.inner_mask | n.leaf_mask) & (1u << c)); c++) {
+                point lo, hi;
+                for (int axis = 0; axis < 3; axis++) {
+                    double scale = power_of_two(n.exponent[axis]);
+                    lo[axis] = n.origin[axis] + n.lo[axis][c] * scale;
+                    hi[axis] = n.origin[axis] + n.hi[axis][c] * scale;
+                }
+                boxes[count++] = aabb(lo, hi);
+            }
+            return count;
+        }
+
+        aabb refit_node(uint32_t index) {
+            quantized_node& n = nodes[index];
+            aabb boxes[width];
+            int count = 0;
+            uint32_t next_inner = n.child_base, next_leaf = n.leaf_base;
+            for (int c = 0; c < width; c++) {
+                uint8_t bit = uint8_t(1u << c);
+                if (n.inner_mask & bit) {
+                    boxes[count++] = refit_node(next_inner++);
+                } else if (n.leaf_mask & bit) {
+                    const leaf& l = leaves[next_leaf++];
+                    aabb box;
+                    for (uint32_t i = l.first; i < l.first + l.count; i++)
+                        box = aabb(box, items[i]->refit());
+                    boxes[count++] = box;
+                } else {
+                    break;
+                }
+            }
+            quantize(nodes[index], boxes, count);
+            aabb bounds;
+            for (int c = 0; c < count; c++)
+                bounds = aabb(bounds, boxes[c]);
+            return bounds;
+        }
+
+        // Every child box is tested when its node is visited, leaves pay their primitives whenever their box is hit
+        double node_cost(uint32_t index) const {
+            const quantized_node& n = nodes[index];
+            aabb boxes[width];
+            int count = child_boxes(n, boxes);
+            double cost = 0;
+            uint32_t next_inner = n.child_base, next_leaf = n.leaf_base;
+            for (int c = 0; c < count; c++) {
+                double area = boxes[c].surface_area();
+                cost += node::traversal_cost * area;
+                if (n.inner_mask & (1u << c)) {
+                    cost += node_cost(next_inner++);
+                } else {
+                    const leaf& l = leaves[next_leaf++];
+                    for (uint32_t i = l.first; i < l.first + l.count; i++)
+                        cost += items[i]->sah_cost(area);
+                }
+            }
+            return cost;
+        }
+};
+
+// `root` in the array form of `layout`, or `root` itself for "pointer" and for what is not a tree. "pointer" keeps
+// the trees as they are built, otherwise "dfs", "treelet", "veb" or "quantized"
+inline shared_ptr<hittable> with_layout(const shared_ptr<hittable>& root, const std::string& layout) {
+    if (layout == "pointer" || !std::dynamic_pointer_cast<node>(root))
+        return root;
+    if (!flat_tree::fits(root)) {
+        std::clog << "\rTree deeper than " << flat_tree::max_depth << " levels, keeping it as pointers" << std::endl;
+        return root;
+    }
+    if (layout == "quantized")
+        return make_shared<quantized_tree>(root);
+    return make_shared<flat_tree>(root, layout);
+}
+
+// Renders `world` once at 1/`divisor` of the resolution and one sample per pixel, then lays out every flat tree by
+// how often its nodes were visited
+inline void profile_layouts(const camera& cam, const hittable& world, int divisor) {
+    camera sampling = cam;
+    sampling.width = std::max(1, cam.width / divisor);
+    sampling.on_tile = nullptr;
+    std::vector<color> sums;
+    flat_tree::start_profile();
+    sampling.initialize();
+    sampling.render_samples(world, 0, 0, sampling.width, sampling.height, 0, 1, sums);
+    flat_tree::finish_profile();
+}
+
+#endif
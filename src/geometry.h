@@ -51,12 +51,12 @@ class vec3{
             return (std::fabs(e[0]) < s) && (std::fabs(e[1]) < s) && (std::fabs(e[2]) < s);
         }
 
-        static vec3 random() {
-            return vec3(random_double(), random_double(), random_double());
+        static vec3 random(rng& gen) {
+            return vec3(gen.next(), gen.next(), gen.next());
         }
 
-        static vec3 random(double min, double max) {
-            return vec3(random_double(min, max), random_double(min, max), random_double(min, max));
+        static vec3 random(rng& gen, double min, double max) {
+            return vec3(gen.next(min, max), gen.next(min, max), gen.next(min, max));
         }
 };
 
@@ -106,28 +106,57 @@ inline vec3 unit_vector(const vec3& v) {
     return v / v.length();
 }
 
-inline vec3 random_in_unit_disk() {
-    double r = random_double();
-    double theta = random_double(0, 2) * pi;
-    return vec3(r*cos(theta),r*sin(theta),0);
+// Concentric mapping (Shirley & Chiu) keeps the stratification of the 2D sample
+inline vec3 random_in_unit_disk(sampler& s) {
+    sample_2d u = s.get_2d();
+    double a = 2 * u.u - 1;
+    double b = 2 * u.v - 1;
+    if (a == 0 && b == 0)
+        return vec3(0, 0, 0);
+
+    double r, theta;
+    if (std::fabs(a) > std::fabs(b)) {
+        r = a;
+        theta = (pi / 4) * (b / a);
+    } else {
+        r = b;
+        theta = (pi / 2) - (pi / 4) * (a / b);
+    }
+    return vec3(r*cos(theta), r*sin(theta), 0);
 }
 
-inline vec3 random_unit_vector() {
-    double r = random_double();
-    double theta = random_double(0, 2) * pi;
-    double phi = random_double(0, 2) * pi;
-    auto p = vec3(r * sin(phi) * cos(theta), r * sin(phi) * sin(theta), r * cos(phi));
-    return unit_vector(p);
+// Uniform on the sphere from one 2D sample, a single sincos and no normalize
+inline vec3 random_unit_vector(sampler& s) {
+    sample_2d u = s.get_2d();
+    double z = 1 - 2 * u.u;
+    double r = std::sqrt(std::fmax(0.0, 1 - z*z));
+    double phi = 2 * pi * u.v;
+    return vec3(r * cos(phi), r * sin(phi), z);
 }
 
-inline vec3 random_on_hemisphere(const vec3& normal) {
-    vec3 on_unit_sphere = random_unit_vector();
-    if (dot(on_unit_sphere, normal) > 0,0)
+inline vec3 random_on_hemisphere(const vec3& normal, sampler& s) {
+    vec3 on_unit_sphere = random_unit_vector(s);
+    if (dot(on_unit_sphere, normal) > 0.0)
         return on_unit_sphere;
     else
         return -on_unit_sphere;
 }
 
+// Cosine weighted around `normal` (which must be unit length), the disk sample is lifted onto the hemisphere
+// and rotated with a branchless orthonormal basis (Duff et al. 2017)
+inline vec3 random_cosine_direction(const vec3& normal, sampler& s) {
+    vec3 d = random_in_unit_disk(s);
+    double z = std::sqrt(std::fmax(0.0, 1 - d.x()*d.x() - d.y()*d.y()));
+
+    double sign = std::copysign(1.0, normal.z());
+    double a = -1.0 / (sign + normal.z());
+    double b = normal.x() * normal.y() * a;
+    vec3 t(1.0 + sign * normal.x() * normal.x() * a, sign * b, -sign * normal.x());
+    vec3 bt(b, sign + normal.y() * normal.y() * a, -normal.y());
+
+    return d.x() * t + d.y() * bt + z * normal;
+}
+
 inline vec3 reflect(const vec3& v, const vec3& n) {
     return v - 2*dot(v, n)*n;
 }
@@ -261,6 +290,11 @@ class aabb {
             return point(x.min + (0.5*x.size()), y.min + (0.5*y.size()), z.min + (0.5*z.size()));
         }
 
+        double surface_area() const {
+            double dx = x.size(), dy = y.size(), dz = z.size();
+            return (dx < 0 || dy < 0 || dz < 0) ? 0 : 2 * (dx * dy + dy * dz + dz * dx);
+        }
+
     private:
         void pad_to_minimums() {
             double delta = 0.0001;
@@ -270,4 +304,74 @@ class aabb {
         }
 };
 
+// Overlap of two boxes, empty when they are apart
+inline aabb intersect(const aabb& a, const aabb& b) {
+    interval axes[3];
+    for (int axis = 0; axis < 3; axis++) {
+        double lo = std::fmax(a.axis_interval(axis).min, b.axis_interval(axis).min);
+        double hi = std::fmin(a.axis_interval(axis).max, b.axis_interval(axis).max);
+        if (lo > hi)
+            return aabb();
+        axes[axis] = interval(lo, hi);
+    }
+    return aabb(axes[0], axes[1], axes[2]);
+}
+
+// Keeps the part of the convex polygon `in` (n corners) on the side of the plane at `plane` on `axis` that `sign`
+// points to, Sutherland-Hodgman. Returns the corner count written to `out`, at most n + 1
+inline int clip_to_plane(const point* in, int n, point* out, int axis, double plane, double sign) {
+    int m = 0;
+    for (int i = 0; i < n; i++) {
+        const point& p = in[i];
+        const point& q = in[(i + 1) % n];
+        bool p_in = sign * (p[axis] - plane) >= 0, q_in = sign * (q[axis] - plane) >= 0;
+        if (p_in)
+            out[m++] = p;
+        if (p_in != q_in) {
+            point x = p + ((plane - p[axis]) / (q[axis] - p[axis])) * (q - p);
+            x.e[axis] = plane;
+            out[m++] = x;
+        }
+    }
+    return m;
+}
+
+// Box of the part of a convex polygon between `lo` and `hi` on `axis`, empty when nothing is left
+inline aabb clip_polygon(const point* corners, int n, int axis, double lo, double hi) {
+    point a[8], b[8];
+    n = clip_to_plane(corners, n, b, axis, lo, 1);
+    n = clip_to_plane(b, n, a, axis, hi, -1);
+    if (n == 0)
+        return aabb();
+    point lower = a[0], upper = a[0];
+    for (int i = 1; i < n; i++) {
+        for (int c = 0; c < 3; c++) {
+            lower.e[c] = std::fmin(lower.e[c], a[i].e[c]);
+            upper.e[c] = std::fmax(upper.e[c], a[i].e[c]);
+        }
+    }
+    return aabb(lower, upper);
+}
+
+// Area of the part of a convex polygon (up to 4 corners) inside `box`
+inline double polygon_area_in_box(const point* corners, int n, const aabb& box) {
+    point a[10], b[10];
+    for (int i = 0; i < n; i++)
+        a[i] = corners[i];
+    for (int axis = 0; axis < 3 && n > 0; axis++) {
+        n = clip_to_plane(a, n, b, axis, box.axis_interval(axis).min, 1);
+        n = clip_to_plane(b, n, a, axis, box.axis_interval(axis).max, -1);
+    }
+    vec3 twice_area(0, 0, 0);
+    for (int i = 1; i + 1 < n; i++)
+        twice_area += cross(a[i] - a[0], a[i + 1] - a[0]);
+    return 0.5 * twice_area.length();
+}
+
+inline aabb operator+(const aabb& box, const vec3& offset) {
+    return aabb(interval(box.x.min + offset.x(), box.x.max + offset.x()),
+                interval(box.y.min + offset.y(), box.y.max + offset.y()),
+                interval(box.z.min + offset.z(), box.z.max + offset.z()));
+}
+
 #endif
\ No newline at end of file
@@ -5,13 +5,18 @@
 #include "stat_collector.h"
 
 class material;
+class hittable;
 
 class hit_record {
   public:
     point p;
     vec3 normal;
     shared_ptr<material> mat;
-    shared_ptr<stat_collector> stats;
+#ifdef COLLECT_STATS
+    // Only set for primary rays, so bounces do not count towards the per-sample statistics
+    stat_collector* stats = nullptr;
+    unsigned int stat_slot = 0;
+#endif
     double t;
     double u;
     double v;
@@ -23,13 +28,96 @@ class hit_record {
     }
 };
 
+inline void record_traversal_step(const hit_record& rec) {
+#ifdef COLLECT_STATS
+    if (rec.stats) rec.stats->record_traversal_step(rec.stat_slot);
+#endif
+}
+
+inline void record_intersection_test(const hit_record& rec) {
+#ifdef COLLECT_STATS
+    if (rec.stats) rec.stats->record_intersection_test(rec.stat_slot);
+#endif
+}
+
+// Plain copy of one primitive, for backends that keep their own version of the scene
+struct flat_primitive {
+    enum shape_type { TRIANGLE, SPHERE };
+
+    shape_type shape;
+    point a;                    // triangle: first vertex, sphere: center
+    vec3 b, c;                  // triangle: edges from a
+    double radius = 0;
+    const material* mat = nullptr;
+    const hittable* source = nullptr;
+    int part = 0;               // quads are split into two triangles
+    const hittable* owner = nullptr;    // the instance that placed it, copies of a model share the source
+};
+
+// Rays that are traced together, one bounce of many paths, see hittable::hit_batch
+struct ray_batch {
+    std::vector<ray> rays;
+    std::vector<double> t_max;          // closest hit so far, every object only looks in front of it
+    std::vector<hit_record> recs;
+    std::vector<char> found;
+    double t_min = 0.0001;
+
+    // Forgets the hits of the last bounce, `rays` is filled by the caller
+    void reset() {
+        t_max.assign(rays.size(), infinity);
+        recs.assign(rays.size(), hit_record());
+        found.assign(rays.size(), 0);
+    }
+};
+
 class hittable {
   public:
     virtual ~hittable() = default;
 
     virtual bool hit(const ray& r, interval ray_t, hit_record& rec) const = 0;
 
+    // Intersects every ray of `batch` in front of its closest hit so far. Objects that have to fetch their data
+    // before they can test a ray (out-of-core meshes) serve all rays that need the same data at once instead
+    virtual void hit_batch(ray_batch& batch) const {
+        for (size_t i = 0; i < batch.rays.size(); i++) {
+            hit_record rec;
+#ifdef COLLECT_STATS
+            rec.stats = batch.recs[i].stats;
+            rec.stat_slot = batch.recs[i].stat_slot;
+#endif
+            if (hit(batch.rays[i], interval(batch.t_min, batch.t_max[i]), rec)) {
+                batch.t_max[i] = rec.t;
+                batch.recs[i] = rec;
+                batch.found[i] = 1;
+            }
+        }
+    }
+
     virtual aabb bounding_box() const = 0;
+
+    // Bytes used by acceleration structure nodes and lists below this object, primitives excluded
+    virtual size_t structure_bytes() const { return 0; }
+
+    // The part of structure_bytes above the objects in the leaves, a model or an instance in a leaf adds nothing
+    virtual size_t top_level_bytes() const { return 0; }
+
+    // Appends the primitives below this object to `out`, a primitive shared by several leaves is appended every time
+    virtual void flatten(std::vector<flat_primitive>& out) const {}
+
+    // Recomputes the cached boxes below this object after primitives moved, the topology stays the same
+    virtual aabb refit() { return bounding_box(); }
+
+    // Box of the part of this object between `lo` and `hi` on `axis`, for builders that split primitives. Objects
+    // that cannot do better return their box cut to the slab
+    virtual aabb clip_box(int axis, double lo, double hi) const {
+        interval slab(lo, hi);
+        return intersect(bounding_box(), aabb(axis == 0 ? slab : interval::universe, axis == 1 ? slab : interval::universe,
+                                             axis == 2 ? slab : interval::universe));
+    }
+
+    // Unnormalised SAH cost of the structure below this object. A primitive costs one intersection test every time
+    // the box it sits in, of area `parent_area`, is entered.
+    virtual double sah_cost(double parent_area) const { return parent_area; }
 };
 
 class hittable_list : public hittable {
@@ -53,7 +141,10 @@ class hittable_list : public hittable {
 
         bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
             hit_record temp_rec;
+#ifdef COLLECT_STATS
             temp_rec.stats = rec.stats;
+            temp_rec.stat_slot = rec.stat_slot;
+#endif
             bool hit_anything = false;
             auto closest = ray_t.max;
 
@@ -68,8 +159,96 @@ class hittable_list : public hittable {
             return hit_anything;
         }
 
+        void hit_batch(ray_batch& batch) const override {
+            for (const auto& obj : objects)
+                obj->hit_batch(batch);
+        }
+
         aabb bounding_box() const override { return bbox; }
+
+        size_t structure_bytes() const override {
+            size_t bytes = sizeof(hittable_list) + objects.capacity() * sizeof(shared_ptr<hittable>);
+            for (const auto& obj : objects)
+                bytes += obj->structure_bytes();
+            return bytes;
+        }
+
+        size_t top_level_bytes() const override {
+            size_t bytes = sizeof(hittable_list) + objects.capacity() * sizeof(shared_ptr<hittable>);
+            for (const auto& obj : objects)
+                bytes += obj->top_level_bytes();
+            return bytes;
+        }
+
+        void flatten(std::vector<flat_primitive>& out) const override {
+            for (const auto& obj : objects)
+                obj->flatten(out);
+        }
+
+        aabb refit() override {
+            bbox = aabb();
+            for (const auto& obj : objects)
+                bbox = aabb(bbox, obj->refit());
+            return bbox;
+        }
+
+        // A list has no box of its own, every object is tested
+        double sah_cost(double parent_area) const override {
+            double cost = 0;
+            for (const auto& obj : objects)
+                cost += obj->sah_cost(parent_area);
+            return cost;
+        }
+    private:
+        aabb bbox;
+};
+
+// An object moved by `offset`, e.g. a model instance in an animation. The object keeps its own structure, moving
+// the instance only changes the offset.
+class instance : public hittable {
+    public:
+        instance(shared_ptr<hittable> object, const vec3& offset = vec3(0, 0, 0)) : object(object) {
+            move_to(offset);
+        }
+
+        void move_to(const vec3& new_offset) {
+            offset = new_offset;
+            bbox = object->bounding_box() + offset;
+        }
+
+        const vec3& position() const { return offset; }
+        const hittable* placed() const { return object.get(); }
+
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            ray local(r.origin() - offset, r.direction());
+            if (!object->hit(local, ray_t, rec))
+                return false;
+            rec.p += offset;
+            return true;
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        size_t structure_bytes() const override { return sizeof(instance) + object->structure_bytes(); }
+
+        void flatten(std::vector<flat_primitive>& out) const override {
+            size_t first = out.size();
+            object->flatten(out);
+            for (size_t i = first; i < out.size(); i++) {
+                out[i].a += offset;
+                out[i].owner = this;
+            }
+        }
+
+        aabb refit() override {
+            bbox = object->refit() + offset;
+            return bbox;
+        }
+
+        double sah_cost(double parent_area) const override { return object->sah_cost(parent_area); }
     private:
+        shared_ptr<hittable> object;
+        vec3 offset;
         aabb bbox;
 };
 
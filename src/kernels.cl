@@ -1,223 +1,764 @@
-#include <opencl-c-base.h>
 struct Intersection
 {
     float t;                    // intersection distance along ray
-    float u, v;	                // barycentric coordinates of the intersection
+    float u, v;                 // barycentric coordinates of the intersection
+    uint prim;                  // index of the primitive that was hit
 };
- 
+
 struct Ray
 {
     float3 O, D, rD;            // in OpenCL, each of these will be padded to 16 bytes
     struct Intersection hit;    // total ray size: 64 bytes
 };
 
-struct Tri 
-{ 
-    float v0x, v0y, v0z;
-    float v1x, v1y, v1z;
-    float v2x, v2y, v2z;
-    float cx, cy, cz;
+// Primitive as uploaded by cl_backend.h, 48 bytes
+struct Prim
+{
+    float ax, ay, az;           // triangle: first vertex, sphere: center
+    int type;                   // PRIM_TRIANGLE or PRIM_SPHERE
+    float bx, by, bz;           // triangle: first edge
+    int material;
+    float cx, cy, cz;           // triangle: second edge
+    float radius;
 };
 
-bool IntersectTri( struct Ray* ray, __global struct Tri* tri)
+#define PRIM_TRIANGLE 0
+#define PRIM_SPHERE 1
+
+// Material as uploaded by cl_backend.h, 32 bytes
+struct Material
 {
-    float3 v0 = (float3)(tri->v0x, tri->v0y, tri->v0z);
-    float3 v1 = (float3)(tri->v1x, tri->v1y, tri->v1z);
-    float3 v2 = (float3)(tri->v2x, tri->v2y, tri->v2z);
-    float3 edge1 = v1 - v0, edge2 = v2 - v0;
-    float3 h = cross( ray->D, edge2 );
-    float a = dot( edge1, h );
-    if (a > -0.00001f && a < 0.00001f) return false; // ray parallel to triangle
-    float f = 1 / a;
-    float3 s = ray->O - v0;
-    float u = f * dot( s, h );
-    if (u < 0 || u > 1) return false;
-    float3 q = cross( s, edge1 );
-    float v = f * dot( ray->D, q );
-    if (v < 0 || u + v > 1) return false;
-    float t = f * dot( edge2, q );
-    if (t > 0.0001f && t < ray->hit.t)
-        ray->hit.t = t, ray->hit.u = u,
-        ray->hit.v = v;
-    return true;
-}
+    float r, g, b;
+    float param;                // metal: fuzz, dielectric: refraction index
+    int type;                   // MAT_NONE, MAT_LAMBERTIAN, MAT_METAL or MAT_DIELECTRIC
+    int pad0, pad1, pad2;
+};
+
+#define MAT_NONE 0
+#define MAT_LAMBERTIAN 1
+#define MAT_METAL 2
+#define MAT_DIELECTRIC 3
 
 struct BVHNode
 {
     float minx, miny, minz;
-    int leftFirst;
+    int leftFirst;              // inner node: index of the left child, the right one follows it. leaf: first primitive
     float maxx, maxy, maxz;
-    int triCount;
+    int primCount;              // 0 for inner nodes
 };
 
-inline uint RGB32FtoRGB8( float3 c )
+#define NO_HIT 1e30f
+#define T_MIN 0.0001f
+
+// 4D PCG hash, the same as pcg4d in rng.h
+void pcg4d(uint* v)
 {
-    int r = (int)(min( c.x, 1.f ) * 255);
-    int g = (int)(min( c.y, 1.f ) * 255);
-    int b = (int)(min( c.z, 1.f ) * 255);
-    return (r << 16) + (g << 8) + b;
+    for (int i = 0; i < 4; i++)
+        v[i] = v[i] * 1664525u + 1013904223u;
+    v[0] += v[1] * v[3];
+    v[1] += v[2] * v[0];
+    v[2] += v[0] * v[1];
+    v[3] += v[1] * v[2];
+    for (int i = 0; i < 4; i++)
+        v[i] ^= v[i] >> 16;
+    v[0] += v[1] * v[3];
+    v[1] += v[2] * v[0];
+    v[2] += v[0] * v[1];
+    v[3] += v[1] * v[2];
 }
 
-float3 Trace( struct Ray* ray, __global struct Tri* tri)
+float to_unit(uint v)
 {
-    // return ray->D;
-    for (uint i = 0; i < 508; i++)
-    {
-        IntersectTri(ray, &tri[i]);
-    }
-    if (ray->hit.t < 9999)
-        return (float3)( 1, 1, 1 );
+    return v * (1.0f / 4294967296.0f);
+}
+
+void IntersectTri(struct Ray* ray, __global const struct Prim* prim, uint index)
+{
+    float3 v0 = (float3)(prim->ax, prim->ay, prim->az);
+    float3 edge1 = (float3)(prim->bx, prim->by, prim->bz);
+    float3 edge2 = (float3)(prim->cx, prim->cy, prim->cz);
+    float3 h = cross(ray->D, edge2);
+    float a = dot(edge1, h);
+    if (a > -0.00000001f && a < 0.00000001f) return; // ray parallel to triangle
+    float f = 1 / a;
+    float3 s = ray->O - v0;
+    float u = f * dot(s, h);
+    if (u < 0 || u > 1) return;
+    float3 q = cross(s, edge1);
+    float v = f * dot(ray->D, q);
+    if (v < 0 || u + v > 1) return;
+    float t = f * dot(edge2, q);
+    if (t > T_MIN && t < ray->hit.t)
+        ray->hit.t = t, ray->hit.u = u, ray->hit.v = v, ray->hit.prim = index;
+}
+
+// Ray Tracing Gems, chapter 7: the discriminant and the near root are computed without the cancellation the
+// textbook formula suffers from, which matters for the huge ground spheres in float precision
+void IntersectSphere(struct Ray* ray, __global const struct Prim* prim, uint index)
+{
+    float3 center = (float3)(prim->ax, prim->ay, prim->az);
+    float radius = prim->radius;
+    float3 f = ray->O - center;
+    float b = -dot(f, ray->D);
+    float3 l = f + b * ray->D;
+    float discriminant = radius * radius - dot(l, l);
+    if (discriminant < 0) return;
+    float flen = length(f);
+    float c = (flen - radius) * (flen + radius);
+    float q = b + copysign(sqrt(discriminant), b);
+    float t0 = c / q, t1 = q;
+    if (t0 > t1) { float tmp = t0; t0 = t1; t1 = tmp; }
+    float t = (t0 > T_MIN) ? t0 : t1;
+    if (t > T_MIN && t < ray->hit.t)
+        ray->hit.t = t, ray->hit.prim = index;
+}
+
+void IntersectPrim(struct Ray* ray, __global const struct Prim* prims, uint index)
+{
+    if (prims[index].type == PRIM_SPHERE)
+        IntersectSphere(ray, &prims[index], index);
     else
-        return (float3)( 0, 0, 0 );
+        IntersectTri(ray, &prims[index], index);
 }
 
-bool intersect(struct BVHNode* node, struct Ray* ray)
+// Distance to the box along the ray, NO_HIT if it is missed or further away than the current hit
+float IntersectAABB(const struct Ray* ray, __global const struct BVHNode* node)
 {
-    float adinv = 1.0 / ray->D.x;
-    float t0 = (node->minx - ray->O.x) * adinv;
-    float t1 = (node->maxx - ray->O.x) * adinv;
-    if (t0 < t1)
+    float tx1 = (node->minx - ray->O.x) * ray->rD.x, tx2 = (node->maxx - ray->O.x) * ray->rD.x;
+    float tmin = fmin(tx1, tx2), tmax = fmax(tx1, tx2);
+    float ty1 = (node->miny - ray->O.y) * ray->rD.y, ty2 = (node->maxy - ray->O.y) * ray->rD.y;
+    tmin = fmax(tmin, fmin(ty1, ty2)), tmax = fmin(tmax, fmax(ty1, ty2));
+    float tz1 = (node->minz - ray->O.z) * ray->rD.z, tz2 = (node->maxz - ray->O.z) * ray->rD.z;
+    tmin = fmax(tmin, fmin(tz1, tz2)), tmax = fmin(tmax, fmax(tz1, tz2));
+    if (tmax >= tmin && tmin < ray->hit.t && tmax > 0)
+        return tmin;
+    return NO_HIT;
+}
+
+// ---------------------------------------------------------------------------------------------------------------------
+// Wavefront path tracing (Laine, Karras and Aila, "Megakernels Considered Harmful", 2013)
+//
+//   generate  a primary ray and a fresh path for every pixel, all of them queued
+//   extend    closest hit of every queued ray
+//   shade     adds the sky for paths that escaped, scatters the others off their material (as material.h does) and
+//             ends them with Russian roulette (as camera::path_color does)
+//   compact   moves the paths that are still alive into the queue of the next bounce
+//
+// Rays, paths, queues and queue lengths stay on the device for the whole render. The host never reads a queue length,
+// so every bounce is launched over all pixels and the work-items past the end of the queue return at once.
+// ---------------------------------------------------------------------------------------------------------------------
+
+// State of one path between the kernels, 32 bytes
+struct Path
+{
+    float3 throughput;
+    uint pixel;
+    uint alive;
+    uint pad0, pad1;
+};
+
+// Concentric mapping of two uniform numbers onto the unit disk, as random_in_unit_disk does
+float2 ConcentricDisk(float u, float v)
+{
+    float a = 2 * u - 1, b = 2 * v - 1;
+    float r = 0, phi = 0;
+    if (a * a > b * b)
+        r = a, phi = (M_PI_F / 4) * (b / a);
+    else if (b != 0)
+        r = b, phi = (M_PI_F / 2) - (M_PI_F / 4) * (a / b);
+    return (float2)(r * cos(phi), r * sin(phi));
+}
+
+struct Ray MakeRay(float3 O, float3 D)
+{
+    struct Ray ray;
+    ray.O = O;
+    ray.D = D;
+    ray.rD = (float3)(1 / D.x, 1 / D.y, 1 / D.z);
+    ray.hit.t = NO_HIT;
+    ray.hit.u = ray.hit.v = 0;
+    ray.hit.prim = 0;
+    return ray;
+}
+
+// Primary rays through a random point of every pixel, `sample` keys the random numbers like the CPU samplers do
+__kernel void generate( __global struct Ray* rays, __global struct Path* paths, __global uint* queue,
+                        __global uint* queue_length, __global float4* accum, uint width, uint height, uint sample,
+                        float3 origin, float3 p00, float3 du, float3 dv, float3 disk_u, float3 disk_v )
+{
+    uint id = get_global_id(0);
+    if (id >= width * height)
+        return;
+    uint x = id % width, y = id / width;
+
+    uint h[4] = { (y << 16) ^ x, sample, 0, 0 };
+    pcg4d(h);
+    float3 target = p00 + (x + to_unit(h[0]) - 0.5f) * du + (y + to_unit(h[1]) - 0.5f) * dv;
+    float2 lens = ConcentricDisk(to_unit(h[2]), to_unit(h[3]));
+    float3 O = origin + lens.x * disk_u + lens.y * disk_v;
+    rays[id] = MakeRay(O, normalize(target - O));
+
+    struct Path path;
+    path.throughput = (float3)(1.0f, 1.0f, 1.0f);
+    path.pixel = id;
+    path.alive = 1;
+    path.pad0 = path.pad1 = 0;
+    paths[id] = path;
+    queue[id] = id;
+    accum[id].w += 1.0f;
+    if (id == 0)
+        *queue_length = width * height;
+}
+
+// Closest hit, stack based and visiting the nearer child first (after Jacco Bikker's GPU BVH)
+void Trace(struct Ray* ray, __global const struct BVHNode* BVH, __global const struct Prim* prims)
+{
+    uint stack[64];
+    uint stackPtr = 0;
+    uint index = 0;
+    if (IntersectAABB(ray, &BVH[0]) == NO_HIT)
+        return;
+
+    while (true)
     {
-        if (t0 > ray->hit.u) ray->hit.u = t0;
-        if (t1 < ray->hit.v) ray->hit.v = t1;
+        __global const struct BVHNode* node = &BVH[index];
+        if (node->primCount > 0)
+        {
+            for (int i = 0; i < node->primCount; i++)
+                IntersectPrim(ray, prims, node->leftFirst + i);
+            if (stackPtr == 0)
+                break;
+            index = stack[--stackPtr];
+            continue;
+        }
+
+        uint nearChild = node->leftFirst, farChild = node->leftFirst + 1;
+        float dNear = IntersectAABB(ray, &BVH[nearChild]);
+        float dFar = IntersectAABB(ray, &BVH[farChild]);
+        if (dNear > dFar)
+        {
+            float d = dNear; dNear = dFar; dFar = d;
+            uint c = nearChild; nearChild = farChild; farChild = c;
+        }
+        if (dNear == NO_HIT)
+        {
+            if (stackPtr == 0)
+                break;
+            index = stack[--stackPtr];
+        }
+        else
+        {
+            index = nearChild;
+            if (dFar != NO_HIT)
+                stack[stackPtr++] = farChild;
+        }
     }
-    else
+}
+
+// Also empties the next queue, which compact fills after shade, and counts the traced rays
+__kernel void extend( __global const struct BVHNode* BVH, __global const struct Prim* prims,
+                      __global struct Ray* rays, __global const uint* queue, __global const uint* queue_length,
+                      __global uint* next_length, __global ulong* traced )
+{
+    uint id = get_global_id(0), length = *queue_length;
+    if (id == 0)
     {
-        if (t1 > ray->hit.u) ray->hit.u = t1;
-        if (t0 < ray->hit.v) ray->hit.v = t0;
+        *next_length = 0;
+        *traced += length;
     }
-    if (ray->hit.v <= ray->hit.u)
-        return false;
+    if (id >= length)
+        return;
+
+    uint slot = queue[id];
+    struct Ray ray = rays[slot];
+    Trace(&ray, BVH, prims);
+    rays[slot].hit = ray.hit;
+}
+
+float3 PrimNormal(__global const struct Prim* prim, float3 p)
+{
+    if (prim->type == PRIM_SPHERE)
+        return (p - (float3)(prim->ax, prim->ay, prim->az)) / prim->radius;
+    return normalize(cross((float3)(prim->bx, prim->by, prim->bz), (float3)(prim->cx, prim->cy, prim->cz)));
+}
+
+// The sky of camera::background
+float3 Background(float3 D)
+{
+    float a = 0.5f * (D.y + 1.0f);
+    return (1.0f - a) * (float3)(1.0f, 1.0f, 1.0f) + a * (float3)(0.5f, 0.7f, 1.0f);
+}
 
-    adinv = 1.0 / ray->D.y;
-    t0 = (node->miny - ray->O.y) * adinv;
-    t1 = (node->maxy - ray->O.y) * adinv;
-    if (t0 < t1)
+float3 Reflect(float3 v, float3 n)
+{
+    return v - 2 * dot(v, n) * n;
+}
+
+float3 Refract(float3 uv, float3 n, float eta)
+{
+    float cos_theta = fmin(dot(-uv, n), 1.0f);
+    float3 perp = eta * (uv + cos_theta * n);
+    float3 parallel = -sqrt(fabs(1.0f - dot(perp, perp))) * n;
+    return perp + parallel;
+}
+
+// Cosine weighted around the unit normal n, with a branchless orthonormal basis (Duff et al. 2017)
+float3 CosineDirection(float3 n, float u, float v)
+{
+    float2 d = ConcentricDisk(u, v);
+    float z = sqrt(fmax(0.0f, 1 - d.x * d.x - d.y * d.y));
+    float sign = copysign(1.0f, n.z);
+    float a = -1.0f / (sign + n.z);
+    float b = n.x * n.y * a;
+    float3 t = (float3)(1.0f + sign * n.x * n.x * a, sign * b, -sign * n.x);
+    float3 bt = (float3)(b, sign + n.y * n.y * a, -n.y);
+    return d.x * t + d.y * bt + z * n;
+}
+
+float3 UnitVector(float u, float v)
+{
+    float z = 1 - 2 * u;
+    float r = sqrt(fmax(0.0f, 1 - z * z));
+    float phi = 2 * M_PI_F * v;
+    return (float3)(r * cos(phi), r * sin(phi), z);
+}
+
+// The hit point moved off the surface, to the side the scattered ray leaves on. In float the hit point is only as
+// precise as the coordinates around it, for the huge ground spheres that is far more than T_MIN, and a ray that
+// starts just below the surface would hit it again.
+float3 OffsetOrigin(__global const struct Prim* prim, float3 p, float3 n, float3 direction)
+{
+    float3 extent = fabs(p);
+    if (prim->type == PRIM_SPHERE)
+        extent = fmax(extent, fabs((float3)(prim->ax, prim->ay, prim->az)) + prim->radius);
+    float offset = 8 * FLT_EPSILON * fmax(fmax(extent.x, extent.y), fmax(extent.z, 1.0f));
+    return p + (dot(direction, n) > 0 ? offset : -offset) * n;
+}
+
+// Scatters the ray off the material at the hit point, false when the material absorbs it
+bool Scatter(__global const struct Material* mat, float3 D, float3 n, bool front_face, uint* h, float3* direction)
+{
+    if (mat->type == MAT_LAMBERTIAN)
     {
-        if (t0 > ray->hit.u) ray->hit.u = t0;
-        if (t1 < ray->hit.v) ray->hit.v = t1;
+        *direction = CosineDirection(n, to_unit(h[0]), to_unit(h[1]));
+        return true;
     }
-    else
+    if (mat->type == MAT_METAL)
     {
-        if (t1 > ray->hit.u) ray->hit.u = t1;
-        if (t0 < ray->hit.v) ray->hit.v = t0;
+        *direction = Reflect(D, n) + mat->param * UnitVector(to_unit(h[0]), to_unit(h[1]));
+        return dot(*direction, n) > 0;
     }
-    if (ray->hit.v <= ray->hit.u)
-        return false;
+    if (mat->type == MAT_DIELECTRIC)
+    {
+        float ri = front_face ? 1.0f / mat->param : mat->param;
+        float cos_theta = fmin(dot(-D, n), 1.0f);
+        float sin_theta = sqrt(fmax(0.0f, 1.0f - cos_theta * cos_theta));
+        float r0 = (1 - ri) / (1 + ri);
+        r0 = r0 * r0;
+        float reflectance = r0 + (1 - r0) * pown(1 - cos_theta, 5);
+        if (ri * sin_theta > 1.0f || reflectance > to_unit(h[2]))
+            *direction = Reflect(D, n);
+        else
+            *direction = Refract(D, n, ri);
+        return true;
+    }
+    return false;
+}
 
-    adinv = 1.0 / ray->D.z;
-    t0 = (node->minz - ray->O.z) * adinv;
-    t1 = (node->maxz - ray->O.z) * adinv;
-    if (t0 < t1)
+__kernel void shade( __global struct Ray* rays, __global struct Path* paths, __global const struct Prim* prims,
+                     __global const struct Material* materials, __global const uint* queue,
+                     __global const uint* queue_length, __global float4* accum, uint width, uint sample, uint bounce,
+                     uint max_depth, uint rr_depth )
+{
+    uint id = get_global_id(0);
+    if (id >= *queue_length)
+        return;
+    uint slot = queue[id];
+    struct Ray ray = rays[slot];
+    struct Path path = paths[slot];
+
+    if (ray.hit.t == NO_HIT)
     {
-        if (t0 > ray->hit.u) ray->hit.u = t0;
-        if (t1 < ray->hit.v) ray->hit.v = t1;
+        float3 c = path.throughput * Background(ray.D);
+        accum[path.pixel] += (float4)(c.x, c.y, c.z, 0.0f);
+        paths[slot].alive = 0;
+        return;
     }
-    else
+
+    __global const struct Prim* prim = &prims[ray.hit.prim];
+    __global const struct Material* mat = &materials[prim->material];
+    float3 p = ray.O + ray.hit.t * ray.D;
+    float3 n = PrimNormal(prim, p);
+    bool front_face = dot(ray.D, n) < 0;
+    if (!front_face)
+        n = -n;
+
+    // Keyed by pixel, sample and bounce like the CPU samplers: two numbers for the direction, one for the dielectric
+    // and one for Russian roulette
+    uint x = path.pixel % width, y = path.pixel / width;
+    uint h[4] = { (y << 16) ^ x, sample, bounce + 1, 0x5ade };
+    pcg4d(h);
+
+    float3 direction;
+    bool alive = bounce + 1 < max_depth && Scatter(mat, ray.D, n, front_face, h, &direction);
+    if (alive)
     {
-        if (t1 > ray->hit.u) ray->hit.u = t1;
-        if (t0 < ray->hit.v) ray->hit.v = t0;
+        path.throughput *= (float3)(mat->r, mat->g, mat->b);
+        if (bounce + 1 >= rr_depth)
+        {
+            float survive = fmin(fmax(path.throughput.x, fmax(path.throughput.y, path.throughput.z)), 0.95f);
+            alive = survive > 0 && to_unit(h[3]) < survive;
+            path.throughput /= survive;
+        }
     }
-    if (ray->hit.v <= ray->hit.u)
-        return false;
+    path.alive = alive;
+    paths[slot] = path;
+    if (alive)
+        rays[slot] = MakeRay(OffsetOrigin(prim, p, n, direction), normalize(direction));
+}
 
-    return true;
+// Appends the live paths of the queue to the next queue. The order of the next queue varies between runs, but every
+// path keeps its own slot and random numbers, so the image does not.
+__kernel void compact( __global const struct Path* paths, __global const uint* queue, __global const uint* queue_length,
+                       __global uint* next_queue, __global uint* next_length )
+{
+    uint id = get_global_id(0);
+    if (id >= *queue_length)
+        return;
+    uint slot = queue[id];
+    if (paths[slot].alive)
+        next_queue[atomic_inc(next_length)] = slot;
+}
+
+// ---------------------------------------------------------------------------------------------------------------------
+// LBVH construction (Karras, "Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d Trees", 2012)
+//
+//   lbvh_bounds     primitive boxes, and the centroid bounds of the scene through local reduction and global atomics
+//   lbvh_morton     30-bit Morton code of every centroid, paired with the primitive index
+//   radix_*         LSD radix sort of the (code, index) pairs, 4 bits per pass
+//   lbvh_hierarchy  one work-item per internal node finds its key range and split, and places the leaves
+//   lbvh_link       writes the inner nodes and the parent links
+//   lbvh_fit        bottom-up boxes, the second work-item to reach a node merges its children
+//   lbvh_gather     stores the primitives in sorted order, so leaf k points at primitive k
+//
+// The children of the inner node that splits the sorted keys between gamma and gamma + 1 go to slots 2 gamma + 1 and
+// 2 gamma + 2, every split happens once, so the n - 1 inner nodes and n leaves fill 2n - 1 slots with the root at 0 and
+// siblings next to each other, as Trace expects.
+// ---------------------------------------------------------------------------------------------------------------------
+
+#define LBVH_GROUP 256
+#define RADIX_BITS 4
+#define RADIX_BUCKETS 16
+
+struct AABB
+{
+    float minx, miny, minz, pad0;
+    float maxx, maxy, maxz, pad1;
+};
+
+// Floats as ints whose signed order matches the float order, for atomic_min / atomic_max
+int float_to_ordered(float f)
+{
+    int i = as_int(f);
+    return (i >= 0) ? i : i ^ 0x7fffffff;
+}
+
+float ordered_to_float(int i)
+{
+    return as_float((i >= 0) ? i : i ^ 0x7fffffff);
 }
 
-__kernel void traverse( __global struct BVHNode* BVH, __global struct Tri* triData, __global const struct Ray *rays, __global float3* output )
+// `scene` holds the centroid bounds as ordered ints: min x, y, z and max x, y, z
+__kernel void lbvh_bounds( __global const struct Prim* prims, uint count, __global struct AABB* bounds,
+                           __global int* scene )
 {
-    // Get the ray used by the instance
-    struct Ray ray = rays[get_global_id(0)];
+    __local float lminx[LBVH_GROUP], lminy[LBVH_GROUP], lminz[LBVH_GROUP];
+    __local float lmaxx[LBVH_GROUP], lmaxy[LBVH_GROUP], lmaxz[LBVH_GROUP];
+    uint id = get_global_id(0), lid = get_local_id(0);
 
-    int stack[64];
-    int* stackPtr = stack;
-    int index = 0;
-    
-    do
+    float3 c = (float3)(INFINITY, INFINITY, INFINITY);
+    float3 cmax = -c;
+    if (id < count)
     {
-        struct BVHNode node = BVH[index];
-        // It is a leaf
-        if (node.triCount > 0)
+        struct Prim p = prims[id];
+        float3 a = (float3)(p.ax, p.ay, p.az), lo, hi;
+        if (p.type == PRIM_SPHERE)
         {
-            bool hit;
-            for (int i = 0; i < node.triCount; i++)
-            {
-                hit = IntersectTri(&ray, &triData[node.leftFirst+i]);
-            }
-            output[get_global_id(0)] = (hit) ? (float3)(1, 1, 1) : (float3)(0, 0, 0);
+            float3 r = (float3)(p.radius, p.radius, p.radius);
+            lo = a - r, hi = a + r;
         }
-        // It is a child
         else
         {
-            struct BVHNode childL = BVH[node.leftFirst];
-            struct BVHNode childR = BVH[node.leftFirst+1];
-
-            bool overlapL = intersect(&childL, &ray);
-            bool overlapR = intersect(&childR, &ray);
-
-            if (!overlapL && !overlapR)
-                index = *--stackPtr;
-            else
-            {
-                node = (overlapL) ? childL : childR;
-                if (overlapL && overlapR)
-                    *stackPtr++ = node.leftFirst+1;
-            }
+            float3 b = a + (float3)(p.bx, p.by, p.bz), d = a + (float3)(p.cx, p.cy, p.cz);
+            lo = fmin(a, fmin(b, d)), hi = fmax(a, fmax(b, d));
         }
+        // Rounded outwards, like the host builder, so the box still holds the surface
+        lo = nextafter(lo, -c), hi = nextafter(hi, c);
+        struct AABB box;
+        box.minx = lo.x, box.miny = lo.y, box.minz = lo.z, box.pad0 = 0;
+        box.maxx = hi.x, box.maxy = hi.y, box.maxz = hi.z, box.pad1 = 0;
+        bounds[id] = box;
+        c = cmax = 0.5f * (lo + hi);
+    }
+    lminx[lid] = c.x, lminy[lid] = c.y, lminz[lid] = c.z;
+    lmaxx[lid] = cmax.x, lmaxy[lid] = cmax.y, lmaxz[lid] = cmax.z;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (uint stride = LBVH_GROUP / 2; stride > 0; stride >>= 1)
+    {
+        if (lid < stride)
+        {
+            lminx[lid] = fmin(lminx[lid], lminx[lid + stride]);
+            lminy[lid] = fmin(lminy[lid], lminy[lid + stride]);
+            lminz[lid] = fmin(lminz[lid], lminz[lid + stride]);
+            lmaxx[lid] = fmax(lmaxx[lid], lmaxx[lid + stride]);
+            lmaxy[lid] = fmax(lmaxy[lid], lmaxy[lid + stride]);
+            lmaxz[lid] = fmax(lmaxz[lid], lmaxz[lid + stride]);
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    if (lid == 0)
+    {
+        atomic_min(&scene[0], float_to_ordered(lminx[0]));
+        atomic_min(&scene[1], float_to_ordered(lminy[0]));
+        atomic_min(&scene[2], float_to_ordered(lminz[0]));
+        atomic_max(&scene[3], float_to_ordered(lmaxx[0]));
+        atomic_max(&scene[4], float_to_ordered(lmaxy[0]));
+        atomic_max(&scene[5], float_to_ordered(lmaxz[0]));
     }
-    while (index != NULL);
 }
 
-// Based on Jacco Bikkers gpu implementation of a bvh
-__kernel void render( __global struct Tri* triData, __global uint* target, uint width, uint height, float3 camPos, float3 p0, float3 du, float3 dv)
+// Spreads the low 10 bits of v so there are two zero bits between every bit
+uint expand_bits(uint v)
 {
-    // plot a pixel into the target array in GPU memory
-    int threadIdx = get_global_id( 0 );
-    int x = threadIdx % width;
-    int y = threadIdx / width;
-    // create a primary ray for the pixel
-    struct Ray ray;
-    ray.O = camPos;
-    float3 pixelPos = p0 + x * du + y * dv;
-    ray.D = normalize( pixelPos - ray.O );
-    ray.hit.t = 1e30f; // 1e30f denotes 'no hit'
-    // trace the primary ray
-    float3 color = Trace( &ray, triData);
-    // plot the result
-    target[x + y * width] = RGB32FtoRGB8(color);
-}
-
-uint3 to_morton_part(int val, int offset){
-    uint3 res;
-    for (uint i = 0; i < sizeof(uint); i++){
-        uint v = 1 & (val >> 0);
-        uint t = 0 * 3 + offset;
-        uint lt = t % sizeof(uint);
-        uint v2 = v << lt;
-        int ax = t / 3;
-        if (ax == 0) {
-            res.x = res.x | v2;
-        } else if (ax == 1) {
-            res.y = res.y | v2;
-        } else {
-            res.z = res.z | v2;
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+uint morton3(float x, float y, float z)
+{
+    uint ix = (uint)clamp(x * 1024.0f, 0.0f, 1023.0f);
+    uint iy = (uint)clamp(y * 1024.0f, 0.0f, 1023.0f);
+    uint iz = (uint)clamp(z * 1024.0f, 0.0f, 1023.0f);
+    return (expand_bits(ix) << 2) | (expand_bits(iy) << 1) | expand_bits(iz);
+}
+
+__kernel void lbvh_morton( __global const struct AABB* bounds, uint count, __global const int* scene,
+                           __global uint* keys, __global uint* values )
+{
+    uint id = get_global_id(0);
+    if (id >= count)
+        return;
+    float3 lo = (float3)(ordered_to_float(scene[0]), ordered_to_float(scene[1]), ordered_to_float(scene[2]));
+    float3 hi = (float3)(ordered_to_float(scene[3]), ordered_to_float(scene[4]), ordered_to_float(scene[5]));
+    float3 extent = fmax(hi - lo, (float3)(1e-20f, 1e-20f, 1e-20f));
+
+    struct AABB box = bounds[id];
+    float3 c = 0.5f * ((float3)(box.minx, box.miny, box.minz) + (float3)(box.maxx, box.maxy, box.maxz));
+    float3 n = (c - lo) / extent;
+    keys[id] = morton3(n.x, n.y, n.z);
+    values[id] = id;
+}
+
+// Per work-group digit counts, stored digit-major so one scan gives every group its output offsets
+__kernel void radix_count( __global const uint* keys, uint count, uint shift, __global uint* histogram )
+{
+    __local uint counts[RADIX_BUCKETS];
+    uint id = get_global_id(0), lid = get_local_id(0);
+    uint group = get_group_id(0), groups = get_num_groups(0);
+
+    if (lid < RADIX_BUCKETS)
+        counts[lid] = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (id < count)
+        atomic_inc(&counts[(keys[id] >> shift) & (RADIX_BUCKETS - 1)]);
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (lid < RADIX_BUCKETS)
+        histogram[lid * groups + group] = counts[lid];
+}
+
+// Exclusive prefix sum of `length` values, run as a single work-group of LBVH_GROUP items
+__kernel void radix_scan( __global uint* data, uint length )
+{
+    __local uint sums[LBVH_GROUP];
+    __local uint carry;
+    uint lid = get_local_id(0);
+
+    if (lid == 0)
+        carry = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (uint base = 0; base < length; base += LBVH_GROUP)
+    {
+        uint i = base + lid;
+        uint value = (i < length) ? data[i] : 0;
+        sums[lid] = value;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        for (uint offset = 1; offset < LBVH_GROUP; offset <<= 1)
+        {
+            uint add = (lid >= offset) ? sums[lid - offset] : 0;
+            barrier(CLK_LOCAL_MEM_FENCE);
+            sums[lid] += add;
+            barrier(CLK_LOCAL_MEM_FENCE);
         }
+        if (i < length)
+            data[i] = carry + sums[lid] - value;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (lid == LBVH_GROUP - 1)
+            carry += sums[lid];
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+}
+
+// Stable scatter: the rank of a key among the keys with the same digit earlier in its work-group, plus the scanned
+// offset of that digit for the work-group
+__kernel void radix_scatter( __global const uint* keys_in, __global const uint* values_in, __global uint* keys_out,
+                             __global uint* values_out, uint count, uint shift, __global const uint* histogram )
+{
+    __local uint digits[LBVH_GROUP];
+    uint id = get_global_id(0), lid = get_local_id(0);
+    uint group = get_group_id(0), groups = get_num_groups(0);
+
+    uint key = (id < count) ? keys_in[id] : 0;
+    uint digit = (id < count) ? (key >> shift) & (RADIX_BUCKETS - 1) : RADIX_BUCKETS;
+    digits[lid] = digit;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (id >= count)
+        return;
+
+    uint rank = 0;
+    for (uint j = 0; j < lid; j++)
+        rank += (digits[j] == digit);
+    uint dst = histogram[digit * groups + group] + rank;
+    keys_out[dst] = key;
+    values_out[dst] = values_in[id];
+}
+
+// Length of the common prefix of keys i and j, ties between equal keys are broken by their index
+int common_prefix(__global const uint* keys, int count, int i, int j)
+{
+    if (j < 0 || j >= count)
+        return -1;
+    uint a = keys[i], b = keys[j];
+    if (a == b)
+        return 32 + clz((uint)(i ^ j));
+    return clz(a ^ b);
+}
+
+__kernel void lbvh_hierarchy( __global const uint* keys, __global const uint* values, uint count,
+                              __global const struct AABB* bounds, __global struct BVHNode* BVH, __global int* split,
+                              __global int* slot_of, __global int* leaf_slot )
+{
+    int i = get_global_id(0), n = count;
+    if (i >= n - 1)
+        return;
+
+    // Direction of the range and an upper bound of its length
+    int d = (common_prefix(keys, n, i, i + 1) - common_prefix(keys, n, i, i - 1)) >= 0 ? 1 : -1;
+    int delta_min = common_prefix(keys, n, i, i - d);
+    int l_max = 2;
+    while (common_prefix(keys, n, i, i + l_max * d) > delta_min)
+        l_max *= 2;
+
+    // The other end with a binary search
+    int l = 0;
+    for (int t = l_max / 2; t >= 1; t /= 2)
+        if (common_prefix(keys, n, i, i + (l + t) * d) > delta_min)
+            l += t;
+    int j = i + l * d;
+
+    // Split position, where the common prefix with i gets shorter
+    int delta_node = common_prefix(keys, n, i, j);
+    int s = 0;
+    for (int t = (l + 1) / 2; ; t = (t + 1) / 2)
+    {
+        if (common_prefix(keys, n, i, i + (s + t) * d) > delta_node)
+            s += t;
+        if (t == 1)
+            break;
+    }
+    int gamma = i + s * d + min(d, 0);
+    split[i] = gamma;
+
+    int first = min(i, j), last = max(i, j);
+    if (first == gamma)
+    {
+        struct AABB box = bounds[values[gamma]];
+        struct BVHNode leaf;
+        leaf.minx = box.minx, leaf.miny = box.miny, leaf.minz = box.minz;
+        leaf.maxx = box.maxx, leaf.maxy = box.maxy, leaf.maxz = box.maxz;
+        leaf.leftFirst = gamma, leaf.primCount = 1;
+        BVH[2 * gamma + 1] = leaf;
+        leaf_slot[gamma] = 2 * gamma + 1;
+    }
+    else
+        slot_of[gamma] = 2 * gamma + 1;
+
+    if (last == gamma + 1)
+    {
+        struct AABB box = bounds[values[gamma + 1]];
+        struct BVHNode leaf;
+        leaf.minx = box.minx, leaf.miny = box.miny, leaf.minz = box.minz;
+        leaf.maxx = box.maxx, leaf.maxy = box.maxy, leaf.maxz = box.maxz;
+        leaf.leftFirst = gamma + 1, leaf.primCount = 1;
+        BVH[2 * gamma + 2] = leaf;
+        leaf_slot[gamma + 1] = 2 * gamma + 2;
     }
-    return res;
-}
-
-__kernel void to_morton_codes(__global struct Tri* triData, __global uint3* target, uint count)
-{
-    int threadIdx = get_global_id( 0 );
-    int tri_idx = threadIdx % count;
-    struct Tri t = triData[tri_idx];
-    int3 val = convert_int3( (float3) (t.cx, t.cy, t.cz));
-    uint3 px = to_morton_part(val.x, 0);
-    uint3 py = to_morton_part(val.y, 1);
-    uint3 pz = to_morton_part(val.z, 2);
-    uint3 combined;
-    combined.x = px.x | py.x | pz.x;
-    combined.y = px.y | py.y | pz.y;
-    combined.z = px.x | py.z | pz.z;
-    target[tri_idx] = combined;
+    else
+        slot_of[gamma + 1] = 2 * gamma + 2;
+
+    if (i == 0)
+        slot_of[0] = 0;
+}
+
+__kernel void lbvh_link( __global const int* split, __global const int* slot_of, uint count,
+                         __global struct BVHNode* BVH, __global int* parent, __global uint* visits )
+{
+    int i = get_global_id(0);
+    if (i >= (int)count - 1)
+        return;
+    int node = slot_of[i], gamma = split[i];
+    BVH[node].leftFirst = 2 * gamma + 1;
+    BVH[node].primCount = 0;
+    parent[2 * gamma + 1] = node;
+    parent[2 * gamma + 2] = node;
+    visits[node] = 0;
+    if (node == 0)
+        parent[0] = -1;
+}
+
+__kernel void lbvh_fit( __global const int* leaf_slot, uint count, __global const int* parent,
+                        __global uint* visits, volatile __global struct BVHNode* BVH )
+{
+    uint id = get_global_id(0);
+    if (id >= count)
+        return;
+
+    int node = parent[leaf_slot[id]];
+    while (node >= 0)
+    {
+        // The first child to arrive stops, the second one sees both boxes
+        mem_fence(CLK_GLOBAL_MEM_FENCE);
+        if (atomic_inc(&visits[node]) == 0)
+            return;
+
+        int left = BVH[node].leftFirst, right = left + 1;
+        BVH[node].minx = fmin(BVH[left].minx, BVH[right].minx);
+        BVH[node].miny = fmin(BVH[left].miny, BVH[right].miny);
+        BVH[node].minz = fmin(BVH[left].minz, BVH[right].minz);
+        BVH[node].maxx = fmax(BVH[left].maxx, BVH[right].maxx);
+        BVH[node].maxy = fmax(BVH[left].maxy, BVH[right].maxy);
+        BVH[node].maxz = fmax(BVH[left].maxz, BVH[right].maxz);
+        node = parent[node];
+    }
+}
+
+__kernel void lbvh_gather( __global const struct Prim* prims_in, __global const uint* values, uint count,
+                           __global struct Prim* prims_out )
+{
+    uint id = get_global_id(0);
+    if (id < count)
+        prims_out[id] = prims_in[values[id]];
 }
@@ -0,0 +1,111 @@
+/*
+    IN THIS FILE you will find the lazy bvh build of --lazy-levels n. Only the top n levels of a bvh are built while
+    the scene loads. Every larger subtree below them is a lazy_node that holds the range of objects the subtree will
+    cover, and builds it the first time a ray enters its box. Subtrees that no ray reaches are never built.
+
+    The deferred subtrees are built by the same bvh_node code from the same sorted ranges, and put in the same
+    --layout, so the finished tree is the one an eager build makes and renders the same image. Anything that needs
+    the whole tree (the SAH cost, flattening for OpenCL, --tree-report) builds what is left.
+*/
+
+#ifndef LAZY_TREE_H
+#define LAZY_TREE_H
+
+#include "common.h"
+#include "accelerate.h"
+#include "flat_tree.h"
+#include "hittable.h"
+
+#include <atomic>
+#include <mutex>
+#include <string>
+
+//* LAZY NODE
+class lazy_node : public hittable {
+    public:
+        typedef std::vector<shared_ptr<hittable>> object_vector;
+
+        // `objects` is shared by all lazy nodes of a tree, each only ever sorts its own range of it. The subtree is
+        // put in `layout` once it is built
+        lazy_node(const shared_ptr<object_vector>& objects, size_t start, size_t end, const std::string& layout)
+            : objects(objects), start(start), end(end), layout(layout), ready(nullptr) {
+            for (size_t i = start; i < end; i++)
+                bbox = aabb(bbox, (*objects)[i]->bounding_box());
+        }
+
+        // Rays that miss the box do not build the subtree
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            const hittable* root = ready.load(std::memory_order_acquire);
+            if (!root) {
+                if (!bbox.hit(r, ray_t))
+                    return false;
+                root = &subtree();
+            }
+            return root->hit(r, ray_t, rec);
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        size_t structure_bytes() const override {
+            const hittable* root = ready.load(std::memory_order_acquire);
+            return sizeof(lazy_node) + (root ? root->structure_bytes() : 0);
+        }
+
+        size_t top_level_bytes() const override {
+            const hittable* root = ready.load(std::memory_order_acquire);
+            return sizeof(lazy_node) + (root ? root->top_level_bytes() : 0);
+        }
+
+        void flatten(std::vector<flat_primitive>& out) const override { subtree().flatten(out); }
+
+        // An unbuilt subtree only needs its box, it will be built from where the objects are by then
+        aabb refit() override {
+            std::lock_guard<std::mutex> lock(build_mutex);
+            if (built)
+                bbox = built->refit();
+            else {
+                bbox = aabb();
+                for (size_t i = start; i < end; i++)
+                    bbox = aabb(bbox, (*objects)[i]->refit());
+            }
+            return bbox;
+        }
+
+        double sah_cost(double parent_area) const override { return subtree().sah_cost(parent_area); }
+
+        // The subtree, built by the first thread to ask while the others wait for it
+        const hittable& subtree() const {
+            const hittable* root = ready.load(std::memory_order_acquire);
+            if (root)
+                return *root;
+            std::lock_guard<std::mutex> lock(build_mutex);
+            if (!built) {
+                built = with_layout(make_shared<bvh_node>(*objects, start, end), layout);
+                ready.store(built.get(), std::memory_order_release);
+            }
+            return *built;
+        }
+
+    private:
+        shared_ptr<object_vector> objects;
+        size_t start;
+        size_t end;
+        std::string layout;
+        aabb bbox;
+        mutable shared_ptr<hittable> built;
+        mutable std::atomic<const hittable*> ready;     // built.get() once it is safe to use without the lock
+        mutable std::mutex build_mutex;
+};
+
+// A bvh over `list`, with all but the top `levels` levels left to be built on demand in `layout`. 0 levels builds
+// the whole tree
+inline shared_ptr<hittable> make_bvh(hittable_list& list, int levels, const std::string& layout) {
+    if (levels <= 0)
+        return make_shared<bvh_node>(list);
+    auto objects = make_shared<lazy_node::object_vector>(list.objects);
+    return make_shared<bvh_node>(*objects, 0, objects->size(), levels, [objects, layout](size_t s, size_t e) {
+        return shared_ptr<hittable>(make_shared<lazy_node>(objects, s, e, layout));
+    });
+}
+
+#endif
@@ -0,0 +1,558 @@
+/*
+    IN THIS FILE you will find the levels of detail of --lod, for models that cover only a few pixels:
+
+    1) mesh_simplifier: quadric edge collapse (Garland and Heckbert, "Surface Simplification Using Quadric Error
+       Metrics", 1997). Every vertex sums the planes of its faces, weighted by their area, and planes through the
+       border edges keep holes open. The edge whose merged vertex is closest to all those planes goes first.
+       Collapses that would flip a face or pinch the surface are skipped
+    2) lod_set: the levels of one OBJ file, each with about a quarter of the triangles of the one before. They are
+       simplified once and cached as OBJ files in --lod-cache, and only built when an instance asks for them
+    3) selection: a triangle of a level should not be wider than --lod-detail pixels. With "instance" every MODEL
+       gets the level its distance to the camera asks for. With "ray" a lod_instance holds every level and takes
+       the level from the width of a ray cone where the ray reaches its box: the camera's pixel cone continued
+       through mirror bounces, as wide as the path from the camera through the ray's origin is long. Rays that
+       start inside the box of the instance, such as its own bounces, keep the level the camera sees, so they
+       leave the same surface they hit
+*/
+
+#ifndef LOD_H
+#define LOD_H
+
+#include "common.h"
+#include "build_options.h"
+#include "camera.h"
+#include "hittable.h"
+#include "metrics.h"
+#include "model.h"
+
+#include <cstdio>
+#include <queue>
+#include <string>
+#include <sys/stat.h>
+#ifdef _WIN32
+    #include <direct.h>
+#endif
+
+//* SIMPLIFICATION
+// Sum of squared distances to a set of planes, the symmetric 4x4 matrix stored as its upper triangle
+struct quadric {
+    double a[10] = {};      // 00 01 02 03 11 12 13 22 23 33
+
+    // The plane through `p` with unit normal `n`
+    static quadric plane(const vec3& n, const point& p, double weight) {
+        quadric q;
+        double d = -dot(n, p);
+        double v[4] = {n.x(), n.y(), n.z(), d};
+        int k = 0;
+        for (int i = 0; i < 4; i++)
+            for (int j = i; j < 4; j++)
+                q.a[k++] = weight * v[i] * v[j];
+        return q;
+    }
+
+    quadric& operator+=(const quadric& other) {
+        for (int i = 0; i < 10; i++)
+            a[i] += other.a[i];
+        return *this;
+    }
+
+    double error(const point& p) const {
+        double x = p.x(), y = p.y(), z = p.z();
+        return a[0] * x * x + 2 * a[1] * x * y + 2 * a[2] * x * z + 2 * a[3] * x + a[4] * y * y + 2 * a[5] * y * z +
+               2 * a[6] * y + a[7] * z * z + 2 * a[8] * z + a[9];
+    }
+
+    // The point of least error, false where the planes do not pin one down
+    bool minimum(point& p) const {
+        double det = a[0] * (a[4] * a[7] - a[5] * a[5]) - a[1] * (a[1] * a[7] - a[5] * a[2]) +
+                     a[2] * (a[1] * a[5] - a[4] * a[2]);
+        double scale = a[0] * a[4] * a[7];
+        if (std::fabs(det) <= 1e-9 * std::fabs(scale) || det == 0)
+            return false;
+        double b[3] = {-a[3], -a[6], -a[8]};
+        double x = (b[0] * (a[4] * a[7] - a[5] * a[5]) - a[1] * (b[1] * a[7] - a[5] * b[2]) +
+                    a[2] * (b[1] * a[5] - a[4] * b[2])) / det;
+        double y = (a[0] * (b[1] * a[7] - a[5] * b[2]) - b[0] * (a[1] * a[7] - a[5] * a[2]) +
+                    a[2] * (a[1] * b[2] - b[1] * a[2])) / det;
+        double z = (a[0] * (a[4] * b[2] - b[1] * a[5]) - a[1] * (a[1] * b[2] - b[1] * a[2]) +
+                    b[0] * (a[1] * a[5] - a[4] * a[2])) / det;
+        p = point(x, y, z);
+        return true;
+    }
+};
+
+class mesh_simplifier {
+    public:
+        // Border planes count this many times as much as face planes of the same size
+        static constexpr double border_weight = 100;
+
+        // Faces whose normal would turn by more than about 80 degrees block a collapse
+        static constexpr double min_normal_cosine = 0.2;
+
+        // Takes the mesh in the form of model::loadOBJ, faces with repeated vertices are dropped
+        mesh_simplifier(const std::vector<vec3>& vertices, const std::vector<vec3>& face_indices)
+            : positions(vertices), quadrics(vertices.size()), vertex_faces(vertices.size()),
+              versions(vertices.size(), 0), removed(vertices.size(), 0) {
+            for (const auto& f : face_indices) {
+                face t = {{int(f.x()), int(f.y()), int(f.z())}};
+                bool valid = t.v[0] != t.v[1] && t.v[1] != t.v[2] && t.v[0] != t.v[2];
+                for (int c = 0; c < 3; c++)
+                    valid = valid && t.v[c] >= 0 && size_t(t.v[c]) < vertices.size();
+                if (!valid)
+                    continue;
+                for (int c = 0; c < 3; c++)
+                    vertex_faces[t.v[c]].push_back(int(faces.size()));
+                faces.push_back(t);
+                dead.push_back(0);
+            }
+            live_faces = faces.size();
+
+            std::vector<std::pair<int, int>> edges;
+            for (size_t f = 0; f < faces.size(); f++) {
+                vec3 n = cross(positions[faces[f].v[1]] - positions[faces[f].v[0]],
+                               positions[faces[f].v[2]] - positions[faces[f].v[0]]);
+                double area = 0.5 * n.length();
+                if (area <= 0)
+                    continue;
+                quadric q = quadric::plane(n / (2 * area), positions[faces[f].v[0]], area);
+                for (int c = 0; c < 3; c++) {
+                    quadrics[faces[f].v[c]] += q;
+                    int a = faces[f].v[c], b = faces[f].v[(c + 1) % 3];
+                    edges.push_back(std::make_pair(std::min(a, b), std::max(a, b)));
+                }
+            }
+
+            // Edges of one face are on the border
+            std::sort(edges.begin(), edges.end());
+            for (size_t i = 0; i < edges.size();) {
+                size_t j = i;
+                while (j < edges.size() && edges[j] == edges[i])
+                    j++;
+                if (j - i == 1)
+                    add_border_plane(edges[i].first, edges[i].second);
+                i = j;
+            }
+            edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+            for (const auto& e : edges)
+                push(e.first, e.second);
+        }
+
+        size_t face_count() const { return live_faces; }
+
+        // Collapses edges until at most `target` faces are left or no edge can go without folding the mesh
+        void simplify(size_t target) {
+            while (live_faces > target && !queue.empty()) {
+                candidate c = queue.top();
+                queue.pop();
+                if (removed[c.v0] || removed[c.v1] || versions[c.v0] != c.version0 || versions[c.v1] != c.version1)
+                    continue;
+                collapse(c);
+            }
+        }
+
+        // The faces that are left, with the vertices they use renumbered from 0
+        void result(std::vector<vec3>& vertices, std::vector<vec3>& face_indices) const {
+            std::vector<int> index(positions.size(), -1);
+            vertices.clear();
+            face_indices.clear();
+            for (size_t f = 0; f < faces.size(); f++) {
+                if (dead[f])
+                    continue;
+                double v[3];
+                for (int c = 0; c < 3; c++) {
+                    int& i = index[faces[f].v[c]];
+                    if (i < 0) {
+                        i = int(vertices.size());
+                        vertices.push_back(positions[faces[f].v[c]]);
+                    }
+                    v[c] = i;
+                }
+                face_indices.push_back(vec3(v[0], v[1], v[2]));
+            }
+        }
+
+    private:
+        struct face {
+            int v[3];
+        };
+
+        struct candidate {
+            double cost;
+            int v0, v1;
+            int version0, version1;
+            point target;
+
+            bool operator>(const candidate& other) const { return cost > other.cost; }
+        };
+
+        std::vector<point> positions;
+        std::vector<quadric> quadrics;
+        std::vector<std::vector<int>> vertex_faces;
+        std::vector<int> versions;              // bumped whenever a vertex moves, older candidates are stale
+        std::vector<char> removed;
+        std::vector<face> faces;
+        std::vector<char> dead;
+        size_t live_faces = 0;
+        std::priority_queue<candidate, std::vector<candidate>, std::greater<candidate>> queue;
+
+        void add_border_plane(int a, int b) {
+            for (int f : vertex_faces[a]) {
+                const face& t = faces[f];
+                if (t.v[0] != b && t.v[1] != b && t.v[2] != b)
+                    continue;
+                vec3 edge = positions[b] - positions[a];
+                vec3 n = cross(edge, cross(positions[t.v[1]] - positions[t.v[0]], positions[t.v[2]] - positions[t.v[0]]));
+                if (n.length_squared() <= 0)
+                    return;
+                quadric q = quadric::plane(unit_vector(n), positions[a], border_weight * edge.length_squared());
+                quadrics[a] += q;
+                quadrics[b] += q;
+                return;
+            }
+        }
+
+        void push(int v0, int v1) {
+            quadric q = quadrics[v0];
+            q += quadrics[v1];
+            candidate c;
+            c.v0 = v0;
+            c.v1 = v1;
+            c.version0 = versions[v0];
+            c.version1 = versions[v1];
+            point options[3] = {positions[v0], positions[v1], 0.5 * (positions[v0] + positions[v1])};
+            c.target = options[2];
+            c.cost = infinity;
+            point optimum;
+            if (q.minimum(optimum)) {
+                c.target = optimum;
+                c.cost = q.error(optimum);
+            }
+            for (const point& p : options) {
+                double cost = q.error(p);
+                if (cost < c.cost) {
+                    c.cost = cost;
+                    c.target = p;
+                }
+            }
+            queue.push(c);
+        }
+
+        void neighbours(int v, std::vector<int>& out) const {
+            out.clear();
+            for (int f : vertex_faces[v])
+                if (!dead[f])
+                    for (int c = 0; c < 3; c++)
+                        if (faces[f].v[c] != v)
+                            out.push_back(faces[f].v[c]);
+            std::sort(out.begin(), out.end());
+            out.erase(std::unique(out.begin(), out.end()), out.end());
+        }
+
+        // Whether the faces around `v` that do not hold `other` keep their orientation once `v` moves to `target`
+        bool keeps_faces(int v, int other, const point& target) const {
+            for (int f : vertex_faces[v]) {
+                const face& t = faces[f];
+                if (dead[f] || t.v[0] == other || t.v[1] == other || t.v[2] == other)
+                    continue;
+                point p[3], q[3];
+                for (int c = 0; c < 3; c++) {
+                    p[c] = positions[t.v[c]];
+                    q[c] = t.v[c] == v ? target : p[c];
+                }
+                vec3 before = cross(p[1] - p[0], p[2] - p[0]), after = cross(q[1] - q[0], q[2] - q[0]);
+                double lengths = before.length() * after.length();
+                if (lengths <= 0 || dot(before, after) < min_normal_cosine * lengths)
+                    return false;
+            }
+            return true;
+        }
+
+        void collapse(const candidate& c) {
+            int v0 = c.v0, v1 = c.v1;
+
+            // The link condition: the two vertices share exactly the neighbours of the faces on their edge
+            std::vector<int> n0, n1, common;
+            neighbours(v0, n0);
+            neighbours(v1, n1);
+            std::set_intersection(n0.begin(), n0.end(), n1.begin(), n1.end(), std::back_inserter(common));
+            size_t shared = 0;
+            for (int f : vertex_faces[v0]) {
+                const face& t = faces[f];
+                if (!dead[f] && (t.v[0] == v1 || t.v[1] == v1 || t.v[2] == v1))
+                    shared++;
+            }
+            if (shared == 0 || common.size() != shared)
+                return;
+            if (!keeps_faces(v0, v1, c.target) || !keeps_faces(v1, v0, c.target))
+                return;
+
+            positions[v0] = c.target;
+            quadrics[v0] += quadrics[v1];
+            removed[v1] = 1;
+            versions[v0]++;
+            for (int f : vertex_faces[v1]) {
+                if (dead[f])
+                    continue;
+                face& t = faces[f];
+                if (t.v[0] == v0 || t.v[1] == v0 || t.v[2] == v0) {
+                    dead[f] = 1;
+                    live_faces--;
+                    continue;
+                }
+                for (int k = 0; k < 3; k++)
+                    if (t.v[k] == v1)
+                        t.v[k] = v0;
+                vertex_faces[v0].push_back(f);
+            }
+            vertex_faces[v1].clear();
+            auto& around = vertex_faces[v0];
+            around.erase(std::remove_if(around.begin(), around.end(), [&](int f) { return dead[f] != 0; }),
+                         around.end());
+
+            neighbours(v0, n0);
+            for (int n : n0)
+                push(std::min(v0, n), std::max(v0, n));
+        }
+};
+
+//* LEVELS
+class lod_set : public std::enable_shared_from_this<lod_set> {
+    public:
+        // Levels are not made below this many triangles
+        static const size_t min_triangles = 64;
+
+        // Finds the cached levels of the OBJ file at `path` or simplifies it, the levels are built by level(). The
+        // lod options say how many levels, where they are cached and how they are chosen: "instance" (one level per
+        // MODEL) or "ray" (a level per ray)
+        lod_set(const std::string& path, shared_ptr<material> mat, const char* structure_mode,
+                const build_options& options)
+            : path(path), mat(mat), structure_mode(structure_mode), options(options) {
+            std::string flat_name = path;
+            std::replace(flat_name.begin(), flat_name.end(), '/', '_');
+            paths.push_back(path);
+            for (int k = 1; k < options.max_lod_levels(); k++)
+                paths.push_back(options.lod_cache + "/" + flat_name + ".lod" + std::to_string(k) + ".obj");
+            if (!read_headers())
+                write_levels();
+            models.resize(counts.size());
+            placed.assign(counts.size(), 0);
+        }
+
+        int levels() const { return int(counts.size()); }
+        size_t triangles(int k) const { return counts[k]; }
+
+        // About the edge length of the mean triangle of level `k`
+        double triangle_size(int k) const { return size0 * std::sqrt(double(counts[0]) / counts[k]); }
+
+        // The coarsest level whose triangles are no wider than --lod-detail times `footprint`
+        int level_for(double footprint) const {
+            int k = 0;
+            while (k + 1 < levels() && triangle_size(k + 1) <= options.lod_detail * footprint)
+                k++;
+            return k;
+        }
+
+        // Level `k` with its structure, built the first time it is asked for
+        const shared_ptr<model>& level(int k) {
+            if (!models[k])
+                models[k] = make_shared<model>(paths[k].c_str(), mat, structure_mode.c_str(), options);
+            return models[k];
+        }
+
+        const std::vector<shared_ptr<model>>& built() const { return models; }
+
+        // The level `offset` is seen at from `cam`, as an instance, or with "ray" a lod_instance over all levels
+        shared_ptr<hittable> place(const vec3& offset, const camera& cam);
+
+        lod_metrics metrics() const {
+            lod_metrics m;
+            m.name = path;
+            m.triangles = counts;
+            m.instances = placed;
+            return m;
+        }
+
+    private:
+        std::string path;
+        shared_ptr<material> mat;
+        std::string structure_mode;
+        build_options options;
+        std::vector<std::string> paths;
+        std::vector<size_t> counts;
+        double size0 = 0;
+        aabb box0;
+        std::vector<shared_ptr<model>> models;
+        std::vector<size_t> placed;
+
+        // "# lod <level> of <path> <bytes> <mtime> <triangles of the full mesh> <their size> <their box>"
+        std::string header(int k) const {
+            struct stat info;
+            if (stat(path.c_str(), &info) != 0)
+                return "";
+            char line[512];
+            snprintf(line, sizeof(line), "# lod %d of %s %lld %lld %zu %.17g %.17g %.17g %.17g %.17g %.17g %.17g", k,
+                     path.c_str(), (long long)info.st_size, (long long)info.st_mtime, counts.empty() ? 0 : counts[0],
+                     size0, box0.x.min, box0.y.min, box0.z.min, box0.x.max, box0.y.max, box0.z.max);
+            return line;
+        }
+
+        // Takes the levels from the cache if every file there was made from the OBJ file as it is now
+        bool read_headers() {
+            counts.clear();
+            for (int k = 1; k < options.max_lod_levels(); k++) {
+                FILE* file = fopen(paths[k].c_str(), "r");
+                if (!file)
+                    break;
+                char first[512] = {}, counted[64] = {};
+                bool read = fgets(first, sizeof(first), file) && fgets(counted, sizeof(counted), file);
+                fclose(file);
+                size_t n0, n;
+                double s, lo[3], hi[3];
+                char name[256];
+                long long bytes, mtime;
+                int level;
+                if (!read || sscanf(first, "# lod %d of %255s %lld %lld %zu %lf %lf %lf %lf %lf %lf %lf", &level, name,
+                                    &bytes, &mtime, &n0, &s, &lo[0], &lo[1], &lo[2], &hi[0], &hi[1], &hi[2]) != 12 ||
+                    sscanf(counted, "# %zu triangles", &n) != 1 || level != k)
+                    return false;
+                if (counts.empty()) {
+                    counts.push_back(n0);
+                    size0 = s;
+                    box0 = aabb(point(lo[0], lo[1], lo[2]), point(hi[0], hi[1], hi[2]));
+                }
+                if (header(k) != std::string(first, strcspn(first, "\n")))
+                    return false;
+                counts.push_back(n);
+            }
+            // A mesh too small for any level has no files, it is read again to be sure
+            return !counts.empty() && counts.size() == paths.size();
+        }
+
+        void write_levels() {
+            std::vector<vec3> vertices, face_indices;
+            counts.assign(1, 0);
+            if (!model::loadOBJ(path.c_str(), vertices, face_indices))
+                return;
+            stopwatch timer;
+            counts[0] = face_indices.size();
+            double area = 0;
+            for (const auto& f : face_indices) {
+                const point &a = vertices[int(f.x())], &b = vertices[int(f.y())], &c = vertices[int(f.z())];
+                area += 0.5 * cross(b - a, c - a).length();
+                box0 = aabb(box0, aabb(aabb(a, b), aabb(c, c)));
+            }
+            size0 = counts[0] > 0 ? std::sqrt(2 * area / counts[0]) : 0;
+
+#ifdef _WIN32
+            _mkdir(options.lod_cache.c_str());
+#else
+            mkdir(options.lod_cache.c_str(), 0755);
+#endif
+            mesh_simplifier simplifier(vertices, face_indices);
+            for (int k = 1; k < options.max_lod_levels(); k++) {
+                size_t target = counts[k - 1] / 4;
+                if (target < min_triangles)
+                    break;
+                simplifier.simplify(target);
+                // Stops where the surface cannot lose more triangles without folding
+                if (simplifier.face_count() > counts[k - 1] * 3 / 4)
+                    break;
+                counts.push_back(simplifier.face_count());
+                simplifier.result(vertices, face_indices);
+                FILE* file = fopen(paths[k].c_str(), "w");
+                if (!file) {
+                    std::clog << "\rCould not write " << paths[k] << ", the level is left out" << std::endl;
+                    counts.pop_back();
+                    break;
+                }
+                fprintf(file, "%s\n# %zu triangles\n", header(k).c_str(), face_indices.size());
+                for (const auto& v : vertices)
+                    fprintf(file, "v %.9g %.9g %.9g\n", v.x(), v.y(), v.z());
+                for (const auto& f : face_indices)
+                    fprintf(file, "f %d %d %d\n", int(f.x()) + 1, int(f.y()) + 1, int(f.z()) + 1);
+                fclose(file);
+            }
+            paths.resize(counts.size());
+            std::clog << "\rSimplified " << path << " into " << counts.size() << " levels in " << timer.elapsed()
+                      << "s" << std::endl;
+        }
+};
+
+// Width of a pixel at distance 1 from the camera of `cam`, as the camera will be set up
+inline double pixel_angle(const camera& cam) {
+    double height = std::max(1, int(cam.width / cam.aspect_ratio));
+    return 2 * std::tan(degrees_to_radian(cam.vfov) / 2) / height;
+}
+
+inline double distance_to(const aabb& box, const point& p) {
+    double squared = 0;
+    for (int axis = 0; axis < 3; axis++) {
+        const interval& extent = box.axis_interval(axis);
+        double d = std::fmax(0.0, std::fmax(extent.min - p[axis], p[axis] - extent.max));
+        squared += d * d;
+    }
+    return std::sqrt(squared);
+}
+
+//* PER-RAY SELECTION
+class lod_instance : public hittable {
+    public:
+        lod_instance(const std::vector<shared_ptr<model>>& levels, shared_ptr<const lod_set> set, const vec3& offset,
+                     int camera_level, const point& eye, double pixel_angle)
+            : levels(levels), set(set), offset(offset), camera_level(camera_level), eye(eye), angle(pixel_angle) {
+            for (const auto& level : levels)
+                bbox = aabb(bbox, level->bounding_box() + offset);
+        }
+
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            double distance = distance_to(bbox, r.origin());
+            int k = distance > 0 ? set->level_for(((r.origin() - eye).length() + distance) * angle) : camera_level;
+            ray local(r.origin() - offset, r.direction());
+            if (!levels[k]->hit(local, ray_t, rec))
+                return false;
+            rec.p += offset;
+            return true;
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        size_t structure_bytes() const override {
+            return sizeof(lod_instance) + levels[camera_level]->structure_bytes();
+        }
+
+        // Backends without per-ray levels get the one the camera sees
+        void flatten(std::vector<flat_primitive>& out) const override {
+            size_t first = out.size();
+            levels[camera_level]->flatten(out);
+            for (size_t i = first; i < out.size(); i++) {
+                out[i].a += offset;
+                out[i].owner = this;
+            }
+        }
+
+        double sah_cost(double parent_area) const override { return levels[camera_level]->sah_cost(parent_area); }
+
+    private:
+        std::vector<shared_ptr<model>> levels;
+        shared_ptr<const lod_set> set;
+        vec3 offset;
+        int camera_level;
+        point eye;
+        double angle;
+        aabb bbox;
+};
+
+inline shared_ptr<hittable> lod_set::place(const vec3& offset, const camera& cam) {
+    double angle = pixel_angle(cam);
+    aabb box = (levels() > 1 ? box0 : level(0)->bounding_box()) + offset;
+    int k = level_for(distance_to(box, cam.lookfrom) * angle);
+    // With "ray" a copy holds every level, it is counted at the one the camera sees
+    placed[k]++;
+    if (options.lod != "ray")
+        return make_shared<instance>(level(k), offset);
+    for (int i = 0; i < levels(); i++)
+        level(i);
+    return make_shared<lod_instance>(models, shared_from_this(), offset, k, cam.lookfrom, angle);
+}
+
+#endif
@@ -1,310 +1,362 @@
 #include "common.h"
+#include "animation.h"
 #include "camera.h"
+#include "checkpoint.h"
+#include "cl_backend.h"
+#include "distributed.h"
 #include "hittable.h"
-
-#include <time.h>
+#include "metrics.h"
+#include "scene_bench.h"
+#include "server.h"
+#include "tree_report.h"
+
+#include <csignal>
+#include <cstdio>
+#include <functional>
 #include <stdlib.h>
 #include <vector>
-#ifdef __APPLE__
-    #include <OpenCL/cl.h>
-#elif defined _WIN32 || defined _WIN64
-    #include <CL/cl.h>
-#endif
 
-static std::string readStringFromFile(
-    const std::string& filename )
+// "output/image.ppm" -> "output/image_0007.ppm"
+static std::string numbered_path(const std::string& image_path, int number)
 {
-    std::ifstream is(filename, std::ios::binary);
-    if (!is.good()) {
-        printf("Couldn't open file '%s'!\n", filename.c_str());
-        return "";
-    }
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), "_%04d", number);
+    auto slash = image_path.find_last_of("/\\");
+    auto dot = image_path.find_last_of('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return image_path + suffix;
+    return image_path.substr(0, dot) + suffix + image_path.substr(dot);
+}
 
-    size_t filesize = 0;
-    is.seekg(0, std::ios::end);
-    filesize = (size_t)is.tellg();
-    is.seekg(0, std::ios::beg);
+// Renders every view with `render` against the world that is already built (or uploaded), one image per view
+static bool render_views(camera& cam, const std::vector<camera_view>& views, const settings& stng,
+                         render_metrics& metrics, const std::function<bool(camera&)>& render)
+{
+    stopwatch timer;
+    for (size_t i = 0; i < views.size(); i++) {
+        view_metrics v;
+        v.source = views[i].source;
+        v.image = numbered_path(stng.outfile, int(i));
+        unsigned long long rays = cam.primary_rays + cam.secondary_rays;
+
+        views[i].apply(cam);
+        std::clog << "Starting Render of view " << i << " (" << v.source << ") to " << v.image << std::endl;
+        timer.reset();
+        if (!render(cam))
+            return false;
+        v.render_seconds = timer.elapsed();
+        v.rays = cam.primary_rays + cam.secondary_rays - rays;
+        metrics.add_time("render", v.render_seconds);
+
+        timer.reset();
+        cam.write_image(v.image.c_str());
+        metrics.add_time("output", timer.elapsed());
+#ifdef COLLECT_STATS
+        if (stng.backend != "opencl")
+            cam.save_stats(v.image);
+#endif
+        metrics.views.push_back(v);
+    }
+    return true;
+}
 
-    std::string source{
-        std::istreambuf_iterator<char>(is),
-        std::istreambuf_iterator<char>() };
+// Renders on the first OpenCL device (GPUs first), the scene is uploaded once and every image read back at its end
+static bool render_opencl(camera& cam, const hittable& world, const std::vector<camera_view>& views,
+                          const settings& stng, render_metrics& metrics)
+{
+    stopwatch timer;
+    cl_backend backend;
+    backend.kernel_path = stng.kernels;
+    backend.cache_dir = stng.kernel_cache;
+    backend.builder = stng.cl_builder;
+    if (!backend.initialize())
+        return false;
+    metrics.add_time("opencl_setup", timer.elapsed());
 
-    return source;
+    timer.reset();
+    if (!backend.upload(world))
+        return false;
+    metrics.structures.push_back(backend.scene_metrics);
+    metrics.add_time("opencl_build", backend.scene_metrics.build_seconds);
+    metrics.add_time("upload", timer.elapsed() - backend.scene_metrics.build_seconds);
+
+    std::clog << "Starting OpenCL Render on " << backend.device_name << std::endl;
+    if (!views.empty())
+        return render_views(cam, views, stng, metrics, [&](camera& c) { return backend.render(c); });
+    timer.reset();
+    if (!backend.render(cam))
+        return false;
+    metrics.add_time("render", timer.elapsed());
+    return true;
 }
 
-struct Tri 
-{ 
-    float v0x, v0y, v0z;
-    float v1x, v1y, v1z;
-    float v2x, v2y, v2z;
-    float cx, cy, cz;
-};
-
-struct F3
+// Renders an animated sequence on the CPU: a share of the objects moves every frame, and the top-level structure over
+// them is refitted (and rebuilt when its SAH cost degrades) or rebuilt from scratch before the frame is rendered
+static void render_animation(camera& cam, hittable_list& objects, const settings& stng, render_metrics& metrics)
 {
-    float x, y, z;
-    float dummy;
-};
-
-F3 tof3(vec3 v){
-    F3 res;
-    res.x = v.x();
-    res.y = v.y();
-    res.z = v.z();
-    return res;
+    scene_animation animation(objects, stng.moving);
+    stopwatch timer;
+    build_options options = stng.build;
+    options.rays = auto_structure::expected_rays(cam, options);
+    dynamic_structure world(objects, stng.model, options);
+    world.policy = stng.update;
+    world.rebuild_threshold = stng.rebuild_threshold;
+
+    structure_metrics m;
+    m.name = "world";
+    m.primitives = objects.objects.size();
+    m.build_seconds = timer.elapsed();
+    m.bytes = world.top_level_bytes();
+    metrics.structures.push_back(m);
+    metrics.add_time("build", m.build_seconds);
+
+    std::clog << "\rAnimating " << animation.moving_objects() << " of " << objects.objects.size() << " objects over "
+              << stng.frames << " frames, " << stng.update << " between frames" << std::endl;
+    for (int frame = 0; frame < stng.frames; frame++) {
+        frame_metrics f;
+        f.frame = frame;
+        animation.apply(frame);
+        timer.reset();
+        if (frame > 0)
+            f.rebuilt = world.update();
+        f.update_seconds = timer.elapsed();
+        f.sah_cost = world.cost();
+
+        timer.reset();
+        cam.render(world);
+        f.render_seconds = timer.elapsed();
+        cam.write_image(numbered_path(stng.outfile, frame).c_str());
+
+        metrics.add_time("update", f.update_seconds);
+        metrics.add_time("render", f.render_seconds);
+        metrics.frames.push_back(f);
+        std::clog << "\rFrame " << frame << ": update " << f.update_seconds << "s" << (f.rebuilt ? " (rebuilt)" : "")
+                  << ", SAH cost " << f.sah_cost << ", render " << f.render_seconds << "s              " << std::endl;
+    }
 }
 
-bool loadOBJ(const char* path, Tri *tris) {
-    FILE* file = fopen(path, "r");
-    if (file == NULL)
-        return false;
+// Set by SIGINT or SIGTERM, a progressive render then saves its checkpoint after the current pass and stops
+static volatile std::sig_atomic_t stop_requested = 0;
 
-    std::vector<vec3> vertices;
-    int i =0;
-    while (true) {
-        char lineHeader[128];
-        int res = fscanf(file, "%s", lineHeader);
-        if (res == EOF)
-            break;
-
-        if (strcmp(lineHeader, "v") == 0) {
-            double x, y, z;
-            fscanf(file, "%lf %lf %lf\n", &x, &y, &z);
-            vertices.push_back(vec3(x, y, z));
-        } else if (strcmp(lineHeader, "f") == 0) {
-            unsigned int v1, v2, v3;
-            fscanf(file, "%d %d %d\n", &v1, &v2, &v3);
-            Tri t;
-            t.v0x = vertices[v1].x();
-            t.v0y = vertices[v1].y();
-            t.v0z = vertices[v1].z();
-            t.v1x = vertices[v2].x();
-            t.v1y = vertices[v2].y();
-            t.v1z = vertices[v2].z();
-            t.v2x = vertices[v3].x();
-            t.v2y = vertices[v3].y();
-            t.v2z = vertices[v3].z();
-            t.cx = (t.v0x + t.v1x + t.v2x) / 3;
-            t.cy = (t.v0y + t.v1y + t.v2y) / 3;
-            t.cz = (t.v0z + t.v1z + t.v2z) / 3;
-            tris[i] = t;
-            i++;
+static void request_stop(int) { stop_requested = 1; }
+
+// Adds pass after pass of samples to the sums of a checkpoint, new or resumed. A preview is written after every pass,
+// the checkpoint at intervals, after the last pass and when the process is asked to stop. False once stopped early
+static bool render_progressive(camera& cam, const hittable& world, const settings& stng, render_metrics& metrics)
+{
+    std::string path = stng.checkpoint;
+    if (path.empty())
+        path = stng.resume.empty() ? render_checkpoint::path_for(stng.outfile) : stng.resume;
+    bool saving = path != "off";
+
+    cam.initialize();
+    render_checkpoint state;
+    state.fingerprint = render_checkpoint::fingerprint_of(stng.infile, cam, stng.integrator, stng.build);
+    if (!stng.resume.empty()) {
+        render_checkpoint saved;
+        if (!saved.load(stng.resume))
+            return false;
+        if (saved.fingerprint != state.fingerprint) {
+            std::clog << "Checkpoint " << stng.resume << " belongs to another render:\n  " << saved.fingerprint
+                      << "\nnot\n  " << state.fingerprint << std::endl;
+            return false;
         }
+        state = saved;
+        metrics.resumed_samples = int(state.samples);
+        std::clog << "Resuming from " << stng.resume << " at " << state.samples << " samples per pixel" << std::endl;
+    } else {
+        state.width = cam.width;
+        state.height = cam.height;
+        state.sums.assign(size_t(cam.width) * cam.height, color(0, 0, 0));
     }
-    std::cout << "tri size:" << sizeof(Tri) << std::endl;
-    std::cout << "tri count:" << i << std::endl;
-    fclose(file);
 
+    std::signal(SIGINT, request_stop);
+    std::signal(SIGTERM, request_stop);
+    int pass = stng.pass_samples > 0 ? stng.pass_samples : 1;
+    stopwatch timer, since_saved;
+    do {
+        int count = std::min(pass, cam.samples_per_pixel - int(state.samples));
+        if (count > 0) {
+            timer.reset();
+            cam.render_samples(world, 0, 0, cam.width, cam.height, state.samples, count, state.sums);
+            state.samples += count;
+            metrics.add_time("render", timer.elapsed());
+        }
+
+        // The same scaling as camera::render_pixel, so the last pass writes the image render() would
+        timer.reset();
+        double scale = 1.0 / std::max(1u, state.samples);
+        cam.framebuffer.resize(state.sums.size());
+        for (size_t i = 0; i < state.sums.size(); i++)
+            cam.framebuffer[i] = scale * state.sums[i];
+        cam.write_image(stng.outfile.c_str());
+        metrics.add_time("output", timer.elapsed());
+        std::clog << "\rPass done: " << state.samples << '/' << cam.samples_per_pixel << " samples per pixel    "
+                  << std::flush;
+
+        bool last = int(state.samples) >= cam.samples_per_pixel || stop_requested;
+        if (saving && (last || since_saved.elapsed() >= stng.checkpoint_interval)) {
+            timer.reset();
+            state.save(path);
+            metrics.add_time("checkpoint", timer.elapsed());
+            since_saved.reset();
+        }
+    } while (int(state.samples) < cam.samples_per_pixel && !stop_requested);
+    std::clog << std::endl;
+
+    std::signal(SIGINT, SIG_DFL);
+    std::signal(SIGTERM, SIG_DFL);
+    if (stop_requested) {
+        std::clog << "Stopped at " << state.samples << " samples per pixel"
+                  << (saving ? ", resume with --resume " + path : "") << std::endl;
+        return false;
+    }
     return true;
 }
 
 int main(int argc, char* argv[])
 {
+    // Get flags
     settings stng = parse_args(argc, argv);
+    if (!stng.build.valid())
+        return 1;
+    if (!stng.benchmark.empty())
+        return run_scene_benchmark(argv[0], stng) != 0 ? 1 : 0;
+    if (!stng.server.empty())
+        return run_render_server(stng) ? 0 : 1;
+    if (!stng.workers.empty() || stng.local_workers > 0)
+        return run_coordinator(argv[0], stng) ? 0 : 1;
     std::clog << "Building " << stng.infile << " with " << stng.model << " structure." << std::endl;
 
-    // Start clock counter
-    auto clkStart = clock();
+    // Start wall-clock timer
+    stopwatch total;
+    render_metrics metrics;
 
     // Initialize Camera
     camera cam;
+    cam.threads = stng.threads;
+    cam.sampler_type = stng.sampler;
+    cam.iterative = stng.integrator != "recursive";
+    cam.rr_depth = stng.rr_depth;
+    // Out-of-core meshes page clusters in for whole batches of rays
+    cam.batch_rays = stng.ray_batch > 0 ? stng.ray_batch : (stng.build.out_of_core.empty() ? 0 : 1 << 16);
+    if (cam.batch_rays > 0 && !cam.iterative)
+        std::clog << "Batched rays use the iterative integrator" << std::endl;
+    if (!stng.build.out_of_core.empty() && stng.frames > 0)
+        std::clog << "Animated sequences load their models into memory" << std::endl;
+    if (stng.build.lod != "off" && stng.frames > 0)
+        std::clog << "Animated sequences render their models at full detail" << std::endl;
 
     // Read in .trace file
     std::clog << "Loading Scene..." << std::flush;
-    hittable_list world = load_scene(cam, stng.infile.c_str(), stng.model.c_str());
-    Tri tris[508];
-    loadOBJ("models/duck.obj", tris);
-    int n_tris = 508;
-    std::cout <<"n_tris:"<< n_tris << std::endl;
-    
-    cam.initialize();
-    auto clkBuild = clock();
-    std::clog <<"\rBuilding Done in "<< double(clkBuild - clkStart) / CLOCKS_PER_SEC << "s !                " << std::endl;
-
-
-    cl_int status = CL_SUCCESS;
-    cl_uint numPlatforms = 0;
-    cl_platform_id *platforms = NULL;
-    size_t numNames = 0;
-
-    status = clGetPlatformIDs(0, NULL, &numPlatforms);
-    platforms = (cl_platform_id*) malloc(numPlatforms*sizeof(cl_platform_id));
-    status = clGetPlatformIDs(numPlatforms, platforms, NULL);
-
-    status = clGetPlatformInfo(platforms[0], CL_PLATFORM_NAME, 0, NULL, &numNames);
-    char Name[numNames];
-    status = clGetPlatformInfo(platforms[0], CL_PLATFORM_NAME, sizeof(Name), Name, NULL);
-
-    cl_uint numDevices;
-    status = clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_ALL, 0, NULL, &numDevices);
-    cl_device_id *devices = NULL;
-    devices = (cl_device_id*) malloc(numDevices*sizeof(cl_device_id));
-    status = clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_ALL, numDevices, devices, NULL);
-
-    status = clGetDeviceInfo(devices[0], CL_DEVICE_NAME, 0, NULL, &numNames);
-    char deviceName[numNames];
-    status = clGetDeviceInfo(devices[0], CL_DEVICE_NAME, sizeof(deviceName), deviceName, NULL);
-
-    printf("Name of platform: %s\n", Name);
-    printf("Name of device: %s\n", deviceName);
-
-    cl_context context = clCreateContext(NULL, numDevices, devices, NULL, NULL, &status);
-    if (status != CL_SUCCESS)
-        std::cout << "CONTEXT: " << status << std::endl;
-
-    cl_command_queue queue = clCreateCommandQueue(context, devices[0], 0, &status);
-    if (status != CL_SUCCESS)
-        std::cout << "QUEUE: " << status << std::endl;
-
-    int n_pixels = cam.width * cam.height;
-    int out_img_size = n_pixels * sizeof(unsigned int);
-    // int out_img_size = cam.width * cam.height * 4;
-    std::cout << "Size: " << n_pixels << std::endl;
-    cl_mem out_img = clCreateBuffer(context, CL_MEM_WRITE_ONLY, out_img_size, NULL, &status);
-    cl_mem tri_buff = clCreateBuffer(context, CL_MEM_READ_ONLY, n_tris * sizeof(Tri), NULL, &status);
-    if (status != CL_SUCCESS)
-        std::cout << "BUFFER: " << status << std::endl;
-    status = clEnqueueWriteBuffer(queue, tri_buff, CL_TRUE, 0, sizeof(Tri)*n_tris, tris, 0, NULL, NULL);
-    Tri tris2[2];
-    tris2[0].cx = 1;
-    tris2[0].cy = 1;
-    tris2[0].cz = 1;
-    tris2[1].cx = 2;
-    tris2[1].cy = 2;
-    tris2[1].cz = 2;
-    uint codes[8];
-    cl_mem out_codes = clCreateBuffer(context, CL_MEM_WRITE_ONLY, 2 * 4 * sizeof(uint), NULL, &status);
-    cl_mem tri_buff2 = clCreateBuffer(context, CL_MEM_READ_ONLY, 2 * sizeof(Tri), NULL, &status);
-    if (status != CL_SUCCESS)
-        std::cout << "BUFFER: " << status << std::endl;
-    status = clEnqueueWriteBuffer(queue, tri_buff2, CL_TRUE, 0, sizeof(Tri)*2, tris2, 0, NULL, NULL);
-    if (status != CL_SUCCESS)
-        std::cout << "ENQUEUE: " << status << std::endl;
-
-    std::string s =readStringFromFile("src/kernels.cl");
-    const char* kernelSource = s.c_str();
-
-
-    cl_program program = clCreateProgramWithSource(context, 1, &kernelSource, NULL, &status);
-    if (status != CL_SUCCESS)
-        std::cout << "PROGRAM: " << status << std::endl;
-
-    status = clBuildProgram(program, 1, &(devices[0]), NULL, NULL, NULL);
-    if (status != CL_SUCCESS){
-        std::cout << "BUILD: " << status << std::endl;
-        // Determine the size of the log
-        size_t log_size;
-        clGetProgramBuildInfo(program, devices[0], CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
-
-        // Allocate memory for the log
-        char *log = (char *) malloc(log_size);
-
-        // Get the log
-        clGetProgramBuildInfo(program, devices[0], CL_PROGRAM_BUILD_LOG, log_size, log, NULL);
-
-        // Print the log
-        printf("%s\n", log);
+    hittable_list objects;
+    bool animated = stng.frames > 0 && stng.tree_report.empty();
+    hittable_list world = load_scene(cam, stng.infile.c_str(), stng.model.c_str(), stng.build, &metrics,
+                                     animated ? &objects : nullptr);
+    std::clog <<"\rBuilding Done in "<< total.elapsed() << "s !                " << std::endl;
+    if (!stng.tree_report.empty())
+        return save_tree_reports(stng.tree_report, world, metrics, stng.build) ? 0 : 1;
+    if (stng.spp > 0)
+        cam.samples_per_pixel = stng.spp;
+    bool progressive = stng.pass_samples > 0 || !stng.resume.empty();
+
+    // Cameras of a multi-view batch, all rendered against the world built above
+    std::vector<camera_view> views;
+    if (!stng.views.empty()) {
+        if (stng.frames > 0)
+            std::clog << "Animated sequences ignore --views" << std::endl;
+        else if (!load_views(stng.views, views) || views.empty())
+            return 1;
+        else
+            std::clog << "Rendering " << views.size() << " views from " << stng.views << std::endl;
+    }
+
+    // Run Renderer
+    stopwatch timer;
+    io_counters io_before = io_counters::now();
+    const std::string& layout = stng.build.layout;
+    if (stng.layout_profile > 0 && layout != "pointer" && layout != "quantized" && stng.backend == "cpu") {
+        std::clog << "Profiling the " << layout << " layout..." << std::flush;
+        profile_layouts(cam, world, stng.layout_profile);
+        metrics.add_time("layout_profile", timer.elapsed());
+        std::clog << "\rProfiled the " << layout << " layout in " << timer.elapsed() << "s" << std::endl;
+        timer.reset();
     }
-    status = clGetProgramBuildInfo(program, devices[0], CL_PROGRAM_BUILD_LOG, 0, NULL, NULL);
-    if (status != CL_SUCCESS)
-       std::cout << "BUILDINFO: " << status << std::endl;
-
-    cl_kernel kernel = clCreateKernel(program, "render", &status);
-    if (status != CL_SUCCESS)
-       std::cout << "KERNEL: " << status << std::endl;
-
-    cl_kernel kernel2 = clCreateKernel(program, "to_morton_codes", &status);
-    if (status != CL_SUCCESS)
-       std::cout << "KERNEL: " << status << std::endl;
-    clSetKernelArg(kernel2, 0, sizeof(cl_mem), (void*)&tri_buff2);
-    clSetKernelArg(kernel2, 1, sizeof(cl_mem), (void*)&out_codes);
-    uint count2 = 2;
-    clSetKernelArg(kernel2, 2, sizeof(unsigned int), (void*)&count2);
-       
-    clSetKernelArg(kernel, 0, sizeof(cl_mem), (void*)&tri_buff);
-    clSetKernelArg(kernel, 1, sizeof(cl_mem), (void*)&out_img);
-    clSetKernelArg(kernel, 2, sizeof(unsigned int), (void*)&cam.width);
-    clSetKernelArg(kernel, 3, sizeof(unsigned int), (void*)&cam.height);
-    F3 camO = tof3(cam.lookfrom);
-    F3 camtl = tof3(cam.pixel00_loc);
-    F3 camdu = tof3(cam.pixel_delta_u);
-    F3 camdv = tof3(cam.pixel_delta_v);
-    clSetKernelArg(kernel, 4, sizeof(F3), (void*)&camO);
-    clSetKernelArg(kernel, 5, sizeof(F3), (void*)&camtl);
-    clSetKernelArg(kernel, 6, sizeof(F3), (void*)&camdu);
-    clSetKernelArg(kernel, 7, sizeof(F3), (void*)&camdv);
-    std::cout << "dx.x" << cam.pixel_delta_u.x() << std::endl;
-    std::cout << "dx.y" << cam.pixel_delta_u.y() << std::endl;
-    std::cout << "dx.z" << cam.pixel_delta_u.z() << std::endl;
-    std::cout << "dy" << cam.pixel_delta_v << std::endl;
-    std::cout << "from" << cam.lookfrom << std::endl;
-    std::cout << "00" << cam.pixel00_loc << std::endl;
-
-    size_t global_size = n_pixels;
-    clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &global_size, NULL, 0, NULL, NULL);
-    unsigned int out_img_cpu[n_pixels];
-    size_t global_size2 = 2;
-    clEnqueueNDRangeKernel(queue, kernel2, 1, NULL, &global_size2, NULL, 0, NULL, NULL);
-    clEnqueueReadBuffer(queue, out_img, CL_TRUE, 0, out_img_size, out_img_cpu, 0, NULL, NULL);
-    clEnqueueReadBuffer(queue, out_codes, CL_TRUE, 0, 8*sizeof(uint), codes, 0, NULL, NULL);
-
-    clReleaseMemObject(out_img);
-    clReleaseKernel(kernel);
-    clReleaseProgram(program);
-    clReleaseCommandQueue(queue);
-    clReleaseContext(context);
-
-    for (int i = 0; i < 8; i++){
-        std::cout << "codes: " << codes[i] << std::endl;
+    if (stng.frames > 0) {
+        if (stng.backend != "cpu")
+            std::clog << "Animated sequences render on the CPU" << std::endl;
+        render_animation(cam, objects, stng, metrics);
+    } else if (progressive) {
+        if (stng.backend != "cpu" || !views.empty())
+            std::clog << "Progressive renders are single views on the CPU" << std::endl;
+        if (!render_progressive(cam, world, stng, metrics))
+            return 1;
+    } else if (stng.backend == "opencl") {
+        if (!render_opencl(cam, world, views, stng, metrics))
+            return 1;
+    } else if (!views.empty()) {
+        render_views(cam, views, stng, metrics, [&](camera& c) { c.render(world); return true; });
+    } else {
+        std::clog << "Starting Render to " << stng.outfile << std::endl;
+        // From the start of the run, so lazily built subtrees and the build up front are both in it
+        cam.on_tile = [&](int, int, int, int) {
+            if (metrics.time("first_tile") == 0)
+                metrics.add_time("first_tile", total.elapsed());
+        };
+        cam.render(world);
+        cam.on_tile = nullptr;
+        metrics.add_time("render", timer.elapsed());
     }
-    std::ofstream image(stng.outfile);
-
-    image << "P3\n" << cam.width << ' ' << cam.height << "\n255\n";
-    for (int i = 0; i < n_pixels; i++){
-        int c = out_img_cpu[i];
-        int r, g, b;
-        r = (c >> 16) & 255;
-        g = (c >> 8) & 255;
-        b = c & 255;
-        image << r << ' ' << g << ' ' << b << '\n';
-        image.flush();
+    std::clog << "\rRendering Done in " << metrics.time("render") << "s !                        " << std::endl;
+    collect_paging(world, metrics);
+    if (!metrics.paging.empty())
+        metrics.render_io = io_counters::now().since(io_before);
+
+    // Animated frames, views and progressive passes were written as they were rendered
+    if (stng.frames == 0 && views.empty() && !progressive) {
+        timer.reset();
+        cam.write_image(stng.outfile.c_str());
+        metrics.add_time("output", timer.elapsed());
     }
-    image.close();
 
-    auto clkFinish = clock();
-    std::clog << "Total Clock Time: " << double(clkFinish - clkStart) / CLOCKS_PER_SEC << "s" << std::endl;
-    return 0;
+    // Error against a converged reference render, to compare samplers at equal sample counts
+    if (!stng.reference.empty() && views.empty()) {
+        int ref_width, ref_height;
+        std::vector<color> reference;
+        if (read_ppm(stng.reference, ref_width, ref_height, reference) && ref_width == cam.width &&
+            ref_height == cam.height) {
+            metrics.reference = stng.reference;
+            metrics.rmse = image_rmse(cam.framebuffer, reference);
+        } else {
+            std::clog << "Could not compare against reference " << stng.reference << std::endl;
+        }
+    }
 
-    // // Get flags
-    // settings stng = parse_args(argc, argv);
-    // std::clog << "Building " << stng.infile << " with " << stng.model << " structure." << std::endl;
-    //
-    // // Start clock counter
-    // auto clkStart = clock();
-    //
-    // // Initialize Camera
-    // camera cam;
-    //
-    // // Read in .trace file
-    // std::clog << "Loading Scene..." << std::flush;
-    // hittable_list world = load_scene(cam, stng.infile.c_str(), stng.model.c_str());
-    // auto clkBuild = clock();
-    // std::clog <<"\rBuilding Done in "<< double(clkBuild - clkStart) / CLOCKS_PER_SEC << "s !                " << std::endl;
-    //
-    // // Run Renderer
-    // std::clog << "Starting Render to " << stng.outfile << std::endl;
-    // cam.render(world, stng.outfile.c_str());
-    // auto clkRender = clock();
-    // std::clog << "\rRendering Done in " << double(clkRender - clkBuild) / CLOCKS_PER_SEC << "s !                        " << std::endl;
-    //
-    // // Save traversal statistics
-    // std::clog << "Starting Stat Collection." << std::endl;
-    // cam.save_stats(stng.outfile);
-    // auto clkFinish = clock();
-    // std::clog << "\rStat Collection Done in " << double(clkFinish - clkRender) / CLOCKS_PER_SEC << "s !                         " << std::endl;
-    //
-    // // End clock counter    
-    // std::clog << "Total Clock Time: " << double(clkFinish - clkStart) / CLOCKS_PER_SEC << "s" << std::endl;
-    //
-    // return 0;
+#ifdef COLLECT_STATS
+    // Save traversal statistics, the OpenCL kernels do not record any and views saved their own
+    if (stng.backend != "opencl" && views.empty()) {
+        std::clog << "Starting Stat Collection." << std::endl;
+        timer.reset();
+        cam.save_stats(stng.outfile);
+        metrics.add_time("stats", timer.elapsed());
+        metrics.mean_traversal_steps = cam.stats->rendered_mean(cam.stats->n_traversal_steps);
+        metrics.mean_intersection_tests = cam.stats->rendered_mean(cam.stats->n_intersection_tests);
+        std::clog << "\rStat Collection Done in " << metrics.time("stats") << "s !                         " << std::endl;
+    }
+#endif
+
+    metrics.width = cam.width;
+    metrics.height = cam.height;
+    metrics.samples_per_pixel = cam.samples_per_pixel;
+    metrics.sampler = cam.sampler_type;
+    metrics.integrator = stng.integrator;
+    metrics.layout = stng.build.layout;
+    metrics.backend = stng.frames > 0 ? "cpu" : stng.backend;
+    metrics.primary_rays = cam.primary_rays;
+    metrics.secondary_rays = cam.secondary_rays;
+    metrics.add_time("total", total.elapsed());
+    metrics.print();
+    metrics.save_json(render_metrics::json_path_for(stng.outfile));
+
+    return 0;
 }
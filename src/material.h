@@ -3,30 +3,43 @@
 
 #include "hittable.h"
 
+// Plain copy of a material, for backends that keep their own version of the scene
+struct flat_material {
+    enum material_type { NONE, LAMBERTIAN, METAL, DIELECTRIC };
+
+    material_type type = NONE;
+    color albedo;
+    double param = 0;           // metal: fuzz, dielectric: refraction index
+};
+
 class material {
     public:
         virtual ~material() = default;
 
-        virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const {
+        virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& samples) const {
             return false;
         }
+
+        virtual flat_material flatten() const { return flat_material(); }
 };
 
 class lambertian : public material {
     public:
         lambertian(const color& albedo) : albedo(albedo) {}
 
-        bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override {
-            auto scattered_direction = rec.normal + random_unit_vector();
-
-            if (scattered_direction.near_zero())
-                scattered_direction = rec.normal;
-
-            scattered = ray(rec.p, scattered_direction);
+        bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& samples) const override {
+            scattered = ray(rec.p, random_cosine_direction(rec.normal, samples));
             attenuation = albedo;
             return true;
         }
 
+        flat_material flatten() const override {
+            flat_material flat;
+            flat.type = flat_material::LAMBERTIAN;
+            flat.albedo = albedo;
+            return flat;
+        }
+
     private:
         color albedo;
 };
@@ -35,13 +48,21 @@ class metal : public material {
     public:
         metal(const color& albedo, double fuzz) : albedo(albedo), fuzz((fuzz < 1) ? fuzz : 1) {}
 
-        bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override {
+        bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& samples) const override {
             vec3 reflected = reflect(r_in.direction(), rec.normal);
-            reflected = unit_vector(reflected) + (fuzz * random_unit_vector());
+            reflected = unit_vector(reflected) + (fuzz * random_unit_vector(samples));
             scattered = ray(rec.p, reflected);
             attenuation = albedo;
             return (dot(scattered.direction(), rec.normal) > 0);
         }
+
+        flat_material flatten() const override {
+            flat_material flat;
+            flat.type = flat_material::METAL;
+            flat.albedo = albedo;
+            flat.param = fuzz;
+            return flat;
+        }
     private:
         color albedo;
         double fuzz;
@@ -51,7 +72,7 @@ class dielectric : public material {
     public:
         dielectric(double refraction_index) : refraction_index(refraction_index) {}
 
-        bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override {
+        bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& samples) const override {
             attenuation = color(1.0, 1.0, 1.0);
             double ri = rec.front_face ? (1.0/refraction_index) : refraction_index;
 
@@ -62,7 +83,7 @@ class dielectric : public material {
             bool cannot_refract = ri * sin_theta > 1.0;
             vec3 direction;
 
-            if (cannot_refract || reflectance(cos_theta, ri) > random_double())
+            if (cannot_refract || reflectance(cos_theta, ri) > samples.get_1d())
                 direction = reflect(unit_direction, rec.normal);
             else
                 direction = refract(unit_direction, rec.normal, ri);
@@ -70,6 +91,14 @@ class dielectric : public material {
             scattered = ray(rec.p, direction);
             return true;
         }
+
+        flat_material flatten() const override {
+            flat_material flat;
+            flat.type = flat_material::DIELECTRIC;
+            flat.albedo = color(1.0, 1.0, 1.0);
+            flat.param = refraction_index;
+            return flat;
+        }
     private:
         double refraction_index;
 
@@ -0,0 +1,351 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "common.h"
+
+#include <chrono>
+#include <string>
+#include <utility>
+#include <vector>
+#ifndef _WIN32
+    #include <sys/resource.h>
+#endif
+
+// Monotonic wall-clock timer, unlike clock() this keeps counting real time once several threads render
+class stopwatch {
+    public:
+        stopwatch() { reset(); }
+
+        void reset() { start = std::chrono::steady_clock::now(); }
+
+        double elapsed() const {
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+    private:
+        std::chrono::steady_clock::time_point start;
+};
+
+// Peak resident set size of this process in bytes (0 where the platform does not report it)
+inline size_t peak_memory_bytes() {
+#ifdef _WIN32
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+    #ifdef __APPLE__
+        return size_t(usage.ru_maxrss);
+    #else
+        return size_t(usage.ru_maxrss) * 1024;
+    #endif
+#endif
+}
+
+// Page faults and bytes read from storage by this process so far (-1 where the platform does not report them)
+struct io_counters {
+    long major_faults = -1;
+    long minor_faults = -1;
+    long long read_bytes = -1;
+
+    static io_counters now() {
+        io_counters io;
+#ifndef _WIN32
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) == 0) {
+            io.major_faults = usage.ru_majflt;
+            io.minor_faults = usage.ru_minflt;
+        }
+        std::ifstream proc("/proc/self/io");
+        std::string key;
+        long long value;
+        while (proc >> key >> value)
+            if (key == "read_bytes:")
+                io.read_bytes = value;
+#endif
+        return io;
+    }
+
+    io_counters since(const io_counters& start) const {
+        io_counters d;
+        d.major_faults = major_faults >= 0 && start.major_faults >= 0 ? major_faults - start.major_faults : -1;
+        d.minor_faults = minor_faults >= 0 && start.minor_faults >= 0 ? minor_faults - start.minor_faults : -1;
+        d.read_bytes = read_bytes >= 0 && start.read_bytes >= 0 ? read_bytes - start.read_bytes : -1;
+        return d;
+    }
+};
+
+struct frame_metrics {
+    int frame = 0;
+    double update_seconds = 0;
+    double render_seconds = 0;
+    double sah_cost = 0;
+    bool rebuilt = false;
+};
+
+struct view_metrics {
+    std::string source;
+    std::string image;
+    double render_seconds = 0;
+    unsigned long long rays = 0;
+};
+
+struct worker_metrics {
+    std::string address;
+    size_t units = 0;
+    double busy_seconds = 0;
+    bool failed = false;
+};
+
+struct structure_metrics {
+    std::string name;
+    std::string mode;                   // only where -m auto chose the structure
+    size_t primitives = 0;
+    size_t references = 0;              // leaf references, more than the primitives where an SBVH split them
+    double load_seconds = 0;
+    double build_seconds = 0;
+    size_t bytes = 0;
+};
+
+// Clusters of one out-of-core mesh that were paged in and out
+struct paging_metrics {
+    std::string name;
+    size_t clusters = 0;
+    size_t file_bytes = 0;
+    size_t budget_bytes = 0;
+    unsigned long long page_ins = 0;
+    unsigned long long evictions = 0;
+    unsigned long long bytes_paged = 0;
+    unsigned long long cluster_visits = 0;  // a cluster entered for a group of rays, or for a single one
+    unsigned long long ray_visits = 0;      // rays traced through a cluster
+
+    double rays_per_page_in() const { return page_ins > 0 ? double(ray_visits) / page_ins : 0; }
+};
+
+// Levels of detail of one model, see --lod
+struct lod_metrics {
+    std::string name;
+    std::vector<size_t> triangles;          // per level, the full mesh first
+    std::vector<size_t> instances;          // placed at each level, with "ray" at the one the camera sees
+};
+
+// Everything we measure about one render, written as JSON next to the image
+class render_metrics {
+    public:
+        std::string scene;
+        std::string mode;
+        std::string layout = "dfs";
+        std::string backend = "cpu";
+        int width = 0;
+        int height = 0;
+        int samples_per_pixel = 0;
+        unsigned long long primary_rays = 0;
+        unsigned long long secondary_rays = 0;
+        double mean_traversal_steps = -1;    // Only known in the research build
+        double mean_intersection_tests = -1;
+        std::string sampler;
+        std::string integrator;
+        std::string reference;
+        double rmse = -1;                    // Only known when rendering against a reference image
+        int resumed_samples = 0;             // Samples per pixel taken from a checkpoint instead of rendered
+        std::vector<structure_metrics> structures;
+        std::vector<frame_metrics> frames;  // Only for animated sequences
+        std::vector<view_metrics> views;    // Only for multi-view batches
+        std::vector<worker_metrics> workers;    // Only for distributed renders
+        std::vector<paging_metrics> paging;     // Only for out-of-core meshes
+        io_counters render_io;                  // Faults and reads while rendering, only for out-of-core meshes
+        std::vector<lod_metrics> lods;          // Only with --lod
+
+        // Phases are kept in the order they were first timed
+        void add_time(const std::string& phase, double seconds) {
+            for (auto& p : phases) {
+                if (p.first == phase) {
+                    p.second += seconds;
+                    return;
+                }
+            }
+            phases.push_back(std::make_pair(phase, seconds));
+        }
+
+        double time(const std::string& phase) const {
+            for (const auto& p : phases)
+                if (p.first == phase)
+                    return p.second;
+            return 0;
+        }
+
+        unsigned long long total_rays() const { return primary_rays + secondary_rays; }
+
+        // Segments per path, primary ray included
+        double mean_path_length() const {
+            return primary_rays > 0 ? double(total_rays()) / primary_rays : 0;
+        }
+
+        double mrays_per_second() const {
+            double seconds = time("render");
+            return seconds > 0 ? total_rays() / seconds / 1e6 : 0;
+        }
+
+        void print() const {
+            for (const auto& p : phases)
+                std::clog << "  " << p.first << ": " << p.second << "s" << std::endl;
+            std::clog << "  rays: " << total_rays() << " (" << primary_rays << " primary, " << secondary_rays
+                      << " secondary), " << mean_path_length() << " per path, " << mrays_per_second() << " MRays/s"
+                      << std::endl;
+            if (resumed_samples > 0)
+                std::clog << "  resumed: " << resumed_samples << " of " << samples_per_pixel
+                          << " samples per pixel came from the checkpoint" << std::endl;
+            if (rmse >= 0)
+                std::clog << "  rmse against " << reference << ": " << rmse << std::endl;
+            if (!frames.empty()) {
+                int rebuilds = 0;
+                for (const auto& f : frames)
+                    rebuilds += f.rebuilt;
+                std::clog << "  frames: " << frames.size() << ", " << time("update") / frames.size() << "s update and "
+                          << time("render") / frames.size() << "s render per frame, " << rebuilds << " rebuilds"
+                          << std::endl;
+            }
+            if (!views.empty())
+                std::clog << "  views: " << views.size() << ", " << time("render") / views.size()
+                          << "s render per view" << std::endl;
+            for (const auto& p : paging)
+                std::clog << "  out of core: " << p.name << ", " << p.page_ins << " page-ins (" << p.rays_per_page_in()
+                          << " rays each), " << p.evictions << " evictions, " << p.bytes_paged / (1024.0 * 1024.0)
+                          << " MiB paged in" << std::endl;
+            for (const auto& l : lods) {
+                std::clog << "  lod: " << l.name << ",";
+                for (size_t k = 0; k < l.triangles.size(); k++)
+                    std::clog << (k ? "," : "") << " level " << k << " " << l.triangles[k] << " triangles "
+                              << l.instances[k] << " instances";
+                std::clog << std::endl;
+            }
+            if (!paging.empty())
+                std::clog << "  render faults: " << render_io.major_faults << " major, " << render_io.minor_faults
+                          << " minor, " << render_io.read_bytes / (1024.0 * 1024.0) << " MiB read" << std::endl;
+            std::clog << "  peak memory: " << peak_memory_bytes() / (1024.0 * 1024.0) << " MiB" << std::endl;
+        }
+
+        void save_json(const std::string& path) const {
+            std::ofstream out(path);
+            out << "{\n";
+            out << "  \"scene\": \"" << escape(scene) << "\",\n";
+            out << "  \"mode\": \"" << escape(mode) << "\",\n";
+            out << "  \"layout\": \"" << escape(layout) << "\",\n";
+            out << "  \"backend\": \"" << escape(backend) << "\",\n";
+            out << "  \"width\": " << width << ",\n";
+            out << "  \"height\": " << height << ",\n";
+            out << "  \"samples_per_pixel\": " << samples_per_pixel << ",\n";
+            out << "  \"sampler\": \"" << escape(sampler) << "\",\n";
+            out << "  \"integrator\": \"" << escape(integrator) << "\",\n";
+            if (resumed_samples > 0)
+                out << "  \"resumed_samples\": " << resumed_samples << ",\n";
+            if (rmse >= 0)
+                out << "  \"error\": {\"reference\": \"" << escape(reference) << "\", \"rmse\": " << rmse
+                    << ", \"psnr\": " << (rmse > 0 ? 20 * std::log10(1.0 / rmse) : infinity) << "},\n";
+            out << "  \"phases\": {";
+            for (size_t i = 0; i < phases.size(); i++)
+                out << (i ? ", " : "") << "\"" << escape(phases[i].first) << "\": " << phases[i].second;
+            out << "},\n";
+            out << "  \"rays\": {\"primary\": " << primary_rays << ", \"secondary\": " << secondary_rays
+                << ", \"total\": " << total_rays() << ", \"mean_path_length\": " << mean_path_length()
+                << ", \"mrays_per_second\": " << mrays_per_second() << "},\n";
+            if (mean_traversal_steps >= 0)
+                out << "  \"stats\": {\"mean_traversal_steps\": " << mean_traversal_steps
+                    << ", \"mean_intersection_tests\": " << mean_intersection_tests << "},\n";
+            out << "  \"peak_memory_bytes\": " << peak_memory_bytes() << ",\n";
+            out << "  \"structures\": [";
+            for (size_t i = 0; i < structures.size(); i++) {
+                const auto& s = structures[i];
+                out << (i ? "," : "") << "\n    {\"name\": \"" << escape(s.name) << "\"";
+                if (!s.mode.empty())
+                    out << ", \"mode\": \"" << escape(s.mode) << "\"";
+                out << ", \"primitives\": " << s.primitives;
+                if (s.references > s.primitives)
+                    out << ", \"references\": " << s.references;
+                out << ", \"load_seconds\": " << s.load_seconds << ", \"build_seconds\": " << s.build_seconds
+                    << ", \"bytes\": " << s.bytes << "}";
+            }
+            out << "\n  ]";
+            if (!frames.empty()) {
+                out << ",\n  \"frames\": [";
+                for (size_t i = 0; i < frames.size(); i++) {
+                    const auto& f = frames[i];
+                    out << (i ? "," : "") << "\n    {\"frame\": " << f.frame << ", \"update_seconds\": " << f.update_seconds
+                        << ", \"render_seconds\": " << f.render_seconds << ", \"sah_cost\": " << f.sah_cost
+                        << ", \"rebuilt\": " << (f.rebuilt ? "true" : "false") << "}";
+                }
+                out << "\n  ]";
+            }
+            if (!views.empty()) {
+                out << ",\n  \"views\": [";
+                for (size_t i = 0; i < views.size(); i++) {
+                    const auto& v = views[i];
+                    out << (i ? "," : "") << "\n    {\"source\": \"" << escape(v.source) << "\", \"image\": \""
+                        << escape(v.image) << "\", \"render_seconds\": " << v.render_seconds << ", \"rays\": " << v.rays
+                        << "}";
+                }
+                out << "\n  ]";
+            }
+            if (!workers.empty()) {
+                out << ",\n  \"workers\": [";
+                for (size_t i = 0; i < workers.size(); i++) {
+                    const auto& w = workers[i];
+                    out << (i ? "," : "") << "\n    {\"address\": \"" << escape(w.address) << "\", \"units\": " << w.units
+                        << ", \"busy_seconds\": " << w.busy_seconds << ", \"failed\": " << (w.failed ? "true" : "false")
+                        << "}";
+                }
+                out << "\n  ]";
+            }
+            if (!paging.empty()) {
+                out << ",\n  \"out_of_core\": {\"major_faults\": " << render_io.major_faults << ", \"minor_faults\": "
+                    << render_io.minor_faults << ", \"read_bytes\": " << render_io.read_bytes << ", \"meshes\": [";
+                for (size_t i = 0; i < paging.size(); i++) {
+                    const auto& p = paging[i];
+                    out << (i ? "," : "") << "\n    {\"name\": \"" << escape(p.name) << "\", \"clusters\": " << p.clusters
+                        << ", \"file_bytes\": " << p.file_bytes << ", \"budget_bytes\": " << p.budget_bytes
+                        << ", \"page_ins\": " << p.page_ins << ", \"evictions\": " << p.evictions
+                        << ", \"bytes_paged\": " << p.bytes_paged << ", \"cluster_visits\": " << p.cluster_visits
+                        << ", \"ray_visits\": " << p.ray_visits << ", \"rays_per_page_in\": " << p.rays_per_page_in()
+                        << "}";
+                }
+                out << "\n  ]}";
+            }
+            if (!lods.empty()) {
+                out << ",\n  \"lod\": [";
+                for (size_t i = 0; i < lods.size(); i++) {
+                    const auto& l = lods[i];
+                    out << (i ? "," : "") << "\n    {\"name\": \"" << escape(l.name) << "\", \"levels\": [";
+                    for (size_t k = 0; k < l.triangles.size(); k++)
+                        out << (k ? ", " : "") << "{\"triangles\": " << l.triangles[k] << ", \"instances\": "
+                            << l.instances[k] << "}";
+                    out << "]}";
+                }
+                out << "\n  ]";
+            }
+            out << "\n}\n";
+            out.close();
+        }
+
+        // "output/image.ppm" -> "output/image.json"
+        static std::string json_path_for(const std::string& image_path) {
+            auto slash = image_path.find_last_of("/\\");
+            auto dot = image_path.find_last_of('.');
+            if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+                return image_path + ".json";
+            return image_path.substr(0, dot) + ".json";
+        }
+
+        // For strings written between quotes in JSON
+        static std::string escape(const std::string& s) {
+            std::string res;
+            for (char c : s) {
+                if (c == '"' || c == '\\')
+                    res += '\\';
+                res += c;
+            }
+            return res;
+        }
+    private:
+        std::vector<std::pair<std::string, double>> phases;
+};
+
+#endif
@@ -3,37 +3,70 @@
 
 #include "mesh.h"
 #include "accelerate.h"
+#include "auto_structure.h"
+#include "build_options.h"
+#include "flat_tree.h"
+#include "metrics.h"
 
 #include <cstring>
 
 class model : public hittable {
     public:
-        model(const char* path, shared_ptr<material> mat, const char* mode = "brute")
+        // A null mode only reads the OBJ file, build() gives the model its structure later. Until then only its
+        // bounding box may be asked for, which lets the world be built while the model builds its own structure
+        model(const char* path, shared_ptr<material> mat, const char* mode = "brute",
+              const build_options& options = build_options()) : path(path)
         {
+            stopwatch timer;
             std::vector<vec3> vertices;
             std::vector<vec3> face_indices;
             loadOBJ(path, vertices, face_indices);
 
             _mesh = mesh(vertices, face_indices, mat);
-            if (strcmp(mode, "bvh") == 0)
-                _mesh = hittable_list(make_shared<bvh_node>(_mesh));
-            else if (strcmp(mode, "kd") == 0)
-                _mesh = hittable_list(make_shared<kd_node>(_mesh));
-            else if (strcmp(mode, "bih") == 0)
-                _mesh = hittable_list(make_shared<bih_node>(_mesh));
+            bbox = _mesh.bounding_box();
+            n_triangles = face_indices.size();
+            n_references = n_triangles;
+            load_seconds = timer.elapsed();
+            if (mode)
+                build(mode, options);
+        }
+
+        void build(const char* mode, const build_options& options) {
+            stopwatch timer;
+            built_structure built = make_structure(mode, _mesh, path, options);
+            structure_name = built.mode;
+            if (built.root)
+                _mesh = hittable_list(built.root);
+            if (built.references > 0)
+                n_references = built.references;
+            build_seconds = timer.elapsed();
 
             std::clog << "\rModel: " << path << "           " << std::endl;
         }
 
-        aabb bounding_box() const override { return _mesh.bounding_box(); }
+        aabb bounding_box() const override { return bbox; }
 
         bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
             return _mesh.hit(r, ray_t, rec);
         }
-    private:
-        hittable_list _mesh;
 
-        bool loadOBJ(const char* path, std::vector<vec3>& vertices, std::vector<vec3>& face_indices) {
+        size_t structure_bytes() const override { return _mesh.structure_bytes(); }
+
+        void flatten(std::vector<flat_primitive>& out) const override { _mesh.flatten(out); }
+
+        aabb refit() override { return bbox = _mesh.refit(); }
+
+        double sah_cost(double parent_area) const override { return _mesh.sah_cost(parent_area); }
+
+        const std::string& name() const { return path; }
+        const hittable_list& structure() const { return _mesh; }
+        const std::string& structure_mode() const { return structure_name; }   // what -m auto chose
+        size_t triangle_count() const { return n_triangles; }
+        size_t reference_count() const { return n_references; }    // triangles plus the SBVH duplicates
+        double load_time() const { return load_seconds; }
+        double build_time() const { return build_seconds; }
+
+        static bool loadOBJ(const char* path, std::vector<vec3>& vertices, std::vector<vec3>& face_indices) {
             FILE* file = fopen(path, "r");
             if (file == NULL)
                 return false;
@@ -58,6 +91,15 @@ class model : public hittable {
 
             return true;
         }
+    private:
+        std::string path;
+        std::string structure_name;
+        size_t n_triangles = 0;
+        size_t n_references = 0;
+        double load_seconds = 0;
+        double build_seconds = 0;
+        aabb bbox;
+        hittable_list _mesh;
 };
 
 #endif
\ No newline at end of file
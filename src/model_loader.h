@@ -0,0 +1,142 @@
+/*
+    IN THIS FILE you will find the pipeline that loads the models of a scene while the scene file is parsed:
+
+    1) load: every MODEL line starts a task that reads its OBJ file and then builds the model's structure, unless a
+       task for the same file and material was started before. At most --load-threads tasks run at once, the
+       parser waits for the oldest one while that many are busy. Every task builds with its own copy of the
+       options
+    2) wait_loaded: once every OBJ file is read the bounding boxes of all models are known, so the world structure
+       can be built while the models are still building theirs
+    3) wait_built: every model has its structure, and the scene can be measured and rendered
+*/
+
+#ifndef MODEL_LOADER_H
+#define MODEL_LOADER_H
+
+#include "common.h"
+#include "build_options.h"
+#include "metrics.h"
+#include "model.h"
+
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+class model_loader {
+    public:
+        // With options.load_threads models loaded at once, 0 takes one per hardware thread and 1 loads each while
+        // its line is parsed
+        model_loader(const std::string& mode, const build_options& options) : mode(mode), options(options) {}
+
+        // Tasks still running when the scene is abandoned are waited for, they write into this loader
+        ~model_loader() {
+            for (const auto& t : tasks)
+                if (t->built.valid())
+                    t->built.wait();
+        }
+
+        // The task giving the model of `path` with `mat`, one started before under the same `key` is shared. -m auto
+        // builds it for `rays` rays
+        size_t load(const std::string& key, const std::string& path, shared_ptr<material> mat, double rays) {
+            for (size_t i = 0; i < tasks.size(); i++)
+                if (tasks[i]->key == key)
+                    return i;
+
+            tasks.push_back(std::unique_ptr<task>(new task));
+            task* t = tasks.back().get();
+            t->key = key;
+            t->read = t->obj_read.get_future().share();
+            std::string structure = mode;
+            build_options built_with = options;
+            built_with.rays = rays;
+            auto work = [t, path, mat, structure, built_with]() {
+                bool read = false;
+                try {
+                    t->mdl = make_shared<model>(path.c_str(), mat, nullptr);
+                    read = true;
+                    t->obj_read.set_value();
+                    t->mdl->build(structure.c_str(), built_with);
+                } catch (...) {
+                    if (!read)
+                        t->obj_read.set_exception(std::current_exception());
+                    throw;
+                }
+            };
+
+            if (limit() <= 1) {
+                stopwatch timer;
+                work();
+                blocked += timer.elapsed();
+            } else {
+                throttle();
+                t->built = std::async(std::launch::async, work);
+            }
+            return tasks.size() - 1;
+        }
+
+        // Blocks until every OBJ file is read
+        void wait_loaded() {
+            stopwatch timer;
+            for (const auto& t : tasks)
+                t->read.get();
+            blocked += timer.elapsed();
+        }
+
+        // The model of task `i`, once wait_loaded returned. Only its bounding box is known before wait_built
+        const shared_ptr<model>& model_of(size_t i) const { return tasks[i]->mdl; }
+
+        // Blocks until every model has its structure
+        void wait_built() {
+            stopwatch timer;
+            for (const auto& t : tasks)
+                if (t->built.valid())
+                    t->built.get();
+            blocked += timer.elapsed();
+        }
+
+        size_t size() const { return tasks.size(); }
+
+        // Time the parser spent waiting for models or loading them itself
+        double waited() const { return blocked; }
+
+    private:
+        struct task {
+            std::string key;
+            shared_ptr<model> mdl;
+            std::promise<void> obj_read;
+            std::shared_future<void> read;
+            std::future<void> built;
+        };
+
+        std::string mode;
+        build_options options;
+        std::vector<std::unique_ptr<task>> tasks;
+        double blocked = 0;
+
+        size_t limit() const {
+            if (options.load_threads > 0)
+                return size_t(options.load_threads);
+            return std::max(1u, std::thread::hardware_concurrency());
+        }
+
+        // Waits for the oldest running tasks until fewer than limit() run
+        void throttle() {
+            stopwatch timer;
+            size_t running = 0;
+            for (const auto& t : tasks)
+                if (t->built.valid() && t->built.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+                    running++;
+            for (size_t i = 0; i < tasks.size() && running >= limit(); i++) {
+                auto& built = tasks[i]->built;
+                if (built.valid() && built.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+                    built.wait();
+                    running--;
+                }
+            }
+            blocked += timer.elapsed();
+        }
+};
+
+#endif
@@ -0,0 +1,932 @@
+/*
+    IN THIS FILE you will find the out-of-core meshes of --out-of-core dir, for models that do not fit in memory.
+    Every MODEL is converted once into a cluster file in that directory, which is mapped into memory to render:
+
+    1) ooc_builder: converts the OBJ file in passes whose heap memory does not grow with the mesh. The vertices
+       are written to a temporary file that is mapped to look up the faces, and the triangles to a second one. A
+       64^3 grid counts the triangle centroids, its cells are cut along the Morton curve into clusters of up to
+       cluster_triangles, and the triangles are scattered into cluster order in a mapped file. Then one cluster at
+       a time is read back, gets a binned SAH tree and is written out with it, every cluster starting on a page of
+       its own. The temporary files are mapped, so the kernel can write back and reclaim their pages at any time
+    2) ooc_model: the hittable. The cluster table and a tree over the cluster boxes stay in memory, the clusters
+       are paged in with madvise when a ray first needs them. While more than --ooc-memory MiB of clusters are
+       resident, the least recently used ones are dropped from the mapping and from the page cache. hit_batch lists
+       the clusters every ray enters, nearest first, and then hands out the next cluster of every ray round by
+       round, grouped by cluster, so each page-in serves every ray of the batch that needs that cluster
+
+    A cluster file is reused as long as its OBJ file keeps its size and modification time.
+*/
+
+#ifndef OUT_OF_CORE_H
+#define OUT_OF_CORE_H
+
+#include "common.h"
+#include "build_options.h"
+#include "flat_tree.h"
+#include "hittable.h"
+#include "material.h"
+#include "metrics.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <numeric>
+#include <string>
+#ifndef _WIN32
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+// A triangle of a cluster file, its three vertices
+struct ooc_triangle {
+    float a[3];
+    float b[3];
+    float c[3];
+};
+
+// A node of a cluster tree or of the tree over the clusters. Inner nodes have their left child right after them and
+// the right one at `first`, leaves hold the items [first, first + count)
+struct ooc_node {
+    float lo[3];
+    float hi[3];
+    uint32_t first;
+    uint32_t count;         // 0 for inner nodes
+};
+
+static_assert(sizeof(ooc_node) == 32, "two nodes share a cache line");
+
+// Where a cluster is in the file: its nodes, then its triangles in leaf order
+struct ooc_cluster {
+    float lo[3];
+    float hi[3];
+    uint64_t offset;
+    uint32_t nodes;
+    uint32_t triangles;
+};
+
+struct ooc_header {
+    char magic[8];
+    uint64_t source_bytes;          // size and modification time of the OBJ file it was converted from
+    int64_t source_mtime;
+    uint64_t triangles;
+    uint64_t clusters;
+    uint64_t table_offset;
+};
+
+//* TREES
+// Binned SAH tree over a list of boxes, depth first. `order` returns the boxes in leaf order
+class ooc_tree_builder {
+    public:
+        // Splits are taken at the middle below this depth, so the traversal stack always has room
+        static const int max_sah_depth = 48;
+        static const int bins = 16;
+
+        static void build(const std::vector<aabb>& boxes, uint32_t max_leaf, std::vector<ooc_node>& nodes,
+                          std::vector<uint32_t>& order) {
+            order.resize(boxes.size());
+            std::iota(order.begin(), order.end(), 0u);
+            nodes.clear();
+            if (!boxes.empty())
+                ooc_tree_builder(boxes, max_leaf, nodes, order).build(0, boxes.size(), 0);
+        }
+
+    private:
+        const std::vector<aabb>& boxes;
+        uint32_t max_leaf;
+        std::vector<ooc_node>& nodes;
+        std::vector<uint32_t>& order;
+
+        ooc_tree_builder(const std::vector<aabb>& boxes, uint32_t max_leaf, std::vector<ooc_node>& nodes,
+                         std::vector<uint32_t>& order)
+            : boxes(boxes), max_leaf(max_leaf), nodes(nodes), order(order) {}
+
+        uint32_t build(size_t start, size_t end, int depth) {
+            uint32_t index = uint32_t(nodes.size());
+            nodes.push_back(ooc_node());
+            aabb box, centres;
+            for (size_t i = start; i < end; i++) {
+                box = aabb(box, boxes[order[i]]);
+                point c = boxes[order[i]].centroid();
+                centres = aabb(centres, aabb(c, c));
+            }
+            for (int axis = 0; axis < 3; axis++) {
+                nodes[index].lo[axis] = flat_tree::round_down(box.axis_interval(axis).min);
+                nodes[index].hi[axis] = flat_tree::round_up(box.axis_interval(axis).max);
+            }
+            if (end - start <= max_leaf) {
+                nodes[index].first = uint32_t(start);
+                nodes[index].count = uint32_t(end - start);
+                return index;
+            }
+
+            size_t mid = depth < max_sah_depth ? sah_split(start, end, centres) : start;
+            if (mid == start || mid == end) {
+                int axis = 0;
+                for (int a = 1; a < 3; a++)
+                    if (centres.axis_interval(a).size() > centres.axis_interval(axis).size())
+                        axis = a;
+                mid = (start + end) / 2;
+                std::nth_element(order.begin() + start, order.begin() + mid, order.begin() + end,
+                                 [&](uint32_t x, uint32_t y) {
+                                     return boxes[x].centroid()[axis] < boxes[y].centroid()[axis];
+                                 });
+            }
+            build(start, mid, depth + 1);
+            uint32_t right = build(mid, end, depth + 1);
+            nodes[index].first = right;
+            nodes[index].count = 0;
+            return index;
+        }
+
+        // Partitions the range at the cheapest of the bin borders on all three axes, returns the first item of the
+        // right side, or `start` when the centroids cannot be told apart
+        size_t sah_split(size_t start, size_t end, const aabb& centres) {
+            double best = infinity;
+            int best_axis = -1, best_bin = 0;
+            for (int axis = 0; axis < 3; axis++) {
+                const interval& extent = centres.axis_interval(axis);
+                aabb bin_boxes[bins];
+                size_t bin_counts[bins] = {};
+                for (size_t i = start; i < end; i++) {
+                    int b = bin_of(boxes[order[i]].centroid()[axis], extent);
+                    bin_counts[b]++;
+                    bin_boxes[b] = aabb(bin_boxes[b], boxes[order[i]]);
+                }
+                double right_area[bins];
+                size_t right_count[bins];
+                aabb right;
+                size_t count = 0;
+                for (int b = bins - 1; b > 0; b--) {
+                    right = aabb(right, bin_boxes[b]);
+                    count += bin_counts[b];
+                    right_area[b] = right.surface_area();
+                    right_count[b] = count;
+                }
+                aabb left;
+                count = 0;
+                for (int b = 1; b < bins; b++) {
+                    left = aabb(left, bin_boxes[b - 1]);
+                    count += bin_counts[b - 1];
+                    if (count == 0 || right_count[b] == 0)
+                        continue;
+                    double cost = left.surface_area() * count + right_area[b] * right_count[b];
+                    if (cost < best) {
+                        best = cost;
+                        best_axis = axis;
+                        best_bin = b;
+                    }
+                }
+            }
+            if (best_axis < 0)
+                return start;
+            const interval& extent = centres.axis_interval(best_axis);
+            auto middle = std::partition(order.begin() + start, order.begin() + end, [&](uint32_t item) {
+                return bin_of(boxes[item].centroid()[best_axis], extent) < best_bin;
+            });
+            return size_t(middle - order.begin());
+        }
+
+        static int bin_of(double value, const interval& extent) {
+            int b = int(bins * (value - extent.min) / extent.size());
+            return std::max(0, std::min(bins - 1, b));
+        }
+};
+
+// Where the ray enters the box of `n` in `ray_t`, false when it misses it
+inline bool ooc_box_entry(const ooc_node& n, const point& origin, const double* inverse, interval ray_t,
+                          double& entry) {
+    for (int axis = 0; axis < 3; axis++) {
+        double t0 = (n.lo[axis] - origin[axis]) * inverse[axis];
+        double t1 = (n.hi[axis] - origin[axis]) * inverse[axis];
+        if (t0 < t1) {
+            if (t0 > ray_t.min) ray_t.min = t0;
+            if (t1 < ray_t.max) ray_t.max = t1;
+        } else {
+            if (t1 > ray_t.min) ray_t.min = t1;
+            if (t0 < ray_t.max) ray_t.max = t0;
+        }
+        if (ray_t.max <= ray_t.min)
+            return false;
+    }
+    entry = ray_t.min;
+    return true;
+}
+
+inline aabb box_of(const ooc_triangle& tri) {
+    point a(tri.a[0], tri.a[1], tri.a[2]), b(tri.b[0], tri.b[1], tri.b[2]), c(tri.c[0], tri.c[1], tri.c[2]);
+    return aabb(aabb(a, b), aabb(c, c));
+}
+
+#ifndef _WIN32
+//* CONVERSION
+class ooc_builder {
+    public:
+        // About 300 KiB of triangles and 100 KiB of nodes per cluster
+        static const uint32_t cluster_triangles = 8192;
+
+        // Cells per axis of the grid the clusters are cut from, as a power of two
+        static const int grid_bits = 6;
+
+        // Converts the OBJ file at `source` into the cluster file `target`, false if it cannot be read or written
+        static bool build(const std::string& source, const std::string& target) {
+            struct stat info;
+            if (stat(source.c_str(), &info) != 0)
+                return false;
+            std::string vertex_path = target + ".vertices", unsorted_path = target + ".unsorted";
+            std::string sorted_path = target + ".sorted", partial_path = target + ".partial";
+
+            // Pass 1: the vertices
+            std::clog << "\rOut-of-core " << source << ": vertices...            " << std::flush;
+            FILE* obj = fopen(source.c_str(), "r");
+            FILE* out = fopen(vertex_path.c_str(), "wb");
+            if (!obj || !out) {
+                if (obj) fclose(obj);
+                if (out) fclose(out);
+                return false;
+            }
+            size_t n_vertices = 0;
+            char header[128];
+            while (fscanf(obj, "%127s", header) != EOF) {
+                if (strcmp(header, "v") == 0) {
+                    double x, y, z;
+                    fscanf(obj, "%lf %lf %lf\n", &x, &y, &z);
+                    float v[3] = {float(x), float(y), float(z)};
+                    fwrite(v, sizeof(v), 1, out);
+                    n_vertices++;
+                }
+            }
+            fclose(out);
+
+            // Pass 2: the faces, looked up in the mapped vertices
+            std::clog << "\rOut-of-core " << source << ": faces...               " << std::flush;
+            mapping vertices(vertex_path, n_vertices * 3 * sizeof(float), false);
+            out = vertices.data ? fopen(unsorted_path.c_str(), "wb") : nullptr;
+            if (!out) {
+                fclose(obj);
+                unlink(vertex_path.c_str());
+                return false;
+            }
+            const float* v = reinterpret_cast<const float*>(vertices.data);
+            rewind(obj);
+            size_t n_triangles = 0, skipped = 0;
+            aabb centres;
+            while (fscanf(obj, "%127s", header) != EOF) {
+                if (strcmp(header, "f") == 0) {
+                    unsigned int v1, v2, v3;
+                    fscanf(obj, "%u %u %u\n", &v1, &v2, &v3);
+                    if (v1 == 0 || v2 == 0 || v3 == 0 || v1 > n_vertices || v2 > n_vertices || v3 > n_vertices) {
+                        skipped++;
+                        continue;
+                    }
+                    ooc_triangle tri;
+                    memcpy(tri.a, v + 3 * size_t(v1 - 1), sizeof(tri.a));
+                    memcpy(tri.b, v + 3 * size_t(v2 - 1), sizeof(tri.b));
+                    memcpy(tri.c, v + 3 * size_t(v3 - 1), sizeof(tri.c));
+                    fwrite(&tri, sizeof(tri), 1, out);
+                    point c = box_of(tri).centroid();
+                    centres = aabb(centres, aabb(c, c));
+                    n_triangles++;
+                }
+            }
+            fclose(obj);
+            fclose(out);
+            vertices.close();
+            unlink(vertex_path.c_str());
+            if (skipped > 0)
+                std::clog << "\r" << source << ": skipped " << skipped << " faces with unknown vertices" << std::endl;
+            if (n_triangles == 0) {
+                unlink(unsorted_path.c_str());
+                return false;
+            }
+
+            // Pass 3: triangles per grid cell, and the clusters cut from the cells in Morton order
+            std::clog << "\rOut-of-core " << source << ": clusters...            " << std::flush;
+            mapping unsorted(unsorted_path, n_triangles * sizeof(ooc_triangle), false);
+            if (!unsorted.data) {
+                unlink(unsorted_path.c_str());
+                return false;
+            }
+            const ooc_triangle* triangles = reinterpret_cast<const ooc_triangle*>(unsorted.data);
+            std::vector<uint64_t> cell_start(size_t(1) << (3 * grid_bits), 0);
+            for (size_t i = 0; i < n_triangles; i++)
+                cell_start[cell_of(triangles[i], centres)]++;
+            std::vector<std::pair<uint64_t, uint64_t>> ranges;      // of every cluster in the sorted triangles
+            uint64_t position = 0, cluster_start = 0;
+            for (auto& start : cell_start) {
+                uint64_t count = start;
+                start = position;
+                if (position + count - cluster_start > cluster_triangles && position > cluster_start) {
+                    ranges.push_back(std::make_pair(cluster_start, position));
+                    cluster_start = position;
+                }
+                // A cell of its own that is still too large is cut in file order
+                while (position + count - cluster_start > cluster_triangles) {
+                    ranges.push_back(std::make_pair(cluster_start, cluster_start + cluster_triangles));
+                    cluster_start += cluster_triangles;
+                }
+                position += count;
+            }
+            if (position > cluster_start)
+                ranges.push_back(std::make_pair(cluster_start, position));
+
+            // Pass 4: the triangles scattered into cluster order
+            std::clog << "\rOut-of-core " << source << ": sorting...             " << std::flush;
+            mapping sorted(sorted_path, n_triangles * sizeof(ooc_triangle), true);
+            if (!sorted.data) {
+                unlink(unsorted_path.c_str());
+                unlink(sorted_path.c_str());
+                return false;
+            }
+            ooc_triangle* in_order = reinterpret_cast<ooc_triangle*>(sorted.data);
+            for (size_t i = 0; i < n_triangles; i++)
+                in_order[cell_start[cell_of(triangles[i], centres)]++] = triangles[i];
+            unsorted.close();
+            unlink(unsorted_path.c_str());
+
+            // Pass 5: one cluster at a time gets its tree and is written out
+            out = fopen(partial_path.c_str(), "wb");
+            if (!out) {
+                unlink(sorted_path.c_str());
+                return false;
+            }
+            size_t page = size_t(sysconf(_SC_PAGESIZE));
+            ooc_header head;
+            memset(&head, 0, sizeof(head));
+            // The first page holds the header, which is filled in once the table is written
+            fwrite(&head, sizeof(head), 1, out);
+            pad(out, page);
+            std::vector<ooc_cluster> table;
+            std::vector<aabb> boxes;
+            std::vector<ooc_node> nodes;
+            std::vector<uint32_t> order;
+            std::vector<ooc_triangle> leaf_order;
+            for (size_t c = 0; c < ranges.size(); c++) {
+                if (c % 64 == 0)
+                    std::clog << "\rOut-of-core " << source << ": cluster " << c << '/' << ranges.size()
+                              << "          " << std::flush;
+                const ooc_triangle* first = in_order + ranges[c].first;
+                size_t count = size_t(ranges[c].second - ranges[c].first);
+                boxes.clear();
+                for (size_t i = 0; i < count; i++)
+                    boxes.push_back(box_of(first[i]));
+                ooc_tree_builder::build(boxes, 4, nodes, order);
+                leaf_order.clear();
+                for (uint32_t i : order)
+                    leaf_order.push_back(first[i]);
+
+                ooc_cluster cluster;
+                memcpy(cluster.lo, nodes[0].lo, sizeof(cluster.lo));
+                memcpy(cluster.hi, nodes[0].hi, sizeof(cluster.hi));
+                cluster.offset = uint64_t(ftell(out));
+                cluster.nodes = uint32_t(nodes.size());
+                cluster.triangles = uint32_t(count);
+                fwrite(nodes.data(), sizeof(ooc_node), nodes.size(), out);
+                fwrite(leaf_order.data(), sizeof(ooc_triangle), leaf_order.size(), out);
+                pad(out, page);
+                table.push_back(cluster);
+                sorted.drop(ranges[c].first * sizeof(ooc_triangle), count * sizeof(ooc_triangle));
+            }
+            sorted.close();
+            unlink(sorted_path.c_str());
+
+            memcpy(head.magic, "OOCMESH2", 8);
+            head.source_bytes = uint64_t(info.st_size);
+            head.source_mtime = int64_t(info.st_mtime);
+            head.triangles = n_triangles;
+            head.clusters = table.size();
+            head.table_offset = uint64_t(ftell(out));
+            fwrite(table.data(), sizeof(ooc_cluster), table.size(), out);
+            fseek(out, 0, SEEK_SET);
+            fwrite(&head, sizeof(head), 1, out);
+            bool written = !ferror(out);
+            written = fclose(out) == 0 && written;
+            if (!written || rename(partial_path.c_str(), target.c_str()) != 0) {
+                unlink(partial_path.c_str());
+                return false;
+            }
+            std::clog << "\rOut-of-core " << source << ": " << n_triangles << " triangles in " << table.size()
+                      << " clusters" << std::endl;
+            return true;
+        }
+
+        // The header of `target` if it was converted from `source` as it is now
+        static bool up_to_date(const std::string& source, const std::string& target, ooc_header& head) {
+            struct stat info;
+            if (stat(source.c_str(), &info) != 0)
+                return false;
+            FILE* file = fopen(target.c_str(), "rb");
+            if (!file)
+                return false;
+            bool read = fread(&head, sizeof(head), 1, file) == 1;
+            fclose(file);
+            return read && memcmp(head.magic, "OOCMESH2", 8) == 0 && head.source_bytes == uint64_t(info.st_size) &&
+                   head.source_mtime == int64_t(info.st_mtime);
+        }
+
+    private:
+        // A temporary file mapped for one pass, created with `bytes` when it is written. `data` stays null when it
+        // cannot be opened or mapped
+        struct mapping {
+            char* data = nullptr;
+            size_t bytes = 0;
+
+            mapping(const std::string& path, size_t size, bool write) : bytes(size) {
+                int fd = open(path.c_str(), write ? O_RDWR | O_CREAT | O_TRUNC : O_RDONLY, 0644);
+                if (fd < 0 || bytes == 0 || (write && ftruncate(fd, off_t(bytes)) != 0)) {
+                    if (fd >= 0)
+                        ::close(fd);
+                    bytes = 0;
+                    return;
+                }
+                void* p = mmap(nullptr, bytes, write ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+                ::close(fd);
+                if (p == MAP_FAILED) {
+                    bytes = 0;
+                    return;
+                }
+                data = static_cast<char*>(p);
+                madvise(data, bytes, MADV_SEQUENTIAL);
+            }
+
+            ~mapping() { close(); }
+
+            // Lets the pages of a part that is done go, so the resident memory stays bounded
+            void drop(size_t offset, size_t size) {
+                size_t page = size_t(sysconf(_SC_PAGESIZE));
+                size_t begin = offset / page * page;
+                if (data && begin < offset + size)
+                    madvise(data + begin, offset + size - begin, MADV_DONTNEED);
+            }
+
+            void close() {
+                if (data)
+                    munmap(data, bytes);
+                data = nullptr;
+            }
+        };
+
+        static size_t cell_of(const ooc_triangle& tri, const aabb& centres) {
+            point c = box_of(tri).centroid();
+            const int cells = 1 << grid_bits;
+            size_t code = 0;
+            int cell[3];
+            for (int axis = 0; axis < 3; axis++) {
+                const interval& extent = centres.axis_interval(axis);
+                int i = int(cells * (c[axis] - extent.min) / extent.size());
+                cell[axis] = std::max(0, std::min(cells - 1, i));
+            }
+            for (int bit = grid_bits - 1; bit >= 0; bit--)
+                for (int axis = 0; axis < 3; axis++)
+                    code = (code << 1) | size_t((cell[axis] >> bit) & 1);
+            return code;
+        }
+
+        static void pad(FILE* out, size_t page) {
+            long position = ftell(out);
+            size_t padding = (page - size_t(position) % page) % page;
+            static const char zeros[4096] = {};
+            while (padding > 0) {
+                size_t n = std::min(padding, sizeof(zeros));
+                fwrite(zeros, 1, n, out);
+                padding -= n;
+            }
+        }
+};
+
+//* OUT-OF-CORE MESH
+class ooc_model : public hittable {
+    public:
+        // The OBJ file at `path` as an out-of-core mesh, converted into the --out-of-core directory unless it
+        // already is, with --ooc-memory of its clusters resident at once. Null when it cannot be read or converted
+        static shared_ptr<ooc_model> open(const std::string& path, shared_ptr<material> mat,
+                                          const build_options& options) {
+            const std::string& directory = options.out_of_core;
+            std::string flat_name = path;
+            std::replace(flat_name.begin(), flat_name.end(), '/', '_');
+            std::string target = directory + "/" + flat_name + ".clusters";
+            stopwatch timer;
+            ooc_header head;
+            bool converted = false;
+            if (!ooc_builder::up_to_date(path, target, head)) {
+                mkdir(directory.c_str(), 0755);
+                if (!ooc_builder::build(path, target) || !ooc_builder::up_to_date(path, target, head)) {
+                    std::clog << "\rCould not convert " << path << " into " << target << std::endl;
+                    return nullptr;
+                }
+                converted = true;
+            }
+            double build_seconds = converted ? timer.elapsed() : 0;
+            timer.reset();
+            auto mdl = shared_ptr<ooc_model>(new ooc_model(path, target, head, mat));
+            if (!mdl->base) {
+                std::clog << "\rCould not map " << target << ", " << path << " is loaded into memory" << std::endl;
+                return nullptr;
+            }
+            mdl->memory_budget = options.ooc_budget_bytes();
+            mdl->build_seconds = build_seconds;
+            mdl->load_seconds = timer.elapsed();
+            std::clog << "\rModel: " << path << " (out of core, " << (converted ? "converted" : "reused") << " "
+                      << target << ")" << std::endl;
+            return mdl;
+        }
+
+        ~ooc_model() {
+            if (base)
+                munmap(const_cast<char*>(base), file_bytes);
+            if (fd >= 0)
+                ::close(fd);
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            const point& origin = r.origin();
+            double inverse[3];
+            for (int axis = 0; axis < 3; axis++)
+                inverse[axis] = 1.0 / r.direction()[axis];
+
+            uint32_t stack[max_stack];
+            int top = 0;
+            stack[top++] = 0;
+            bool hit_anything = false;
+            while (top > 0) {
+                const ooc_node& n = tree[stack[--top]];
+                double entry;
+                record_traversal_step(rec);
+                if (!ooc_box_entry(n, origin, inverse, ray_t, entry))
+                    continue;
+                if (n.count > 0) {
+                    uint32_t c = tree_order[n.first];
+                    use(c);
+                    cluster_visits.fetch_add(1, std::memory_order_relaxed);
+                    ray_visits.fetch_add(1, std::memory_order_relaxed);
+                    if (hit_cluster(c, r, inverse, ray_t, rec)) {
+                        hit_anything = true;
+                        ray_t.max = rec.t;
+                    }
+                    continue;
+                }
+                stack[top++] = n.first;
+                stack[top++] = uint32_t(&n - tree.data()) + 1;
+            }
+            return hit_anything;
+        }
+
+        void hit_batch(ray_batch& batch) const override {
+            // The clusters every ray enters in front of its closest hit, nearest first
+            struct entry {
+                double t;
+                uint32_t cluster;
+                bool operator<(const entry& other) const { return t < other.t; }
+            };
+            size_t n_rays = batch.rays.size();
+            std::vector<entry> entries;
+            std::vector<size_t> first(n_rays + 1, 0), next(n_rays, 0);
+            std::vector<uint32_t> stack;
+            for (size_t i = 0; i < n_rays; i++) {
+                first[i] = next[i] = entries.size();
+                const ray& r = batch.rays[i];
+                double inverse[3];
+                for (int axis = 0; axis < 3; axis++)
+                    inverse[axis] = 1.0 / r.direction()[axis];
+                interval ray_t(batch.t_min, batch.t_max[i]);
+                stack.assign(1, 0);
+                while (!stack.empty()) {
+                    const ooc_node& n = tree[stack.back()];
+                    stack.pop_back();
+                    double t;
+                    if (!ooc_box_entry(n, r.origin(), inverse, ray_t, t))
+                        continue;
+                    if (n.count > 0) {
+                        entry e = {t, tree_order[n.first]};
+                        entries.push_back(e);
+                        continue;
+                    }
+                    stack.push_back(n.first);
+                    stack.push_back(uint32_t(&n - tree.data()) + 1);
+                }
+                std::sort(entries.begin() + first[i], entries.end());
+            }
+            first[n_rays] = entries.size();
+
+            // Every round takes the next cluster of every ray that may still find a closer hit there
+            std::vector<std::pair<uint32_t, uint32_t>> requests;
+            while (true) {
+                requests.clear();
+                for (size_t i = 0; i < n_rays; i++) {
+                    if (next[i] < first[i + 1] && entries[next[i]].t <= batch.t_max[i])
+                        requests.push_back(std::make_pair(entries[next[i]++].cluster, uint32_t(i)));
+                }
+                if (requests.empty())
+                    break;
+                std::sort(requests.begin(), requests.end());
+
+                for (size_t k = 0; k < requests.size();) {
+                    uint32_t c = requests[k].first;
+                    use(c);
+                    cluster_visits.fetch_add(1, std::memory_order_relaxed);
+                    for (; k < requests.size() && requests[k].first == c; k++) {
+                        uint32_t i = requests[k].second;
+                        const ray& r = batch.rays[i];
+                        double inverse[3];
+                        for (int axis = 0; axis < 3; axis++)
+                            inverse[axis] = 1.0 / r.direction()[axis];
+                        hit_record rec;
+#ifdef COLLECT_STATS
+                        rec.stats = batch.recs[i].stats;
+                        rec.stat_slot = batch.recs[i].stat_slot;
+#endif
+                        ray_visits.fetch_add(1, std::memory_order_relaxed);
+                        if (hit_cluster(c, r, inverse, interval(batch.t_min, batch.t_max[i]), rec)) {
+                            batch.t_max[i] = rec.t;
+                            batch.recs[i] = rec;
+                            batch.found[i] = 1;
+                        }
+                    }
+                }
+            }
+        }
+
+        // Only the cluster table and the tree over the clusters are kept in memory
+        size_t structure_bytes() const override {
+            return sizeof(ooc_model) + clusters.capacity() * sizeof(ooc_cluster) +
+                   tree.capacity() * sizeof(ooc_node) + tree_order.capacity() * sizeof(uint32_t);
+        }
+
+        // Pages in every cluster, in turn
+        void flatten(std::vector<flat_primitive>& out) const override {
+            int part = 0;
+            for (uint32_t c = 0; c < clusters.size(); c++) {
+                use(c);
+                const ooc_triangle* tris = triangles_of(c);
+                for (uint32_t i = 0; i < clusters[c].triangles; i++) {
+                    flat_primitive tri;
+                    tri.shape = flat_primitive::TRIANGLE;
+                    tri.mat = mat.get();
+                    tri.source = this;
+                    tri.part = part++;
+                    point a, b, v;
+                    vertices(tris[i], a, b, v);
+                    tri.a = a;
+                    tri.b = b - a;
+                    tri.c = v - a;
+                    out.push_back(tri);
+                }
+            }
+        }
+
+        const std::string& name() const { return path; }
+        const std::string& file() const { return target; }
+        size_t triangle_count() const { return n_triangles; }
+        size_t cluster_count() const { return clusters.size(); }
+        size_t file_size() const { return file_bytes; }
+        double load_time() const { return load_seconds; }
+        double build_time() const { return build_seconds; }
+
+        paging_metrics paging() const {
+            paging_metrics m;
+            m.name = path;
+            m.clusters = clusters.size();
+            m.file_bytes = file_bytes;
+            m.budget_bytes = memory_budget;
+            m.page_ins = page_ins.load();
+            m.evictions = evictions.load();
+            m.bytes_paged = bytes_paged.load();
+            m.cluster_visits = cluster_visits.load();
+            m.ray_visits = ray_visits.load();
+            return m;
+        }
+
+    private:
+        // Room for the tree over the clusters and for the cluster trees, whose SAH splits stop at depth 48
+        static const int max_stack = 128;
+
+        std::string path;
+        std::string target;
+        shared_ptr<material> mat;
+        aabb bbox;
+        size_t n_triangles = 0;
+        double load_seconds = 0;
+        double build_seconds = 0;
+
+        int fd = -1;
+        const char* base = nullptr;
+        size_t file_bytes = 0;
+        std::vector<ooc_cluster> clusters;
+        std::vector<ooc_node> tree;             // over the cluster boxes, one cluster per leaf
+        std::vector<uint32_t> tree_order;
+
+        size_t memory_budget = 0;               // bytes of clusters that may be resident at once
+
+        // Paging: the tick of the last use of every resident cluster, 0 for the others
+        std::unique_ptr<std::atomic<uint64_t>[]> last_use;
+        mutable std::atomic<uint64_t> ticks;
+        mutable std::mutex paging_mutex;
+        mutable std::vector<uint32_t> resident;
+        mutable size_t resident_bytes = 0;
+        mutable std::atomic<unsigned long long> page_ins, evictions, bytes_paged, cluster_visits, ray_visits;
+
+        ooc_model(const std::string& path, const std::string& target, const ooc_header& head,
+                  shared_ptr<material> mat)
+            : path(path), target(target), mat(mat), n_triangles(size_t(head.triangles)), ticks(0), page_ins(0),
+              evictions(0), bytes_paged(0), cluster_visits(0), ray_visits(0) {
+            fd = ::open(target.c_str(), O_RDONLY);
+            struct stat info;
+            if (fd < 0 || fstat(fd, &info) != 0 || head.clusters == 0)
+                return;
+            file_bytes = size_t(info.st_size);
+            // A file cut short leaves base null rather than clusters outside the mapping
+            if (head.table_offset > file_bytes ||
+                head.clusters > (file_bytes - head.table_offset) / sizeof(ooc_cluster))
+                return;
+            void* p = mmap(nullptr, file_bytes, PROT_READ, MAP_SHARED, fd, 0);
+            if (p == MAP_FAILED)
+                return;
+
+            // Nothing is resident before a ray needs it, not even in the page cache
+            madvise(p, file_bytes, MADV_RANDOM);
+            fdatasync(fd);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+            const ooc_cluster* table = reinterpret_cast<const ooc_cluster*>(static_cast<const char*>(p) +
+                                                                            head.table_offset);
+            clusters.assign(table, table + head.clusters);
+            for (const auto& c : clusters) {
+                size_t bytes = c.nodes * sizeof(ooc_node) + c.triangles * sizeof(ooc_triangle);
+                if (c.nodes == 0 || c.offset > file_bytes || bytes > file_bytes - c.offset) {
+                    munmap(p, file_bytes);
+                    clusters.clear();
+                    return;
+                }
+            }
+            base = static_cast<const char*>(p);
+            std::vector<aabb> boxes;
+            for (const auto& c : clusters) {
+                boxes.push_back(aabb(point(c.lo[0], c.lo[1], c.lo[2]), point(c.hi[0], c.hi[1], c.hi[2])));
+                bbox = aabb(bbox, boxes.back());
+            }
+            ooc_tree_builder::build(boxes, 1, tree, tree_order);
+            last_use.reset(new std::atomic<uint64_t>[clusters.size()]);
+            for (size_t c = 0; c < clusters.size(); c++)
+                last_use[c].store(0);
+            madvise(const_cast<char*>(base), file_bytes, MADV_DONTNEED);
+        }
+
+        const ooc_node* nodes_of(uint32_t c) const {
+            return reinterpret_cast<const ooc_node*>(base + clusters[c].offset);
+        }
+
+        const ooc_triangle* triangles_of(uint32_t c) const {
+            return reinterpret_cast<const ooc_triangle*>(nodes_of(c) + clusters[c].nodes);
+        }
+
+        size_t bytes_of(uint32_t c) const {
+            size_t page = size_t(sysconf(_SC_PAGESIZE));
+            size_t bytes = clusters[c].nodes * sizeof(ooc_node) + clusters[c].triangles * sizeof(ooc_triangle);
+            return (bytes + page - 1) / page * page;
+        }
+
+        // Pages cluster `c` in unless it is resident, and marks it as used
+        void use(uint32_t c) const {
+            uint64_t now = ticks.fetch_add(1, std::memory_order_relaxed) + 1;
+            uint64_t seen = last_use[c].load(std::memory_order_relaxed);
+            if (seen != 0 && last_use[c].compare_exchange_strong(seen, now, std::memory_order_relaxed))
+                return;
+
+            std::lock_guard<std::mutex> lock(paging_mutex);
+            if (last_use[c].load(std::memory_order_relaxed) != 0) {
+                last_use[c].store(now, std::memory_order_relaxed);
+                return;
+            }
+            madvise(const_cast<char*>(base) + clusters[c].offset, bytes_of(c), MADV_WILLNEED);
+            last_use[c].store(now, std::memory_order_relaxed);
+            resident.push_back(c);
+            resident_bytes += bytes_of(c);
+            page_ins++;
+            bytes_paged += bytes_of(c);
+
+            // A cluster dropped while a ray is still in it is read again by the page faults
+            while (resident_bytes > memory_budget && resident.size() > 1) {
+                size_t oldest = 0;
+                for (size_t i = 1; i < resident.size(); i++)
+                    if (last_use[resident[i]].load(std::memory_order_relaxed) <
+                        last_use[resident[oldest]].load(std::memory_order_relaxed))
+                        oldest = i;
+                uint32_t victim = resident[oldest];
+                if (victim == c)
+                    break;
+                resident[oldest] = resident.back();
+                resident.pop_back();
+                last_use[victim].store(0, std::memory_order_relaxed);
+                resident_bytes -= bytes_of(victim);
+                madvise(const_cast<char*>(base) + clusters[victim].offset, bytes_of(victim), MADV_DONTNEED);
+                posix_fadvise(fd, off_t(clusters[victim].offset), off_t(bytes_of(victim)), POSIX_FADV_DONTNEED);
+                evictions++;
+            }
+        }
+
+        bool hit_cluster(uint32_t c, const ray& r, const double* inverse, interval ray_t, hit_record& rec) const {
+            const ooc_node* nodes = nodes_of(c);
+            const ooc_triangle* tris = triangles_of(c);
+            uint32_t stack[max_stack];
+            int top = 0;
+            stack[top++] = 0;
+            bool hit_anything = false;
+            while (top > 0) {
+                uint32_t index = stack[--top];
+                const ooc_node& n = nodes[index];
+                double entry;
+                record_traversal_step(rec);
+                if (!ooc_box_entry(n, r.origin(), inverse, ray_t, entry))
+                    continue;
+                if (n.count > 0) {
+                    for (uint32_t i = n.first; i < n.first + n.count; i++) {
+                        if (hit_triangle(tris[i], r, ray_t, rec)) {
+                            hit_anything = true;
+                            ray_t.max = rec.t;
+                        }
+                    }
+                    continue;
+                }
+                stack[top++] = n.first;
+                stack[top++] = index + 1;
+            }
+            return hit_anything;
+        }
+
+        static void vertices(const ooc_triangle& tri, point& a, point& b, point& c) {
+            a = point(tri.a[0], tri.a[1], tri.a[2]);
+            b = point(tri.b[0], tri.b[1], tri.b[2]);
+            c = point(tri.c[0], tri.c[1], tri.c[2]);
+        }
+
+        // Moller-Trumbore, with the barycentrics of the second and third vertex as (u, v) like triangle
+        bool hit_triangle(const ooc_triangle& tri, const ray& r, interval ray_t, hit_record& rec) const {
+            record_intersection_test(rec);
+            point a, b, c;
+            vertices(tri, a, b, c);
+            vec3 e1 = b - a, e2 = c - a;
+            vec3 p = cross(r.direction(), e2);
+            double det = dot(e1, p);
+            if (det == 0)
+                return false;
+            double inverse = 1.0 / det;
+            vec3 s = r.origin() - a;
+            double u = dot(s, p) * inverse;
+            if (u < 0 || u > 1)
+                return false;
+            vec3 q = cross(s, e1);
+            double v = dot(r.direction(), q) * inverse;
+            if (v < 0 || u + v > 1)
+                return false;
+            double t = dot(e2, q) * inverse;
+            if (!ray_t.contains(t))
+                return false;
+
+            rec.t = t;
+            rec.p = r.at(t);
+            rec.u = u;
+            rec.v = v;
+            rec.mat = mat;
+            rec.set_face_normal(r, unit_vector(cross(e1, e2)));
+            return true;
+        }
+};
+
+#else
+// Needs mmap, models are loaded into memory on this platform
+class ooc_model : public hittable {
+    public:
+        static shared_ptr<ooc_model> open(const std::string& path, shared_ptr<material>, const build_options&) {
+            std::clog << "Out-of-core meshes need mmap, " << path << " is loaded into memory" << std::endl;
+            return nullptr;
+        }
+
+        bool hit(const ray&, interval, hit_record&) const override { return false; }
+        aabb bounding_box() const override { return aabb(); }
+        const std::string& name() const { return path; }
+        size_t triangle_count() const { return 0; }
+        size_t cluster_count() const { return 0; }
+        size_t file_size() const { return 0; }
+        double load_time() const { return 0; }
+        double build_time() const { return 0; }
+        paging_metrics paging() const { return paging_metrics(); }
+    private:
+        std::string path;
+};
+#endif
+
+// Adds the paging counters of every out-of-core mesh in the world to `metrics`
+inline void collect_paging(const hittable_list& world, render_metrics& metrics) {
+    for (const auto& obj : world.objects) {
+        auto mdl = dynamic_cast<const ooc_model*>(obj.get());
+        if (mdl)
+            metrics.paging.push_back(mdl->paging());
+    }
+}
+
+#endif
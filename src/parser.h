@@ -2,18 +2,74 @@
 #define PARSER_H
 
 #include "common.h"
+#include "build_options.h"
 #include "camera.h"
 #include "hittable.h"
+#include "lod.h"
 #include "material.h"
+#include "metrics.h"
 #include "model.h"
+#include "model_loader.h"
+#include "out_of_core.h"
 #include "primitive.h"
 
 #include <cstring>
+#include <functional>
+#include <map>
+#include <set>
+#include <sstream>
 
 struct settings {
     std::string infile = "scenes/in.trace";
     std::string outfile = "output/image.ppm";
     std::string model = "bvh";
+    std::string backend = "cpu";
+    std::string kernels;                // OpenCL source to build instead of the embedded one
+    std::string kernel_cache;           // OpenCL binary cache directory, "off" disables it
+    std::string cl_builder = "sah";     // OpenCL BVH: "sah" on the host or "lbvh" on the device
+    build_options build;                // how the structures and models are built, see build_options.h
+    int layout_profile = 0;             // lay the trees out after a sampling run at 1/n of the resolution
+    std::string tree_report;            // JSON file to describe the built structures in, instead of rendering
+    int ray_batch = 0;                  // paths traced a bounce at a time together, 0 traces them one by one
+    int threads = 0;
+    std::string sampler = "sobol";
+    std::string reference;
+    std::string integrator = "iterative";
+    int rr_depth = 5;
+
+    // Animated sequence, enabled by asking for more than zero frames
+    int frames = 0;
+    double moving = 0.01;               // share of the spheres and models that move
+    std::string update = "refit";       // "refit" or "rebuild" the top-level structure every frame
+    double rebuild_threshold = 1.5;
+
+    // Multi-view batch, one image per camera in this file against a single loaded scene
+    std::string views;
+
+    // Progressive rendering, enabled by giving samples per pass or a checkpoint to resume
+    int spp = 0;                        // overrides the AA line of the scene
+    int pass_samples = 0;
+    std::string checkpoint;             // defaults to the image path with .ckpt, "off" disables it
+    double checkpoint_interval = 60;    // seconds between checkpoints, the last pass always saves one
+    std::string resume;
+
+    // Render server, "stdin" or the path of a Unix socket
+    std::string server;
+
+    // Distributed render over render servers, enabled by giving workers
+    std::string workers;                // comma separated addresses
+    int local_workers = 0;              // servers to start on this host
+    int tile_size = 32;
+    int chunk_samples = 0;              // samples per work unit, 0 takes all of them at once
+    double worker_timeout = 120;
+
+    // Batch scene benchmark, enabled by giving a directory of .trace files
+    std::string benchmark;
+    std::string bench_modes = "bvh,kd,bih";
+    int bench_runs = 3;
+    std::string bench_baseline;
+    double bench_tolerance = 10.0;
+    std::string bench_output = "output/benchmark";
 };
 
 const settings parse_args(int argc, char* argv[]) {
@@ -33,6 +89,77 @@ const settings parse_args(int argc, char* argv[]) {
                     stng.infile = param;
                 } else if (strcmp(opt, "-o") == 0 || strcmp(opt, "--output") == 0) {
                     stng.outfile = param;
+                } else if (strcmp(opt, "-b") == 0 || strcmp(opt, "--backend") == 0) {
+                    stng.backend = param;
+                } else if (strcmp(opt, "--kernels") == 0) {
+                    stng.kernels = param;
+                } else if (strcmp(opt, "--kernel-cache") == 0) {
+                    stng.kernel_cache = param;
+                } else if (strcmp(opt, "--cl-build") == 0) {
+                    stng.cl_builder = param;
+                } else if (strncmp(opt, "--", 2) == 0 && stng.build.set(opt + 2, param)) {
+                    // --sbvh-budget, --layout, --lazy-levels, --auto-probe, --out-of-core, --ooc-memory, --lod,
+                    // --lod-detail, --lod-levels, --lod-cache and --load-threads
+                } else if (strcmp(opt, "--layout-profile") == 0) {
+                    stng.layout_profile = atoi(param);
+                } else if (strcmp(opt, "--ray-batch") == 0) {
+                    stng.ray_batch = atoi(param);
+                } else if (strcmp(opt, "--tree-report") == 0) {
+                    stng.tree_report = param;
+                } else if (strcmp(opt, "-t") == 0 || strcmp(opt, "--threads") == 0) {
+                    stng.threads = atoi(param);
+                } else if (strcmp(opt, "-s") == 0 || strcmp(opt, "--sampler") == 0) {
+                    stng.sampler = param;
+                } else if (strcmp(opt, "-r") == 0 || strcmp(opt, "--reference") == 0) {
+                    stng.reference = param;
+                } else if (strcmp(opt, "--integrator") == 0) {
+                    stng.integrator = param;
+                } else if (strcmp(opt, "--rr-depth") == 0) {
+                    stng.rr_depth = atoi(param);
+                } else if (strcmp(opt, "--frames") == 0) {
+                    stng.frames = atoi(param);
+                } else if (strcmp(opt, "--moving") == 0) {
+                    stng.moving = atof(param);
+                } else if (strcmp(opt, "--update") == 0) {
+                    stng.update = param;
+                } else if (strcmp(opt, "--rebuild-threshold") == 0) {
+                    stng.rebuild_threshold = atof(param);
+                } else if (strcmp(opt, "--views") == 0) {
+                    stng.views = param;
+                } else if (strcmp(opt, "--spp") == 0) {
+                    stng.spp = stng.build.spp = atoi(param);
+                } else if (strcmp(opt, "--pass-samples") == 0) {
+                    stng.pass_samples = atoi(param);
+                } else if (strcmp(opt, "--checkpoint") == 0) {
+                    stng.checkpoint = param;
+                } else if (strcmp(opt, "--checkpoint-interval") == 0) {
+                    stng.checkpoint_interval = atof(param);
+                } else if (strcmp(opt, "--resume") == 0) {
+                    stng.resume = param;
+                } else if (strcmp(opt, "--server") == 0) {
+                    stng.server = param;
+                } else if (strcmp(opt, "--workers") == 0) {
+                    stng.workers = param;
+                } else if (strcmp(opt, "--local-workers") == 0) {
+                    stng.local_workers = atoi(param);
+                } else if (strcmp(opt, "--tile") == 0) {
+                    stng.tile_size = atoi(param);
+                } else if (strcmp(opt, "--chunk-samples") == 0) {
+                    stng.chunk_samples = atoi(param);
+                } else if (strcmp(opt, "--worker-timeout") == 0) {
+                    stng.worker_timeout = atof(param);
+                } else if (strcmp(opt, "--benchmark") == 0) {
+                    stng.benchmark = param;
+                } else if (strcmp(opt, "--modes") == 0) {
+                    stng.bench_modes = param;
+                } else if (strcmp(opt, "--runs") == 0) {
+                    stng.bench_runs = atoi(param) > 0 ? atoi(param) : 1;
+                } else if (strcmp(opt, "--baseline") == 0) {
+                    stng.bench_baseline = param;
+                } else if (strcmp(opt, "--tolerance") == 0) {
+                    stng.bench_tolerance = atof(param);
+                } else if (strcmp(opt, "--bench-output") == 0) {
+                    stng.bench_output = param;
                 }
             }
         }
@@ -69,6 +196,82 @@ const void parse_camera_info(FILE* file, camera& cam) {
         << ' ' << upz << ") " << fov << std::endl;
 }
 
+// One camera placement of a multi-view batch, the rest of the camera comes from the scene file
+struct camera_view {
+    std::string source;
+    point lookfrom;
+    point lookat;
+    vec3 vup;
+    double vfov = 90;
+
+    void apply(camera& cam) const {
+        cam.lookfrom = lookfrom;
+        cam.lookat = lookat;
+        cam.vup = vup;
+        cam.vfov = vfov;
+    }
+};
+
+// Reads the arguments of a CAM line in the same format as parse_camera_info
+inline bool parse_view(const char* text, camera_view& view) {
+    double lfx, lfy, lfz;
+    double lax, lay, laz;
+    int upx, upy, upz;
+    double fov;
+    if (sscanf(text, " (%lf %lf %lf) (%lf %lf %lf) (%i %i %i) %lf",
+               &lfx, &lfy, &lfz, &lax, &lay, &laz, &upx, &upy, &upz, &fov) != 10)
+        return false;
+    view.lookfrom = point(lfx, lfy, lfz);
+    view.lookat = point(lax, lay, laz);
+    view.vup = vec3(upx, upy, upz);
+    view.vfov = fov;
+    return true;
+}
+
+// Every line of a views file is either a CAM line or a .trace file whose CAM line is taken, so a camera path can be
+// listed directly and the _angle_N files of a scene can be batched without editing them
+inline bool load_views(const std::string& path, std::vector<camera_view>& views) {
+    std::ifstream file(path);
+    if (!file) {
+        std::clog << "Could not open views file " << path << std::endl;
+        return false;
+    }
+    std::string line;
+    for (int number = 1; std::getline(file, line); number++) {
+        auto start = line.find_first_not_of(" \t\r");
+        if (start == std::string::npos || line[start] == '#')
+            continue;
+        auto end = line.find_last_not_of(" \t\r");
+        line = line.substr(start, end - start + 1);
+
+        camera_view view;
+        view.source = path + ":" + std::to_string(number);
+        if (line.compare(0, 3, "CAM") == 0) {
+            if (!parse_view(line.c_str() + 3, view)) {
+                std::clog << "Could not parse camera on " << view.source << std::endl;
+                return false;
+            }
+            views.push_back(view);
+            continue;
+        }
+
+        std::ifstream trace(line);
+        std::string trace_line;
+        bool found = false;
+        while (!found && std::getline(trace, trace_line)) {
+            auto cam = trace_line.find("CAM");
+            found = cam != std::string::npos && parse_view(trace_line.c_str() + cam + 3, view);
+        }
+        if (!found) {
+            std::clog << "No camera in " << line << " (" << view.source << ")" << std::endl;
+            return false;
+        }
+        view.source = line;
+        views.push_back(view);
+    }
+    return true;
+}
+
 const void parse_aa(FILE* file, camera& cam) {
     std::clog << "\rLoading Scene (Anti-Aliasing)...            " << std::flush;
     int samples;
@@ -115,12 +318,32 @@ const shared_ptr<material> parse_material(FILE* file) {
     throw std::invalid_argument("Could not parse Material!");
 }
 
-const shared_ptr<model> parse_model(FILE* file, const char* mode = "brute") {
+// The OBJ path and the material of a MODEL line
+const std::string parse_model_line(FILE* file, shared_ptr<material>& mat) {
     std::clog << "\rLoading Scene (Building Model)...           " << std::flush;
     char model_path[128];
     fscanf(file, "%s ", model_path);
-    shared_ptr<material> mat = parse_material(file);
-    return make_shared<model>(model_path, mat, mode);
+    mat = parse_material(file);
+    return model_path;
+}
+
+// The optional "(x y z)" after the material of a MODEL line, where the model is placed as an instance
+const vec3 parse_offset(FILE* file) {
+    double x, y, z;
+    long start = ftell(file);
+    if (fscanf(file, " (%lf %lf %lf)", &x, &y, &z) == 3)
+        return vec3(x, y, z);
+    fseek(file, start, SEEK_SET);
+    return vec3(0, 0, 0);
+}
+
+// MODEL lines with the same OBJ file and material share one model
+const std::string model_key(const std::string& path, const material& mat) {
+    flat_material flat = mat.flatten();
+    std::ostringstream key;
+    key << path << " " << flat.type << " " << flat.albedo.x() << " " << flat.albedo.y() << " " << flat.albedo.z()
+        << " " << flat.param;
+    return key.str();
 }
 
 const shared_ptr<sphere> parse_sphere(FILE* file) {
@@ -143,12 +366,56 @@ const shared_ptr<quad> parse_quad(FILE* file) {
     return make_shared<quad>(point(qx, qy, qz), vec3(ux, uy, uz), vec3(vx, vy, vz), mat);
 }
 
-const hittable_list load_scene(camera& cam, const char* path, const char* mode) {
+// With `objects` the top-level objects are stored there and the world is returned without a structure over them.
+// `view` changes the camera after every IMAGE and CAM line, so levels of detail are chosen for the camera of a render
+// that overrides the file's
+const hittable_list load_scene(camera& cam, const char* path, const char* mode, const build_options& options,
+                               render_metrics* metrics = nullptr, hittable_list* objects = nullptr,
+                               const std::function<void(camera&)>& view = nullptr) {
+    stopwatch timer;
     hittable_list world;
+    hittable_list out_of_core;          // meshes with their own trees, kept out of the world structure
+    std::map<std::string, shared_ptr<lod_set>> lod_sets;
+    model_loader loader(mode, options);
+
+    // The world in file order, models that are still loading hold their place as null
+    struct pending_model {
+        size_t slot;
+        size_t task;
+        vec3 offset;
+    };
+    std::vector<shared_ptr<hittable>> placed;
+    std::vector<pending_model> pending;
+    std::set<const model*> recorded;
+    double model_seconds = 0;
+
+    auto record = [&](const model& mdl) {
+        recorded.insert(&mdl);
+        model_seconds += mdl.load_time() + mdl.build_time();
+        if (!metrics)
+            return;
+        structure_metrics m;
+        m.name = mdl.name();
+        if (mdl.structure_mode() != mode)
+            m.mode = mdl.structure_mode();
+        m.primitives = mdl.triangle_count();
+        m.references = mdl.reference_count();
+        m.load_seconds = mdl.load_time();
+        m.build_seconds = mdl.build_time();
+        m.bytes = mdl.structure_bytes();
+        metrics->structures.push_back(m);
+        metrics->add_time("obj_load", mdl.load_time());
+        metrics->add_time("build", mdl.build_time());
+    };
 
     FILE* file = fopen(path, "r");
     if (file == NULL)
         return world;
+    if (metrics) {
+        metrics->scene = path;
+        metrics->mode = mode;
+        metrics->add_time("parse", 0);
+    }
 
     while (true) {
         char lineHeader[128];
@@ -157,15 +424,67 @@ const hittable_list load_scene(camera& cam, const char* path, const char* mode)
             break;
 
         if (strcmp(lineHeader, "MODEL") == 0) {
-            world.add(parse_model(file, mode));
+            shared_ptr<material> mat;
+            std::string model_path = parse_model_line(file, mat);
+            vec3 offset = parse_offset(file);
+            bool moved = offset.length_squared() > 0;
+            shared_ptr<ooc_model> streamed;
+            if (!options.out_of_core.empty() && !objects)
+                streamed = ooc_model::open(model_path, mat, options);
+            if (streamed) {
+                if (moved)
+                    std::clog << "\rThe offset of " << model_path << " is ignored out of core" << std::endl;
+                out_of_core.add(streamed);
+                model_seconds += streamed->load_time() + streamed->build_time();
+                if (metrics) {
+                    structure_metrics m;
+                    m.name = streamed->name();
+                    m.mode = "out_of_core";
+                    m.primitives = streamed->triangle_count();
+                    m.references = m.primitives;
+                    m.load_seconds = streamed->load_time();
+                    m.build_seconds = streamed->build_time();
+                    m.bytes = streamed->structure_bytes();
+                    metrics->structures.push_back(m);
+                    metrics->add_time("obj_load", m.load_seconds);
+                    metrics->add_time("build", m.build_seconds);
+                }
+                continue;
+            }
+            // The levels are chosen from the camera, so IMAGE and CAM come before the models
+            build_options model_options = options;
+            model_options.rays = auto_structure::expected_rays(cam, options);
+            std::string key = model_key(model_path, *mat);
+            if (options.lod != "off" && !objects) {
+                auto& set = lod_sets[key];
+                if (!set) {
+                    stopwatch simplify;
+                    set = make_shared<lod_set>(model_path, mat, mode, model_options);
+                    model_seconds += simplify.elapsed();
+                    if (metrics)
+                        metrics->add_time("simplify", simplify.elapsed());
+                }
+                placed.push_back(set->place(offset, cam));
+                for (const auto& level : set->built())
+                    if (level && !recorded.count(level.get()))
+                        record(*level);
+                continue;
+            }
+            pending_model p = {placed.size(), loader.load(key, model_path, mat, model_options.rays), offset};
+            pending.push_back(p);
+            placed.push_back(nullptr);
         } else if (strcmp(lineHeader, "SPHERE") == 0) {
-            world.add(parse_sphere(file));
+            placed.push_back(parse_sphere(file));
         } else if (strcmp(lineHeader, "QUAD") == 0) {
-            world.add(parse_quad(file));
+            placed.push_back(parse_quad(file));
         } else if (strcmp(lineHeader, "IMAGE") == 0) {
             parse_image_info(file, cam);
+            if (view)
+                view(cam);
         } else if (strcmp(lineHeader, "CAM") == 0) {
             parse_camera_info(file, cam);
+            if (view)
+                view(cam);
         } else if (strcmp(lineHeader, "AA") == 0) {
             parse_aa(file, cam);
         } else if (strcmp(lineHeader, "DEPTH") == 0) {
@@ -175,15 +494,71 @@ const hittable_list load_scene(camera& cam, const char* path, const char* mode)
         }
     }
     fclose(file);
+    double parse_seconds = timer.elapsed() - model_seconds - loader.waited();
+    double parse_waited = loader.waited();
+
+    // The world can be laid out as soon as every model knows its bounding box
+    loader.wait_loaded();
+    for (const auto& p : pending) {
+        const auto& mdl = loader.model_of(p.task);
+        placed[p.slot] = p.offset.length_squared() > 0 ? shared_ptr<hittable>(make_shared<instance>(mdl, p.offset))
+                                                       : shared_ptr<hittable>(mdl);
+    }
+    for (const auto& obj : placed)
+        world.add(obj);
+    if (metrics)
+        for (const auto& set : lod_sets)
+            metrics->lods.push_back(set.second->metrics());
     std::clog << "size:" << std::endl;
     std::clog << world.objects.size() << std::endl;
+    size_t n_objects = world.objects.size();
+    size_t n_references = n_objects;
+    auto finish_models = [&]() {
+        loader.wait_built();
+        for (size_t i = 0; i < loader.size(); i++)
+            record(*loader.model_of(i));
+        if (metrics) {
+            metrics->add_time("parse", parse_seconds);
+            metrics->add_time("load_wait", loader.waited() - parse_waited);
+        }
+    };
+    if (objects) {
+        finish_models();
+        *objects = world;
+        return world;
+    }
 
-    if (strcmp(mode, "bvh") == 0)
-        world = hittable_list(make_shared<bvh_node>(world));
-    else if (strcmp(mode, "kd") == 0)
-        world = hittable_list(make_shared<kd_node>(world));
-    else if (strcmp(mode, "bih") == 0)
-        world = hittable_list(make_shared<bih_node>(world));
+    // Statistics of -m auto ask the models about their structures
+    if (std::string(mode) == "auto")
+        finish_models();
+    timer.reset();
+    build_options world_options = options;
+    world_options.rays = auto_structure::expected_rays(cam, options);
+    built_structure built = make_structure(mode, world, "world", world_options);
+    if (built.root)
+        world = hittable_list(built.root);
+    if (built.references > 0)
+        n_references = built.references;
+    double world_seconds = timer.elapsed();
+    if (std::string(mode) != "auto")
+        finish_models();
+    // As objects of the world list their hit_batch is called with every batch of rays
+    for (const auto& streamed : out_of_core.objects)
+        world.add(streamed);
+
+    if (metrics) {
+        structure_metrics m;
+        m.name = "world";
+        if (built.mode != mode)
+            m.mode = built.mode;
+        m.primitives = n_objects;
+        m.references = n_references;
+        m.build_seconds = world_seconds;
+        // The models have entries of their own, a shared one would be counted once per instance
+        m.bytes = world.top_level_bytes();
+        metrics->structures.push_back(m);
+        metrics->add_time("build", m.build_seconds);
+    }
 
     return world;
 }
@@ -25,7 +25,7 @@ class quad : public hittable {
         aabb bounding_box() const override { return bbox; }
 
         bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-            rec.stats->record_intersection_test();
+            record_intersection_test(rec);
             auto denom = dot(normal, r.direction());
 
             if (std::fabs(denom) < 1e-8)
@@ -51,6 +51,21 @@ class quad : public hittable {
             return true;
         }
 
+        aabb clip_box(int axis, double lo, double hi) const override {
+            point outline[4];
+            int n = corners(outline);
+            return intersect(bbox, clip_polygon(outline, n, axis, lo, hi));
+        }
+
+        // The outline of the surface, in order
+        virtual int corners(point* out) const {
+            out[0] = Q;
+            out[1] = Q + u;
+            out[2] = Q + u + v;
+            out[3] = Q + v;
+            return 4;
+        }
+
         virtual bool is_interior(double a, double b, hit_record& rec) const {
             interval unit_interval = interval(0,1);
 
@@ -62,7 +77,24 @@ class quad : public hittable {
             return true;
         }
 
-    private:
+        void flatten(std::vector<flat_primitive>& out) const override {
+            flat_primitive tri;
+            tri.shape = flat_primitive::TRIANGLE;
+            tri.mat = mat.get();
+            tri.source = this;
+            tri.a = Q;
+            tri.b = u;
+            tri.c = v;
+            out.push_back(tri);
+
+            tri.a = Q + u + v;
+            tri.b = -u;
+            tri.c = -v;
+            tri.part = 1;
+            out.push_back(tri);
+        }
+
+    protected:
         point Q;
         vec3 u, v, w;
         shared_ptr<material> mat;
@@ -75,6 +107,13 @@ class triangle : public quad {
     public:
         triangle(const point& Q, const vec3& u, const vec3& v, shared_ptr<material> mat) : quad(Q, u, v, mat) {}
 
+        int corners(point* out) const override {
+            out[0] = Q;
+            out[1] = Q + u;
+            out[2] = Q + v;
+            return 3;
+        }
+
         bool is_interior(double a, double b, hit_record& rec) const override {
             auto gamma = 1.0 - a - b;
             if (a < 0 || b < 0 || gamma < 0)
@@ -84,13 +123,17 @@ class triangle : public quad {
             rec.v = b;
             return true;
         }
-    private:
-        point Q;
-        vec3 u, v, w;
-        shared_ptr<material> mat;
-        aabb bbox;
-        vec3 normal;
-        double D;
+
+        void flatten(std::vector<flat_primitive>& out) const override {
+            flat_primitive tri;
+            tri.shape = flat_primitive::TRIANGLE;
+            tri.mat = mat.get();
+            tri.source = this;
+            tri.a = Q;
+            tri.b = u;
+            tri.c = v;
+            out.push_back(tri);
+        }
 };
 
 class sphere : public hittable {
@@ -107,7 +150,7 @@ class sphere : public hittable {
             }
 
         bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-            rec.stats->record_intersection_test();
+            record_intersection_test(rec);
             vec3 oc = center - r.origin();
             auto a = r.direction().length_squared();
             auto h = dot(r.direction(), oc);
@@ -137,6 +180,24 @@ class sphere : public hittable {
         }
 
         aabb bounding_box() const override { return bbox; }
+
+        const point& position() const { return center; }
+
+        void move_to(const point& new_center) {
+            center = new_center;
+            auto rvec = vec3(radius, radius, radius);
+            bbox = aabb(center - rvec, center + rvec);
+        }
+
+        void flatten(std::vector<flat_primitive>& out) const override {
+            flat_primitive sph;
+            sph.shape = flat_primitive::SPHERE;
+            sph.mat = mat.get();
+            sph.source = this;
+            sph.a = center;
+            sph.radius = radius;
+            out.push_back(sph);
+        }
 };
 
 #endif
@@ -0,0 +1,86 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <cstdint>
+
+// 4D PCG hash (Jarzynski & Olano, "Hash Functions for GPU Rendering"), mixes all four inputs into four outputs
+inline void pcg4d(uint32_t v[4]) {
+    for (int i = 0; i < 4; i++)
+        v[i] = v[i] * 1664525u + 1013904223u;
+
+    v[0] += v[1] * v[3];
+    v[1] += v[2] * v[0];
+    v[2] += v[0] * v[1];
+    v[3] += v[1] * v[2];
+
+    for (int i = 0; i < 4; i++)
+        v[i] ^= v[i] >> 16;
+
+    v[0] += v[1] * v[3];
+    v[1] += v[2] * v[0];
+    v[2] += v[0] * v[1];
+    v[3] += v[1] * v[2];
+}
+
+// Counter-based random numbers: the n-th number drawn at a bounce is a pure function of
+// (pixel, sample, bounce, n), so there is no shared state and the image does not depend on thread count or the
+// order pixels are visited in. Every hash produces four numbers, which are handed out one by one or all at once.
+class rng {
+    public:
+        rng(uint32_t pixel = 0, uint32_t sample = 0, uint32_t bounce = 0)
+            : pixel(pixel), sample(sample), bounce(bounce) {}
+
+        // Starts a fresh stream for the next path vertex
+        void set_bounce(uint32_t b) {
+            bounce = b;
+            dimension = 0;
+            lane = 4;
+        }
+
+        // Four 32-bit numbers from one hash, for filling SIMD lanes
+        void next4(uint32_t out[4]) {
+            out[0] = pixel;
+            out[1] = sample;
+            out[2] = bounce;
+            out[3] = dimension++;
+            pcg4d(out);
+        }
+
+        void fill(double* out, int n) {
+            uint32_t v[4];
+            for (int i = 0; i < n; i += 4) {
+                next4(v);
+                for (int j = 0; j < 4 && i + j < n; j++)
+                    out[i + j] = to_unit(v[j]);
+            }
+        }
+
+        // Uniform in [0, 1)
+        double next() {
+            if (lane == 4) {
+                next4(cache);
+                lane = 0;
+            }
+            return to_unit(cache[lane++]);
+        }
+
+        double next(double min, double max) {
+            return min + (max-min) * next();
+        }
+
+        int next_int(int min, int max) {
+            return int(next(min, max+1));
+        }
+
+    private:
+        uint32_t pixel, sample, bounce;
+        uint32_t dimension = 0;
+        uint32_t cache[4];
+        int lane = 4;
+
+        static double to_unit(uint32_t v) {
+            return v * (1.0 / 4294967296.0);
+        }
+};
+
+#endif
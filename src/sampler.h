@@ -0,0 +1,272 @@
+/*
+    IN THIS FILE you will find the samplers that feed random numbers to the camera and the materials:
+
+    1) independent: uniform white noise from the counter-based rng
+    2) sobol: a 2D Sobol (0,2)-sequence per dimension pair, Owen scrambled and shuffled per pixel
+              (Burley, "Practical Hash-based Owen Scrambling")
+    3) bluenoise: the same Sobol points with one scramble for the whole image, dithered per pixel with a
+                  toroidally shifted blue-noise tile so the remaining error is spread as high frequency noise
+
+    Every path vertex ("bounce") starts a fresh set of dimensions, so a sample only depends on
+    (pixel, sample index, bounce, dimension).
+*/
+
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "rng.h"
+
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct sample_2d {
+    double u, v;
+};
+
+class sampler {
+    public:
+        virtual ~sampler() = default;
+
+        virtual void start(uint32_t x, uint32_t y, uint32_t sample) = 0;
+
+        // Starts the dimensions of the next path vertex
+        virtual void start_bounce(uint32_t bounce) = 0;
+
+        virtual double get_1d() = 0;
+        virtual sample_2d get_2d() = 0;
+};
+
+class independent_sampler : public sampler {
+    public:
+        void start(uint32_t x, uint32_t y, uint32_t sample) override {
+            gen = rng((y << 16) ^ x, sample);
+        }
+
+        void start_bounce(uint32_t bounce) override { gen.set_bounce(bounce); }
+
+        double get_1d() override { return gen.next(); }
+
+        sample_2d get_2d() override {
+            sample_2d s;
+            s.u = gen.next();
+            s.v = gen.next();
+            return s;
+        }
+    private:
+        rng gen;
+};
+
+inline uint32_t reverse_bits(uint32_t x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+// Owen scrambling of a 32-bit fraction, every bit is flipped depending on the bits above it
+inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverse_bits(x);
+}
+
+// The first two Sobol dimensions, together they form a (0,2)-sequence
+inline uint32_t sobol_0(uint32_t index) { return reverse_bits(index); }
+
+inline uint32_t sobol_1(uint32_t index) {
+    uint32_t result = 0;
+    for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1)
+        if (index & 1)
+            result ^= v;
+    return result;
+}
+
+inline uint32_t hash_seed(uint32_t a, uint32_t b, uint32_t c, uint32_t d) {
+    uint32_t v[4] = {a, b, c, d};
+    pcg4d(v);
+    return v[0];
+}
+
+class sobol_sampler : public sampler {
+    public:
+        void start(uint32_t x, uint32_t y, uint32_t sample) override {
+            pixel_seed = hash_seed(x, y, 0x50b01u, 0);
+            index = sample;
+            bounce = dimension = 0;
+        }
+
+        void start_bounce(uint32_t b) override {
+            bounce = b;
+            dimension = 0;
+        }
+
+        double get_1d() override {
+            uint32_t seed = hash_seed(pixel_seed, bounce, dimension++, 1);
+            uint32_t i = nested_uniform_scramble(index, seed);
+            return to_unit(nested_uniform_scramble(sobol_0(i), seed ^ 0x9e3779b9u));
+        }
+
+        sample_2d get_2d() override {
+            uint32_t seed = hash_seed(pixel_seed, bounce, dimension++, 2);
+            uint32_t i = nested_uniform_scramble(index, seed);
+            sample_2d s;
+            s.u = to_unit(nested_uniform_scramble(sobol_0(i), seed ^ 0x9e3779b9u));
+            s.v = to_unit(nested_uniform_scramble(sobol_1(i), seed ^ 0x7f4a7c15u));
+            return s;
+        }
+
+    protected:
+        uint32_t pixel_seed = 0;
+        uint32_t index = 0;
+        uint32_t bounce = 0;
+        uint32_t dimension = 0;
+
+        static double to_unit(uint32_t v) { return v * (1.0 / 4294967296.0); }
+};
+
+// Blue-noise tile made with void-and-cluster (Ulichney 1993), values are ranks / (size*size)
+class blue_noise_tile {
+    public:
+        static const int size = 64;
+
+        static const blue_noise_tile& get() {
+            static blue_noise_tile tile;
+            return tile;
+        }
+
+        double operator()(uint32_t x, uint32_t y) const { return values[(y % size) * size + (x % size)]; }
+
+    private:
+        std::vector<double> values;
+
+        blue_noise_tile() : values(size * size) {
+            const int n = size * size;
+            const double sigma = 1.5;
+
+            // Toroidal gaussian energy of a single point, indexed by offset
+            std::vector<double> kernel(n);
+            for (int dy = 0; dy < size; dy++) {
+                for (int dx = 0; dx < size; dx++) {
+                    int wx = std::min(dx, size - dx), wy = std::min(dy, size - dy);
+                    kernel[dy * size + dx] = std::exp(-(wx * wx + wy * wy) / (2 * sigma * sigma));
+                }
+            }
+
+            std::vector<char> on(n, 0);
+            std::vector<double> energy(n, 0.0);
+            auto toggle = [&](int p, bool set) {
+                on[p] = set;
+                int px = p % size, py = p / size;
+                double sign = set ? 1.0 : -1.0;
+                for (int y = 0; y < size; y++)
+                    for (int x = 0; x < size; x++)
+                        energy[y * size + x] +=
+                            sign * kernel[((y - py + size) % size) * size + ((x - px + size) % size)];
+            };
+            // Tightest cluster: the set pixel with the most energy, largest void: the empty pixel with the least
+            auto extreme = [&](bool set, bool most) {
+                int best = -1;
+                for (int p = 0; p < n; p++) {
+                    if (on[p] != set)
+                        continue;
+                    if (best < 0 || (most ? energy[p] > energy[best] : energy[p] < energy[best]))
+                        best = p;
+                }
+                return best;
+            };
+
+            // Initial pattern: random points, relaxed by moving the tightest cluster into the largest void
+            rng gen(0x6e01u);
+            int initial = n / 10;
+            for (int placed = 0; placed < initial;) {
+                int p = int(gen.next() * n);
+                if (!on[p]) {
+                    toggle(p, true);
+                    placed++;
+                }
+            }
+            for (int iteration = 0; iteration < 4 * n; iteration++) {
+                int cluster = extreme(true, true);
+                toggle(cluster, false);
+                int hole = extreme(false, false);
+                toggle(hole, true);
+                if (hole == cluster)
+                    break;
+            }
+
+            std::vector<char> prototype = on;
+            std::vector<double> prototype_energy = energy;
+            std::vector<int> rank(n, 0);
+
+            // Phase 1: rank the initial points by removing clusters
+            for (int r = initial - 1; r >= 0; r--) {
+                int cluster = extreme(true, true);
+                toggle(cluster, false);
+                rank[cluster] = r;
+            }
+
+            // Phase 2 and 3: fill the largest voids until the tile is full
+            on = prototype;
+            energy = prototype_energy;
+            for (int r = initial; r < n; r++) {
+                int hole = extreme(false, false);
+                toggle(hole, true);
+                rank[hole] = r;
+            }
+
+            for (int p = 0; p < n; p++)
+                values[p] = (rank[p] + 0.5) / n;
+        }
+};
+
+class blue_noise_sampler : public sobol_sampler {
+    public:
+        void start(uint32_t px, uint32_t py, uint32_t sample) override {
+            sobol_sampler::start(px, py, sample);
+            pixel_seed = 0x5eedu;
+            x = px;
+            y = py;
+        }
+
+        double get_1d() override {
+            uint32_t dim = dimension;
+            return rotate(sobol_sampler::get_1d(), dim, 0);
+        }
+
+        sample_2d get_2d() override {
+            uint32_t dim = dimension;
+            sample_2d s = sobol_sampler::get_2d();
+            s.u = rotate(s.u, dim, 0);
+            s.v = rotate(s.v, dim, 1);
+            return s;
+        }
+    private:
+        uint32_t x = 0, y = 0;
+
+        // Cranley-Patterson rotation by the blue-noise tile, shifted differently for every dimension
+        double rotate(double value, uint32_t dim, uint32_t axis) const {
+            uint32_t shift = hash_seed(bounce, dim, axis, 0xb1u);
+            double offset = blue_noise_tile::get()(x + (shift & 0xffff), y + (shift >> 16));
+            value += offset;
+            return value >= 1.0 ? value - 1.0 : value;
+        }
+};
+
+inline std::unique_ptr<sampler> make_sampler(const std::string& type) {
+    if (type == "independent")
+        return std::unique_ptr<sampler>(new independent_sampler());
+    if (type == "bluenoise")
+        return std::unique_ptr<sampler>(new blue_noise_sampler());
+    return std::unique_ptr<sampler>(new sobol_sampler());
+}
+
+#endif
@@ -0,0 +1,258 @@
+/*
+    Batch benchmark over whole scenes:
+
+    Every .trace file in a directory is rendered under every requested -m mode a number of times. Each render runs in
+    its own process so build time, render time and peak memory are not polluted by the renders before it. The numbers
+    are read back from the JSON metrics file every render writes, the image itself is checksummed so a faster mode
+    that draws a different picture is caught.
+*/
+
+#ifndef SCENE_BENCH_H
+#define SCENE_BENCH_H
+
+#include "common.h"
+#include "metrics.h"
+#include "parser.h"
+
+#include <cstdlib>
+#include <dirent.h>
+#include <map>
+#include <sstream>
+
+struct scene_run {
+    double build_seconds = 0;
+    double render_seconds = 0;
+    double mrays_per_second = 0;
+    double mean_traversal_steps = -1;
+    double mean_intersection_tests = -1;
+    double peak_memory_bytes = 0;
+    unsigned long long checksum = 0;
+};
+
+struct scene_result {
+    std::string scene;
+    std::string mode;
+    int runs = 0;
+    scene_run median;
+    bool deterministic = true;
+    std::string status = "ok";
+};
+
+// FNV-1a over the bytes of the image file
+inline unsigned long long file_checksum(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    unsigned long long hash = 14695981039346656037ULL;
+    char c;
+    while (in.get(c)) {
+        hash ^= (unsigned char)c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Reads the first number stored under "key" in a flat piece of JSON, `fallback` if it is not there
+inline double json_number(const std::string& json, const std::string& key, double fallback = 0) {
+    auto pos = json.find("\"" + key + "\": ");
+    if (pos == std::string::npos)
+        return fallback;
+    return atof(json.c_str() + pos + key.size() + 4);
+}
+
+inline std::vector<std::string> list_scenes(const std::string& dir) {
+    std::vector<std::string> paths;
+    DIR* d = opendir(dir.c_str());
+    if (d == NULL)
+        return paths;
+    while (dirent* entry = readdir(d)) {
+        std::string name = entry->d_name;
+        if (name.size() > 6 && name.substr(name.size() - 6) == ".trace")
+            paths.push_back(dir + "/" + name);
+    }
+    closedir(d);
+    std::sort(paths.begin(), paths.end());
+    return paths;
+}
+
+inline std::vector<std::string> split_list(const std::string& list) {
+    std::vector<std::string> items;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ','))
+        if (!item.empty())
+            items.push_back(item);
+    return items;
+}
+
+inline double median_of(std::vector<double> values) {
+    std::sort(values.begin(), values.end());
+    size_t n = values.size();
+    return (n % 2) ? values[n / 2] : 0.5 * (values[n / 2 - 1] + values[n / 2]);
+}
+
+inline bool run_scene_once(const std::string& exe, const std::string& scene, const std::string& mode,
+                           const std::string& image, scene_run& run) {
+    std::string cmd = "\"" + exe + "\" -i \"" + scene + "\" -m " + mode + " -o \"" + image + "\" 2> /dev/null";
+    if (std::system(cmd.c_str()) != 0)
+        return false;
+
+    std::ifstream in(render_metrics::json_path_for(image));
+    std::string json((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (json.empty())
+        return false;
+
+    run.build_seconds = json_number(json, "build");
+    run.render_seconds = json_number(json, "render");
+    run.mrays_per_second = json_number(json, "mrays_per_second");
+    run.mean_traversal_steps = json_number(json, "mean_traversal_steps", -1);
+    run.mean_intersection_tests = json_number(json, "mean_intersection_tests", -1);
+    run.peak_memory_bytes = json_number(json, "peak_memory_bytes");
+    run.checksum = file_checksum(image);
+    return true;
+}
+
+// False when the file cannot be read or holds no results, a baseline that checks nothing must not pass silently
+inline bool load_scene_baseline(const std::string& path, std::map<std::string, scene_result>& baseline) {
+    std::ifstream in(path);
+    if (!in) {
+        std::clog << "Could not read the baseline " << path << std::endl;
+        return false;
+    }
+    std::string line;
+    std::getline(in, line); // header
+    while (std::getline(in, line)) {
+        std::stringstream ss(line);
+        std::string field;
+        std::vector<std::string> f;
+        while (std::getline(ss, field, ','))
+            f.push_back(field);
+        if (f.size() < 10)
+            continue;
+        scene_result r;
+        r.scene = f[0];
+        r.mode = f[1];
+        r.median.build_seconds = atof(f[3].c_str());
+        r.median.render_seconds = atof(f[4].c_str());
+        r.median.checksum = strtoull(f[9].c_str(), NULL, 16);
+        baseline[r.scene + "|" + r.mode] = r;
+    }
+    if (baseline.empty()) {
+        std::clog << "The baseline " << path << " holds no results" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+inline void save_scene_results(const std::string& base, const std::vector<scene_result>& results) {
+    std::ofstream csv(base + ".csv");
+    csv << "scene,mode,runs,build_seconds,render_seconds,mrays_per_second,mean_traversal_steps,"
+           "mean_intersection_tests,peak_memory_bytes,checksum,deterministic,status\n";
+    for (const auto& r : results) {
+        csv << r.scene << ',' << r.mode << ',' << r.runs << ',' << r.median.build_seconds << ','
+            << r.median.render_seconds << ',' << r.median.mrays_per_second << ',' << r.median.mean_traversal_steps
+            << ',' << r.median.mean_intersection_tests << ',' << (unsigned long long)r.median.peak_memory_bytes << ','
+            << std::hex << r.median.checksum << std::dec << ',' << r.deterministic << ',' << r.status << '\n';
+    }
+
+    std::ofstream json(base + ".json");
+    json << "[";
+    for (size_t i = 0; i < results.size(); i++) {
+        const auto& r = results[i];
+        json << (i ? "," : "") << "\n  {\"scene\": \"" << r.scene << "\", \"mode\": \"" << r.mode
+             << "\", \"runs\": " << r.runs << ", \"build_seconds\": " << r.median.build_seconds
+             << ", \"render_seconds\": " << r.median.render_seconds
+             << ", \"mrays_per_second\": " << r.median.mrays_per_second
+             << ", \"mean_traversal_steps\": " << r.median.mean_traversal_steps
+             << ", \"mean_intersection_tests\": " << r.median.mean_intersection_tests
+             << ", \"peak_memory_bytes\": " << (unsigned long long)r.median.peak_memory_bytes << ", \"checksum\": \""
+             << std::hex << r.median.checksum << std::dec << "\", \"deterministic\": "
+             << (r.deterministic ? "true" : "false") << ", \"status\": \"" << r.status << "\"}";
+    }
+    json << "\n]\n";
+}
+
+// Returns the number of flagged (slower or changed) scene/mode pairs, -1 if the given baseline could not be read
+inline int run_scene_benchmark(const std::string& exe, const settings& stng) {
+    auto scenes = list_scenes(stng.benchmark);
+    auto modes = split_list(stng.bench_modes);
+    std::map<std::string, scene_result> baseline;
+    if (!stng.bench_baseline.empty() && !load_scene_baseline(stng.bench_baseline, baseline))
+        return -1;
+    std::string dir = "output/bench";
+    std::system(("mkdir -p " + dir).c_str());
+
+    std::vector<scene_result> results;
+    int flagged = 0;
+    for (const auto& scene : scenes) {
+        for (const auto& mode : modes) {
+            std::clog << "\rBenchmarking " << scene << " with " << mode << "...                " << std::flush;
+            auto name = scene.substr(scene.find_last_of("/\\") + 1);
+            name = name.substr(0, name.find_last_of('.'));
+            std::string image = dir + "/" + name + "_" + mode + ".ppm";
+
+            std::vector<scene_run> runs;
+            for (int i = 0; i < stng.bench_runs; i++) {
+                scene_run run;
+                if (run_scene_once(exe, scene, mode, image, run))
+                    runs.push_back(run);
+            }
+
+            scene_result res;
+            res.scene = scene;
+            res.mode = mode;
+            res.runs = runs.size();
+            if (runs.empty()) {
+                res.status = "failed";
+                flagged++;
+                results.push_back(res);
+                continue;
+            }
+
+            std::vector<double> build, render, mrays, steps, tests, memory;
+            for (const auto& run : runs) {
+                build.push_back(run.build_seconds);
+                render.push_back(run.render_seconds);
+                mrays.push_back(run.mrays_per_second);
+                steps.push_back(run.mean_traversal_steps);
+                tests.push_back(run.mean_intersection_tests);
+                memory.push_back(run.peak_memory_bytes);
+                res.deterministic = res.deterministic && run.checksum == runs[0].checksum;
+            }
+            res.median.build_seconds = median_of(build);
+            res.median.render_seconds = median_of(render);
+            res.median.mrays_per_second = median_of(mrays);
+            res.median.mean_traversal_steps = median_of(steps);
+            res.median.mean_intersection_tests = median_of(tests);
+            res.median.peak_memory_bytes = median_of(memory);
+            res.median.checksum = runs[0].checksum;
+
+            auto it = baseline.find(scene + "|" + mode);
+            if (it == baseline.end()) {
+                res.status = baseline.empty() ? "ok" : "new";
+                if (!baseline.empty())
+                    std::clog << "\rNo baseline for " << scene << " with " << mode << ", it is not checked" << std::endl;
+            } else {
+                const auto& base = it->second.median;
+                double before = base.build_seconds + base.render_seconds;
+                double now = res.median.build_seconds + res.median.render_seconds;
+                double change = before > 0 ? (now - before) / before * 100.0 : 0;
+                if (base.checksum != res.median.checksum)
+                    res.status = "IMAGE_CHANGED";
+                else if (change > stng.bench_tolerance)
+                    res.status = "SLOWER";
+                if (res.status != "ok") {
+                    flagged++;
+                    std::clog << "\r" << res.status << ": " << scene << " with " << mode << " (" << before << "s -> "
+                              << now << "s)" << std::endl;
+                }
+            }
+            results.push_back(res);
+        }
+    }
+
+    save_scene_results(stng.bench_output, results);
+    std::clog << "\rBenchmarked " << results.size() << " scene/mode pairs, " << flagged
+              << " flagged. Results in " << stng.bench_output << ".csv/.json" << std::endl;
+    return flagged;
+}
+
+#endif
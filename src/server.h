@@ -0,0 +1,519 @@
+/*
+    IN THIS FILE you will find the render server, a long-running process that keeps parsed scenes and their built
+    acceleration structures resident so a render only pays for tracing:
+
+    1) resident_scene: a loaded .trace file, its world under one -m mode and one set of build options, and the camera
+       the file describes
+    2) render_server: reads one request per line from stdin or a socket and answers on the same stream
+    3) socket helpers shared with the distributed coordinator, addresses are "tcp:host:port", "tcp:port" or the
+       path of a Unix socket
+
+    Requests (words separated by spaces, a scene is keyed by its path, mode and build options, and with levels of
+    detail also by width and camera, which the models are placed for):
+
+        load <scene> [mode] [key=value ...]     parse and build, a no-op when already resident. Keys: the build
+                                                options (see build_options.h) by their flag names, such as
+                                                layout=veb, the others are those of the server. The answer gives
+                                                the size and samples a render with the render keys would have
+        render <scene> [key=value ...]          render, loading first when needed. Keys: the build options, mode,
+                                                width, spp, depth, tile, sampler, integrator, rr,
+                                                camera=lfx,lfy,lfz,lax,lay,laz,upx,upy,upz,fov and out (also write a
+                                                .ppm on the server)
+        trace <scene> [key=value ...]           the render keys plus region=x,y,w,h and samples=first,count
+        unload <scene> [mode]                   drop the scene under one mode, or under all modes
+        list                                    the resident scenes
+        quit                                    stop the server
+
+    Every request ends with one line starting with "ok" or "error". A render first answers "image <width> <height>"
+    and then streams a "tile <x> <y> <w> <h> <pixels>" line for every finished tile, the pixels as six hex digits
+    (gamma corrected rgb bytes) per pixel, row by row. A trace answers one "sums <x> <y> <w> <h> <values>" line with
+    the linear sums of the sample range, every channel as the 16 hex digits of a double.
+*/
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "common.h"
+#include "build_options.h"
+#include "camera.h"
+#include "metrics.h"
+#include "parser.h"
+
+#include <cstdio>
+#include <map>
+#include <sstream>
+#ifndef _WIN32
+    #include <csignal>
+    #include <netdb.h>
+    #include <netinet/in.h>
+    #include <netinet/tcp.h>
+    #include <sys/socket.h>
+    #include <sys/un.h>
+    #include <unistd.h>
+#endif
+
+// Doubles travel as the 16 hex digits of their bits, so sample sums arrive exactly as they were computed
+inline std::string encode_double(double value) {
+    static const char digits[] = "0123456789abcdef";
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    std::string hex(16, '0');
+    for (int i = 15; i >= 0; i--, bits >>= 4)
+        hex[i] = digits[bits & 15];
+    return hex;
+}
+
+inline double decode_double(const char* hex) {
+    uint64_t bits = 0;
+    for (int i = 0; i < 16; i++) {
+        char c = hex[i];
+        bits = (bits << 4) | uint64_t(c >= 'a' ? c - 'a' + 10 : c - '0');
+    }
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+#ifndef _WIN32
+// Addresses are "tcp:host:port", "tcp:port" (127.0.0.1) or the path of a Unix socket, optionally behind "unix:"
+inline bool resolve_address(const std::string& address, std::string& host, std::string& port, std::string& path) {
+    if (address.compare(0, 4, "tcp:") == 0) {
+        std::string rest = address.substr(4);
+        auto colon = rest.find_last_of(':');
+        host = colon == std::string::npos ? "127.0.0.1" : rest.substr(0, colon);
+        port = colon == std::string::npos ? rest : rest.substr(colon + 1);
+        return !port.empty();
+    }
+    path = address.compare(0, 5, "unix:") == 0 ? address.substr(5) : address;
+    return !path.empty();
+}
+
+// Requests and answers are single lines, sent at once instead of waiting for more to fill a TCP packet
+inline void set_no_delay(int fd) {
+    int one = 1;
+    if (fd >= 0)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// Listening socket for `address`, -1 on failure
+inline int listen_socket(const std::string& address) {
+    std::string host, port, path;
+    if (!resolve_address(address, host, port, path))
+        return -1;
+    if (path.empty()) {
+        addrinfo hints = {}, *info = NULL;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &info) != 0)
+            return -1;
+        int fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+        int reuse = 1;
+        if (fd >= 0)
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (fd >= 0 && (bind(fd, info->ai_addr, info->ai_addrlen) != 0 || listen(fd, 16) != 0)) {
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(info);
+        return fd;
+    }
+
+    sockaddr_un unix_address = {};
+    unix_address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(unix_address.sun_path))
+        return -1;
+    strncpy(unix_address.sun_path, path.c_str(), sizeof(unix_address.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path.c_str());
+    if (fd >= 0 && (bind(fd, (sockaddr*)&unix_address, sizeof(unix_address)) != 0 || listen(fd, 16) != 0)) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+// Connected socket to `address`, -1 on failure
+inline int connect_socket(const std::string& address) {
+    std::string host, port, path;
+    if (!resolve_address(address, host, port, path))
+        return -1;
+    if (path.empty()) {
+        addrinfo hints = {}, *info = NULL;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &info) != 0)
+            return -1;
+        int fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+        if (fd >= 0 && connect(fd, info->ai_addr, info->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(info);
+        set_no_delay(fd);
+        return fd;
+    }
+
+    sockaddr_un unix_address = {};
+    unix_address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(unix_address.sun_path))
+        return -1;
+    strncpy(unix_address.sun_path, path.c_str(), sizeof(unix_address.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (sockaddr*)&unix_address, sizeof(unix_address)) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+#endif
+
+struct resident_scene {
+    std::string path;
+    std::string mode;
+    build_options options;
+    std::string view;                   // the width and camera the levels of detail were chosen for
+    camera cam;
+    hittable_list world;
+    size_t objects = 0;
+    size_t bytes = 0;
+    double load_seconds = 0;
+};
+
+class render_server {
+    public:
+        explicit render_server(const settings& stng) : stng(stng) {}
+
+        // Serves `in` until it ends or a quit request, returns false once the server should stop
+        bool serve(FILE* in, FILE* out) {
+            char buffer[4096];
+            while (fgets(buffer, sizeof(buffer), in)) {
+                std::istringstream request(buffer);
+                std::string command;
+                if (!(request >> command) || command[0] == '#')
+                    continue;
+                if (command == "quit") {
+                    reply(out, "ok bye");
+                    return false;
+                }
+                try {
+                    handle(command, request, out);
+                } catch (const std::exception& e) {
+                    reply(out, std::string("error ") + e.what());
+                }
+            }
+            return true;
+        }
+
+        // Listens on a Unix or TCP socket and serves one client at a time until a quit request
+        bool listen_on(const std::string& address) {
+#ifdef _WIN32
+            std::clog << "Unix sockets are not supported on this platform, use --server stdin" << std::endl;
+            return false;
+#else
+            int listener = listen_socket(address);
+            if (listener < 0) {
+                std::clog << "Could not listen on " << address << std::endl;
+                return false;
+            }
+            std::clog << "Render server listening on " << address << std::endl;
+            // A client that hangs up during a render must not take the server down with it
+            signal(SIGPIPE, SIG_IGN);
+
+            bool running = true;
+            while (running) {
+                int client = accept(listener, NULL, NULL);
+                if (client < 0)
+                    continue;
+                set_no_delay(client);
+                FILE* in = fdopen(client, "r");
+                FILE* out = fdopen(dup(client), "w");
+                running = serve(in, out);
+                fclose(out);
+                fclose(in);
+            }
+            close(listener);
+            std::string host, port, path;
+            if (resolve_address(address, host, port, path) && !path.empty())
+                unlink(path.c_str());
+            return true;
+#endif
+        }
+    private:
+        const settings& stng;
+        std::map<std::string, resident_scene> scenes;
+
+        // The width and camera= of a request over the camera of the scene file
+        struct request_view {
+            bool sized = false;
+            int width = 0;
+            bool moved = false;
+            camera_view placement;
+
+            void apply(camera& cam) const {
+                if (sized)
+                    cam.width = width;
+                if (moved)
+                    placement.apply(cam);
+            }
+        };
+
+        static std::string key(const std::string& path, const std::string& mode, const build_options& options,
+                               const std::string& view) {
+            return path + "|" + mode + "|" + options.request() + view;
+        }
+
+        // Levels of detail are placed for one camera at load, so a scene with them is kept per width and camera=
+        static std::string view_key(const std::map<std::string, std::string>& options, const build_options& build) {
+            std::string view;
+            if (build.lod == "off")
+                return view;
+            for (const char* name : {"width", "camera"}) {
+                auto found = options.find(name);
+                if (found != options.end())
+                    view += std::string(" ") + name + "=" + found->second;
+            }
+            return view;
+        }
+
+        static void reply(FILE* out, const std::string& line) {
+            fputs(line.c_str(), out);
+            fputc('\n', out);
+            fflush(out);
+        }
+
+        void handle(const std::string& command, std::istringstream& request, FILE* out) {
+            std::string path, word;
+            if (command == "list") {
+                for (const auto& s : scenes) {
+                    std::ostringstream line;
+                    line << "scene " << s.second.path << ' ' << s.second.mode << s.second.options.request()
+                         << s.second.view << " objects=" << s.second.objects
+                         << " bytes=" << s.second.bytes << " load_seconds=" << s.second.load_seconds;
+                    reply(out, line.str());
+                }
+                reply(out, "ok " + std::to_string(scenes.size()));
+                return;
+            }
+            if (!(request >> path))
+                throw std::invalid_argument("missing scene path");
+
+            if (command == "load") {
+                std::string mode = stng.model;
+                auto options = parse_options(request, &mode);
+                build_options build = build_options_of(options);
+                bool resident = scenes.count(key(path, mode, build, view_key(options, build))) > 0;
+                const resident_scene& scene = load(path, mode, build, options);
+                std::ostringstream line;
+                camera cam = make_camera(scene, options);
+                line << "ok " << (resident ? "resident " : "loaded ") << path << ' ' << mode
+                     << " objects=" << scene.objects << " seconds=" << scene.load_seconds << " width=" << cam.width
+                     << " height=" << cam.height << " spp=" << cam.samples_per_pixel;
+                reply(out, line.str());
+            } else if (command == "unload") {
+                bool all = !(request >> word);
+                size_t dropped = 0;
+                for (auto it = scenes.begin(); it != scenes.end();) {
+                    if (it->second.path == path && (all || it->second.mode == word)) {
+                        it = scenes.erase(it);
+                        dropped++;
+                    } else {
+                        ++it;
+                    }
+                }
+                reply(out, dropped ? "ok unloaded " + std::to_string(dropped) : "error not loaded " + path);
+            } else if (command == "render") {
+                render(path, request, out);
+            } else if (command == "trace") {
+                trace(path, request, out);
+            } else {
+                reply(out, "error unknown request " + command);
+            }
+        }
+
+        const resident_scene& load(const std::string& path, const std::string& mode, const build_options& build,
+                                   const std::map<std::string, std::string>& options) {
+            std::string view = view_key(options, build);
+            auto found = scenes.find(key(path, mode, build, view));
+            if (found != scenes.end())
+                return found->second;
+            if (mode != "brute" && mode != "bvh" && mode != "kd" && mode != "bih" && mode != "sbvh" &&
+                mode != "auto")
+                throw std::invalid_argument("unknown mode " + mode);
+            if (!build.valid())
+                throw std::invalid_argument("invalid build options");
+            if (!std::ifstream(path))
+                throw std::invalid_argument("could not open " + path);
+
+            std::function<void(camera&)> placed_for;
+            if (!view.empty()) {
+                request_view overrides = view_of(options);
+                placed_for = [overrides](camera& cam) { overrides.apply(cam); };
+            }
+
+            stopwatch timer;
+            resident_scene scene;
+            scene.path = path;
+            scene.mode = mode;
+            scene.options = build;
+            scene.view = view;
+            scene.world = load_scene(scene.cam, path.c_str(), mode.c_str(), build, nullptr, nullptr, placed_for);
+            scene.objects = scene.world.objects.size();
+            scene.bytes = scene.world.structure_bytes();
+            scene.load_seconds = timer.elapsed();
+            std::clog << "\rResident: " << path << " (" << mode << ") in " << scene.load_seconds << "s          "
+                      << std::endl;
+            return scenes[key(path, mode, build, view)] = scene;
+        }
+
+        // With `positional` a first word without '=' is stored there
+        static std::map<std::string, std::string> parse_options(std::istringstream& request,
+                                                                std::string* positional = nullptr) {
+            std::map<std::string, std::string> options;
+            std::string word;
+            for (bool first = true; request >> word; first = false) {
+                auto eq = word.find('=');
+                if (eq == std::string::npos && first && positional) {
+                    *positional = word;
+                    continue;
+                }
+                if (eq == std::string::npos)
+                    throw std::invalid_argument("expected key=value, got " + word);
+                options[word.substr(0, eq)] = word.substr(eq + 1);
+            }
+            return options;
+        }
+
+        // The build options of the server with those a request gives
+        build_options build_options_of(const std::map<std::string, std::string>& options) const {
+            build_options build = stng.build;
+            for (const auto& option : options)
+                build.set(option.first, option.second);
+            // -m auto expects the rays of the samples asked for, as --spp does
+            auto spp = options.find("spp");
+            if (spp != options.end())
+                build.spp = atoi(spp->second.c_str());
+            return build;
+        }
+
+        static request_view view_of(const std::map<std::string, std::string>& options) {
+            request_view view;
+            auto width = options.find("width");
+            if (width != options.end()) {
+                view.sized = true;
+                view.width = atoi(width->second.c_str());
+            }
+            auto placement = options.find("camera");
+            if (placement != options.end()) {
+                double v[10];
+                if (sscanf(placement->second.c_str(), "%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf",
+                           &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7], &v[8], &v[9]) != 10)
+                    throw std::invalid_argument("camera needs lfx,lfy,lfz,lax,lay,laz,upx,upy,upz,fov");
+                view.moved = true;
+                view.placement.lookfrom = point(v[0], v[1], v[2]);
+                view.placement.lookat = point(v[3], v[4], v[5]);
+                view.placement.vup = vec3(v[6], v[7], v[8]);
+                view.placement.vfov = v[9];
+            }
+            return view;
+        }
+
+        // The camera of the scene file with the overrides of a request, initialized so its height is known
+        camera make_camera(const resident_scene& scene, std::map<std::string, std::string>& options) const {
+            camera cam = scene.cam;
+            cam.threads = stng.threads;
+            cam.sampler_type = options.count("sampler") ? options["sampler"] : stng.sampler;
+            cam.iterative = (options.count("integrator") ? options["integrator"] : stng.integrator) != "recursive";
+            cam.rr_depth = options.count("rr") ? atoi(options["rr"].c_str()) : stng.rr_depth;
+            cam.tile_size = options.count("tile") ? atoi(options["tile"].c_str()) : 32;
+            view_of(options).apply(cam);
+            if (options.count("spp"))
+                cam.samples_per_pixel = atoi(options["spp"].c_str());
+            if (options.count("depth"))
+                cam.max_depth = atoi(options["depth"].c_str());
+            if (cam.width < 1 || cam.samples_per_pixel < 1 || cam.tile_size < 1)
+                throw std::invalid_argument("width, spp and tile must be positive");
+            cam.initialize();
+            return cam;
+        }
+
+        void render(const std::string& path, std::istringstream& request, FILE* out) {
+            auto options = parse_options(request);
+            std::string mode = options.count("mode") ? options["mode"] : stng.model;
+            const resident_scene& scene = load(path, mode, build_options_of(options), options);
+            camera cam = make_camera(scene, options);
+
+            reply(out, "image " + std::to_string(cam.width) + " " + std::to_string(cam.height));
+            cam.on_tile = [&](int x, int y, int w, int h) {
+                static const char digits[] = "0123456789abcdef";
+                std::string line = "tile " + std::to_string(x) + " " + std::to_string(y) + " " + std::to_string(w) +
+                                   " " + std::to_string(h) + " ";
+                for (int j = y; j < y + h; j++) {
+                    for (int i = x; i < x + w; i++) {
+                        int bytes[3];
+                        color_to_bytes(cam.framebuffer[j * cam.width + i], bytes);
+                        for (int c = 0; c < 3; c++) {
+                            line += digits[bytes[c] >> 4];
+                            line += digits[bytes[c] & 15];
+                        }
+                    }
+                }
+                reply(out, line);
+            };
+
+            stopwatch timer;
+            cam.render(scene.world);
+            double seconds = timer.elapsed();
+            std::clog << "\rRendered " << path << " (" << mode << ") in " << seconds << "s              " << std::endl;
+            if (options.count("out"))
+                cam.write_image(options["out"].c_str());
+
+            std::ostringstream line;
+            line << "ok rendered " << cam.width << ' ' << cam.height << " seconds=" << seconds
+                 << " rays=" << cam.primary_rays + cam.secondary_rays;
+            reply(out, line.str());
+        }
+
+        // Work unit of a distributed render: the linear sample sums of a region, not gamma corrected or averaged,
+        // so a coordinator can add up the sample ranges of several workers
+        void trace(const std::string& path, std::istringstream& request, FILE* out) {
+            auto options = parse_options(request);
+            std::string mode = options.count("mode") ? options["mode"] : stng.model;
+            const resident_scene& scene = load(path, mode, build_options_of(options), options);
+            camera cam = make_camera(scene, options);
+
+            int x = 0, y = 0, w = cam.width, h = cam.height;
+            int first = 0, count = cam.samples_per_pixel;
+            if (options.count("region") && sscanf(options["region"].c_str(), "%d,%d,%d,%d", &x, &y, &w, &h) != 4)
+                throw std::invalid_argument("region needs x,y,w,h");
+            if (options.count("samples") && sscanf(options["samples"].c_str(), "%d,%d", &first, &count) != 2)
+                throw std::invalid_argument("samples needs first,count");
+            if (x < 0 || y < 0 || w < 1 || h < 1 || x + w > cam.width || y + h > cam.height || first < 0 || count < 1)
+                throw std::invalid_argument("region or samples outside the image");
+
+            std::vector<color> sums;
+            cam.render_samples(scene.world, x, y, w, h, first, count, sums);
+            std::string line = "sums " + std::to_string(x) + " " + std::to_string(y) + " " + std::to_string(w) + " " +
+                               std::to_string(h) + " ";
+            line.reserve(line.size() + sums.size() * 3 * 16);
+            for (const color& c : sums)
+                for (int i = 0; i < 3; i++)
+                    line += encode_double(c[i]);
+            reply(out, line);
+            reply(out, "ok traced primary=" + std::to_string(cam.primary_rays) +
+                       " secondary=" + std::to_string(cam.secondary_rays));
+        }
+};
+
+// --server stdin answers on stdout, anything else is the address to listen on
+inline bool run_render_server(const settings& stng) {
+    render_server server(stng);
+    if (stng.server == "stdin") {
+        std::clog << "Render server reading requests from stdin" << std::endl;
+        server.serve(stdin, stdout);
+        return true;
+    }
+    return server.listen_on(stng.server);
+}
+
+#endif
@@ -1,44 +1,77 @@
+#ifndef STAT_COLLECTOR_H
+#define STAT_COLLECTOR_H
+
 #include "color.h"
 #include "common.h"
 #include <iostream>
 #include <ostream>
 #include <vector>
 
+// Traversal statistics are a compile-time policy. Only the research build (-DCOLLECT_STATS, see the
+// main_stats target) carries a collector on hit_record; the release build compiles the counters away.
 class stat_collector {
-private:
-    unsigned int pixel_index = 0;
-    unsigned int sample_index = 0;
 public:
     unsigned int samples_per_pixel;
     std::vector<int> n_intersection_tests;
     std::vector<int> n_traversal_steps;
     std::vector<int> sample_indeces;
     std::vector<int> pixel_indeces;
-    bool freeze = false;
-    stat_collector(unsigned int p_samples_per_pixel = 1) : n_intersection_tests(), n_traversal_steps(), sample_indeces(), pixel_indeces() {
+    stat_collector(unsigned int p_samples_per_pixel = 1, unsigned int n_pixels = 0) : n_intersection_tests(), n_traversal_steps(), sample_indeces(), pixel_indeces() {
         samples_per_pixel = p_samples_per_pixel;
+        resize(n_pixels);
     }
-    void next_sample(){
-        sample_index++;
+    // Every sample owns a row up front, so threads rendering different pixels never share a counter
+    void resize(unsigned int n_pixels){
+        size_t rows = size_t(n_pixels) * samples_per_pixel;
+        n_traversal_steps.assign(rows, 0);
+        n_intersection_tests.assign(rows, 0);
+        sample_indeces.resize(rows);
+        pixel_indeces.resize(rows);
+        for (size_t i = 0; i < rows; i++) {
+            pixel_indeces[i] = i / samples_per_pixel;
+            sample_indeces[i] = i % samples_per_pixel;
+        }
     }
-    void new_row(){
-        n_traversal_steps.push_back(0);
-        n_intersection_tests.push_back(0);
-        sample_indeces.push_back(sample_index);
-        pixel_indeces.push_back(pixel_index);
-        freeze = false;
+    // Samples [first_sample, end_sample) of every pixel were rendered, resumed and stopped renders leave the rest at 0
+    unsigned int first_sample = 0;
+    unsigned int end_sample = 0;
+    void rendered(unsigned int first, unsigned int count) {
+        if (end_sample == first_sample) {
+            first_sample = first;
+            end_sample = first + count;
+        } else {
+            first_sample = std::min(first_sample, first);
+            end_sample = std::max(end_sample, first + count);
+        }
     }
-    void next_pixel(){
-        pixel_index++;
-        sample_index = 0;
+    // Mean over the rendered samples only
+    double rendered_mean(const std::vector<int>& data) const {
+        double sum = 0;
+        size_t n = 0;
+        for (size_t i = 0; i < data.size(); i++) {
+            if (sample_indeces[i] < int(first_sample) || sample_indeces[i] >= int(end_sample))
+                continue;
+            sum += data[i];
+            n++;
+        }
+        return n > 0 ? sum / n : 0;
     }
-    void record_traversal_step() {
-        if (freeze) return;
-        n_traversal_steps[pixel_index * samples_per_pixel + sample_index]++;
+    unsigned int slot(unsigned int pixel, unsigned int sample) const {
+        return pixel * samples_per_pixel + sample;
     }
-    void record_intersection_test() {
-        if (freeze) return;
-        n_intersection_tests[pixel_index * samples_per_pixel + sample_index]++;
+    void record_traversal_step(unsigned int slot) {
+        n_traversal_steps[slot]++;
+    }
+    void record_intersection_test(unsigned int slot) {
+        n_intersection_tests[slot]++;
+    }
+    static double mean(const std::vector<int>& data) {
+        if (data.empty())
+            return 0;
+        double sum = 0;
+        for (int v : data)
+            sum += v;
+        return sum / data.size();
     }
     void print(){
     for (auto i: sample_indeces)
@@ -109,3 +142,5 @@ public:
         return base_file.substr(0, p);
     }
 };
+
+#endif
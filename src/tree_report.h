@@ -0,0 +1,332 @@
+/*
+    IN THIS FILE you will find the structure report written by --tree-report. It describes a built structure
+    without rendering anything, so builder parameters can be compared on a scene quickly:
+
+    1) node and leaf counts, the leaves per depth and per primitive count
+    2) the SAH cost, per ray and in primitive intersection tests, as dynamic_structure::cost computes it
+    3) the EPO (end-point overlap, Aila et al. 2013): the share of the primitive surface that lies inside the boxes
+       of nodes that do not hold the primitive. A ray that hits that surface has to visit those nodes for nothing
+    4) the duplication factor, leaf references per primitive, above 1 for the kD-tree and the SBVH
+    5) the bytes used by the structure, a model in one of its leaves is reported on its own
+
+    Pointer trees, flat arrays and quantized trees are all walked into the same list of entries, so a layout is
+    described by the nodes it really stores: a quantized tree has fewer, wider nodes than the tree it came from.
+*/
+
+#ifndef TREE_REPORT_H
+#define TREE_REPORT_H
+
+#include "common.h"
+#include "accelerate.h"
+#include "build_options.h"
+#include "flat_tree.h"
+#include "hittable.h"
+#include "lazy_tree.h"
+#include "metrics.h"
+#include "model.h"
+#include "primitive.h"
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+class tree_report {
+    public:
+        std::string name;
+        size_t bytes = 0;
+        size_t nodes = 0;                       // inner nodes
+        size_t leaves = 0;
+        size_t empty_leaves = 0;
+        size_t primitives = 0;                  // distinct primitives
+        size_t references = 0;                  // leaf references, a duplicated primitive counts every time
+        int max_depth = 0;
+        double sah_cost = 0;
+        double epo = 0;
+        double build_seconds = 0;
+        std::vector<size_t> depth_histogram;        // leaves per depth, the root is at depth 0
+        std::vector<size_t> leaf_size_histogram;    // leaves per primitive count
+
+        tree_report(const std::string& name, const hittable& structure) : name(name) {
+            bytes = structure.top_level_bytes();
+            walk(unwrap(&structure), 0);
+            double area = structure.bounding_box().surface_area();
+            sah_cost = area > 0 ? structure.sah_cost(area) / area : 0;
+            count_primitives();
+            epo = end_point_overlap();
+        }
+
+        double duplication() const { return primitives > 0 ? double(references) / primitives : 0; }
+
+        // Children per inner node, 2 for the binary trees
+        double branching() const { return nodes > 0 ? double(entries.size() - 1) / nodes : 0; }
+
+        // The primitives in the order the tree first reaches them
+        const std::vector<const hittable*>& primitive_list() const { return distinct; }
+
+        void print() const {
+            std::clog << "  " << name << ": " << nodes << " nodes, " << leaves << " leaves (" << empty_leaves
+                      << " empty), depth " << max_depth << ", SAH " << sah_cost << ", EPO " << epo
+                      << ", duplication " << duplication() << ", " << bytes << " bytes" << std::endl;
+        }
+
+        void save_json(std::ostream& out) const {
+            out << "{\"name\": \"" << render_metrics::escape(name) << "\", \"nodes\": " << nodes
+                << ", \"leaves\": " << leaves << ", \"empty_leaves\": " << empty_leaves
+                << ", \"branching\": " << branching() << ", \"max_depth\": " << max_depth
+                << ", \"primitives\": " << primitives
+                << ", \"references\": " << references << ", \"duplication\": " << duplication()
+                << ", \"sah_cost\": " << sah_cost << ", \"epo\": " << epo << ", \"bytes\": " << bytes
+                << ", \"build_seconds\": " << build_seconds;
+            out << ",\n      \"depth_histogram\": ";
+            save_histogram(out, depth_histogram);
+            out << ",\n      \"leaf_size_histogram\": ";
+            save_histogram(out, leaf_size_histogram);
+            out << "}";
+        }
+
+    private:
+        // A node or a leaf, in depth-first order. Its subtree is entries [index, end) and references [first, last)
+        struct entry {
+            aabb box;
+            uint32_t end;
+            uint32_t first;
+            uint32_t last;
+        };
+
+        std::vector<entry> entries;
+        std::vector<const hittable*> refs;      // leaf contents in depth-first order
+        std::vector<const hittable*> distinct;
+
+        static void save_histogram(std::ostream& out, const std::vector<size_t>& histogram) {
+            out << "[";
+            for (size_t i = 0; i < histogram.size(); i++)
+                out << (i ? ", " : "") << histogram[i];
+            out << "]";
+        }
+
+        // A list of one object is that object, as in the world and the models after their build
+        static const hittable* unwrap(const hittable* object) {
+            auto list = dynamic_cast<const hittable_list*>(object);
+            while (list && list->objects.size() == 1) {
+                object = list->objects[0].get();
+                list = dynamic_cast<const hittable_list*>(object);
+            }
+            return object;
+        }
+
+        static bool overlaps(const aabb& a, const aabb& b) {
+            for (int axis = 0; axis < 3; axis++)
+                if (a.axis_interval(axis).min > b.axis_interval(axis).max ||
+                    b.axis_interval(axis).min > a.axis_interval(axis).max)
+                    return false;
+            return true;
+        }
+
+        uint32_t open(const aabb& box) {
+            entry e;
+            e.box = box;
+            e.first = uint32_t(refs.size());
+            entries.push_back(e);
+            return uint32_t(entries.size() - 1);
+        }
+
+        void close(uint32_t index) {
+            entries[index].end = uint32_t(entries.size());
+            entries[index].last = uint32_t(refs.size());
+        }
+
+        void inner(int depth) {
+            nodes++;
+            max_depth = std::max(max_depth, depth);
+        }
+
+        // Leaves are counted where they are closed, once their primitives are known
+        void leaf(uint32_t index, int depth) {
+            close(index);
+            size_t size = entries[index].last - entries[index].first;
+            leaves++;
+            empty_leaves += size == 0;
+            max_depth = std::max(max_depth, depth);
+            if (depth_histogram.size() <= size_t(depth))
+                depth_histogram.resize(depth + 1, 0);
+            depth_histogram[depth]++;
+            if (leaf_size_histogram.size() <= size)
+                leaf_size_histogram.resize(size + 1, 0);
+            leaf_size_histogram[size]++;
+        }
+
+        // Anything that is not a node is a leaf, a list is a leaf of its objects
+        void walk(const hittable* object, int depth) {
+            if (auto lazy = dynamic_cast<const lazy_node*>(object))
+                return walk(&lazy->subtree(), depth);
+            if (auto tree = dynamic_cast<const flat_tree*>(object))
+                return walk_flat(*tree, tree->root_ref, depth);
+            if (auto tree = dynamic_cast<const quantized_tree*>(object))
+                return walk_quantized(*tree, 0, tree->bounding_box(), depth);
+
+            auto branch = dynamic_cast<const node*>(object);
+            // A bvh node over a single object holds it as both children
+            if (branch && branch->left_child() != branch->right_child()) {
+                uint32_t index = open(branch->bounding_box());
+                inner(depth);
+                walk(branch->left_child().get(), depth + 1);
+                walk(branch->right_child().get(), depth + 1);
+                close(index);
+                return;
+            }
+            if (branch)
+                object = branch->left_child().get();
+
+            uint32_t index = open(object->bounding_box());
+            auto list = dynamic_cast<const hittable_list*>(object);
+            if (list) {
+                for (const auto& obj : list->objects)
+                    refs.push_back(obj.get());
+            } else {
+                refs.push_back(object);
+            }
+            leaf(index, depth);
+        }
+
+        void walk_flat(const flat_tree& tree, uint32_t ref, int depth) {
+            if (ref & flat_tree::leaf_bit) {
+                const flat_tree::flat_leaf& l = tree.leaves[ref & ~flat_tree::leaf_bit];
+                // A subtree that was left to be built on demand sits in a leaf of its own
+                if (l.count == 1 && dynamic_cast<const lazy_node*>(tree.items[l.first]))
+                    return walk(tree.items[l.first], depth);
+                aabb box;
+                for (uint32_t i = l.first; i < l.first + l.count; i++)
+                    box = aabb(box, tree.items[i]->bounding_box());
+                uint32_t index = open(box);
+                refs.insert(refs.end(), tree.items.begin() + l.first, tree.items.begin() + l.first + l.count);
+                leaf(index, depth);
+                return;
+            }
+            const flat_node& n = tree.nodes[ref];
+            uint32_t index = open(flat_tree::box_of(n));
+            inner(depth);
+            walk_flat(tree, n.child[0], depth + 1);
+            walk_flat(tree, n.child[1], depth + 1);
+            close(index);
+        }
+
+        // Quantized nodes hold the boxes of their children, so every entry gets its box from its parent
+        void walk_quantized(const quantized_tree& tree, uint32_t node_index, const aabb& box, int depth) {
+            const quantized_node& n = tree.nodes[node_index];
+            uint32_t index = open(box);
+            inner(depth);
+            aabb boxes[quantized_tree::width];
+            int count = tree.child_boxes(n, boxes);
+            uint32_t next_inner = n.child_base, next_leaf = n.leaf_base;
+            for (int c = 0; c < count; c++) {
+                if (n.inner_mask & (1u << c)) {
+                    walk_quantized(tree, next_inner++, boxes[c], depth + 1);
+                    continue;
+                }
+                const quantized_tree::leaf& l = tree.leaves[next_leaf++];
+                if (l.count == 1 && dynamic_cast<const lazy_node*>(tree.items[l.first])) {
+                    walk(tree.items[l.first], depth + 1);
+                    continue;
+                }
+                uint32_t child = open(boxes[c]);
+                refs.insert(refs.end(), tree.items.begin() + l.first, tree.items.begin() + l.first + l.count);
+                leaf(child, depth + 1);
+            }
+            close(index);
+        }
+
+        void count_primitives() {
+            references = refs.size();
+            std::unordered_map<const hittable*, size_t> seen;
+            for (const auto* r : refs)
+                if (seen.insert(std::make_pair(r, seen.size())).second)
+                    distinct.push_back(r);
+            primitives = distinct.size();
+        }
+
+        // Surface of `object` and the part of it inside `box`. Objects that are not polygons count with the surface
+        // of their bounding box, cut to `box`
+        static double surface(const hittable* object, const aabb* box) {
+            auto polygon = dynamic_cast<const quad*>(object);
+            if (polygon) {
+                point corners[4];
+                int n = polygon->corners(corners);
+                return polygon_area_in_box(corners, n, box ? *box : object->bounding_box());
+            }
+            return box ? intersect(object->bounding_box(), *box).surface_area() : object->bounding_box().surface_area();
+        }
+
+        // Every primitive is pushed down the entries its box overlaps. Where the entry's subtree does not hold the
+        // primitive, the part of it inside the entry's box counts against the tree
+        double end_point_overlap() const {
+            std::unordered_map<const hittable*, std::vector<uint32_t>> positions;
+            for (uint32_t i = 0; i < refs.size(); i++)
+                positions[refs[i]].push_back(i);
+
+            double total = 0, overlap = 0;
+            for (const auto* p : distinct) {
+                const std::vector<uint32_t>& at = positions[p];
+                aabb bounds = p->bounding_box();
+                total += surface(p, nullptr);
+                uint32_t i = 0;
+                while (i < entries.size()) {
+                    const entry& e = entries[i];
+                    if (!overlaps(e.box, bounds)) {
+                        i = e.end;
+                        continue;
+                    }
+                    auto held = std::lower_bound(at.begin(), at.end(), e.first);
+                    if (held == at.end() || *held >= e.last)
+                        overlap += surface(p, &e.box);
+                    i++;
+                }
+            }
+            return total > 0 ? overlap / total : 0;
+        }
+};
+
+// Describes the world and the structure of every model in it, built with `options`, and writes the reports to `path`
+// as JSON
+inline bool save_tree_reports(const std::string& path, const hittable_list& world, const render_metrics& metrics,
+                              const build_options& options) {
+    std::vector<tree_report> reports;
+    reports.push_back(tree_report("world", world));
+    std::set<const model*> reported;
+    for (const auto* object : reports[0].primitive_list()) {
+        // Copies of a model placed with an offset share it
+        auto placed = dynamic_cast<const instance*>(object);
+        auto mdl = dynamic_cast<const model*>(placed ? placed->placed() : object);
+        if (mdl && reported.insert(mdl).second)
+            reports.push_back(tree_report(mdl->name(), mdl->structure()));
+    }
+    for (auto& r : reports)
+        for (const auto& s : metrics.structures)
+            if (s.name == r.name)
+                r.build_seconds = s.build_seconds;
+
+    std::ofstream out(path);
+    if (!out) {
+        std::clog << "Could not write the tree report to " << path << std::endl;
+        return false;
+    }
+    out << "{\n";
+    out << "  \"scene\": \"" << render_metrics::escape(metrics.scene) << "\",\n";
+    out << "  \"mode\": \"" << render_metrics::escape(metrics.mode) << "\",\n";
+    out << "  \"layout\": \"" << options.layout << "\",\n";
+    out << "  \"structures\": [";
+    for (size_t i = 0; i < reports.size(); i++) {
+        out << (i ? "," : "") << "\n    ";
+        reports[i].save_json(out);
+    }
+    out << "\n  ]\n}\n";
+
+    std::clog << "Tree report written to " << path << ":" << std::endl;
+    for (const auto& r : reports)
+        r.print();
+    return true;
+}
+
+#endif